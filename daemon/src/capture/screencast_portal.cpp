@@ -27,4 +27,24 @@ bool ScreencastPortal::isActive() const {
     return active_;
 }
 
+void ScreencastPortal::setMinFrameInterval(int ms) {
+    if (ms != minFrameIntervalMs_) {
+        LOG_INFO("Screencast frame interval set to" << ms << "ms");
+        minFrameIntervalMs_ = ms;
+    }
+}
+
+int ScreencastPortal::minFrameInterval() const {
+    return minFrameIntervalMs_;
+}
+
+void ScreencastPortal::deliverFrame(const QByteArray &data) {
+    if (minFrameIntervalMs_ > 0 && lastFrame_.isValid() &&
+        lastFrame_.elapsed() < minFrameIntervalMs_) {
+        return;
+    }
+    lastFrame_.start();
+    emit frameAvailable(data);
+}
+
 } // namespace vibenote
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <QElapsedTimer>
 #include <QObject>
 
 namespace vibenote {
@@ -15,12 +16,22 @@ public:
     void stop();
     bool isActive() const;
 
+    // Frames closer together than this are dropped inside the portal, before
+    // they reach OCR. Zero delivers every frame.
+    void setMinFrameInterval(int ms);
+    int minFrameInterval() const;
+
 signals:
     void frameAvailable(const QByteArray &data);
     void error(const QString &message);
 
 private:
+    // Every captured frame leaves the portal through here.
+    void deliverFrame(const QByteArray &data);
+
     bool active_ = false;
+    int minFrameIntervalMs_ = 0;
+    QElapsedTimer lastFrame_;
 };
 
 } // namespace vibenote
@@ -1,147 +1,142 @@
-#include <nvml.h>
-#include <QTimer>
-#include <QObject>
-#include <atomic>
+#include "gpu_guard.h"
 
 #include "logging.h"
+#include "monitor/resource_monitor.h"
 
-class GpuGuard : public QObject {
-    Q_OBJECT
-public:
-    struct Stats {
-        float utilization;           // current GPU utilization percentage
-        size_t vramFreeMb;           // free VRAM in megabytes
-        size_t vramTotalMb;          // total VRAM in megabytes
-        bool throttled;              // whether throttling is active
-    };
-
-    GpuGuard(nvmlDevice_t dev, float util_threshold, size_t vram_headroom_mb, QObject *parent = nullptr);
-
-    bool initialize();
-
-    bool canAcceptWork() const;
-    int calculateOptimalNgl(size_t model_size_mb) const;
-    void requestModelRestart(int new_ngl);
-    Stats getStats() const;
-
-public slots:
-    void pollGpu();
-
-signals:
-    void utilizationChanged(float percent);
-    void throttleRequested(bool enable);
-    void modelRestartRequested(int newNgl);
-
-private:
-    nvmlDevice_t m_device{};
-    std::atomic<float> m_utilization{0.0f};
-    std::atomic<size_t> m_vram_free{0};
-    size_t m_vram_total{0};
-    float m_util_threshold{0.0f};
-    size_t m_vram_headroom{0};
-    bool m_throttled{false};
-    bool m_nvml_available{false};
-    QTimer m_timer;
-};
-
-static constexpr size_t kMB = 1024 * 1024;
-
-GpuGuard::GpuGuard(nvmlDevice_t dev, float util_threshold, size_t vram_headroom_mb, QObject *parent)
-    : QObject(parent), m_device(dev), m_util_threshold(util_threshold), m_vram_headroom(vram_headroom_mb) {}
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
+namespace {
+
+// Smaller moves of the admitted share are not worth waking the queue for.
+constexpr double kAdmissionStep = 0.01;
+
+} // namespace
+
+GpuGuard::GpuGuard(QObject *parent) : QObject(parent) {}
+
+GpuGuard::GpuGuard(std::unique_ptr<vibenote::ResourceMonitor> monitor, Limits limits,
+                   QObject *parent)
+    : QObject(parent), m_monitor(std::move(monitor)), m_limits(limits), m_controller(limits) {}
+
+GpuGuard::~GpuGuard() { stopSampling(); }
 
 bool GpuGuard::initialize() {
-    if (!m_device) {
-        LOG_WARN("NVML device handle is null; GPU monitoring disabled");
-        m_nvml_available = false;
-        m_throttled = true;
-        emit throttleRequested(true);
+    if (!m_monitor) {
+        LOG_WARNING("No resource monitor; inference is not throttled");
+        return true;
+    }
+    m_available = true;
+    pollGpu();
+    if (!m_available) {
         return false;
     }
-
-    m_nvml_available = true;
-    QObject::connect(&m_timer, &QTimer::timeout, this, &GpuGuard::pollGpu);
-    m_timer.start(200); // 5Hz
+    LOG_INFO("Throttling on" << m_monitor->name() << "telemetry");
+    if (m_limits.poll_interval.count() > 0 && !m_sampler.joinable()) {
+        m_sampler = std::thread([this] { samplingLoop(); });
+    }
     return true;
 }
 
-void GpuGuard::pollGpu() {
-    if (!m_nvml_available)
-        return;
+void GpuGuard::samplingLoop() {
+    std::unique_lock lock(m_stop_mutex);
+    while (!m_stop_cv.wait_for(lock, m_limits.poll_interval, [this] { return m_stopping; })) {
+        lock.unlock();
+        pollGpu();
+        lock.lock();
+        if (!m_available.load(std::memory_order_relaxed)) {
+            return;
+        }
+    }
+}
 
-    nvmlUtilization_t util{};
-    nvmlReturn_t err = nvmlDeviceGetUtilizationRates(m_device, &util);
-    if (err != NVML_SUCCESS) {
-        LOG_ERROR("NVML utilization query failed: %s", nvmlErrorString(err));
-        m_nvml_available = false;
-        m_throttled = true;
-        emit throttleRequested(true);
-        m_timer.stop();
-        return;
+void GpuGuard::stopSampling() {
+    {
+        std::lock_guard lock(m_stop_mutex);
+        m_stopping = true;
+    }
+    m_stop_cv.notify_all();
+    if (m_sampler.joinable()) {
+        m_sampler.join();
     }
+}
 
-    nvmlMemory_t mem{};
-    err = nvmlDeviceGetMemoryInfo(m_device, &mem);
-    if (err != NVML_SUCCESS) {
-        LOG_ERROR("NVML memory query failed: %s", nvmlErrorString(err));
-        m_nvml_available = false;
-        m_throttled = true;
-        emit throttleRequested(true);
-        m_timer.stop();
+void GpuGuard::pollGpu() {
+    if (!m_monitor || !m_available.load(std::memory_order_relaxed)) {
         return;
     }
+    std::unique_lock lock(m_poll_mutex);
+    const std::optional<vibenote::ResourceSample> sample = m_monitor->sample();
+    double share = 0.0;
+    if (sample) {
+        share = m_controller.update(*sample);
+        m_utilization.store(sample->utilization, std::memory_order_relaxed);
+        m_forecast.store(m_controller.forecastUtilization(), std::memory_order_relaxed);
+        m_vram_free.store(sample->memory_free_mb, std::memory_order_relaxed);
+        m_vram_total.store(sample->memory_total_mb, std::memory_order_relaxed);
+    } else {
+        LOG_WARNING("Resource monitor" << m_monitor->name() << "stopped reporting; throttling");
+        m_available = false;
+    }
+    const double previous = m_admission.exchange(share, std::memory_order_relaxed);
+    const bool report = share != m_reported_admission &&
+                        (std::abs(share - m_reported_admission) >= kAdmissionStep ||
+                         share == 0.0 || share == 1.0);
+    if (report) {
+        m_reported_admission = share;
+    }
+    lock.unlock();
 
-    float gpu_util = static_cast<float>(util.gpu);
-    m_utilization.store(gpu_util, std::memory_order_relaxed);
+    if (sample) {
+        emit utilizationChanged(sample->utilization);
+    }
+    if (report) {
+        emit admissionChanged(share);
+    }
+    if ((previous == 0.0) != (share == 0.0)) {
+        emit throttleRequested(share == 0.0);
+        emit throttleStateChanged(share == 0.0);
+    }
+}
 
-    size_t free_mb = mem.free / kMB;
-    size_t total_mb = mem.total / kMB;
-    m_vram_free.store(free_mb, std::memory_order_relaxed);
-    m_vram_total = total_mb;
+bool GpuGuard::canAcceptWork() const { return admission() > 0.0; }
 
-    emit utilizationChanged(gpu_util);
+double GpuGuard::admission() const {
+    if (!m_monitor) {
+        return 1.0;
+    }
+    return m_admission.load(std::memory_order_relaxed);
+}
 
-    bool shouldThrottle = gpu_util > m_util_threshold || free_mb <= m_vram_headroom;
-    if (shouldThrottle && !m_throttled) {
-        m_throttled = true;
-        emit throttleRequested(true);
-    } else if (m_throttled && gpu_util < (m_util_threshold - 10.0f) && free_mb > m_vram_headroom) {
-        m_throttled = false;
-        emit throttleRequested(false);
+std::int64_t GpuGuard::memoryMarginBytes() const {
+    if (!m_available.load(std::memory_order_relaxed)) {
+        return 0;
     }
+    const auto free_mb = static_cast<std::int64_t>(m_vram_free.load(std::memory_order_relaxed));
+    return (free_mb - static_cast<std::int64_t>(m_limits.vram_headroom_mb)) * (1 << 20);
 }
 
-bool GpuGuard::canAcceptWork() const {
-    if (!m_nvml_available)
-        return false;
-    return m_utilization.load(std::memory_order_relaxed) < m_util_threshold &&
-           m_vram_free.load(std::memory_order_relaxed) > m_vram_headroom;
+std::uint64_t GpuGuard::offloadBudgetBytes() const {
+    return static_cast<std::uint64_t>(std::max<std::int64_t>(0, memoryMarginBytes()));
 }
 
-int GpuGuard::calculateOptimalNgl(size_t model_size_mb) const {
-    if (!m_nvml_available || model_size_mb == 0)
-        return 0;
-    size_t free_mb = m_vram_free.load(std::memory_order_relaxed);
-    if (free_mb <= m_vram_headroom)
-        return 0;
-    size_t usable = free_mb - m_vram_headroom;
-    const int total_layers = 32; // assume 32 layers for model
-    size_t per_layer = model_size_mb / total_layers;
-    if (per_layer == 0)
-        per_layer = 1;
-    int layers = static_cast<int>(usable / per_layer);
-    if (layers > total_layers)
-        layers = total_layers;
-    if (layers < 0)
-        layers = 0;
-    return layers;
+vibenote::OffloadPlan GpuGuard::planOffload(const vibenote::ModelLayout &model,
+                                            vibenote::OffloadBudget budget) const {
+    budget.memory_bytes = offloadBudgetBytes();
+    return vibenote::planOffload(model, budget);
 }
 
 void GpuGuard::requestModelRestart(int new_ngl) { emit modelRestartRequested(new_ngl); }
 
 GpuGuard::Stats GpuGuard::getStats() const {
+    const double share = admission();
     return Stats{m_utilization.load(std::memory_order_relaxed),
-                 m_vram_free.load(std::memory_order_relaxed), m_vram_total, m_throttled};
+                 m_forecast.load(std::memory_order_relaxed),
+                 m_vram_free.load(std::memory_order_relaxed),
+                 m_vram_total.load(std::memory_order_relaxed), share, share == 0.0};
 }
 
-#include "gpu_guard.moc"
+const char *GpuGuard::monitorName() const { return m_monitor ? m_monitor->name() : "none"; }
 
+#include "moc_gpu_guard.cpp"
@@ -1,33 +1,106 @@
 #pragma once
 
 #include <QObject>
-#include <QTimer>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <thread>
 
+#include "offload_planner.h"
+#include "throttle_controller.h"
+
+namespace vibenote {
+class ResourceMonitor;
+}
+
+// Admission control for inference. Samples a ResourceMonitor (NVML, CPU
+// pressure, or a replayed trace) at 5 Hz on its own thread and feeds a
+// ThrottleController, which turns forecast utilization and free memory into
+// the share of inference slots to admit. The queue runs that many slots;
+// at zero, work pauses until the forecast falls back under the target.
 class GpuGuard : public QObject {
     Q_OBJECT
 
 public:
+    struct Limits : vibenote::ThrottleOptions {
+        // Zero starts no sampling thread; pollGpu() is then stepped by hand.
+        std::chrono::milliseconds poll_interval{200};
+    };
+
+    struct Stats {
+        float utilization;           // last sampled utilization percentage
+        float forecastUtilization;   // what the controller expects next
+        size_t vramFreeMb;           // free VRAM (or memory) in megabytes
+        size_t vramTotalMb;          // total VRAM (or memory) in megabytes
+        double admission;            // share of inference slots admitted, 0..1
+        bool throttled;              // whether admission is zero
+    };
+
+    // Unmonitored: every task is admitted.
     explicit GpuGuard(QObject *parent = nullptr);
-    ~GpuGuard();
-    
+    GpuGuard(std::unique_ptr<vibenote::ResourceMonitor> monitor, Limits limits,
+             QObject *parent = nullptr);
+    ~GpuGuard() override;
+
+    // Takes the first sample and starts the sampling thread. False, and
+    // throttled, if the monitor cannot report.
     bool initialize();
-    bool canAcceptWork() const;
-    void requestThrottle(bool throttle);
+    virtual bool canAcceptWork() const;
+    double admission() const;
+    // Free memory last sampled, less the headroom; negative while something
+    // has eaten into the headroom. Zero without telemetry.
+    std::int64_t memoryMarginBytes() const;
+    // The margin, if positive: what a model may still load onto the device.
+    std::uint64_t offloadBudgetBytes() const;
+    // -ngl and context for `model` in offloadBudgetBytes(). Without telemetry
+    // nothing is offloaded.
+    vibenote::OffloadPlan planOffload(const vibenote::ModelLayout &model,
+                                      vibenote::OffloadBudget budget) const;
     void requestModelRestart(int new_ngl);
+    Stats getStats() const;
+    // Backend name, or "none".
+    const char *monitorName() const;
 
 signals:
+    // Sampling signals are emitted on the sampling thread; connect with a
+    // receiver context to have them queued to its thread instead.
+    void utilizationChanged(float percent);
+    // The admitted share moved by at least a percent, or reached 0 or 1.
+    void admissionChanged(double share);
     void throttleRequested(bool throttle);
     void throttleStateChanged(bool throttled);
     void modelRestartRequested(int new_ngl);
 
 public slots:
+    // Takes one sample. Called by the sampling thread; tests call it to step
+    // a replay.
     void pollGpu();
 
 private:
-    QTimer m_timer;
-    void *m_device = nullptr;
-    bool m_throttled = false;
-    int m_util_threshold = 85;
-    int m_vram_headroom_mb = 800;
+    void samplingLoop();
+    void stopSampling();
+
+    std::unique_ptr<vibenote::ResourceMonitor> m_monitor;
+    Limits m_limits;
+    // m_poll_mutex serialises pollGpu() and guards the controller and the
+    // last reported share.
+    std::mutex m_poll_mutex;
+    vibenote::ThrottleController m_controller;
+    double m_reported_admission = 1.0;
+
+    std::mutex m_stop_mutex;
+    std::condition_variable m_stop_cv;
+    bool m_stopping = false;
+    std::thread m_sampler;
+
+    std::atomic<float> m_utilization{0.0f};
+    std::atomic<float> m_forecast{0.0f};
+    std::atomic<size_t> m_vram_free{0};
+    std::atomic<size_t> m_vram_total{0};
+    std::atomic<double> m_admission{1.0};
+    std::atomic<bool> m_available{false};
 };
@@ -1,20 +1,34 @@
 #include <QBuffer>
 #include <QDateTime>
+#include <QFuture>
+#include <QPromise>
 #include <QHttpServer>
 #include <QHttpServerResponse>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QMetaObject>
+#include <QPointer>
 #include <QUrlQuery>
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <functional>
+#include <memory>
+#include <optional>
 #include <string>
 #include <unordered_map>
 
 #include "store/sqlite_store.h"
 #include "logging.h"
+#include "map_reduce.h"
+#include "structured_summary.h"
+#include "summary_cache.h"
 #include "http_server.h"
+#include "metrics.h"
+#include "queue.h"
+#include "worker_pool.h"
 
 namespace exporters {
 void exportCsv(SqliteStore *store, const QDateTime &from, const QDateTime &to,
@@ -24,52 +38,117 @@ void exportStructuredPrompts(SqliteStore *store, const QDateTime &from,
                              QChar delimiter = ',');
 } // namespace exporters
 
-namespace vibenote {
+class ConfigManager {
+ public:
+  QJsonObject load() const { return {}; }
+  void update(const QJsonObject &) {}
+};
+  ConfigManager *config_;
+};
 
-enum class TaskType { kWatch, kInteractive, kExport };
-enum class TaskPriority { kHigh = 0, kNormal = 1, kLow = 2, kCount };
+namespace {
 
-struct Task {
-  std::uint64_t id{};
-  TaskType type{TaskType::kInteractive};
-  TaskPriority priority{TaskPriority::kNormal};
-  std::string prompt;
-  std::function<void(const std::string &)> callback;
-};
+// Task for a /v1/summarize body. "structured": true asks for a
+// StructuredSummary; callers may also pass their own "json_schema" object or
+// GBNF "grammar" string.
+vibenote::Task summaryTask(const QJsonObject &body) {
+  vibenote::Task task;
+  task.type = vibenote::TaskType::kInteractive;
+  task.priority = vibenote::TaskPriority::kHigh;
+  task.prompt = body.value(QStringLiteral("text")).toString().toStdString();
+  if (body.value(QStringLiteral("structured")).toBool()) {
+    task.json_schema = QJsonDocument(summarySchema()).toJson(QJsonDocument::Compact).toStdString();
+  } else if (body.value(QStringLiteral("json_schema")).isObject()) {
+    task.json_schema = QJsonDocument(body.value(QStringLiteral("json_schema")).toObject())
+                           .toJson(QJsonDocument::Compact)
+                           .toStdString();
+  }
+  task.grammar = body.value(QStringLiteral("grammar")).toString().toStdString();
+  return task;
+}
 
-class TaskQueue {
- public:
-  struct Stats {
-    std::array<std::size_t, static_cast<std::size_t>(TaskPriority::kCount)> queued{};
-    std::unordered_map<TaskType, std::size_t> running;
-  };
+QJsonObject summaryJson(const std::string &summary, bool structured) {
+  const QString text = QString::fromStdString(summary);
+  if (structured) {
+    if (const auto parsed = StructuredSummary::parse(text)) {
+      QJsonObject res = parsed->toJson();
+      res.insert(QStringLiteral("summary"), parsed->activity);
+      return res;
+    }
+  }
+  return {{QStringLiteral("summary"), text}};
+}
 
-  bool enqueue(Task task);
-  Stats getStats() const;
-};
+QJsonObject rejectionJson(const vibenote::Admission &admission) {
+  const bool rateLimited = admission.result == vibenote::Admission::Result::kRateLimited;
+  return {{QStringLiteral("error"),
+           rateLimited ? QStringLiteral("rate_limited") : QStringLiteral("queue_full")},
+          {QStringLiteral("retry_after_ms"), static_cast<qint64>(admission.retry_after.count())}};
+}
 
-} // namespace vibenote
+QHttpServerResponse rejectionResponse(const vibenote::Admission &admission) {
+  QHttpServerResponse response(rejectionJson(admission),
+                               QHttpServerResponder::StatusCode::TooManyRequests);
+  // Retry-After is whole seconds; round up so clients never retry early.
+  const auto retryMs = admission.retry_after.count();
+  response.setHeader(QByteArrayLiteral("Retry-After"),
+                     QByteArray::number(std::max<qint64>(1, (retryMs + 999) / 1000)));
+  return response;
+}
 
-class LlamaClient {
- public:
-  QString streamCompletion(const QString &prompt, const QJsonObject &params,
-                           std::function<void(const QString &)> callback);
-};
+const char *failureName(vibenote::TaskFailure failure) {
+  switch (failure) {
+    case vibenote::TaskFailure::kExpired:
+      return "expired";
+    case vibenote::TaskFailure::kCancelled:
+      return "cancelled";
+    case vibenote::TaskFailure::kDropped:
+      return "dropped";
+    case vibenote::TaskFailure::kError:
+      break;
+  }
+  return "failed";
+}
 
-class Metrics {
- public:
-  QByteArray serialize() const { return {}; }
-};
+QJsonObject failureJson(vibenote::TaskFailure failure) {
+  return {{QStringLiteral("error"), QString::fromLatin1(failureName(failure))}};
+}
 
-class ConfigManager {
- public:
-  QJsonObject load() const { return {}; }
-  void update(const QJsonObject &) {}
-};
-  ConfigManager *config_;
+// A task that outlived its deadline timed out; one dropped or cancelled
+// under load may succeed if retried; a handler error will not.
+QHttpServerResponse failureResponse(vibenote::TaskFailure failure) {
+  QHttpServerResponder::StatusCode status = QHttpServerResponder::StatusCode::ServiceUnavailable;
+  if (failure == vibenote::TaskFailure::kExpired) {
+    status = QHttpServerResponder::StatusCode::GatewayTimeout;
+  } else if (failure == vibenote::TaskFailure::kError) {
+    status = QHttpServerResponder::StatusCode::InternalServerError;
+  }
+  return QHttpServerResponse(failureJson(failure), status);
+}
+
+// Resolves a response future exactly once: a task's failure hook may follow
+// a callback that ran just before its handler threw.
+struct PendingResponse {
+  QPromise<QHttpServerResponse> promise;
+  std::atomic<bool> answered{false};
+
+  void answer(QHttpServerResponse response) {
+    if (answered.exchange(true)) {
+      return;
+    }
+    promise.addResult(std::move(response));
+    promise.finish();
+  }
 };
 
-HttpServer::HttpServer(vibenote::TaskQueue *queue, LlamaClient *llama,
+QByteArray serverSentEvent(const char *event, const QJsonObject &data) {
+  return QByteArrayLiteral("event: ") + event + QByteArrayLiteral("\ndata: ") +
+         QJsonDocument(data).toJson(QJsonDocument::Compact) + QByteArrayLiteral("\n\n");
+}
+
+} // namespace
+
+HttpServer::HttpServer(vibenote::TaskQueue *queue, InferenceBackend *llama,
                        SqliteStore *store, Metrics *metrics,
                        ConfigManager *config, QObject *parent)
     : QObject(parent),
@@ -95,6 +174,23 @@ bool HttpServer::start(quint16 port) {
                        static_cast<qint64>(it.second));
       }
       obj.insert(QStringLiteral("running"), running);
+      obj.insert(QStringLiteral("expired"), static_cast<qint64>(stats.expired));
+      obj.insert(QStringLiteral("cancelled"), static_cast<qint64>(stats.cancelled));
+      obj.insert(QStringLiteral("coalesced"), static_cast<qint64>(stats.coalesce_hits));
+      obj.insert(QStringLiteral("coalesce_hit_rate"), stats.coalesceHitRate());
+      obj.insert(QStringLiteral("rejected_queue_full"), static_cast<qint64>(stats.rejected_full));
+      obj.insert(QStringLiteral("rejected_rate_limited"), static_cast<qint64>(stats.rejected_rate));
+      obj.insert(QStringLiteral("backpressure"), stats.backpressure);
+      obj.insert(QStringLiteral("preemptions"), static_cast<qint64>(stats.preemptions));
+      obj.insert(QStringLiteral("inference_share"), stats.inference_share);
+      QJsonObject projected;
+      for (std::size_t t = 0; t < vibenote::kTaskTypeCount; ++t) {
+        auto type = static_cast<vibenote::TaskType>(t);
+        projected.insert(QString::number(static_cast<int>(t)),
+                         static_cast<qint64>(
+                             queue_->projectedWait(type, vibenote::TaskPriority::kNormal).count()));
+      }
+      obj.insert(QStringLiteral("projected_wait_ms"), projected);
     }
     return QHttpServerResponse(QJsonDocument(obj).toJson(),
                                QStringLiteral("application/json"));
@@ -115,43 +211,106 @@ bool HttpServer::start(quint16 port) {
   });
 
   server_.route(QStringLiteral("/v1/export"), [this](const QHttpServerRequest &req) {
-    if (!store_) {
-      return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
+    if (!store_ || !queue_) {
+      return QtFuture::makeReadyFuture(
+          QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError));
     }
     QUrlQuery query(req.query());
     QString format = query.queryItemValue("format");
-    QDateTime from = QDateTime::fromString(query.queryItemValue("from"), Qt::ISODate);
-    QDateTime to = QDateTime::fromString(query.queryItemValue("to"), Qt::ISODate);
-    QByteArray data;
-    QBuffer buffer(&data);
-    buffer.open(QIODevice::WriteOnly);
-    if (format == QStringLiteral("csv")) {
-      exporters::exportCsv(store_, from, to, &buffer);
-      return QHttpServerResponse(data, QStringLiteral("text/csv"));
-    } else if (format == QStringLiteral("structured_prompts")) {
-      exporters::exportStructuredPrompts(store_, from, to, &buffer);
-      return QHttpServerResponse(data, QStringLiteral("text/csv"));
-    } else {
-      QJsonArray notes = store_->queryNotes(from.toSecsSinceEpoch(),
-                                            to.toSecsSinceEpoch(), QString(), 0);
-      return QHttpServerResponse(QJsonDocument(notes).toJson(),
-                                 QStringLiteral("application/json"));
-    }
+    QJsonObject spec{{QStringLiteral("format"), format},
+                     {QStringLiteral("from"), query.queryItemValue("from")},
+                     {QStringLiteral("to"), query.queryItemValue("to")}};
+    QString mime = format == QStringLiteral("csv") || format == QStringLiteral("structured_prompts")
+                       ? QStringLiteral("text/csv")
+                       : QStringLiteral("application/json");
+
+    vibenote::Task task;
+    task.type = vibenote::TaskType::kExport;
+    task.priority = vibenote::TaskPriority::kLow;
+    task.prompt = QJsonDocument(spec).toJson(QJsonDocument::Compact).toStdString();
+    return runQueued(std::move(task), [mime](const std::string &result) {
+      return QHttpServerResponse(QByteArray::fromStdString(result), mime);
+    });
   });
 
   server_.route(QStringLiteral("/v1/summarize"),
                 QHttpServerRequest::Method::Post,
                 [this](const QHttpServerRequest &req) {
-    if (!llama_) {
-      return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
+    if (!queue_) {
+      return QtFuture::makeReadyFuture(
+          QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError));
     }
-    QJsonDocument doc = QJsonDocument::fromJson(req.body());
-    QString prompt = doc.object().value(QStringLiteral("text")).toString();
-    QString output;
-    llama_->streamCompletion(prompt, {}, [&](const QString &tok) { output += tok; });
-    QJsonObject res{{QStringLiteral("summary"), output}};
-    return QHttpServerResponse(QJsonDocument(res).toJson(),
-                               QStringLiteral("application/json"));
+    const QJsonObject body = QJsonDocument::fromJson(req.body()).object();
+    const bool structured = body.value(QStringLiteral("structured")).toBool();
+    auto pending = std::make_shared<PendingResponse>();
+    QFuture<QHttpServerResponse> future = pending->promise.future();
+    pending->promise.start();
+    summarize(summaryTask(body), structured, {},
+              [pending, structured](std::optional<std::string> summary,
+                                    const vibenote::Admission &rejection,
+                                    std::optional<vibenote::TaskFailure> failure) {
+      if (summary) {
+        pending->answer(QHttpServerResponse(
+            QJsonDocument(summaryJson(*summary, structured)).toJson(),
+            QStringLiteral("application/json")));
+      } else if (failure) {
+        pending->answer(failureResponse(*failure));
+      } else {
+        pending->answer(rejectionResponse(rejection));
+      }
+    });
+    return future;
+  });
+
+  // Same body as /v1/summarize, answered with server-sent events: "progress"
+  // as chunk and reduce summaries finish, then "summary" or "error".
+  server_.route(QStringLiteral("/v1/summarize/stream"),
+                QHttpServerRequest::Method::Post,
+                [this](const QHttpServerRequest &req, QHttpServerResponder &responder) {
+    if (!queue_) {
+      responder.sendResponse(
+          QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError));
+      return;
+    }
+    const QJsonObject body = QJsonDocument::fromJson(req.body()).object();
+    const bool structured = body.value(QStringLiteral("structured")).toBool();
+    auto stream = std::make_shared<QHttpServerResponder>(std::move(responder));
+    stream->writeBeginChunked(QByteArrayLiteral("text/event-stream"));
+    // Handlers run on pool workers; the responder belongs to this thread.
+    // Events are posted in the order the summarizer reports them.
+    QPointer<HttpServer> self(this);
+    auto post = [self, stream](QByteArray event, bool last) {
+      QMetaObject::invokeMethod(self, [stream, event = std::move(event), last]() {
+        if (last) {
+          stream->writeEndChunked(event);
+        } else {
+          stream->writeChunk(event);
+        }
+      }, Qt::QueuedConnection);
+    };
+    summarize(
+        summaryTask(body), structured,
+        [post](const vibenote::MapReduceProgress &progress) {
+          const QJsonObject data{
+              {QStringLiteral("stage"), progress.stage == vibenote::MapReduceProgress::Stage::kMap
+                                            ? QStringLiteral("map")
+                                            : QStringLiteral("reduce")},
+              {QStringLiteral("level"), progress.level},
+              {QStringLiteral("done"), static_cast<qint64>(progress.done)},
+              {QStringLiteral("total"), static_cast<qint64>(progress.total)}};
+          post(serverSentEvent("progress", data), false);
+        },
+        [post, structured](std::optional<std::string> summary,
+                           const vibenote::Admission &rejection,
+                           std::optional<vibenote::TaskFailure> failure) {
+          if (summary) {
+            post(serverSentEvent("summary", summaryJson(*summary, structured)), true);
+          } else if (failure) {
+            post(serverSentEvent("error", failureJson(*failure)), true);
+          } else {
+            post(serverSentEvent("error", rejectionJson(rejection)), true);
+          }
+        });
   });
 
   server_.route(QStringLiteral("/v1/watch/start"), [this]() {
@@ -181,7 +340,7 @@ bool HttpServer::start(quint16 port) {
 
   server_.route(QStringLiteral("/metrics"), [this]() {
     QByteArray data = metrics_ ? metrics_->serialize() : QByteArrayLiteral("");
-    return QHttpServerResponse(data, QStringLiteral("text/plain"));
+    return QHttpServerResponse(data, QStringLiteral("text/plain; version=0.0.4"));
   });
 
   const auto actualPort = server_.listen(QHostAddress::LocalHost, port);
@@ -190,4 +349,104 @@ bool HttpServer::start(quint16 port) {
 
 void HttpServer::stop() { server_.close(); }
 
+QFuture<QHttpServerResponse> HttpServer::runQueued(
+    vibenote::Task task, std::function<QHttpServerResponse(const std::string &)> respond) {
+  auto pending = std::make_shared<PendingResponse>();
+  QFuture<QHttpServerResponse> future = pending->promise.future();
+  pending->promise.start();
+
+  task.id = queue_->nextTaskId();
+  task.callback = [pending, respond = std::move(respond)](const std::string &result) {
+    pending->answer(respond(result));
+  };
+  task.on_failure = [pending](vibenote::TaskFailure failure) {
+    pending->answer(failureResponse(failure));
+  };
+  vibenote::Admission admission = queue_->tryEnqueue(std::move(task));
+  if (!admission.accepted()) {
+    pending->answer(rejectionResponse(admission));
+  }
+  return future;
+}
+
+void HttpServer::summarize(vibenote::Task task, bool structured,
+                           vibenote::MapReduceSummarizer::ProgressHandler progress,
+                           SummaryHandler done) {
+  if (!summaryCache_) {
+    summarizeUncached(std::move(task), structured, std::move(progress), std::move(done), {});
+    return;
+  }
+  std::string cacheKey = summaryCache_->key(task);
+  if (auto cached = summaryCache_->lookupInMemory(cacheKey)) {
+    done(std::move(cached), vibenote::Admission{}, std::nullopt);
+    return;
+  }
+  auto lookupOnDisk = [this, task = std::move(task), structured, progress = std::move(progress),
+                       done = std::move(done), cacheKey = std::move(cacheKey)]() mutable {
+    if (auto cached = summaryCache_->lookupOnDisk(cacheKey)) {
+      done(std::move(cached), vibenote::Admission{}, std::nullopt);
+      return;
+    }
+    summarizeUncached(std::move(task), structured, std::move(progress), std::move(done),
+                      std::move(cacheKey));
+  };
+  // The disk tier is a SQLite query; keep it off the HTTP thread.
+  if (pool_ && summaryCache_->hasDiskTier()) {
+    pool_->submit(std::move(lookupOnDisk));
+  } else {
+    lookupOnDisk();
+  }
+}
+
+void HttpServer::summarizeUncached(vibenote::Task task, bool structured,
+                                   vibenote::MapReduceSummarizer::ProgressHandler progress,
+                                   SummaryHandler done, std::string cacheKey) {
+  // `done` runs once, even if a failure hook follows a delivered result.
+  auto finished = std::make_shared<std::atomic<bool>>(false);
+  auto finish = [cache = summaryCache_, cacheKey, structured, finished, done = std::move(done)](
+                    std::optional<std::string> summary, const vibenote::Admission &rejection,
+                    std::optional<vibenote::TaskFailure> failure) {
+    if (finished->exchange(true)) {
+      return;
+    }
+    if (cache && summary && !summary->empty() &&
+        (!structured || StructuredSummary::parse(QString::fromStdString(*summary)))) {
+      cache->insert(cacheKey, *summary);
+    }
+    done(std::move(summary), rejection, failure);
+  };
+  if (summarizer_) {
+    summarizer_->summarize(std::move(task), std::move(progress), std::move(finish));
+    return;
+  }
+  task.id = queue_->nextTaskId();
+  task.callback = [finish](const std::string &summary) {
+    finish(summary, vibenote::Admission{}, std::nullopt);
+  };
+  task.on_failure = [finish](vibenote::TaskFailure failure) {
+    finish(std::nullopt, vibenote::Admission{}, failure);
+  };
+  const vibenote::Admission admission = queue_->tryEnqueue(std::move(task));
+  if (!admission.accepted()) {
+    finish(std::nullopt, admission, std::nullopt);
+  }
+}
+
+QByteArray HttpServer::renderExport(const QString &format, const QDateTime &from,
+                                    const QDateTime &to) const {
+  QByteArray data;
+  QBuffer buffer(&data);
+  buffer.open(QIODevice::WriteOnly);
+  if (format == QStringLiteral("csv")) {
+    exporters::exportCsv(store_, from, to, &buffer);
+  } else if (format == QStringLiteral("structured_prompts")) {
+    exporters::exportStructuredPrompts(store_, from, to, &buffer);
+  } else {
+    QJsonArray notes = store_->queryNotes(from.toSecsSinceEpoch(), to.toSecsSinceEpoch(),
+                                          QString(), 0);
+    data = QJsonDocument(notes).toJson();
+  }
+  return data;
+}
+
 #include "moc_http_server.cpp"
@@ -1,32 +1,79 @@
 #pragma once
 
 #include <QObject>
+#include <QDateTime>
+#include <QFuture>
 #include <QHttpServer>
+#include <QHttpServerResponse>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <string>
 
-class LlamaClient;
+#include "map_reduce.h"
+
+class InferenceBackend;
 class Metrics;
+class SummaryCache;
 namespace vibenote {
     class TaskQueue;
     class SqliteStore;
+    class WorkerPool;
+    struct Task;
 }
 
 class HttpServer : public QObject {
     Q_OBJECT
     
 public:
-    HttpServer(vibenote::TaskQueue *queue, LlamaClient *llama,
+    HttpServer(vibenote::TaskQueue *queue, InferenceBackend *llama,
               vibenote::SqliteStore *store, Metrics *metrics,
               QObject *parent = nullptr);
     ~HttpServer();
     
     bool start(quint16 port);
+    // /v1/summarize answers repeated requests from `cache` without queuing.
+    // Its disk tier is read on `pool`, off the HTTP thread.
+    void setSummaryCache(SummaryCache *cache, vibenote::WorkerPool *pool) {
+        summaryCache_ = cache;
+        pool_ = pool;
+    }
+    // Splits input longer than a slot's context into chunk and reduce tasks;
+    // without it /v1/summarize queues the text as one task.
+    void setSummarizer(vibenote::MapReduceSummarizer *summarizer) { summarizer_ = summarizer; }
     void stop();
-    
+
+    // Renders an export synchronously; called by the export task handler.
+    QByteArray renderExport(const QString &format, const QDateTime &from,
+                            const QDateTime &to) const;
+
 private:
+    // Receives the summary, or nullopt with the admission the queue refused
+    // or the failure of the admitted task.
+    using SummaryHandler = std::function<void(std::optional<std::string> summary,
+                                              const vibenote::Admission &rejection,
+                                              std::optional<vibenote::TaskFailure> failure)>;
+
+    // Enqueues `task` and resolves with `respond(result)` once a worker has run
+    // it, or with an error status if the task is dropped or fails.
+    QFuture<QHttpServerResponse> runQueued(
+        vibenote::Task task, std::function<QHttpServerResponse(const std::string &)> respond);
+    // Answers a summary task from the cache, or runs it through the
+    // summarizer and caches the result. `done` may run on any thread.
+    void summarize(vibenote::Task task, bool structured,
+                   vibenote::MapReduceSummarizer::ProgressHandler progress,
+                   SummaryHandler done);
+    // The part of summarize() after a cache miss.
+    void summarizeUncached(vibenote::Task task, bool structured,
+                           vibenote::MapReduceSummarizer::ProgressHandler progress,
+                           SummaryHandler done, std::string cacheKey);
+
     QHttpServer server_;
     vibenote::TaskQueue *queue_;
-    LlamaClient *llama_;
+    InferenceBackend *llama_;
     vibenote::SqliteStore *store_;
     Metrics *metrics_;
+    SummaryCache *summaryCache_ = nullptr;
+    vibenote::WorkerPool *pool_ = nullptr;
+    vibenote::MapReduceSummarizer *summarizer_ = nullptr;
 };
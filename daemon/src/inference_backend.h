@@ -0,0 +1,51 @@
+#pragma once
+
+#include <QJsonObject>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Text generation as the task handlers see it. Implemented by LlamaClient
+// (llama.cpp server over HTTP) and LocalLlamaBackend (libllama in-process).
+// All methods must be called on the thread the backend lives on, and every
+// callback runs on that thread too.
+//
+// `params` takes llama-server's /v1/completions sampling keys plus "prefix":
+// a fixed preamble placed before each prompt whose evaluated KV state the
+// backend may reuse across requests. "grammar" (GBNF) and "json_schema"
+// (object) constrain the output the same way llama-server does.
+class InferenceBackend : public QObject {
+    Q_OBJECT
+
+public:
+    using QObject::QObject;
+    ~InferenceBackend() override = default;
+
+    // Generations the backend runs at once; the queue caps inference tasks
+    // to this many.
+    virtual int parallelSlots() const = 0;
+
+    // Streams the completion of `prompt` token by token. `on_finished` fires
+    // exactly once: at the end of the stream, after stopGeneration(), on
+    // failure, or when the backend is destroyed. Its argument is true only
+    // when the generation ran to its normal end. Returns an id for
+    // stopGeneration().
+    virtual QString streamCompletion(const QString &prompt, const QJsonObject &params,
+                                     std::function<void(const QString &)> on_token,
+                                     std::function<void(bool completed)> on_finished = {}) = 0;
+    // Completes every prompt; `on_result` is called with the index and text
+    // of each prompt that completed, then `on_finished` once. Prompts lost to
+    // an error or stopGeneration() get no on_result call.
+    virtual QString completeBatch(const QStringList &prompts, const QJsonObject &params,
+                                  std::function<void(int, const QString &)> on_result,
+                                  std::function<void()> on_finished) = 0;
+    virtual void stopGeneration(const QString &request_id) = 0;
+    // Tokenizes `text` with the model's vocabulary and calls `done` once with
+    // the bytes of each token (empty on failure). Concatenated, the pieces
+    // give back `text`; one may end inside a UTF-8 character.
+    virtual void tokenize(const QString &text,
+                          std::function<void(std::vector<std::string> pieces)> done) = 0;
+};
@@ -1,63 +1,86 @@
-#include <QTcpSocket>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
 #include <QProcess>
-#include <QTimer>
+#include <QTcpServer>
 #include <QThread>
-#include <QMutex>
-#include <QMutexLocker>
+#include <QUrl>
 #include <QUuid>
+#include <QVector>
+#include <algorithm>
 #include <functional>
+#include <utility>
 
 #include "llama_client.h"
 #include "logging.h"
+#include "metrics.h"
 
-    QMutex mutex_;
-    QHash<QString, std::function<void(const QString &)>> callbacks_;
-    QByteArray buffer_;
-    QString last_event_id_;
-    int reconnect_attempts_;
-};
+namespace {
+
+constexpr int kHealthCheckIntervalMs = 5000;
+constexpr int kHealthCheckTimeoutMs = 2000;
+// A replacement server is probed this often while it loads, and given up
+// after kStandbyTimeoutMs; large models take a while to reach the GPU.
+constexpr int kStandbyProbeIntervalMs = 250;
+constexpr qint64 kStandbyTimeoutMs = 180000;
+// Longest a replaced server may keep finishing requests before it is stopped.
+constexpr int kDrainTimeoutMs = 120000;
+constexpr int kStopTimeoutMs = 5000;
+
+// llama-server has no named prefixes: the preamble goes back in front of
+// the prompt, and cache_prompt lets a slot keep the KV cells it shares with
+// its previous request instead of re-evaluating them.
+QString takePrefix(QJsonObject &payload) {
+    const QString prefix = payload.take(QStringLiteral("prefix")).toString();
+    if (!prefix.isEmpty()) {
+        payload.insert(QStringLiteral("cache_prompt"), true);
+    }
+    return prefix;
+}
+
+} // namespace
 
 LlamaClient::LlamaClient(QObject *parent)
-    : QObject(parent),
-      socket_(new QTcpSocket(this)),
-      server_process_(nullptr),
-      port_(0),
-      ngl_(0),
-      reconnect_attempts_(0) {
-    connect(socket_, &QTcpSocket::connected, this, [this]() {
-        reconnect_attempts_ = 0;
-        emit connected();
-    });
-    connect(socket_, &QTcpSocket::readyRead, this, &LlamaClient::onReadyRead);
-    connect(socket_, &QTcpSocket::disconnected, this, &LlamaClient::onDisconnected);
-    connect(socket_, &QTcpSocket::errorOccurred, this, &LlamaClient::onErrorOccurred);
+    : InferenceBackend(parent),
+      network_(new QNetworkAccessManager(this)) {
+    connect(&health_timer_, &QTimer::timeout, this, &LlamaClient::checkHealth);
+    connect(&standby_timer_, &QTimer::timeout, this, &LlamaClient::probeStandby);
+    drain_deadline_.setSingleShot(true);
+    connect(&drain_deadline_, &QTimer::timeout, this, [this]() { retireDrainedServer(true); });
 }
 
 LlamaClient::~LlamaClient() {
-    if (server_process_) {
-        server_process_->terminate();
-        server_process_->waitForFinished(3000);
+    releasePendingStreams();
+    for (QProcess *process : {standby_process_, draining_process_, server_process_}) {
+        if (process) {
+            process->disconnect(this);
+            process->terminate();
+            process->waitForFinished(3000);
+        }
     }
 }
 
-void LlamaClient::connectToServer(const QString &host, quint16 port) {
+bool LlamaClient::connectToServer(const QString &host, int port) {
     host_ = host;
-    port_ = port;
-    attemptReconnect();
+    port_ = static_cast<quint16>(port);
+    health_timer_.start(kHealthCheckIntervalMs);
+    checkHealth();
+    return true;
 }
 
-void LlamaClient::attemptReconnect() {
-    if (socket_->state() == QAbstractSocket::ConnectedState)
-        return;
-    int delay = qMin(30000, (1 << reconnect_attempts_) * 1000);
-    QTimer::singleShot(delay, this, [this]() {
-        LOG_INFO("Connecting to llama.cpp server %s:%d", qPrintable(host_), port_);
-        socket_->connectToHost(host_, port_);
-    });
-    reconnect_attempts_++;
+void LlamaClient::setPoolSize(int size) {
+    pool_size_ = std::max(1, size);
+}
+
+int LlamaClient::poolSize() const {
+    return pool_size_;
+}
+
+bool LlamaClient::isHealthy() const {
+    return healthy_;
 }
 
 bool LlamaClient::spawnServer(const QString &model_path, int ngl, const QStringList &other_params) {
@@ -72,21 +95,18 @@ bool LlamaClient::spawnServer(const QString &model_path, int ngl, const QStringL
     }
 
     server_process_ = new QProcess(this);
-    QString program = QStringLiteral("third_party/llama.cpp/server");
-    QStringList args;
-    args << QStringLiteral("--model") << model_path_ << QStringLiteral("--host") << host_ << QStringLiteral("--port") << QString::number(port_)
-         << "--ngl" << QString::number(ngl_);
-    args << extra_params_;
-
-    server_process_->start(program, args);
+    server_process_->start(server_program_, serverArguments(port_, model_path_, ngl_));
     if (!server_process_->waitForStarted()) {
         emit error(tr("Failed to start llama server: %1").arg(server_process_->errorString()));
         return false;
     }
 
     for (int i = 0; i < 30; ++i) {
-        socket_->connectToHost(host_, port_);
-        if (socket_->waitForConnected(1000)) {
+        QTcpSocket probe;
+        probe.connectToHost(host_, port_);
+        if (probe.waitForConnected(1000)) {
+            health_timer_.start(kHealthCheckIntervalMs);
+            checkHealth();
             return true;
         }
         QThread::sleep(1);
@@ -95,17 +115,32 @@ bool LlamaClient::spawnServer(const QString &model_path, int ngl, const QStringL
     return false;
 }
 
-QString LlamaClient::buildRequest(const QString &path, const QJsonObject &payload) const {
+void LlamaClient::adoptServer(QProcess *process, const QString &program, const QString &model_path,
+                              int ngl, const QStringList &other_params) {
+    server_process_ = process;
+    server_program_ = program;
+    model_path_ = model_path;
+    ngl_ = ngl;
+    extra_params_ = other_params;
+}
+
+QStringList LlamaClient::serverArguments(quint16 port, const QString &model_path, int ngl) const {
+    QStringList args;
+    args << QStringLiteral("--model") << model_path << QStringLiteral("--host") << host_ << QStringLiteral("--port") << QString::number(port)
+         << "-ngl" << QString::number(ngl)
+         << QStringLiteral("--parallel") << QString::number(pool_size_);
+    args << extra_params_;
+    return args;
+}
+
+QByteArray LlamaClient::buildRequest(const QString &path, const QJsonObject &payload) const {
     QByteArray body = QJsonDocument(payload).toJson(QJsonDocument::Compact);
-    QString request = QStringLiteral("POST %1 HTTP/1.1\r\n")
-                          .arg(path) +
-                      QStringLiteral("Host: %1\r\n").arg(host_) +
-                      QStringLiteral("Content-Type: application/json\r\n") +
-                      QStringLiteral("Connection: keep-alive\r\n") +
-                      QStringLiteral("Content-Length: %1\r\n\r\n")
-                          .arg(body.size()) +
-                      QString::fromUtf8(body);
-    return request;
+    QByteArray request = "POST " + path.toUtf8() + " HTTP/1.1\r\n"
+                         "Host: " + host_.toUtf8() + "\r\n"
+                         "Content-Type: application/json\r\n"
+                         "Connection: keep-alive\r\n"
+                         "Content-Length: " + QByteArray::number(body.size()) + "\r\n\r\n";
+    return request + body;
 }
 
 QString LlamaClient::generateRequestId() const {
@@ -113,94 +148,546 @@ QString LlamaClient::generateRequestId() const {
 }
 
 QString LlamaClient::streamCompletion(const QString &prompt, const QJsonObject &params,
-                                      std::function<void(const QString &)> callback) {
-    QString id = generateRequestId();
+                                      std::function<void(const QString &)> callback,
+                                      std::function<void(bool)> on_finished) {
     QJsonObject payload = params;
-    payload.insert(QStringLiteral("id"), id);
-    payload.insert(QStringLiteral("prompt"), prompt);
+    payload.insert(QStringLiteral("prompt"), takePrefix(payload) + prompt);
     payload.insert(QStringLiteral("stream"), true);
 
-    QString request = buildRequest(QStringLiteral("/v1/completions"), payload);
-    {
-        QMutexLocker locker(&mutex_);
-        callbacks_.insert(id, std::move(callback));
+    StreamRequest request;
+    request.id = generateRequestId();
+    request.wire = buildRequest(QStringLiteral("/v1/completions"), payload);
+    request.on_token = std::move(callback);
+    request.on_finished = std::move(on_finished);
+    QString id = request.id;
+    pending_.enqueue(std::move(request));
+    dispatchPending();
+    return id;
+}
+
+QString LlamaClient::completeBatch(const QStringList &prompts, const QJsonObject &params,
+                                   std::function<void(int, const QString &)> on_result,
+                                   std::function<void()> on_finished) {
+    QString id = generateRequestId();
+    QJsonObject payload = params;
+    const QString prefix = takePrefix(payload);
+    QStringList full_prompts;
+    full_prompts.reserve(prompts.size());
+    for (const QString &prompt : prompts) {
+        full_prompts.append(prefix + prompt);
     }
-    socket_->write(request.toUtf8());
+    payload.insert(QStringLiteral("prompt"), QJsonArray::fromStringList(full_prompts));
+    payload.insert(QStringLiteral("stream"), false);
+
+    QNetworkRequest request(QUrl(QStringLiteral("http://%1:%2/v1/completions").arg(host_).arg(port_)));
+    request.setHeader(QNetworkRequest::ContentTypeHeader, QStringLiteral("application/json"));
+    QNetworkReply *reply =
+        network_->post(request, QJsonDocument(payload).toJson(QJsonDocument::Compact));
+
+    batch_replies_.insert(id, reply);
+
+    const int count = static_cast<int>(prompts.size());
+    connect(reply, &QNetworkReply::finished, this,
+            [this, id, reply, count, on_result = std::move(on_result),
+             on_finished = std::move(on_finished)]() {
+        batch_replies_.remove(id);
+        reply->deleteLater();
+        if (reply->error() == QNetworkReply::NoError) {
+            const QJsonArray choices =
+                QJsonDocument::fromJson(reply->readAll()).object().value(QStringLiteral("choices")).toArray();
+            for (const auto &value : choices) {
+                QJsonObject choice = value.toObject();
+                int index = choice.value(QStringLiteral("index")).toInt(-1);
+                if (index >= 0 && index < count) {
+                    on_result(index, choice.value(QStringLiteral("text")).toString());
+                }
+            }
+        } else if (reply->error() != QNetworkReply::OperationCanceledError) {
+            LOG_WARNING("Batch completion failed:" << reply->errorString());
+        }
+        if (on_finished) {
+            on_finished();
+        }
+        retireDrainedServer();
+    });
     return id;
 }
 
+void LlamaClient::tokenize(const QString &text,
+                           std::function<void(std::vector<std::string> pieces)> done) {
+    QJsonObject payload{{QStringLiteral("content"), text},
+                        {QStringLiteral("with_pieces"), true}};
+    QNetworkRequest request(QUrl(QStringLiteral("http://%1:%2/tokenize").arg(host_).arg(port_)));
+    request.setHeader(QNetworkRequest::ContentTypeHeader, QStringLiteral("application/json"));
+    QNetworkReply *reply =
+        network_->post(request, QJsonDocument(payload).toJson(QJsonDocument::Compact));
+    connect(reply, &QNetworkReply::finished, this, [reply, done = std::move(done)]() {
+        reply->deleteLater();
+        std::vector<std::string> pieces;
+        if (reply->error() != QNetworkReply::NoError) {
+            LOG_WARNING("Tokenize failed:" << reply->errorString());
+            done(std::move(pieces));
+            return;
+        }
+        const QJsonArray tokens =
+            QJsonDocument::fromJson(reply->readAll()).object().value(QStringLiteral("tokens")).toArray();
+        pieces.reserve(static_cast<std::size_t>(tokens.size()));
+        for (const auto &value : tokens) {
+            // Pieces that are not valid UTF-8 on their own arrive as byte arrays.
+            const QJsonValue piece = value.toObject().value(QStringLiteral("piece"));
+            if (piece.isArray()) {
+                std::string bytes;
+                for (const auto &byte : piece.toArray()) {
+                    bytes.push_back(static_cast<char>(byte.toInt()));
+                }
+                pieces.push_back(std::move(bytes));
+            } else {
+                pieces.push_back(piece.toString().toStdString());
+            }
+        }
+        done(std::move(pieces));
+    });
+}
+
 void LlamaClient::stopGeneration(const QString &request_id) {
-    QJsonObject payload{QStringLiteral("id"), request_id}};
-    QString request = buildRequest(QStringLiteral("/v1/stop"), payload);
-    socket_->write(request.toUtf8());
+    // Batches run over their own HTTP request; aborting it frees the slots.
+    QPointer<QNetworkReply> batch = batch_replies_.value(request_id);
+    if (batch) {
+        batch->abort();
+        return;
+    }
+    for (auto &conn : connections_) {
+        if (conn->request.id == request_id) {
+            // llama-server cancels a slot's generation when its client leaves.
+            Connection *raw = conn.get();
+            finishRequest(raw);
+            dropConnection(raw);
+            dispatchPending();
+            return;
+        }
+    }
+    for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+        if (it->id == request_id) {
+            auto finished = std::move(it->on_finished);
+            pending_.erase(it);
+            if (finished) {
+                finished(false);
+            }
+            return;
+        }
+    }
 }
 
-bool LlamaClient::restartWithNgl(int new_ngl) {
-    if (server_process_) {
-        server_process_->terminate();
-        if (!server_process_->waitForFinished(5000)) {
-            server_process_->kill();
-            server_process_->waitForFinished();
+bool LlamaClient::restartWithNgl(int new_ngl) { return restartWithModel(model_path_, new_ngl); }
+
+bool LlamaClient::restartWithModel(const QString &model_path, int new_ngl) {
+    if (!server_process_ || model_path.isEmpty()) {
+        LOG_WARNING("Cannot restart a llama server this client did not start");
+        return false;
+    }
+    if (standby_process_) {
+        abandonStandby(tr("superseded by -ngl %1").arg(new_ngl));
+    }
+
+    // Let the OS pick a free port; the replacement binds it right after.
+    QHostAddress address(host_);
+    QTcpServer probe;
+    if (!probe.listen(address.isNull() ? QHostAddress(QHostAddress::LocalHost) : address, 0)) {
+        emit error(tr("No free port for a replacement llama server: %1").arg(probe.errorString()));
+        return false;
+    }
+    standby_port_ = probe.serverPort();
+    probe.close();
+
+    standby_ngl_ = new_ngl;
+    standby_model_path_ = model_path;
+    standby_process_ = new QProcess(this);
+    standby_process_->start(server_program_,
+                            serverArguments(standby_port_, standby_model_path_, standby_ngl_));
+    if (!standby_process_->waitForStarted()) {
+        const QString reason = standby_process_->errorString();
+        delete std::exchange(standby_process_, nullptr);
+        ++failed_switches_;
+        emit error(tr("Failed to start llama server: %1").arg(reason));
+        return false;
+    }
+    connect(standby_process_, &QProcess::finished, this, [this]() {
+        abandonStandby(tr("exited while loading"));
+    });
+    standby_since_.start();
+    standby_timer_.start(kStandbyProbeIntervalMs);
+    LOG_INFO("Loading llama server with" << model_path << "-ngl" << new_ngl << "on port"
+             << standby_port_);
+    return true;
+}
+
+void LlamaClient::probeStandby() {
+    if (!standby_process_) {
+        standby_timer_.stop();
+        return;
+    }
+    if (standby_since_.elapsed() > kStandbyTimeoutMs) {
+        abandonStandby(tr("not healthy after %1 s").arg(kStandbyTimeoutMs / 1000));
+        return;
+    }
+    QNetworkRequest request(QUrl(QStringLiteral("http://%1:%2/health").arg(host_).arg(standby_port_)));
+    request.setTransferTimeout(kHealthCheckTimeoutMs);
+    QNetworkReply *reply = network_->get(request);
+    QPointer<QProcess> process(standby_process_);
+    connect(reply, &QNetworkReply::finished, this, [this, reply, process]() {
+        reply->deleteLater();
+        // Probes still in flight after a switch or an abandoned launch are stale.
+        if (!process || process != standby_process_) {
+            return;
+        }
+        // llama-server answers 503 until the model is loaded.
+        const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        if (reply->error() == QNetworkReply::NoError && status == 200) {
+            switchToStandby();
+        }
+    });
+}
+
+void LlamaClient::abandonStandby(const QString &reason) {
+    if (!standby_process_) {
+        return;
+    }
+    standby_timer_.stop();
+    stopProcess(std::exchange(standby_process_, nullptr));
+    ++failed_switches_;
+    LOG_WARNING("Replacement llama server abandoned:" << reason);
+    emit error(tr("Replacement llama server failed: %1").arg(reason));
+    emit serverSwitchFailed(reason);
+}
+
+// The only step that touches both servers. It runs in one pass of the event
+// loop, so every request is sent either to the old server or to the new one.
+void LlamaClient::switchToStandby() {
+    QElapsedTimer timer;
+    timer.start();
+    standby_timer_.stop();
+    // A server still draining from an earlier switch is cut off now.
+    retireDrainedServer(true);
+
+    QProcess *replacement = std::exchange(standby_process_, nullptr);
+    replacement->disconnect(this);
+    draining_process_ = server_process_;
+    draining_port_ = port_;
+    server_process_ = replacement;
+    port_ = standby_port_;
+    ngl_ = standby_ngl_;
+    model_path_ = standby_model_path_;
+    draining_since_.start();
+    drain_deadline_.start(kDrainTimeoutMs);
+    last_switch_ = SwitchStats{ngl_, standby_since_.elapsed(), 0, 0};
+    ++switches_;
+
+    // Waiting streams start on the new server; idle connections to the old
+    // one are closed, and the old server stops here if it had nothing in flight.
+    dispatchPending();
+    last_switch_.switch_us = timer.nsecsElapsed() / 1000;
+    checkHealth();
+    LOG_INFO("Switched to llama server on port" << port_ << "with -ngl" << ngl_ << "after"
+             << last_switch_.ready_ms << "ms loading," << last_switch_.switch_us << "us switching");
+    emit serverSwitched(ngl_, last_switch_.ready_ms, last_switch_.switch_us);
+}
+
+// Stops the replaced server once no stream or batch is in flight on it, or
+// right away when `force` is set, ending whatever still runs there.
+void LlamaClient::retireDrainedServer(bool force) {
+    if (draining_port_ == 0) {
+        return;
+    }
+    const quint16 port = draining_port_;
+    const auto onOldServer = [port](const QPointer<QNetworkReply> &reply) {
+        return reply && reply->url().port() == port;
+    };
+    const auto onOldConnection = [port](const auto &conn) { return conn->port == port; };
+    const bool busy =
+        std::any_of(batch_replies_.begin(), batch_replies_.end(), onOldServer) ||
+        std::any_of(connections_.begin(), connections_.end(),
+                    [&](const auto &conn) { return onOldConnection(conn) && conn->busy; });
+    if (busy && !force) {
+        return;
+    }
+    // Cleared first: the callbacks below may start requests, which re-enter here.
+    draining_port_ = 0;
+    drain_deadline_.stop();
+    last_switch_.drain_ms = draining_since_.elapsed();
+    for (auto it = std::find_if(connections_.begin(), connections_.end(), onOldConnection);
+         it != connections_.end();
+         it = std::find_if(connections_.begin(), connections_.end(), onOldConnection)) {
+        Connection *conn = it->get();
+        finishRequest(conn);
+        dropConnection(conn);
+    }
+    const QList<QPointer<QNetworkReply>> replies = batch_replies_.values();
+    for (const QPointer<QNetworkReply> &reply : replies) {
+        if (onOldServer(reply)) {
+            reply->abort();
         }
     }
-    ngl_ = new_ngl;
-    return spawnServer(model_path_, ngl_, extra_params_);
+    stopProcess(std::exchange(draining_process_, nullptr));
+    if (busy) {
+        LOG_WARNING("Stopped replaced llama server with requests still in flight");
+    }
+    LOG_INFO("Replaced llama server drained in" << last_switch_.drain_ms << "ms");
+    emit serverRetired(last_switch_.drain_ms);
 }
 
-void LlamaClient::onDisconnected() {
-    emit disconnected();
-    attemptReconnect();
+void LlamaClient::stopProcess(QProcess *process) {
+    if (!process) {
+        return;
+    }
+    process->disconnect(this);
+    // Adopted processes belong to whoever started them.
+    const bool owned = process->parent() == this;
+    if (process->state() == QProcess::NotRunning) {
+        if (owned) {
+            process->deleteLater();
+        }
+        return;
+    }
+    if (owned) {
+        connect(process, &QProcess::finished, process, &QObject::deleteLater);
+    }
+    process->terminate();
+    QTimer::singleShot(kStopTimeoutMs, process, [process]() { process->kill(); });
 }
 
-void LlamaClient::onErrorOccurred(QAbstractSocket::SocketError) {
-    emit error(socket_->errorString());
-    attemptReconnect();
+void LlamaClient::serializeMetrics(std::string &out) const {
+    vibenote::appendCounter(
+        out, "vibenote_llama_server_switches_total",
+        "Times requests moved to a llama server restarted with a new -ngl or model.", switches_);
+    vibenote::appendCounter(out, "vibenote_llama_server_switch_failures_total",
+                            "Replacement llama servers that failed to start or become healthy.",
+                            failed_switches_);
+    vibenote::appendGauge(out, "vibenote_llama_server_switch_ready_seconds",
+                          "Load time of the last replacement server, served by the old one.",
+                          static_cast<double>(last_switch_.ready_ms) / 1e3);
+    vibenote::appendGauge(
+        out, "vibenote_llama_server_switch_pause_seconds",
+        "Event-loop time the last switch took; requests wait no longer than this.",
+        static_cast<double>(last_switch_.switch_us) / 1e6);
+    vibenote::appendGauge(out, "vibenote_llama_server_drain_seconds",
+                          "Time the last replaced server took to finish its requests.",
+                          static_cast<double>(last_switch_.drain_ms) / 1e3);
 }
 
-void LlamaClient::onReadyRead() {
-    buffer_.append(socket_->readAll());
-    while (true) {
-        int idx = buffer_.indexOf("\n\n");
-        if (idx == -1)
-            break;
-        QByteArray event = buffer_.left(idx);
-        buffer_.remove(0, idx + 2);
-        if (!event.startsWith("data: "))
-            continue;
-        QByteArray data = event.mid(6).trimmed();
-        if (data == "[DONE]") {
-            QMutexLocker locker(&mutex_);
-            if (!last_event_id_.isEmpty()) {
-                callbacks_.remove(last_event_id_);
-                last_event_id_.clear();
+void LlamaClient::openConnection() {
+    auto conn = std::make_unique<Connection>();
+    Connection *raw = conn.get();
+    raw->socket = new QTcpSocket(this);
+    raw->port = port_;
+    connect(raw->socket, &QTcpSocket::connected, raw->socket, [this, raw]() {
+        raw->idle_since.start();
+        dispatchPending();
+    });
+    connect(raw->socket, &QTcpSocket::readyRead, raw->socket, [this, raw]() {
+        onConnectionReadyRead(raw);
+    });
+    connect(raw->socket, &QTcpSocket::disconnected, raw->socket, [this, raw]() {
+        finishRequest(raw);
+        dropConnection(raw);
+        dispatchPending();
+    });
+    connect(raw->socket, &QTcpSocket::errorOccurred, raw->socket,
+            [this, raw](QAbstractSocket::SocketError) {
+        if (raw->socket->state() == QAbstractSocket::ConnectedState) {
+            return;  // disconnected() follows and cleans up
+        }
+        emit error(raw->socket->errorString());
+        dropConnection(raw);
+        if (connections_.empty()) {
+            // Nothing can carry the waiting streams; release their waiters.
+            releasePendingStreams();
+        }
+    });
+    connections_.push_back(std::move(conn));
+    raw->socket->connectToHost(host_, raw->port);
+}
+
+// Hands waiting streams to idle connections, least recently used first so
+// every pooled connection stays warm, and opens more connections (up to the
+// pool size) for whatever is left. Only connections to the current server
+// count; the pool is also where a replaced server is seen to have drained.
+void LlamaClient::dispatchPending() {
+    while (!pending_.isEmpty()) {
+        Connection *idle = nullptr;
+        for (auto &conn : connections_) {
+            if (conn->port != port_ || conn->socket->state() != QAbstractSocket::ConnectedState ||
+                conn->busy) {
+                continue;
             }
-            continue;
-        }
-        QJsonParseError err;
-        QJsonDocument doc = QJsonDocument::fromJson(data, &err);
-        if (err.error != QJsonParseError::NoError || !doc.isObject())
-            continue;
-        QJsonObject obj = doc.object();
-        QString id = obj.value("id").toString();
-        QJsonArray choices = obj.value("choices").toArray();
-        QString token;
-        if (!choices.isEmpty()) {
-            QJsonObject choice = choices.first().toObject();
-            QJsonObject delta = choice.value("delta").toObject();
-            token = delta.value("content").toString();
-            if (token.isEmpty()) {
-                token = choice.value("text").toString();
+            if (!idle || conn->idle_since.elapsed() > idle->idle_since.elapsed()) {
+                idle = conn.get();
             }
         }
-        std::function<void(const QString &)> cb;
-        {
-            QMutexLocker locker(&mutex_);
-            cb = callbacks_.value(id);
-            last_event_id_ = id;
+        if (!idle) {
+            break;
+        }
+        startRequest(idle, pending_.dequeue());
+    }
+
+    qsizetype connecting = std::count_if(connections_.begin(), connections_.end(), [this](const auto &conn) {
+        return conn->port == port_ && conn->socket->state() != QAbstractSocket::ConnectedState;
+    });
+    auto current = std::count_if(connections_.begin(), connections_.end(),
+                                 [this](const auto &conn) { return conn->port == port_; });
+    while (connecting < pending_.size() && current < pool_size_) {
+        openConnection();
+        ++connecting;
+        ++current;
+    }
+    retireDrainedServer();
+}
+
+void LlamaClient::startRequest(Connection *conn, StreamRequest request) {
+    conn->request = std::move(request);
+    conn->busy = true;
+    conn->socket->write(conn->request.wire);
+    conn->request.wire.clear();
+}
+
+// Ends the connection's current stream, if any; `completed` is false when it
+// was cut short. The connection is reused only once the rest of the response
+// has been read.
+void LlamaClient::finishRequest(Connection *conn, bool completed) {
+    if (conn->request.id.isEmpty()) {
+        return;
+    }
+    auto finished = std::move(conn->request.on_finished);
+    conn->request = StreamRequest{};
+    if (finished) {
+        finished(completed);
+    }
+}
+
+void LlamaClient::dropConnection(Connection *conn) {
+    auto it = std::find_if(connections_.begin(), connections_.end(),
+                           [conn](const auto &c) { return c.get() == conn; });
+    if (it == connections_.end()) {
+        return;
+    }
+    QTcpSocket *socket = conn->socket;
+    // Cut our handlers first: they capture `conn`, which dies here.
+    socket->disconnect(socket);
+    socket->abort();
+    socket->deleteLater();
+    connections_.erase(it);
+}
+
+void LlamaClient::checkHealth() {
+    if (host_.isEmpty()) {
+        return;
+    }
+    QNetworkRequest request(QUrl(QStringLiteral("http://%1:%2/health").arg(host_).arg(port_)));
+    request.setTransferTimeout(kHealthCheckTimeoutMs);
+    QNetworkReply *reply = network_->get(request);
+    connect(reply, &QNetworkReply::finished, this, [this, reply]() {
+        reply->deleteLater();
+        const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        setHealthy(reply->error() == QNetworkReply::NoError && status == 200);
+    });
+}
+
+void LlamaClient::setHealthy(bool healthy) {
+    if (healthy == healthy_) {
+        return;
+    }
+    healthy_ = healthy;
+    if (healthy) {
+        LOG_INFO("llama server healthy at" << host_ << port_);
+        emit connected();
+        dispatchPending();
+        return;
+    }
+    LOG_WARNING("llama server health check failed");
+    // Idle keep-alive connections to a server that stopped answering are
+    // likely dead; busy ones are left to finish or fail on their own.
+    std::vector<Connection *> idle;
+    for (auto &conn : connections_) {
+        if (!conn->busy) {
+            idle.push_back(conn.get());
+        }
+    }
+    for (Connection *conn : idle) {
+        dropConnection(conn);
+    }
+    emit disconnected();
+}
+
+void LlamaClient::releasePendingStreams() {
+    // Streams that will never see [DONE] must still release their waiters.
+    for (auto &conn : connections_) {
+        finishRequest(conn.get());
+    }
+    QQueue<StreamRequest> waiting;
+    waiting.swap(pending_);
+    for (auto &request : waiting) {
+        if (request.on_finished) {
+            request.on_finished(false);
         }
-        if (cb && !token.isEmpty()) {
-            cb(token);
+    }
+}
+
+void LlamaClient::onConnectionReadyRead(Connection *conn) {
+    using Event = vibenote::SseStreamParser::Event;
+    vibenote::SseStreamParser &parser = conn->parser;
+    bool freed = false;
+    while (conn->socket->bytesAvailable() > 0) {
+        // Read straight into the parser's ring; no intermediate QByteArray.
+        std::span<char> space = parser.ring().writable();
+        const qint64 n = conn->socket->read(space.data(), static_cast<qint64>(space.size()));
+        if (n <= 0) {
+            break;
         }
+        parser.ring().commit(static_cast<std::size_t>(n));
+
+        std::string_view token;
+        for (Event event = parser.next(&token); event != Event::kNeedMore; event = parser.next(&token)) {
+            switch (event) {
+            case Event::kHeaders:
+                if (parser.status() != 200) {
+                    LOG_WARNING("llama server rejected stream with status" << parser.status());
+                    finishRequest(conn);
+                    dropConnection(conn);
+                    dispatchPending();
+                    return;
+                }
+                break;
+            case Event::kToken:
+                if (conn->request.on_token) {
+                    conn->request.on_token(QString::fromUtf8(token.data(), static_cast<qsizetype>(token.size())));
+                }
+                break;
+            case Event::kDone:
+                finishRequest(conn, true);
+                break;
+            case Event::kMessageEnd:
+                finishRequest(conn);
+                if (!parser.keepAlive()) {
+                    dropConnection(conn);
+                    dispatchPending();
+                    return;
+                }
+                conn->busy = false;
+                conn->idle_since.start();
+                freed = true;
+                break;
+            case Event::kError:
+                LOG_WARNING("malformed response from llama server");
+                finishRequest(conn);
+                dropConnection(conn);
+                dispatchPending();
+                return;
+            case Event::kNeedMore:
+                break;
+            }
+        }
+    }
+    if (freed) {
+        dispatchPending();
     }
 }
 
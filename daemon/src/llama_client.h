@@ -1,25 +1,96 @@
 #pragma once
 
-#include <QObject>
-#include <QTcpSocket>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QJsonObject>
+#include <QObject>
+#include <QPointer>
 #include <QProcess>
-#include <memory>
+#include <QQueue>
+#include <QStringList>
+#include <QTcpSocket>
+#include <QTimer>
 #include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "inference_backend.h"
+#include "sse_parser.h"
+
+class QNetworkAccessManager;
+class QNetworkReply;
 
-class LlamaClient : public QObject {
+// Client for the llama.cpp server. Streaming completions run over a pool of
+// keep-alive connections with at most one request in flight per connection,
+// so each stream has its own response and parse state and N streams can use
+// the server's N parallel slots at once. Lives on the thread that created it.
+class LlamaClient : public InferenceBackend {
     Q_OBJECT
 
 public:
     explicit LlamaClient(QObject *parent = nullptr);
-    ~LlamaClient();
-    
+    ~LlamaClient() override;
+
     bool connectToServer(const QString &host, int port);
     bool spawnServer(const QString &model_path, int ngl, const QStringList &other_params);
+    // Takes over a server started elsewhere from `program` with `model_path`,
+    // `ngl` and `other_params` (everything but --model, --host, --port and
+    // -ngl), so restartWithNgl() can replace it. The client stops `process`
+    // when it is replaced or on destruction, but never deletes it.
+    void adoptServer(QProcess *process, const QString &program, const QString &model_path, int ngl,
+                     const QStringList &other_params);
+    // Maximum number of pooled connections; match the server's --parallel.
+    // Streams beyond it wait in FIFO order for a connection to free up.
+    void setPoolSize(int size);
+    int poolSize() const;
+    int parallelSlots() const override { return pool_size_; }
+    // Result of the last /health probe.
+    bool isHealthy() const;
+
+    // `on_finished` fires once the stream ends, or when the connection drops;
+    // it gets true only after the server's [DONE].
     QString streamCompletion(const QString &prompt, const QJsonObject &params,
-                           std::function<void(const QString&)> on_token);
-    void stopGeneration(const QString &request_id);
+                             std::function<void(const QString &)> on_token,
+                             std::function<void(bool completed)> on_finished = {}) override;
+    // Sends all prompts as one multi-prompt /v1/completions request; the server
+    // spreads them over its parallel slots. `on_result` is called for each
+    // prompt the response answers, then `on_finished` once; prompts missing
+    // from the response (or all of them, on error or stopGeneration()) get no
+    // call. Returns an id for stopGeneration().
+    QString completeBatch(const QStringList &prompts, const QJsonObject &params,
+                          std::function<void(int, const QString &)> on_result,
+                          std::function<void()> on_finished) override;
+    // Closes the stream's connection, which makes the server release the slot,
+    // or aborts a batch request. Queued streams are dropped before they start.
+    void stopGeneration(const QString &request_id) override;
+    // Uses the server's /tokenize with pieces.
+    void tokenize(const QString &text,
+                  std::function<void(std::vector<std::string> pieces)> done) override;
+    // Replaces the server without downtime: starts one with `new_ngl` on a
+    // free port next to the current one and keeps serving from the old one
+    // until the new one's /health answers 200. Then new streams and batches
+    // go to the new server, requests in flight finish on the old one, and the
+    // old server is stopped once they have (or after two minutes). Both
+    // servers hold the model while the replacement loads. Returns false if
+    // the client did not start the server or the replacement fails to launch.
     bool restartWithNgl(int new_ngl);
+    // restartWithNgl() with another GGUF file, e.g. a smaller quantization
+    // of the same model, loaded by the replacement.
+    bool restartWithModel(const QString &model_path, int new_ngl);
+    // Model of the server requests go to.
+    QString modelPath() const { return model_path_; }
+
+    // Timings of the last completed restart.
+    struct SwitchStats {
+        int ngl = 0;
+        qint64 ready_ms = 0;   // replacement launch until healthy; the old server served meanwhile
+        qint64 switch_us = 0;  // time the switch held the event loop
+        qint64 drain_ms = 0;   // switch until the old server's last request finished
+    };
+    SwitchStats lastSwitch() const { return last_switch_; }
+    // Appends Prometheus families; registered with Metrics::addSource.
+    void serializeMetrics(std::string &out) const;
 
 signals:
     void connected();
@@ -27,23 +98,81 @@ signals:
     void error(const QString &message);
     void completionChunk(const QString &text);
     void completionFinished();
+    // Requests now go to the replacement server.
+    void serverSwitched(int ngl, qint64 ready_ms, qint64 switch_us);
+    // The replaced server has drained and been stopped.
+    void serverRetired(qint64 drain_ms);
+    // A replacement exited, stayed unhealthy or was superseded; requests
+    // stay on the current server.
+    void serverSwitchFailed(const QString &reason);
 
 private slots:
-    void onReadyRead();
-    void onDisconnected();
-    void onErrorOccurred(QAbstractSocket::SocketError error);
-    void attemptReconnect();
+    void checkHealth();
 
 private:
-    QString buildRequest(const QString &endpoint, const QJsonObject &data);
+    struct StreamRequest {
+        QString id;
+        QByteArray wire;  // serialized HTTP request
+        std::function<void(const QString &)> on_token;
+        std::function<void(bool)> on_finished;
+    };
+
+    // One pooled socket and the state of the response it is reading.
+    struct Connection {
+        QTcpSocket *socket = nullptr;
+        StreamRequest request;  // id is empty once the stream has finished
+        bool busy = false;      // a response is still being read
+        vibenote::SseStreamParser parser;
+        QElapsedTimer idle_since;
+        quint16 port = 0;  // server the socket talks to
+    };
+
+    QByteArray buildRequest(const QString &path, const QJsonObject &payload) const;
     QString generateRequestId() const;
+    void openConnection();
+    void dispatchPending();
+    void startRequest(Connection *conn, StreamRequest request);
+    void onConnectionReadyRead(Connection *conn);
+    void finishRequest(Connection *conn, bool completed = false);
+    void dropConnection(Connection *conn);
+    void setHealthy(bool healthy);
+    void releasePendingStreams();
+    QStringList serverArguments(quint16 port, const QString &model_path, int ngl) const;
+    void probeStandby();
+    void abandonStandby(const QString &reason);
+    void switchToStandby();
+    void retireDrainedServer(bool force = false);
+    void stopProcess(QProcess *process);
 
-    QTcpSocket *socket_;
-    std::unique_ptr<QProcess> server_process_;
+    QNetworkAccessManager *network_;
+    QHash<QString, QPointer<QNetworkReply>> batch_replies_;
+    std::vector<std::unique_ptr<Connection>> connections_;
+    QQueue<StreamRequest> pending_;
+    int pool_size_ = 4;
+    QTimer health_timer_;
+    bool healthy_ = false;
+    QProcess *server_process_ = nullptr;
+    QString server_program_ = QStringLiteral("third_party/llama.cpp/server");
     QString host_;
-    quint16 port_;
+    quint16 port_ = 0;
+    int ngl_ = 0;
     QString model_path_;
     QStringList extra_params_;
-    QByteArray response_buffer_;
-    std::function<void(const QString&)> current_handler_;
+
+    // Replacement being loaded by restartWithModel().
+    QProcess *standby_process_ = nullptr;
+    quint16 standby_port_ = 0;
+    int standby_ngl_ = 0;
+    QString standby_model_path_;
+    QElapsedTimer standby_since_;
+    QTimer standby_timer_;
+    // Replaced server finishing its requests.
+    QProcess *draining_process_ = nullptr;
+    quint16 draining_port_ = 0;
+    QElapsedTimer draining_since_;
+    QTimer drain_deadline_;
+
+    SwitchStats last_switch_;
+    quint64 switches_ = 0;
+    quint64 failed_switches_ = 0;
 };
@@ -0,0 +1,772 @@
+#include "llama_engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <utility>
+#include <vector>
+
+#include "json-schema-to-grammar.h"
+#include "llama.h"
+#include <nlohmann/json.hpp>
+
+namespace vibenote {
+
+namespace {
+
+// Length of the longest prefix of `text` that does not end inside a UTF-8
+// sequence; token pieces may split a multi-byte character.
+std::size_t completeUtf8Prefix(const std::string &text) {
+  const std::size_t size = text.size();
+  for (std::size_t back = 1; back <= std::min<std::size_t>(4, size); ++back) {
+    const auto byte = static_cast<unsigned char>(text[size - back]);
+    if ((byte & 0xC0) == 0x80) continue;  // continuation byte
+    std::size_t length = 1;
+    if ((byte & 0xE0) == 0xC0) {
+      length = 2;
+    } else if ((byte & 0xF0) == 0xE0) {
+      length = 3;
+    } else if ((byte & 0xF8) == 0xF0) {
+      length = 4;
+    }
+    return back >= length ? size : size - back;
+  }
+  return size;
+}
+
+// Drafts are judged per sequence only after this many proposals, and a
+// sequence starts without a draft when the recent average is low, except
+// for one in this many that probes whether drafts pay off again.
+constexpr std::uint64_t kMinProposalsBeforeFallback = 32;
+constexpr std::uint32_t kDraftProbeInterval = 8;
+
+void addToken(llama_batch &batch, llama_token token, llama_pos pos, llama_seq_id seq,
+              bool logits) {
+  const std::int32_t i = batch.n_tokens++;
+  batch.token[i] = token;
+  batch.pos[i] = pos;
+  batch.n_seq_id[i] = 1;
+  batch.seq_id[i][0] = seq;
+  batch.logits[i] = logits;
+}
+
+}  // namespace
+
+LlamaEngine::LlamaEngine(Options options)
+    : options_(std::move(options)), channel_(options_.channel_capacity) {
+  // Every generating sequence needs a row in each step's batch.
+  options_.batch_size = std::max<std::uint32_t>(1, options_.batch_size);
+  options_.max_sequences = std::clamp<std::uint32_t>(options_.max_sequences, 1,
+                                                     std::min<std::uint32_t>(64, options_.batch_size));
+  // ...and a speculating one needs room for its whole draft as well.
+  const auto rows = static_cast<int>(options_.batch_size / options_.max_sequences);
+  options_.draft_max = std::clamp(options_.draft_max, 0, rows - 1);
+}
+
+LlamaEngine::~LlamaEngine() { stop(); }
+
+void LlamaEngine::setWakeup(std::function<void()> wakeup) { wakeup_ = std::move(wakeup); }
+
+bool LlamaEngine::start() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) return true;
+    running_ = true;
+  }
+  stopping_.store(false, std::memory_order_relaxed);
+  std::promise<bool> loaded;
+  std::future<bool> result = loaded.get_future();
+  thread_ = std::thread(&LlamaEngine::run, this, std::move(loaded));
+  if (!result.get()) {
+    thread_.join();
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    return false;
+  }
+  return true;
+}
+
+void LlamaEngine::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    requests_.clear();
+    cancelled_.clear();
+  }
+  stopping_.store(true, std::memory_order_relaxed);
+  cv_.notify_all();
+  if (thread_.joinable()) thread_.join();
+}
+
+std::uint64_t LlamaEngine::submit(std::string prompt, GenerationParams params,
+                                  std::string prefix) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!running_) return 0;
+  const std::uint64_t id = next_id_++;
+  requests_.push_back(Request{id, std::move(prompt), params, std::move(prefix)});
+  cv_.notify_one();
+  return id;
+}
+
+void LlamaEngine::cancel(std::uint64_t request) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const bool queued = std::any_of(requests_.begin(), requests_.end(),
+                                  [request](const Request &r) { return r.id == request; });
+  if (active_.count(request) == 0 && !queued) return;  // already finished
+  cancelled_.insert(request);
+  cancel_epoch_.fetch_add(1, std::memory_order_release);
+}
+
+std::size_t LlamaEngine::drain(const std::function<void(EngineEvent &&)> &sink) {
+  // Re-arm before popping: an event pushed after this point either gets
+  // popped below or triggers a fresh wakeup.
+  wakeup_armed_.store(true, std::memory_order_release);
+  std::size_t drained = 0;
+  EngineEvent event;
+  while (channel_.tryPop(event)) {
+    sink(std::move(event));
+    ++drained;
+  }
+  return drained;
+}
+
+void LlamaEngine::publish(EngineEvent event) {
+  while (!channel_.tryPush(event)) {
+    // The consumer is a full channel behind; it was already woken.
+    if (stopping_.load(std::memory_order_relaxed)) return;
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+  if (wakeup_armed_.exchange(false, std::memory_order_acq_rel) && wakeup_) wakeup_();
+}
+
+LlamaEngine::Stats LlamaEngine::stats() const {
+  Stats stats;
+  stats.prefix_hits = prefix_hits_.load(std::memory_order_relaxed);
+  stats.prefix_misses = prefix_misses_.load(std::memory_order_relaxed);
+  stats.prompt_tokens_evaluated = prompt_tokens_evaluated_.load(std::memory_order_relaxed);
+  stats.prompt_tokens_reused = prompt_tokens_reused_.load(std::memory_order_relaxed);
+  stats.decode_steps = decode_steps_.load(std::memory_order_relaxed);
+  stats.batched_tokens = batched_tokens_.load(std::memory_order_relaxed);
+  stats.draft_tokens_proposed = draft_tokens_proposed_.load(std::memory_order_relaxed);
+  stats.draft_tokens_accepted = draft_tokens_accepted_.load(std::memory_order_relaxed);
+  stats.speculation_fallbacks = speculation_fallbacks_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void LlamaEngine::run(std::promise<bool> loaded) {
+  static std::once_flag backend_once;
+  std::call_once(backend_once, [] { llama_backend_init(); });
+
+  llama_model_params model_params = llama_model_default_params();
+  model_params.n_gpu_layers = options_.gpu_layers;
+  model_ = llama_model_load_from_file(options_.model_path.c_str(), model_params);
+  if (model_ == nullptr) {
+    loaded.set_value(false);
+    return;
+  }
+
+  const int threads = options_.threads > 0
+                          ? options_.threads
+                          : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  llama_context_params context_params = llama_context_default_params();
+  context_params.n_ctx = options_.context_size;
+  context_params.n_batch = options_.batch_size;
+  context_params.n_seq_max = options_.max_sequences;
+  // One cell pool for all sequences, so a prefix copied between them with
+  // llama_memory_seq_cp shares cells instead of duplicating them.
+  context_params.kv_unified = true;
+  context_params.n_threads = threads;
+  context_params.n_threads_batch = threads;
+  ctx_ = llama_init_from_model(model_, context_params);
+  if (ctx_ == nullptr) {
+    llama_model_free(model_);
+    model_ = nullptr;
+    loaded.set_value(false);
+    return;
+  }
+  if (!options_.draft_model_path.empty() && options_.draft_max > 0) {
+    draft_loaded_.store(loadDraft(context_params), std::memory_order_release);
+  }
+  sequence_context_ = static_cast<std::int32_t>(llama_n_ctx(ctx_) / options_.max_sequences);
+  sequences_.assign(options_.max_sequences, Sequence{});
+  llama_batch batch = llama_batch_init(static_cast<std::int32_t>(options_.batch_size), 0, 1);
+  batch_ = &batch;
+  loaded.set_value(true);
+
+  while (admit()) {
+    if (draft_ctx_ != nullptr) draft();
+    step();
+  }
+
+  for (Sequence &sequence : sequences_) {
+    if (sequence.id != 0) finishSequence(sequence, EngineEvent::Kind::kFinished);
+  }
+  batch_ = nullptr;
+  llama_batch_free(batch);
+  if (draft_ctx_ != nullptr) llama_free(draft_ctx_);
+  if (draft_model_ != nullptr) llama_model_free(draft_model_);
+  draft_ctx_ = nullptr;
+  draft_model_ = nullptr;
+  llama_free(ctx_);
+  ctx_ = nullptr;
+  llama_model_free(model_);
+  model_ = nullptr;
+}
+
+// Moves queued requests into free sequences, waiting while there is nothing
+// to decode. Returns false once the engine is stopping.
+bool LlamaEngine::admit() {
+  std::vector<std::pair<std::size_t, Request>> admitted;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !running_ || !requests_.empty() || busy_sequences_ > 0; });
+    if (!running_) return false;
+    for (std::size_t slot = 0; slot < sequences_.size() && !requests_.empty(); ++slot) {
+      if (sequences_[slot].id != 0) continue;
+      Request request = std::move(requests_.front());
+      requests_.pop_front();
+      active_.insert(request.id);
+      sequences_[slot].id = request.id;
+      sequences_[slot].cancelled = cancelled_.erase(request.id) > 0;
+      ++busy_sequences_;
+      admitted.emplace_back(slot, std::move(request));
+    }
+  }
+  // Tokenizing and restoring prefixes happen outside the lock so submit()
+  // never waits on them.
+  for (auto &[slot, request] : admitted) {
+    startSequence(slot, std::move(request));
+  }
+  return true;
+}
+
+void LlamaEngine::startSequence(std::size_t slot, Request request) {
+  Sequence &sequence = sequences_[slot];
+  if (sequence.cancelled) {
+    finishSequence(sequence, EngineEvent::Kind::kFinished);
+    return;
+  }
+
+  const auto seq = static_cast<llama_seq_id>(slot);
+  sequence.max_tokens = std::clamp(request.params.max_tokens, 1, std::max(1, sequence_context_ / 2));
+
+  // With a cached prefix the sequence already holds the preamble and only
+  // the request's own text is evaluated; otherwise everything is.
+  const CachedPrefix *prefix = request.prefix.empty() ? nullptr : preparePrefix(request.prefix, seq);
+  if (prefix == nullptr) {
+    llama_memory_seq_rm(llama_get_memory(ctx_), seq, -1, -1);
+    sequence.prefix_key = 0;
+    sequence.prefix_length = 0;
+  }
+  std::vector<llama_token> tokens =
+      prefix ? tokenize(request.prompt, false) : tokenize(request.prefix + request.prompt, true);
+  if (tokens.empty()) {
+    finishSequence(sequence, EngineEvent::Kind::kFailed, "tokenization failed");
+    return;
+  }
+
+  // Leave room for the reply; an over-long prompt keeps its end, where the
+  // latest screen text is. A cached prefix is under half the sequence's
+  // context and so is max_tokens, so the budget is never negative.
+  const auto prompt_budget =
+      static_cast<std::size_t>(sequence_context_ - sequence.max_tokens - sequence.prefix_length);
+  if (tokens.size() > prompt_budget) {
+    tokens.erase(tokens.begin(), tokens.end() - static_cast<std::ptrdiff_t>(prompt_budget));
+  }
+  prompt_tokens_evaluated_.fetch_add(tokens.size(), std::memory_order_relaxed);
+
+  // The draft context keeps no prefix cache: it sees the whole prompt,
+  // which a small model evaluates quickly.
+  sequence.speculative = false;
+  if (draft_ctx_ != nullptr &&
+      (acceptance_ >= options_.min_acceptance ||
+       ++admissions_without_draft_ % kDraftProbeInterval == 0)) {
+    sequence.speculative = true;
+    sequence.draft_input = prefix ? prefix->tokens : std::vector<llama_token>{};
+    sequence.draft_input.insert(sequence.draft_input.end(), tokens.begin(), tokens.end());
+    sequence.draft_pos = 0;
+    llama_memory_seq_rm(llama_get_memory(draft_ctx_), seq, -1, -1);
+  }
+  sequence.prompt = std::move(tokens);
+  sequence.prompt_done = 0;
+  sequence.pos = sequence.prefix_length;
+  sequence.generated = 0;
+  sequence.pending_text.clear();
+
+  sequence.sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+  std::string grammar = request.params.grammar;
+  if (grammar.empty() && !request.params.json_schema.empty()) {
+    try {
+      grammar = json_schema_to_grammar(nlohmann::ordered_json::parse(request.params.json_schema));
+    } catch (const std::exception &e) {
+      finishSequence(sequence, EngineEvent::Kind::kFailed,
+                     std::string("invalid JSON schema: ") + e.what());
+      return;
+    }
+  }
+  if (!grammar.empty()) {
+    sequence.grammar =
+        llama_sampler_init_grammar(llama_model_get_vocab(model_), grammar.c_str(), "root");
+    if (sequence.grammar == nullptr) {
+      finishSequence(sequence, EngineEvent::Kind::kFailed, "invalid grammar");
+      return;
+    }
+  }
+  if (request.params.temperature <= 0.0f) {
+    llama_sampler_chain_add(sequence.sampler, llama_sampler_init_greedy());
+  } else {
+    llama_sampler_chain_add(sequence.sampler, llama_sampler_init_top_k(request.params.top_k));
+    llama_sampler_chain_add(sequence.sampler, llama_sampler_init_top_p(request.params.top_p, 1));
+    llama_sampler_chain_add(sequence.sampler,
+                            llama_sampler_init_temp(request.params.temperature));
+    llama_sampler_chain_add(sequence.sampler, llama_sampler_init_dist(request.params.seed));
+  }
+}
+
+// Loads the draft model with the main context's settings. Drafting needs
+// token ids to mean the same thing in both models.
+bool LlamaEngine::loadDraft(const llama_context_params &params) {
+  llama_model_params model_params = llama_model_default_params();
+  model_params.n_gpu_layers = options_.gpu_layers;
+  draft_model_ = llama_model_load_from_file(options_.draft_model_path.c_str(), model_params);
+  if (draft_model_ != nullptr) {
+    const llama_vocab *vocab = llama_model_get_vocab(model_);
+    const llama_vocab *draft_vocab = llama_model_get_vocab(draft_model_);
+    if (llama_vocab_type(vocab) == llama_vocab_type(draft_vocab) &&
+        llama_vocab_n_tokens(vocab) == llama_vocab_n_tokens(draft_vocab) &&
+        llama_vocab_bos(vocab) == llama_vocab_bos(draft_vocab) &&
+        llama_vocab_eos(vocab) == llama_vocab_eos(draft_vocab)) {
+      draft_ctx_ = llama_init_from_model(draft_model_, params);
+    }
+  }
+  if (draft_ctx_ == nullptr && draft_model_ != nullptr) {
+    llama_model_free(draft_model_);
+    draft_model_ = nullptr;
+  }
+  return draft_ctx_ != nullptr;
+}
+
+// Extends every speculating sequence by up to draft_max greedy draft
+// tokens. The first pass also feeds the draft context whatever it has not
+// seen yet (a new prompt, or the last draft token of a fully accepted
+// step); every later pass is one token per sequence.
+void LlamaEngine::draft() {
+  llama_batch &batch = *batch_;
+  const auto capacity = static_cast<std::int32_t>(options_.batch_size);
+  const llama_vocab *vocab = llama_model_get_vocab(model_);
+  const std::int32_t vocab_size = llama_vocab_n_tokens(vocab);
+
+  for (Sequence &sequence : sequences_) {
+    sequence.draft.clear();
+    sequence.draft_budget = 0;
+    if (sequence.id == 0 || !sequence.speculative || sequence.cancelled ||
+        sequence.prompt_done < sequence.prompt.size()) {
+      continue;
+    }
+    // Verification emits up to one token more than the draft.
+    sequence.draft_budget = std::min(options_.draft_max, sequence.max_tokens - sequence.generated - 1);
+    if (sequence.draft_budget > 0) sequence.draft_input.push_back(sequence.next_token);
+  }
+
+  while (true) {
+    batch.n_tokens = 0;
+    for (Sequence &sequence : sequences_) {
+      sequence.draft_row = -1;
+      if (sequence.draft_budget <= 0 || sequence.draft_input.empty()) continue;
+      const auto room = static_cast<std::size_t>(capacity - batch.n_tokens);
+      const std::size_t n = std::min(room, sequence.draft_input.size());
+      for (std::size_t i = 0; i < n; ++i) {
+        const bool last = i + 1 == sequence.draft_input.size();
+        if (last) sequence.draft_row = batch.n_tokens;
+        addToken(batch, sequence.draft_input[i], sequence.draft_pos++, seqId(sequence), last);
+      }
+      sequence.draft_input.erase(sequence.draft_input.begin(),
+                                 sequence.draft_input.begin() + static_cast<std::ptrdiff_t>(n));
+    }
+    if (batch.n_tokens == 0) return;
+    if (llama_decode(draft_ctx_, batch) != 0) {
+      for (Sequence &sequence : sequences_) {
+        if (sequence.draft_budget > 0) stopSpeculating(sequence);
+      }
+      return;
+    }
+    for (Sequence &sequence : sequences_) {
+      if (sequence.draft_row < 0) continue;
+      const float *logits = llama_get_logits_ith(draft_ctx_, sequence.draft_row);
+      const llama_token token =
+          static_cast<llama_token>(std::max_element(logits, logits + vocab_size) - logits);
+      sequence.draft.push_back(token);
+      if (static_cast<int>(sequence.draft.size()) < sequence.draft_budget &&
+          !llama_vocab_is_eog(vocab, token)) {
+        sequence.draft_input.push_back(token);
+      } else {
+        sequence.draft_budget = 0;
+      }
+    }
+  }
+}
+
+void LlamaEngine::stopSpeculating(Sequence &sequence) {
+  if (!sequence.speculative) return;
+  sequence.speculative = false;
+  sequence.draft.clear();
+  sequence.draft_input.clear();
+  sequence.draft_budget = 0;
+  llama_memory_seq_rm(llama_get_memory(draft_ctx_), seqId(sequence), -1, -1);
+  speculation_fallbacks_.fetch_add(1, std::memory_order_relaxed);
+}
+
+// One decode over every busy sequence: generating sequences go first with
+// their pending token (followed by their draft when speculating), then
+// prompts fill the rest of the batch in slot order. A prompt longer than
+// the remaining room continues next step.
+void LlamaEngine::step() {
+  applyCancellations();
+
+  llama_batch &batch = *batch_;
+  const auto capacity = static_cast<std::int32_t>(options_.batch_size);
+  batch.n_tokens = 0;
+  for (Sequence &sequence : sequences_) {
+    sequence.logits = -1;
+    if (sequence.id == 0) continue;
+    if (sequence.cancelled) {
+      finishSequence(sequence, EngineEvent::Kind::kFinished);
+    } else if (sequence.prompt_done == sequence.prompt.size()) {
+      sequence.logits = batch.n_tokens;
+      addToken(batch, sequence.next_token, sequence.pos++, seqId(sequence), true);
+      for (llama_token token : sequence.draft) {
+        addToken(batch, token, sequence.pos++, seqId(sequence), true);
+      }
+    }
+  }
+  for (Sequence &sequence : sequences_) {
+    if (sequence.id == 0 || sequence.prompt_done == sequence.prompt.size()) continue;
+    while (batch.n_tokens < capacity && sequence.prompt_done < sequence.prompt.size()) {
+      const bool last = ++sequence.prompt_done == sequence.prompt.size();
+      if (last) sequence.logits = batch.n_tokens;
+      addToken(batch, sequence.prompt[sequence.prompt_done - 1], sequence.pos++,
+               seqId(sequence), last);
+    }
+  }
+  if (batch.n_tokens == 0) return;
+
+  decode_steps_.fetch_add(1, std::memory_order_relaxed);
+  batched_tokens_.fetch_add(static_cast<std::uint64_t>(batch.n_tokens), std::memory_order_relaxed);
+  if (llama_decode(ctx_, batch) != 0) {
+    // The batch's cells are in an unknown state; fail everything it touched.
+    for (Sequence &sequence : sequences_) {
+      if (sequence.id == 0) continue;
+      sequence.prefix_key = 0;
+      finishSequence(sequence, EngineEvent::Kind::kFailed, "decode failed");
+    }
+    return;
+  }
+
+  for (Sequence &sequence : sequences_) {
+    if (sequence.id == 0 || sequence.logits < 0) continue;
+    if (sequence.draft.empty()) {
+      emitToken(sequence, sampleToken(sequence, sequence.logits));
+      continue;
+    }
+
+    // Sample the main model at each drafted position; its tokens stand
+    // until the first one that differs from the draft, so the output is
+    // exactly what plain decoding would have produced.
+    const std::vector<llama_token> drafted = std::move(sequence.draft);
+    const llama_pos base = sequence.pos - static_cast<llama_pos>(drafted.size()) - 1;
+    std::size_t accepted = 0;
+    bool alive = true;
+    for (std::size_t i = 0; i <= drafted.size() && alive; ++i) {
+      const llama_token token =
+          sampleToken(sequence, sequence.logits + static_cast<std::int32_t>(i));
+      alive = emitToken(sequence, token);
+      if (i == drafted.size() || token != drafted[i]) break;
+      ++accepted;
+    }
+    draft_tokens_proposed_.fetch_add(drafted.size(), std::memory_order_relaxed);
+    draft_tokens_accepted_.fetch_add(accepted, std::memory_order_relaxed);
+    acceptance_ = 0.9 * acceptance_ + 0.1 * static_cast<double>(accepted) /
+                                          static_cast<double>(drafted.size());
+    if (!alive) continue;
+
+    // Drop the cells of rejected draft tokens from both contexts.
+    const llama_pos next = base + static_cast<llama_pos>(accepted) + 1;
+    llama_memory_seq_rm(llama_get_memory(ctx_), seqId(sequence), next, -1);
+    llama_memory_seq_rm(llama_get_memory(draft_ctx_), seqId(sequence), next, -1);
+    sequence.pos = next;
+    if (sequence.draft_pos >= next) {
+      sequence.draft_pos = next;
+    } else {
+      sequence.draft_input.push_back(drafted.back());  // accepted, never drafted from
+    }
+    sequence.proposed += drafted.size();
+    sequence.accepted += accepted;
+    if (sequence.proposed >= kMinProposalsBeforeFallback &&
+        static_cast<double>(sequence.accepted) <
+            options_.min_acceptance * static_cast<double>(sequence.proposed)) {
+      stopSpeculating(sequence);
+    }
+  }
+}
+
+// Samples batch row `row` for `sequence`. Under a grammar, the unconstrained
+// pick is kept when the grammar allows it and the whole vocabulary is masked
+// only otherwise, as common_sampler does: checking one token is far cheaper
+// than running the grammar over every candidate each step.
+llama_token LlamaEngine::sampleToken(Sequence &sequence, std::int32_t row) {
+  if (sequence.grammar == nullptr) return llama_sampler_sample(sequence.sampler, ctx_, row);
+
+  const float *logits = llama_get_logits_ith(ctx_, row);
+  const std::int32_t vocab_size = llama_vocab_n_tokens(llama_model_get_vocab(model_));
+  auto fill = [&]() {
+    candidates_.resize(static_cast<std::size_t>(vocab_size));
+    for (llama_token id = 0; id < vocab_size; ++id) {
+      candidates_[static_cast<std::size_t>(id)] = llama_token_data{id, logits[id], 0.0f};
+    }
+    return llama_token_data_array{candidates_.data(), candidates_.size(), -1, false};
+  };
+
+  llama_token_data_array all = fill();
+  llama_sampler_apply(sequence.sampler, &all);
+  llama_token token = all.data[all.selected].id;
+
+  llama_token_data single{token, 1.0f, 0.0f};
+  llama_token_data_array one{&single, 1, -1, false};
+  llama_sampler_apply(sequence.grammar, &one);
+  if (std::isinf(single.logit)) {
+    all = fill();
+    llama_sampler_apply(sequence.grammar, &all);
+    llama_sampler_apply(sequence.sampler, &all);
+    token = all.data[all.selected].id;
+  }
+  llama_sampler_accept(sequence.grammar, token);
+  llama_sampler_accept(sequence.sampler, token);
+  return token;
+}
+
+// Streams `token` and makes it the sequence's next input. Returns false if
+// it ended the request (end of generation or max_tokens).
+bool LlamaEngine::emitToken(Sequence &sequence, llama_token token) {
+  const llama_vocab *vocab = llama_model_get_vocab(model_);
+  if (llama_vocab_is_eog(vocab, token)) {
+    finishSequence(sequence, EngineEvent::Kind::kFinished);
+    return false;
+  }
+  char piece[256];
+  const std::int32_t length = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
+  if (length > 0) {
+    std::string &text = sequence.pending_text;
+    text.append(piece, static_cast<std::size_t>(length));
+    const std::size_t ready = completeUtf8Prefix(text);
+    if (ready > 0) {
+      publish({sequence.id, EngineEvent::Kind::kToken, text.substr(0, ready)});
+      text.erase(0, ready);
+    }
+  }
+  sequence.next_token = token;
+  if (++sequence.generated >= sequence.max_tokens) {
+    finishSequence(sequence, EngineEvent::Kind::kFinished);
+    return false;
+  }
+  return true;
+}
+
+// Publishes the request's last event and frees the slot. Cells after the
+// prefix are removed so the next request can reuse the prefix in place.
+void LlamaEngine::finishSequence(Sequence &sequence, EngineEvent::Kind kind, std::string reason) {
+  if (kind == EngineEvent::Kind::kFinished && !sequence.pending_text.empty()) {
+    publish({sequence.id, EngineEvent::Kind::kToken, std::move(sequence.pending_text)});
+  }
+  publish({sequence.id, kind, std::move(reason)});
+  if (sequence.prefix_key == 0) sequence.prefix_length = 0;
+  llama_memory_seq_rm(llama_get_memory(ctx_), seqId(sequence), sequence.prefix_length, -1);
+  if (draft_ctx_ != nullptr) llama_memory_seq_rm(llama_get_memory(draft_ctx_), seqId(sequence), -1, -1);
+  if (sequence.sampler != nullptr) llama_sampler_free(sequence.sampler);
+  if (sequence.grammar != nullptr) llama_sampler_free(sequence.grammar);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_.erase(sequence.id);
+    cancelled_.erase(sequence.id);
+    --busy_sequences_;
+  }
+  const std::uint64_t prefix_key = sequence.prefix_key;
+  const std::int32_t prefix_length = sequence.prefix_length;
+  sequence = Sequence{};
+  sequence.prefix_key = prefix_key;
+  sequence.prefix_length = prefix_length;
+}
+
+void LlamaEngine::applyCancellations() {
+  if (stopping_.load(std::memory_order_relaxed)) {
+    for (Sequence &sequence : sequences_) sequence.cancelled = true;
+    return;
+  }
+  const std::uint64_t epoch = cancel_epoch_.load(std::memory_order_acquire);
+  if (epoch == seen_cancel_epoch_) return;
+  seen_cancel_epoch_ = epoch;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (Sequence &sequence : sequences_) {
+    if (sequence.id != 0 && cancelled_.erase(sequence.id) > 0) sequence.cancelled = true;
+  }
+}
+
+std::vector<llama_token> LlamaEngine::tokenize(const std::string &text, bool add_special) const {
+  const llama_vocab *vocab = llama_model_get_vocab(model_);
+  const auto size = static_cast<std::int32_t>(text.size());
+  std::vector<llama_token> tokens(text.size() + 2);
+  std::int32_t count = llama_tokenize(vocab, text.data(), size, tokens.data(),
+                                      static_cast<std::int32_t>(tokens.size()), add_special, true);
+  if (count < 0) {
+    tokens.resize(static_cast<std::size_t>(-count));
+    count = llama_tokenize(vocab, text.data(), size, tokens.data(),
+                           static_cast<std::int32_t>(tokens.size()), add_special, true);
+  }
+  tokens.resize(static_cast<std::size_t>(std::max(count, 0)));
+  return tokens;
+}
+
+std::vector<std::string> LlamaEngine::tokenPieces(const std::string &text) const {
+  const llama_vocab *vocab = llama_model_get_vocab(model_);
+  std::vector<std::string> pieces;
+  char piece[256];
+  for (llama_token token : tokenize(text, false)) {
+    const std::int32_t length = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, true);
+    pieces.emplace_back(piece, static_cast<std::size_t>(std::max(length, 0)));
+  }
+  return pieces;
+}
+
+bool LlamaEngine::decodeTokens(const std::vector<llama_token> &tokens, llama_seq_id seq) {
+  llama_batch &batch = *batch_;
+  const std::size_t capacity = options_.batch_size;
+  for (std::size_t i = 0; i < tokens.size(); i += capacity) {
+    batch.n_tokens = 0;
+    for (std::size_t j = i; j < std::min(tokens.size(), i + capacity); ++j) {
+      addToken(batch, tokens[j], static_cast<llama_pos>(j), seq, false);
+    }
+    if (llama_decode(ctx_, batch) != 0) return false;
+  }
+  return true;
+}
+
+// Identifies a prefix under this model, so a state file written for another
+// model or template is never restored.
+std::uint64_t LlamaEngine::prefixKey(const std::string &text) const {
+  char desc[128] = {};
+  llama_model_desc(model_, desc, sizeof(desc));
+  std::uint64_t hash = 1469598103934665603ull;  // FNV-1a
+  auto mix = [&hash](const void *data, std::size_t size) {
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    for (std::size_t i = 0; i < size; ++i) {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+  };
+  const std::uint64_t model_size = llama_model_size(model_);
+  const std::uint64_t model_params = llama_model_n_params(model_);
+  mix(desc, std::strlen(desc));
+  mix(&model_size, sizeof(model_size));
+  mix(&model_params, sizeof(model_params));
+  mix(text.data(), text.size());
+  return hash == 0 ? 1 : hash;
+}
+
+// Leaves sequence `seq` holding exactly the evaluated `text`, reusing
+// earlier work where possible: the sequence may still hold it (drop what
+// followed), another sequence may (share its cells), the state may be
+// cached in memory (copy it in) or on disk (load it); only otherwise is it
+// decoded, which stalls the other sequences for one prompt's worth of work.
+// Returns nullptr, with the sequence cleared, if the prefix cannot be used.
+const LlamaEngine::CachedPrefix *LlamaEngine::preparePrefix(const std::string &text,
+                                                            llama_seq_id seq) {
+  llama_memory_t memory = llama_get_memory(ctx_);
+  Sequence &sequence = sequences_[static_cast<std::size_t>(seq)];
+  const std::uint64_t key = prefixKey(text);
+  auto cached = std::find_if(prefixes_.begin(), prefixes_.end(),
+                             [key](const CachedPrefix &p) { return p.key == key; });
+  if (cached != prefixes_.end()) {
+    const auto length = static_cast<llama_pos>(cached->tokens.size());
+    bool restored = sequence.prefix_key == key && llama_memory_seq_rm(memory, seq, length, -1);
+    if (!restored) {
+      llama_memory_seq_rm(memory, seq, -1, -1);
+      const auto holder = std::find_if(sequences_.begin(), sequences_.end(),
+                                       [key](const Sequence &s) { return s.prefix_key == key; });
+      if (holder != sequences_.end()) {
+        llama_memory_seq_cp(memory, static_cast<llama_seq_id>(holder - sequences_.begin()), seq,
+                            0, length);
+        restored = true;
+      } else {
+        restored =
+            llama_state_seq_set_data(ctx_, cached->state.data(), cached->state.size(), seq) > 0;
+      }
+    }
+    if (restored) {
+      sequence.prefix_key = key;
+      sequence.prefix_length = length;
+      cached->last_used = ++prefix_clock_;
+      prefix_hits_.fetch_add(1, std::memory_order_relaxed);
+      prompt_tokens_reused_.fetch_add(cached->tokens.size(), std::memory_order_relaxed);
+      return &*cached;
+    }
+    prefixes_.erase(cached);
+  }
+
+  llama_memory_seq_rm(memory, seq, -1, -1);
+  sequence.prefix_key = 0;
+  sequence.prefix_length = 0;
+  std::vector<llama_token> tokens = tokenize(text, true);
+  if (tokens.empty() || tokens.size() >= static_cast<std::size_t>(sequence_context_ / 2)) {
+    return nullptr;
+  }
+
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.kv", static_cast<unsigned long long>(key));
+  const std::string path =
+      options_.prefix_cache_dir.empty() ? std::string() : options_.prefix_cache_dir + "/" + name;
+  bool loaded = false;
+  if (!path.empty()) {
+    std::vector<llama_token> stored(tokens.size());
+    std::size_t stored_count = 0;
+    loaded = llama_state_seq_load_file(ctx_, path.c_str(), seq, stored.data(), stored.size(),
+                                       &stored_count) > 0 &&
+             stored_count == tokens.size() && stored == tokens;
+    if (!loaded) llama_memory_seq_rm(memory, seq, -1, -1);
+  }
+  if (loaded) {
+    prefix_hits_.fetch_add(1, std::memory_order_relaxed);
+    prompt_tokens_reused_.fetch_add(tokens.size(), std::memory_order_relaxed);
+  } else {
+    if (!decodeTokens(tokens, seq)) {
+      llama_memory_seq_rm(memory, seq, -1, -1);
+      return nullptr;
+    }
+    prefix_misses_.fetch_add(1, std::memory_order_relaxed);
+    prompt_tokens_evaluated_.fetch_add(tokens.size(), std::memory_order_relaxed);
+    if (!path.empty()) {
+      std::error_code ec;
+      std::filesystem::create_directories(options_.prefix_cache_dir, ec);
+      llama_state_seq_save_file(ctx_, path.c_str(), seq, tokens.data(), tokens.size());
+    }
+  }
+
+  CachedPrefix entry;
+  entry.key = key;
+  entry.tokens = std::move(tokens);
+  entry.state.resize(llama_state_seq_get_size(ctx_, seq));
+  entry.state.resize(llama_state_seq_get_data(ctx_, entry.state.data(), entry.state.size(), seq));
+  entry.last_used = ++prefix_clock_;
+  if (prefixes_.size() >= std::max<std::size_t>(1, options_.max_cached_prefixes)) {
+    prefixes_.erase(std::min_element(prefixes_.begin(), prefixes_.end(),
+                                     [](const CachedPrefix &a, const CachedPrefix &b) {
+                                       return a.last_used < b.last_used;
+                                     }));
+  }
+  prefixes_.push_back(std::move(entry));
+  sequence.prefix_key = key;
+  sequence.prefix_length = static_cast<llama_pos>(prefixes_.back().tokens.size());
+  return &prefixes_.back();
+}
+
+}  // namespace vibenote
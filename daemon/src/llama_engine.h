@@ -0,0 +1,247 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "spsc_channel.h"
+
+struct llama_batch;
+struct llama_context;
+struct llama_context_params;
+struct llama_model;
+struct llama_sampler;
+struct llama_token_data;
+
+namespace vibenote {
+
+struct GenerationParams {
+  int max_tokens{256};
+  float temperature{0.8f};  // <= 0 samples greedily
+  float top_p{0.95f};
+  int top_k{40};
+  std::uint32_t seed{0xFFFFFFFF};  // random
+  // Constrains the output to a GBNF grammar, or to a JSON schema converted
+  // to one; `grammar` wins if both are set.
+  std::string grammar;
+  std::string json_schema;
+};
+
+struct EngineEvent {
+  enum class Kind : std::uint8_t { kToken, kFinished, kFailed };
+
+  std::uint64_t request{0};
+  Kind kind{Kind::kToken};
+  std::string text;  // token text for kToken, reason for kFailed
+};
+
+// Runs libllama in-process. The model and context belong to one engine
+// thread that decodes up to `max_sequences` requests at once with continuous
+// batching: every step packs the next token of each generating sequence and
+// chunks of newly admitted prompts into one shared llama_batch, admits
+// queued requests (FIFO) as soon as a sequence frees up, and removes a
+// finished sequence's cells from the KV cache. With a draft model, each
+// step first drafts a few tokens per sequence and the same batched decode
+// verifies them. Generated text comes back through a lock-free SPSC
+// channel, so the consumer never blocks on the decoder and the decoder only
+// waits when the consumer falls a full channel behind.
+//
+// submit() and cancel() may be called from any thread; drain() only from a
+// single consumer thread.
+class LlamaEngine {
+ public:
+  struct Options {
+    std::string model_path;
+    int gpu_layers{0};
+    std::uint32_t context_size{4096};  // shared by all sequences
+    std::uint32_t batch_size{512};
+    // Sequences decoded together; each may use context_size / max_sequences.
+    std::uint32_t max_sequences{4};
+    int threads{0};  // 0 = one per hardware thread
+    std::size_t channel_capacity{1024};
+    // Where evaluated prompt prefixes are saved so they survive restarts;
+    // empty keeps them in memory only.
+    std::string prefix_cache_dir;
+    std::size_t max_cached_prefixes{8};
+    // Optional small model sharing the main model's vocabulary. It drafts up
+    // to draft_max tokens per step, which the main model verifies in the
+    // same batched decode; a sequence whose drafts are accepted less often
+    // than min_acceptance falls back to plain decoding.
+    std::string draft_model_path;
+    int draft_max{8};
+    float min_acceptance{0.4f};
+  };
+
+  struct Stats {
+    std::uint64_t prefix_hits{0};     // prefix restored from memory or disk
+    std::uint64_t prefix_misses{0};   // prefix evaluated from scratch
+    std::uint64_t prompt_tokens_evaluated{0};
+    std::uint64_t prompt_tokens_reused{0};
+    std::uint64_t decode_steps{0};
+    std::uint64_t batched_tokens{0};  // tokens over all steps
+    std::uint64_t draft_tokens_proposed{0};
+    std::uint64_t draft_tokens_accepted{0};
+    std::uint64_t speculation_fallbacks{0};  // sequences that stopped drafting
+  };
+
+  explicit LlamaEngine(Options options);
+  ~LlamaEngine();
+
+  LlamaEngine(const LlamaEngine &) = delete;
+  LlamaEngine &operator=(const LlamaEngine &) = delete;
+
+  // Called on the engine thread when events arrive after the consumer last
+  // drained the channel; one call per drain at most. Set before start().
+  void setWakeup(std::function<void()> wakeup);
+
+  // Loads the model on the engine thread. Returns false if the model or
+  // context cannot be created; a draft model that fails to load or does not
+  // match the main model's vocabulary only disables speculation.
+  bool start();
+  // Abandons queued requests and joins the engine thread.
+  void stop();
+
+  // `prefix` is a fixed preamble (e.g. summary instructions) that precedes
+  // `prompt`. Its KV state is evaluated once, kept per distinct prefix and
+  // restored for later requests, so only `prompt` is processed each time.
+  std::uint64_t submit(std::string prompt, GenerationParams params, std::string prefix = {});
+  // The request ends with kFinished at its next token, or without decoding
+  // if it has not started yet.
+  void cancel(std::uint64_t request);
+
+  // The bytes of each token `text` tokenizes to, in order; concatenated they
+  // give back `text` (plus a leading space on vocabularies that add one). A
+  // piece may end inside a UTF-8 character. Safe from any thread between
+  // start() and stop().
+  std::vector<std::string> tokenPieces(const std::string &text) const;
+
+  std::uint32_t maxSequences() const { return options_.max_sequences; }
+  bool speculative() const { return draft_loaded_.load(std::memory_order_acquire); }
+
+  // Hands every pending event to `sink` and re-arms the wakeup.
+  std::size_t drain(const std::function<void(EngineEvent &&)> &sink);
+
+  Stats stats() const;
+
+ private:
+  struct Request {
+    std::uint64_t id{0};
+    std::string prompt;
+    GenerationParams params;
+    std::string prefix;
+  };
+
+  // A decoding slot; its index is the request's llama_seq_id.
+  struct Sequence {
+    std::uint64_t id{0};  // 0 when the slot is free
+    std::vector<std::int32_t> prompt;
+    std::size_t prompt_done{0};  // prompt tokens already in the batch
+    std::int32_t pos{0};         // position of the next token
+    std::int32_t next_token{0};  // sampled, not yet decoded
+    std::int32_t logits{-1};     // batch row to sample from this step
+    int generated{0};
+    int max_tokens{0};
+    llama_sampler *sampler{nullptr};
+    llama_sampler *grammar{nullptr};  // kept out of `sampler`, see sampleToken()
+    std::string pending_text;  // piece bytes short of a full UTF-8 character
+    bool cancelled{false};
+    // Speculation: tokens the draft context has yet to see, the current
+    // step's draft, and the running acceptance of this request's drafts.
+    bool speculative{false};
+    std::vector<std::int32_t> draft_input;
+    std::vector<std::int32_t> draft;
+    std::int32_t draft_pos{0};
+    std::int32_t draft_row{-1};
+    int draft_budget{0};
+    std::uint64_t proposed{0};
+    std::uint64_t accepted{0};
+    // Prefix whose cells the slot keeps between requests.
+    std::uint64_t prefix_key{0};
+    std::int32_t prefix_length{0};
+  };
+
+  // KV state of a sequence right after evaluating `tokens`.
+  struct CachedPrefix {
+    std::uint64_t key{0};
+    std::vector<std::int32_t> tokens;
+    std::vector<std::uint8_t> state;
+    std::uint64_t last_used{0};
+  };
+
+  void run(std::promise<bool> loaded);
+  bool admit();
+  void startSequence(std::size_t slot, Request request);
+  bool loadDraft(const llama_context_params &params);
+  void draft();
+  void stopSpeculating(Sequence &sequence);
+  void step();
+  std::int32_t sampleToken(Sequence &sequence, std::int32_t row);
+  bool emitToken(Sequence &sequence, std::int32_t token);
+  void finishSequence(Sequence &sequence, EngineEvent::Kind kind, std::string reason = {});
+  void applyCancellations();
+  void publish(EngineEvent event);
+  std::vector<std::int32_t> tokenize(const std::string &text, bool add_special) const;
+  bool decodeTokens(const std::vector<std::int32_t> &tokens, std::int32_t seq);
+  std::int32_t seqId(const Sequence &sequence) const {
+    return static_cast<std::int32_t>(&sequence - sequences_.data());
+  }
+  const CachedPrefix *preparePrefix(const std::string &text, std::int32_t seq);
+  std::uint64_t prefixKey(const std::string &text) const;
+
+  Options options_;
+  std::function<void()> wakeup_;
+
+  llama_model *model_{nullptr};
+  llama_context *ctx_{nullptr};
+  llama_model *draft_model_{nullptr};
+  llama_context *draft_ctx_{nullptr};
+  std::atomic<bool> draft_loaded_{false};
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Request> requests_;
+  std::unordered_set<std::uint64_t> cancelled_;
+  bool running_{false};
+  std::uint64_t next_id_{1};
+  std::unordered_set<std::uint64_t> active_;  // requests holding a sequence
+  // Bumped by cancel() so the decode loop only takes mutex_ when needed.
+  std::atomic<std::uint64_t> cancel_epoch_{0};
+  std::uint64_t seen_cancel_epoch_{0};  // engine thread only
+  std::atomic<bool> stopping_{false};
+
+  SpscChannel<EngineEvent> channel_;
+  std::atomic<bool> wakeup_armed_{true};
+
+  // Engine thread only.
+  std::vector<Sequence> sequences_;
+  std::size_t busy_sequences_{0};
+  llama_batch *batch_{nullptr};  // owned by run()
+  std::int32_t sequence_context_{0};
+  std::vector<llama_token_data> candidates_;
+  std::vector<CachedPrefix> prefixes_;
+  std::uint64_t prefix_clock_{0};
+  double acceptance_{1.0};  // moving average over recent drafts
+  std::uint32_t admissions_without_draft_{0};
+
+  std::atomic<std::uint64_t> prefix_hits_{0};
+  std::atomic<std::uint64_t> prefix_misses_{0};
+  std::atomic<std::uint64_t> prompt_tokens_evaluated_{0};
+  std::atomic<std::uint64_t> prompt_tokens_reused_{0};
+  std::atomic<std::uint64_t> decode_steps_{0};
+  std::atomic<std::uint64_t> batched_tokens_{0};
+  std::atomic<std::uint64_t> draft_tokens_proposed_{0};
+  std::atomic<std::uint64_t> draft_tokens_accepted_{0};
+  std::atomic<std::uint64_t> speculation_fallbacks_{0};
+};
+
+}  // namespace vibenote
@@ -0,0 +1,221 @@
+#include <QJsonDocument>
+#include <QMetaObject>
+#include <QUuid>
+#include <utility>
+
+#include "local_llama_backend.h"
+#include "logging.h"
+#include "metrics.h"
+
+namespace {
+
+// Accepts the same sampling keys as llama-server's /v1/completions.
+vibenote::GenerationParams generationParams(const QJsonObject &params) {
+    vibenote::GenerationParams out;
+    if (params.contains(QStringLiteral("max_tokens"))) {
+        out.max_tokens = params.value(QStringLiteral("max_tokens")).toInt(out.max_tokens);
+    } else if (params.contains(QStringLiteral("n_predict"))) {
+        out.max_tokens = params.value(QStringLiteral("n_predict")).toInt(out.max_tokens);
+    }
+    out.temperature = static_cast<float>(params.value(QStringLiteral("temperature")).toDouble(out.temperature));
+    out.top_p = static_cast<float>(params.value(QStringLiteral("top_p")).toDouble(out.top_p));
+    out.top_k = params.value(QStringLiteral("top_k")).toInt(out.top_k);
+    if (params.contains(QStringLiteral("seed"))) {
+        out.seed = static_cast<std::uint32_t>(params.value(QStringLiteral("seed")).toInteger());
+    }
+    out.grammar = params.value(QStringLiteral("grammar")).toString().toStdString();
+    const QJsonValue schema = params.value(QStringLiteral("json_schema"));
+    if (schema.isObject()) {
+        out.json_schema =
+            QJsonDocument(schema.toObject()).toJson(QJsonDocument::Compact).toStdString();
+    }
+    return out;
+}
+
+} // namespace
+
+LocalLlamaBackend::LocalLlamaBackend(vibenote::LlamaEngine::Options options, QObject *parent)
+    : InferenceBackend(parent),
+      draft_model_path_(options.draft_model_path),
+      engine_(std::make_unique<vibenote::LlamaEngine>(std::move(options))) {
+    // Runs on the engine thread; the drain itself happens on ours.
+    engine_->setWakeup([this]() {
+        QMetaObject::invokeMethod(this, [this]() { drainEvents(); }, Qt::QueuedConnection);
+    });
+}
+
+LocalLlamaBackend::~LocalLlamaBackend() {
+    // Joining the engine thread first guarantees no wakeup races the destructor.
+    engine_->stop();
+    releaseAll();
+}
+
+bool LocalLlamaBackend::start() {
+    if (!engine_->start()) {
+        return false;
+    }
+    if (!draft_model_path_.empty() && !engine_->speculative()) {
+        LOG_WARNING("Draft model" << QString::fromStdString(draft_model_path_)
+                                  << "is unusable with this model, decoding without speculation");
+    }
+    return true;
+}
+
+void LocalLlamaBackend::serializeMetrics(std::string &out) const {
+    const vibenote::LlamaEngine::Stats stats = engine_->stats();
+    vibenote::appendCounter(out, "vibenote_llama_prompt_tokens_evaluated_total",
+                            "Prompt tokens decoded by the in-process engine.",
+                            stats.prompt_tokens_evaluated);
+    vibenote::appendCounter(out, "vibenote_llama_prompt_tokens_reused_total",
+                            "Prompt tokens restored from the prefix cache instead of decoded.",
+                            stats.prompt_tokens_reused);
+    vibenote::appendCounter(out, "vibenote_llama_decode_steps_total",
+                            "Batched decode steps over all active sequences.", stats.decode_steps);
+    vibenote::appendCounter(out, "vibenote_llama_batched_tokens_total",
+                            "Tokens decoded over all batched steps.", stats.batched_tokens);
+    vibenote::appendCounter(out, "vibenote_llama_draft_tokens_proposed_total",
+                            "Tokens proposed by the draft model.", stats.draft_tokens_proposed);
+    vibenote::appendCounter(out, "vibenote_llama_draft_tokens_accepted_total",
+                            "Draft tokens the main model accepted.", stats.draft_tokens_accepted);
+    vibenote::appendCounter(out, "vibenote_llama_speculation_fallbacks_total",
+                            "Sequences that stopped drafting because too few drafts were accepted.",
+                            stats.speculation_fallbacks);
+}
+
+QString LocalLlamaBackend::streamCompletion(const QString &prompt, const QJsonObject &params,
+                                            std::function<void(const QString &)> on_token,
+                                            std::function<void(bool)> on_finished) {
+    const QString id = QUuid::createUuid().toString(QUuid::WithoutBraces);
+    const quint64 request = engine_->submit(prompt.toStdString(), generationParams(params),
+                                            params.value(QStringLiteral("prefix")).toString().toStdString());
+    if (request == 0) {
+        if (on_finished) {
+            on_finished(false);
+        }
+        return id;
+    }
+    Generation generation;
+    generation.id = id;
+    generation.on_token = std::move(on_token);
+    generation.on_finished = std::move(on_finished);
+    generations_.insert(request, std::move(generation));
+    requests_[id].append(request);
+    return id;
+}
+
+QString LocalLlamaBackend::completeBatch(const QStringList &prompts, const QJsonObject &params,
+                                         std::function<void(int, const QString &)> on_result,
+                                         std::function<void()> on_finished) {
+    const QString id = QUuid::createUuid().toString(QUuid::WithoutBraces);
+    auto batch = std::make_shared<Batch>();
+    batch->results.resize(prompts.size());
+    batch->completed.fill(false, prompts.size());
+    batch->on_result = std::move(on_result);
+    batch->on_finished = std::move(on_finished);
+    const vibenote::GenerationParams generation_params = generationParams(params);
+    const std::string prefix = params.value(QStringLiteral("prefix")).toString().toStdString();
+    for (int i = 0; i < prompts.size(); ++i) {
+        const quint64 request = engine_->submit(prompts[i].toStdString(), generation_params, prefix);
+        if (request == 0) {
+            continue;
+        }
+        Generation generation;
+        generation.id = id;
+        generation.batch = batch;
+        generation.index = i;
+        generations_.insert(request, std::move(generation));
+        requests_[id].append(request);
+        ++batch->remaining;
+    }
+    if (batch->remaining == 0) {
+        if (batch->on_finished) {
+            batch->on_finished();
+        }
+    }
+    return id;
+}
+
+void LocalLlamaBackend::stopGeneration(const QString &request_id) {
+    // The engine answers each cancel with kFinished, which runs the usual
+    // completion path.
+    for (quint64 request : requests_.value(request_id)) {
+        const auto it = generations_.find(request);
+        if (it != generations_.end()) {
+            it->stopped = true;
+            if (it->batch) {
+                it->batch->stopped = true;
+            }
+        }
+        engine_->cancel(request);
+    }
+}
+
+void LocalLlamaBackend::tokenize(const QString &text,
+                                 std::function<void(std::vector<std::string> pieces)> done) {
+    done(engine_->tokenPieces(text.toStdString()));
+}
+
+void LocalLlamaBackend::drainEvents() {
+    engine_->drain([this](vibenote::EngineEvent &&event) {
+        auto it = generations_.find(event.request);
+        if (it == generations_.end()) {
+            return;
+        }
+        switch (event.kind) {
+        case vibenote::EngineEvent::Kind::kToken: {
+            const QString text = QString::fromStdString(event.text);
+            if (it->batch) {
+                it->batch->results[it->index] += text;
+            } else if (it->on_token) {
+                it->on_token(text);
+            }
+            break;
+        }
+        case vibenote::EngineEvent::Kind::kFailed:
+            LOG_WARNING("In-process generation failed:" << QString::fromStdString(event.text));
+            finishGeneration(event.request, false);
+            break;
+        case vibenote::EngineEvent::Kind::kFinished:
+            finishGeneration(event.request, true);
+            break;
+        }
+    });
+}
+
+void LocalLlamaBackend::finishGeneration(quint64 request, bool completed) {
+    Generation generation = generations_.take(request);
+    auto ids = requests_.find(generation.id);
+    if (ids != requests_.end()) {
+        ids->removeOne(request);
+        if (ids->isEmpty()) {
+            requests_.erase(ids);
+        }
+    }
+    if (!generation.batch) {
+        if (generation.on_finished) {
+            generation.on_finished(completed && !generation.stopped);
+        }
+        return;
+    }
+    Batch &batch = *generation.batch;
+    batch.completed[generation.index] = completed;
+    if (--batch.remaining > 0) {
+        return;
+    }
+    for (int i = 0; i < batch.results.size(); ++i) {
+        if (batch.completed[i] && !batch.stopped) {
+            batch.on_result(i, batch.results[i]);
+        }
+    }
+    if (batch.on_finished) {
+        batch.on_finished();
+    }
+}
+
+void LocalLlamaBackend::releaseAll() {
+    // Workers block until their stream finishes; let every one of them go.
+    const QList<quint64> pending = generations_.keys();
+    for (quint64 request : pending) {
+        finishGeneration(request, false);
+    }
+}
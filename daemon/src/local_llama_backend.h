@@ -0,0 +1,73 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QVector>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "inference_backend.h"
+#include "llama_engine.h"
+
+// InferenceBackend on top of an in-process LlamaEngine: no server process,
+// no JSON or sockets per token, and it works on CPU-only machines. Engine
+// events are drained on this object's thread and routed to the callbacks of
+// the stream or batch they belong to.
+class LocalLlamaBackend : public InferenceBackend {
+    Q_OBJECT
+
+public:
+    explicit LocalLlamaBackend(vibenote::LlamaEngine::Options options, QObject *parent = nullptr);
+    ~LocalLlamaBackend() override;
+
+    // Loads the model; false if it cannot be loaded.
+    bool start();
+
+    // Appends the engine's counters in Prometheus text format. Safe to call
+    // from any thread.
+    void serializeMetrics(std::string &out) const;
+
+    int parallelSlots() const override { return static_cast<int>(engine_->maxSequences()); }
+    QString streamCompletion(const QString &prompt, const QJsonObject &params,
+                             std::function<void(const QString &)> on_token,
+                             std::function<void(bool completed)> on_finished = {}) override;
+    QString completeBatch(const QStringList &prompts, const QJsonObject &params,
+                          std::function<void(int, const QString &)> on_result,
+                          std::function<void()> on_finished) override;
+    void stopGeneration(const QString &request_id) override;
+    // Answers synchronously from the loaded vocabulary.
+    void tokenize(const QString &text,
+                  std::function<void(std::vector<std::string> pieces)> done) override;
+
+private:
+    struct Batch {
+        QVector<QString> results;
+        QVector<bool> completed;
+        int remaining = 0;
+        bool stopped = false;
+        std::function<void(int, const QString &)> on_result;
+        std::function<void()> on_finished;
+    };
+
+    // One engine request; either a stream or one prompt of a batch.
+    struct Generation {
+        QString id;
+        std::function<void(const QString &)> on_token;
+        std::function<void(bool)> on_finished;
+        bool stopped = false;
+        std::shared_ptr<Batch> batch;
+        int index = -1;
+    };
+
+    void drainEvents();
+    // `completed` is false for a generation that failed or was released.
+    void finishGeneration(quint64 request, bool completed);
+    void releaseAll();
+
+    std::string draft_model_path_;
+    std::unique_ptr<vibenote::LlamaEngine> engine_;
+    QHash<quint64, Generation> generations_;
+    QHash<QString, QList<quint64>> requests_;
+};
@@ -1,23 +1,52 @@
 #include <QCommandLineParser>
 #include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QImage>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMetaObject>
+#include <QPointer>
 #include <QProcess>
+#include <QSaveFile>
 #include <QThread>
 #include <QTimer>
+#include <chrono>
 #include <csignal>
-
-#include <nvml.h>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
 
 #include "config.h"
 #include "logging.h"
 #include "gpu_guard.h"
+#include "monitor/resource_monitor.h"
+#include "offload_planner.h"
 #include "queue.h"
+#include "queue_journal.h"
+#include "queue_metrics.h"
+#include "metrics.h"
+#include "model_variants.h"
+#include "worker_pool.h"
+#include "map_reduce.h"
 #include "http_server.h"
 
 #include "capture/screencast_portal.h"
 #include "windows/kwin_watcher.h"
 #include "ocr/ocr_engine.h"
 #include "store/sqlite_store.h"
+#include "structured_summary.h"
+#include "summary_cache.h"
 #include "llama_client.h"
+#include "variant_switcher.h"
+#ifdef VIBENOTE_INPROCESS_LLAMA
+#include "local_llama_backend.h"
+#endif
 
 namespace {
 
@@ -27,6 +56,305 @@ void installSignalHandlers() {
     std::signal(SIGTERM, handler);
 }
 
+// A watch summary that waited longer than this is no longer worth generating.
+constexpr auto kWatchDeadline = std::chrono::minutes(10);
+
+// Capture slows to one frame per this interval while the queue pushes back.
+constexpr int kBackpressureFrameIntervalMs = 5000;
+
+// Callback of a watch task: stores the summary under the key its screen text
+// was looked up with and queues the note for the store's ingest thread.
+// Output cut short by max_tokens or a cancel does not parse and is dropped.
+std::function<void(const std::string &)> finishWatchSummary(SummaryCache *cache,
+                                                             SqliteStore *store,
+                                                             std::string key, qint64 capturedAt,
+                                                             QString text) {
+    return [cache, store, key = std::move(key), capturedAt,
+            text = std::move(text)](const std::string &summary) {
+        const QString parsed = QString::fromStdString(summary);
+        if (!StructuredSummary::parse(parsed)) {
+            return;
+        }
+        cache->insert(key, summary);
+        // The id is not needed; the ingest thread reports its own failures.
+        store->enqueueNote(capturedAt, 0, text, parsed,
+                           QJsonObject{{QStringLiteral("source"), QStringLiteral("watch")}});
+    };
+}
+
+// Callback of an export replayed from the journal: its HTTP caller went away
+// with the previous process, so the result is written to `dir` instead.
+std::function<void(const std::string &)> saveRecoveredExport(const QString &dir,
+                                                             const vibenote::Task &task) {
+    const QString format = QJsonDocument::fromJson(QByteArray::fromStdString(task.prompt))
+                               .object()
+                               .value(QStringLiteral("format"))
+                               .toString();
+    const bool csv =
+        format == QStringLiteral("csv") || format == QStringLiteral("structured_prompts");
+    const QString path = QDir(dir).filePath(
+        QStringLiteral("export-%1-%2.%3")
+            .arg(QDateTime::currentDateTime().toString(QStringLiteral("yyyyMMdd-HHmmss")))
+            .arg(task.id)
+            .arg(csv ? QStringLiteral("csv") : QStringLiteral("json")));
+    return [dir, path](const std::string &data) {
+        QSaveFile file(path);
+        if (!QDir().mkpath(dir) || !file.open(QIODevice::WriteOnly) ||
+            file.write(data.data(), static_cast<qint64>(data.size())) !=
+                static_cast<qint64>(data.size()) ||
+            !file.commit()) {
+            LOG_WARNING("Cannot save recovered export to" << path);
+            return;
+        }
+        LOG_INFO("Saved recovered export to" << path);
+    };
+}
+
+// Fixed instructions in front of every summary prompt. They are passed as
+// the "prefix" param so the backend evaluates them once and reuses their KV
+// state; keep them byte-stable, since any edit invalidates that cache.
+constexpr char kWatchPreamble[] =
+    "You keep a private journal of what the user does on their computer. Below is text "
+    "recognized from the active window. Reply with a JSON object: \"title\" names the "
+    "window in a few words, \"activity\" says in one or two sentences which application is "
+    "in use and what the user is working on, and \"entities\" lists the files, people, "
+    "projects or websites shown. Do not guess beyond the text and leave out passwords, "
+    "tokens and payment details.\n\nScreen text:\n";
+constexpr char kInteractivePreamble[] =
+    "Summarize the following text in a few sentences. Keep names, numbers and decisions; "
+    "drop greetings and repetition.\n\nText:\n";
+constexpr char kStructuredPreamble[] =
+    "Summarize the following text. Keep names, numbers and decisions; drop greetings and "
+    "repetition. Answer only in the required format.\n\nText:\n";
+
+// Watch summaries always come back as a StructuredSummary; other tasks only
+// when the caller asked for a grammar or schema. Either way the backend
+// constrains decoding, so the output parses without a retry.
+QJsonObject summaryParams(const vibenote::Task &task) {
+    QJsonObject params{{QStringLiteral("cache_prompt"), true}};
+    const char *preamble = kStructuredPreamble;
+    if (!task.grammar.empty()) {
+        params.insert(QStringLiteral("grammar"), QString::fromStdString(task.grammar));
+    } else if (!task.json_schema.empty()) {
+        params.insert(QStringLiteral("json_schema"),
+                      QJsonDocument::fromJson(QByteArray::fromStdString(task.json_schema)).object());
+    } else if (task.type == vibenote::TaskType::kWatch) {
+        params.insert(QStringLiteral("json_schema"), summarySchema());
+        preamble = kWatchPreamble;
+    } else {
+        preamble = kInteractivePreamble;
+    }
+    params.insert(QStringLiteral("prefix"), QString::fromLatin1(preamble));
+    return params;
+}
+
+// Whether summaryParams() constrains the task's output with a grammar.
+bool hasConstrainedOutput(const vibenote::Task &task) {
+    return !task.grammar.empty() || !task.json_schema.empty() ||
+           task.type == vibenote::TaskType::kWatch;
+}
+
+// Everything besides the input text and the model that shapes a summary;
+// part of every SummaryCache key, so editing a preamble retires old entries.
+QString promptTemplate() {
+    return QString::fromLatin1(kWatchPreamble) + QString::fromLatin1(kInteractivePreamble) +
+           QString::fromLatin1(kStructuredPreamble) +
+           QString::fromUtf8(QJsonDocument(summarySchema()).toJson(QJsonDocument::Compact));
+}
+
+// Cached summaries are only valid for the weights that wrote them; name and
+// size tell a replaced or requantized model apart.
+QString modelId(const QString &path) {
+    const QFileInfo info(path);
+    return info.fileName() + QLatin1Char(':') + QString::number(info.size());
+}
+
+// Makes `token` stop the generation `requestId` when it fires.
+void stopOnSignal(const std::shared_ptr<vibenote::CancellationToken> &token,
+                  QPointer<InferenceBackend> client, const QString &requestId) {
+    if (!token) {
+        return;
+    }
+    token->onCancel([client, requestId]() {
+        QMetaObject::invokeMethod(client, [client, requestId]() {
+            if (client) {
+                client->stopGeneration(requestId);
+            }
+        }, Qt::QueuedConnection);
+    });
+}
+
+bool wasPreempted(const vibenote::Task &task) {
+    return task.preempt_token && task.preempt_token->isCancelled() &&
+           !(task.cancel_token && task.cancel_token->isCancelled());
+}
+
+// Puts a preempted task back in the queue under a fresh id; the callback,
+// deadline and cancel token travel with it. Only free-text output is kept
+// to resume from: a grammar restarts from its root rule on every request,
+// so a constrained task reruns its original prompt instead. If the queue
+// has no room, the producer learns through on_failure.
+void requeuePreempted(vibenote::TaskQueue *queue, const vibenote::Task &task,
+                      const std::string &output) {
+    vibenote::Task resumed = task;
+    resumed.id = queue->nextTaskId();
+    if (hasConstrainedOutput(task)) {
+        resumed.partial_output.clear();
+    } else {
+        resumed.partial_output += output;
+    }
+    resumed.preempt_token.reset();
+    if (!queue->requeue(std::move(resumed))) {
+        LOG_WARNING("Dropping preempted task" << task.id << ": queue is full");
+        if (task.on_failure) {
+            task.on_failure(vibenote::TaskFailure::kDropped);
+        }
+    }
+}
+
+// Runs one summarization on a pool worker. The inference backend lives on
+// the main thread, so the request is posted there and the worker blocks until
+// the stream finishes; the task keeps its queue slot for the whole
+// generation. Cancelling the task stops the generation and fails it with
+// kCancelled; a stream cut short by the backend fails with kError, so a
+// truncated summary never reaches the callback. A preempted free-text task
+// is requeued with its partial output and later continues from it; with
+// cache_prompt the server reuses the KV cache of the shared prefix.
+// Constrained tasks start over.
+// Streamed tokens and the time they took count toward the served variant.
+void runSummary(InferenceBackend *llama, vibenote::TaskQueue *queue, vibenote::ModelVariants *variants,
+                const vibenote::Task &task) {
+    auto output = std::make_shared<QString>();
+    auto tokens = std::make_shared<std::size_t>(0);
+    const auto started = std::chrono::steady_clock::now();
+    auto done = std::make_shared<std::promise<bool>>();
+    std::future<bool> finished = done->get_future();
+    QPointer<InferenceBackend> client(llama);
+    QString prompt = QString::fromStdString(task.prompt + task.partial_output);
+    const QJsonObject params = summaryParams(task);
+    QMetaObject::invokeMethod(llama, [client, prompt, params, cancel = task.cancel_token,
+                                      preempt = task.preempt_token, output, tokens, done]() {
+        QString requestId = client->streamCompletion(
+            prompt, params,
+            [output, tokens](const QString &tok) {
+                *output += tok;
+                ++*tokens;
+            },
+            [done](bool completed) { done->set_value(completed); });
+        stopOnSignal(cancel, client, requestId);
+        stopOnSignal(preempt, client, requestId);
+    }, Qt::QueuedConnection);
+    const bool completed = finished.get();
+    variants->recordGeneration(
+        *tokens, std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+    if (wasPreempted(task)) {
+        requeuePreempted(queue, task, output->toStdString());
+        return;
+    }
+    if (task.cancel_token && task.cancel_token->isCancelled()) {
+        if (task.on_failure) {
+            task.on_failure(vibenote::TaskFailure::kCancelled);
+        }
+        return;
+    }
+    if (!completed) {
+        if (task.on_failure) {
+            task.on_failure(vibenote::TaskFailure::kError);
+        }
+        return;
+    }
+    if (task.callback) {
+        task.callback(task.partial_output + output->toStdString());
+    }
+}
+
+// Upper bounds for one multi-prompt watch request.
+constexpr std::size_t kWatchBatchTasks = 8;
+constexpr std::size_t kWatchBatchTokens = 4096;
+
+// Parallel decode slots of a llama server we connect to or spawn, and
+// sequences the in-process engine batches together. Watch and
+// interactive generations share the backend's slots; an interactive request
+// that finds them all busy preempts the newest watch generation.
+constexpr int kLlamaParallelSlots = 4;
+// Context of each slot, if VRAM allows; the offload planner gives up context
+// down to kLlamaMinSlotContext before it keeps a layer on the CPU.
+// /v1/summarize splits longer input into chunks of three quarters of a slot,
+// leaving the rest for the preamble and the reply.
+constexpr int kLlamaSlotContext = 2048;
+constexpr int kLlamaMinSlotContext = 1024;
+// How often a spawned server's quantization is reconsidered, and how long
+// another one must fit better before it is loaded.
+constexpr auto kVariantCheckInterval = std::chrono::seconds(5);
+constexpr auto kVariantHold = std::chrono::seconds(30);
+
+// Tokenizes on the backend's thread for a pool worker, which blocks until
+// the pieces arrive. Empty if the backend is gone.
+std::vector<std::string> tokenizeBlocking(InferenceBackend *llama, const std::string &text) {
+    auto pieces = std::make_shared<std::promise<std::vector<std::string>>>();
+    std::future<std::vector<std::string>> result = pieces->get_future();
+    QPointer<InferenceBackend> client(llama);
+    QMetaObject::invokeMethod(llama, [client, text = QString::fromStdString(text), pieces]() {
+        if (!client) {
+            pieces->set_value({});
+            return;
+        }
+        client->tokenize(text, [pieces](std::vector<std::string> tokens) {
+            pieces->set_value(std::move(tokens));
+        });
+    }, Qt::QueuedConnection);
+    try {
+        return result.get();
+    } catch (const std::future_error &) {
+        return {};
+    }
+}
+
+// Summarizes a batch of watch tasks with a single llama request and routes
+// each result back to its own task's callback. The batch shares one preempt
+// token; a preempted batch is aborted and every task requeued as it was,
+// since a non-streaming request has no partial output to keep. Tasks whose
+// prompt got no result fail with kError.
+void runSummaryBatch(InferenceBackend *llama, vibenote::TaskQueue *queue,
+                     const std::vector<vibenote::Task> &batch) {
+    QStringList prompts;
+    for (const auto &task : batch) {
+        prompts << QString::fromStdString(task.prompt + task.partial_output);
+    }
+    auto results = std::make_shared<std::vector<std::optional<std::string>>>(batch.size());
+    auto done = std::make_shared<std::promise<void>>();
+    std::future<void> finished = done->get_future();
+    QPointer<InferenceBackend> client(llama);
+    const QJsonObject params = summaryParams(batch.front());
+    QMetaObject::invokeMethod(llama, [client, prompts, params, results, done,
+                                      preempt = batch.front().preempt_token]() {
+        QString requestId = client->completeBatch(
+            prompts, params,
+            [results](int index, const QString &text) {
+                (*results)[static_cast<std::size_t>(index)] = text.toStdString();
+            },
+            [done]() { done->set_value(); });
+        stopOnSignal(preempt, client, requestId);
+    }, Qt::QueuedConnection);
+    finished.wait();
+    if (wasPreempted(batch.front())) {
+        for (const auto &task : batch) {
+            requeuePreempted(queue, task, {});
+        }
+        return;
+    }
+    // Prompts the backend lost to an error or an abort have no result.
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        if (!(*results)[i]) {
+            if (batch[i].on_failure) {
+                batch[i].on_failure(vibenote::TaskFailure::kError);
+            }
+        } else if (batch[i].callback) {
+            batch[i].callback(batch[i].partial_output + *(*results)[i]);
+        }
+    }
+}
+
 } // namespace
 
 int main(int argc, char **argv) {
@@ -40,10 +368,34 @@ int main(int argc, char **argv) {
     QCommandLineOption portOpt("port", "HTTP server port", "port");
     QCommandLineOption spawnOpt("spawn-server", "Spawn llama.cpp server process");
     QCommandLineOption verboseOpt("verbose", "Enable verbose logging");
+    QCommandLineOption journalOpt("journal", "Path to the crash-safe queue journal", "path");
+    QCommandLineOption inferenceOpt("inference",
+                                    "Inference backend: \"server\" (llama.cpp server over HTTP) "
+                                    "or \"local\" (libllama in-process)",
+                                    "backend", "server");
+    QCommandLineOption draftOpt("draft-model",
+                                "Small GGUF model sharing the main model's vocabulary, used to "
+                                "draft tokens for speculative decoding",
+                                "path");
+    QCommandLineOption monitorOpt("monitor",
+                                  "Resource telemetry for throttling: \"auto\" (NVML if a GPU "
+                                  "is present, else CPU pressure), \"nvml\", \"psi\" or "
+                                  "\"replay:<trace.csv>\"",
+                                  "backend", "auto");
+    QCommandLineOption variantOpt("model-variant",
+                                  "Quantization of the model to choose from by free device "
+                                  "memory, e.g. its Q8_0, Q5_K_M and Q4_K_M files (repeatable; "
+                                  "replaces the configured model)",
+                                  "path");
     parser.addOption(configOpt);
     parser.addOption(portOpt);
     parser.addOption(spawnOpt);
     parser.addOption(verboseOpt);
+    parser.addOption(journalOpt);
+    parser.addOption(inferenceOpt);
+    parser.addOption(draftOpt);
+    parser.addOption(monitorOpt);
+    parser.addOption(variantOpt);
     parser.process(app);
 
     Logging::Options logOpts;
@@ -51,25 +403,11 @@ int main(int argc, char **argv) {
     logOpts.verbose = parser.isSet(verboseOpt);
     Logging::init(logOpts);
 
-    nvmlReturn_t nvmlRes = nvmlInit_v2();
-    if (nvmlRes != NVML_SUCCESS) {
-        qCritical() << "nvmlInit_v2 failed:" << nvmlErrorString(nvmlRes);
-        return 1;
-    }
-    nvmlDevice_t device;
-    nvmlRes = nvmlDeviceGetHandleByIndex_v2(0, &device);
-    if (nvmlRes != NVML_SUCCESS) {
-        qCritical() << "nvmlDeviceGetHandleByIndex_v2 failed:" << nvmlErrorString(nvmlRes);
-        nvmlShutdown();
-        return 1;
-    }
-
     Config config;
     if (parser.isSet(configOpt)) {
         auto loaded = Config::fromFile(parser.value(configOpt));
         if (!loaded) {
             qCritical() << "Failed to load config";
-            nvmlShutdown();
             return 1;
         }
         config = *loaded;
@@ -83,55 +421,291 @@ int main(int argc, char **argv) {
     SqliteStore store(config.databasePath());
     if (!store.open()) {
         qCritical() << "Failed to open database";
-        nvmlShutdown();
         return 1;
     }
     if (!store.migrate()) {
         qCritical() << "Failed to migrate database";
-        nvmlShutdown();
         return 1;
     }
 
-    GpuGuard gpuGuard(device, config.gpuLimits());
-    TaskQueue queue(config.queueLimits());
-    QObject::connect(&gpuGuard, &GpuGuard::throttle, &queue, &TaskQueue::pause);
-    QObject::connect(&gpuGuard, &GpuGuard::resume, &queue, &TaskQueue::resume);
+    // A missing GPU is not fatal: "auto" falls back to CPU pressure, and
+    // without any telemetry work is admitted unthrottled.
+    const std::string monitorSpec = parser.value(monitorOpt).toStdString();
+    std::unique_ptr<vibenote::ResourceMonitor> monitor = vibenote::ResourceMonitor::create(monitorSpec);
+    if (!monitor) {
+        LOG_WARNING("Resource monitor" << parser.value(monitorOpt) << "unavailable");
+    }
+    GpuGuard gpuGuard(std::move(monitor), config.gpuLimits());
+    gpuGuard.initialize();
 
-    QProcess llamaProcess;
-    if (parser.isSet(spawnOpt)) {
-        QStringList args;
-        args << "--model" << config.modelPath()
-             << "-ngl" << QString::number(gpuGuard.recommendedLayers());
-        llamaProcess.start(config.llamaServerBinary(), args);
+    // The highest-quality variant that fits on the device; with none given,
+    // the configured model is the only one.
+    QStringList variantPaths = parser.values(variantOpt);
+    if (variantPaths.isEmpty()) {
+        variantPaths << config.modelPath();
+    }
+    std::vector<vibenote::ModelVariant> variantList;
+    for (const QString &path : variantPaths) {
+        if (auto layout = vibenote::ModelLayout::read(path.toStdString())) {
+            variantList.push_back({path.toStdString(), QFileInfo(path).fileName().toStdString(),
+                                   std::move(*layout)});
+        } else {
+            LOG_WARNING("Cannot read GGUF header of" << path
+                        << "; leaving it out of offload planning");
+        }
+    }
+    vibenote::ModelVariants::Options variantOptions;
+    variantOptions.budget.context_size = kLlamaParallelSlots * kLlamaSlotContext;
+    variantOptions.budget.min_context = kLlamaParallelSlots * kLlamaMinSlotContext;
+    variantOptions.hold = kVariantHold;
+    vibenote::ModelVariants variants(std::move(variantList), variantOptions);
+    QString modelPath = variantPaths.front();
+    vibenote::OffloadPlan offload;
+    offload.context_size = variantOptions.budget.context_size;
+    if (variants.size() > 0) {
+        const vibenote::VariantChoice choice = variants.choose(gpuGuard.offloadBudgetBytes());
+        const vibenote::ModelVariant &variant = variants.variant(choice.variant);
+        offload = choice.plan;
+        modelPath = QString::fromStdString(variant.path);
+        variants.setActive(choice.variant, offload);
+        LOG_INFO("Serving" << modelPath << "offloading" << offload.gpu_layers << "of"
+                           << variant.layout.fullOffload() << "layers at" << offload.context_size
+                           << "tokens of context," << (offload.totalBytes() >> 20) << "MB");
     }
+    const std::size_t summaryChunkTokens = offload.context_size / kLlamaParallelSlots * 3 / 4;
+
+    // Any of the variants may have written a cached summary.
+    QStringList modelIds;
+    for (const QString &path : variantPaths) {
+        modelIds << modelId(path);
+    }
+    SummaryCache::Options cacheOptions;
+    cacheOptions.model_id = modelIds.join(QLatin1Char(','));
+    cacheOptions.prompt_template = promptTemplate();
+    SummaryCache summaryCache(&store, cacheOptions);
+
+    const QString draftModelPath =
+        parser.isSet(draftOpt) ? parser.value(draftOpt) : config.draftModelPath();
+    QProcess llamaProcess;
+    std::unique_ptr<InferenceBackend> inference;
+    std::function<void(std::string &)> inferenceMetrics;
+    std::unique_ptr<VariantSwitcher> variantSwitcher;
+    if (parser.value(inferenceOpt) == QLatin1String("local")) {
+#ifdef VIBENOTE_INPROCESS_LLAMA
+        vibenote::LlamaEngine::Options engineOptions;
+        engineOptions.model_path = modelPath.toStdString();
+        engineOptions.draft_model_path = draftModelPath.toStdString();
+        engineOptions.gpu_layers = offload.gpu_layers;
+        engineOptions.max_sequences = kLlamaParallelSlots;
+        engineOptions.context_size = offload.context_size;
+        engineOptions.prefix_cache_dir = (config.databasePath() + QStringLiteral(".kvcache")).toStdString();
+        auto local = std::make_unique<LocalLlamaBackend>(engineOptions);
+        if (!local->start()) {
+            qCritical() << "Failed to load model" << modelPath;
+            return 1;
+        }
+        inferenceMetrics = [backend = local.get()](std::string &out) { backend->serializeMetrics(out); };
+        inference = std::move(local);
+#else
+        qCritical() << "This build has no in-process inference (VIBENOTE_INPROCESS_LLAMA)";
+        return 1;
+#endif
+    } else {
+        // Everything but the model, address, -ngl and --parallel, which the
+        // client sets itself when it restarts the server.
+        QStringList serverArgs;
+        serverArgs << "--ctx-size" << QString::number(offload.context_size);
+        if (!draftModelPath.isEmpty()) {
+            serverArgs << "--model-draft" << draftModelPath
+                       << "-ngld" << QString::number(offload.gpu_layers);
+        }
+        if (parser.isSet(spawnOpt)) {
+            QStringList args;
+            args << "--model" << modelPath
+                 << "-ngl" << QString::number(offload.gpu_layers)
+                 << "--parallel" << QString::number(kLlamaParallelSlots)
+                 << serverArgs;
+            llamaProcess.start(config.llamaServerBinary(), args);
+        }
 
-    std::unique_ptr<LlamaClient> llamaClient;
-    for (int attempt = 0; attempt < 5 && !llamaClient; ++attempt) {
-        llamaClient = LlamaClient::connect(config.llamaEndpoint());
+        std::unique_ptr<LlamaClient> llamaClient;
+        for (int attempt = 0; attempt < 5 && !llamaClient; ++attempt) {
+            llamaClient = LlamaClient::connect(config.llamaEndpoint());
+            if (!llamaClient) {
+                QThread::sleep(1 << attempt);
+            }
+        }
         if (!llamaClient) {
-            QThread::sleep(1 << attempt);
+            qCritical() << "Unable to connect to llama server";
+            return 1;
         }
+        llamaClient->setPoolSize(kLlamaParallelSlots);
+        if (parser.isSet(spawnOpt)) {
+            // A new GPU layer count or variant is applied blue/green: the old
+            // server keeps serving until the replacement is healthy.
+            llamaClient->adoptServer(&llamaProcess, config.llamaServerBinary(), modelPath,
+                                     offload.gpu_layers, serverArgs);
+            QObject::connect(&gpuGuard, &GpuGuard::modelRestartRequested, llamaClient.get(),
+                             &LlamaClient::restartWithNgl);
+            if (variants.size() > 1) {
+                variantSwitcher = std::make_unique<VariantSwitcher>(&variants, &gpuGuard,
+                                                                    llamaClient.get(),
+                                                                    kVariantCheckInterval);
+                variantSwitcher->start();
+            }
+        }
+        inferenceMetrics = [client = llamaClient.get()](std::string &out) {
+            client->serializeMetrics(out);
+        };
+        inference = std::move(llamaClient);
     }
-    if (!llamaClient) {
-        qCritical() << "Unable to connect to llama server";
-        nvmlShutdown();
-        return 1;
+
+    vibenote::QueueConfig queueConfig = config.queueLimits();
+    queueConfig.max_inference = static_cast<std::size_t>(inference->parallelSlots());
+    vibenote::TaskQueue queue(&gpuGuard, queueConfig);
+    vibenote::QueueMetrics queueMetrics;
+    queue.setMetrics(&queueMetrics);
+    Metrics metrics(&queueMetrics);
+    if (inferenceMetrics) {
+        metrics.addSource(inferenceMetrics);
     }
+    metrics.addSource([&summaryCache](std::string &out) { summaryCache.serializeMetrics(out); });
+    metrics.addSource([&variants](std::string &out) { variants.serializeMetrics(out); });
+    // Emitted on the guard's sampling thread; the queue locks for itself.
+    QObject::connect(&gpuGuard, &GpuGuard::admissionChanged,
+                     [&queue](double share) { queue.setInferenceShare(share); });
+    queue.setInferenceShare(gpuGuard.admission());
 
     std::unique_ptr<OcrEngine> ocr = OcrEngine::create(config.ocrConfig());
 
+    vibenote::WorkerPool pool(&queue);
+    pool.setHandler(vibenote::TaskType::kInteractive, [&](const vibenote::Task &task) {
+        runSummary(inference.get(), &queue, &variants, task);
+    });
+    pool.setHandler(vibenote::TaskType::kWatch, [&](const vibenote::Task &task) {
+        runSummary(inference.get(), &queue, &variants, task);
+    });
+    pool.setBatchHandler(vibenote::TaskType::kWatch, [&](const std::vector<vibenote::Task> &batch) {
+        if (batch.size() == 1) {
+            runSummary(inference.get(), &queue, &variants, batch.front());
+        } else {
+            runSummaryBatch(inference.get(), &queue, batch);
+        }
+    }, kWatchBatchTasks, kWatchBatchTokens);
+
+    // OCR is CPU-bound and runs on the pool directly; only the resulting
+    // summarization competes for a watch slot in the queue. A screen already
+    // summarized (same text, model and template) never reaches the queue.
     ScreencastPortal portal;
-    QObject::connect(&portal, &ScreencastPortal::frameCaptured, ocr.get(), &OcrEngine::processFrame);
+    QObject::connect(&portal, &ScreencastPortal::frameAvailable, [&](const QByteArray &data) {
+        const qint64 capturedAt = QDateTime::currentSecsSinceEpoch();
+        pool.submit([&queue, &ocr, &summaryCache, &store, data, capturedAt]() {
+            QString text = ocr->recognize(QImage::fromData(data));
+            if (text.trimmed().isEmpty()) {
+                return;
+            }
+            vibenote::Task task;
+            task.type = vibenote::TaskType::kWatch;
+            task.priority = vibenote::TaskPriority::kLow;
+            task.prompt = text.toStdString();
+            const std::string cacheKey = summaryCache.key(task);
+            if (summaryCache.lookup(cacheKey)) {
+                return;
+            }
+            task.id = queue.nextTaskId();
+            task.deadline = vibenote::TaskClock::now() + kWatchDeadline;
+            task.callback = finishWatchSummary(&summaryCache, &store, cacheKey, capturedAt, text);
+            queue.enqueue(std::move(task));
+        });
+    });
+    // Runs on whichever thread flipped the state; the portal lives on the main thread.
+    queue.backpressureChanged([&portal](bool slowDown) {
+        QMetaObject::invokeMethod(&portal, [&portal, slowDown]() {
+            portal.setMinFrameInterval(slowDown ? kBackpressureFrameIntervalMs : 0);
+        }, Qt::QueuedConnection);
+    });
     portal.start();
 
     KWinWatcher watcher;
     QObject::connect(&watcher, &KWinWatcher::windowChanged, &store, &SqliteStore::updateWindow);
     watcher.start();
 
-    HttpServer server(config.port(), &queue, &store, llamaClient.get());
-    if (!server.start()) {
+    HttpServer server(&queue, inference.get(), &store, &metrics);
+    server.setSummaryCache(&summaryCache, &pool);
+    vibenote::MapReduceOptions mapReduceOptions;
+    mapReduceOptions.chunk_tokens = summaryChunkTokens;
+    mapReduceOptions.max_in_flight = static_cast<std::size_t>(inference->parallelSlots());
+    vibenote::MapReduceSummarizer summarizer(
+        &queue, &pool,
+        [&inference](const std::string &text) { return tokenizeBlocking(inference.get(), text); },
+        mapReduceOptions);
+    server.setSummarizer(&summarizer);
+    pool.setHandler(vibenote::TaskType::kExport, [&server](const vibenote::Task &task) {
+        QJsonObject spec = QJsonDocument::fromJson(QByteArray::fromStdString(task.prompt)).object();
+        QByteArray data = server.renderExport(
+            spec.value(QStringLiteral("format")).toString(),
+            QDateTime::fromString(spec.value(QStringLiteral("from")).toString(), Qt::ISODate),
+            QDateTime::fromString(spec.value(QStringLiteral("to")).toString(), Qt::ISODate));
+        if (task.callback) {
+            task.callback(data.toStdString());
+        }
+    });
+    // Replay work accepted before a crash ahead of any new requests. Watch
+    // summaries go to the summary cache and the store as before, stamped with
+    // the replay time, and exports are saved next to the database.
+    // Interactive summaries are dropped: their caller went away with the
+    // previous process and nothing else reads the result.
+    //
+    // Each task is journaled again under a fresh id before its old record is
+    // retired, so a crash during replay loses nothing. Fresh ids skip the
+    // replayed ones, whose records are still live while the loop runs.
+    const QString journalPath = parser.isSet(journalOpt)
+                                    ? parser.value(journalOpt)
+                                    : config.databasePath() + QStringLiteral(".journal");
+    const QString recoveredExportDir = config.databasePath() + QStringLiteral(".exports");
+    vibenote::QueueJournal journal(journalPath.toStdString());
+    if (journal.open()) {
+        std::vector<vibenote::Task> replayed = journal.replay();
+        queue.setJournal(&journal);
+        std::unordered_set<std::uint64_t> replayedIds;
+        for (const auto &task : replayed) {
+            replayedIds.insert(task.id);
+        }
+        std::size_t resumed = 0;
+        for (auto &task : replayed) {
+            const std::uint64_t journaledId = task.id;
+            do {
+                task.id = queue.nextTaskId();
+            } while (replayedIds.count(task.id) > 0);
+            bool wanted = true;
+            if (task.type == vibenote::TaskType::kWatch) {
+                const std::string cacheKey = summaryCache.key(task);
+                wanted = !summaryCache.lookup(cacheKey);
+                task.callback =
+                    finishWatchSummary(&summaryCache, &store, cacheKey,
+                                       QDateTime::currentSecsSinceEpoch(),
+                                       QString::fromStdString(task.prompt));
+            } else if (task.type == vibenote::TaskType::kExport) {
+                task.callback = saveRecoveredExport(recoveredExportDir, task);
+            } else {
+                wanted = false;
+            }
+            if (wanted && queue.requeue(std::move(task))) {
+                ++resumed;
+            }
+            journal.recordCompleted(journaledId);
+        }
+        if (!replayed.empty()) {
+            LOG_INFO("Replayed" << resumed << "of" << replayed.size() << "journaled tasks");
+        }
+        journal.start();
+    } else {
+        LOG_WARNING("Queue journal unavailable, queued work will not survive a crash");
+    }
+    pool.start();
+
+    if (!server.start(config.port())) {
         qCritical() << "Failed to start HTTP server";
-        nvmlShutdown();
         return 1;
     }
 
@@ -141,12 +715,14 @@ int main(int argc, char **argv) {
         portal.stop();
         watcher.stop();
         queue.stop();
-        llamaClient.reset();
+        // Destroying the backend releases workers still waiting on a stream.
+        inference.reset();
+        pool.stop();
+        journal.stop();
         if (llamaProcess.state() == QProcess::Running) {
             llamaProcess.terminate();
             llamaProcess.waitForFinished(3000);
         }
-        nvmlShutdown();
     });
 
     return app.exec();
@@ -0,0 +1,331 @@
+#include "map_reduce.h"
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+
+#include "worker_pool.h"
+
+namespace vibenote {
+
+namespace {
+
+constexpr char kReduceHeader[] = "Summaries of consecutive parts of one document:\n\n";
+// Budget for the header and the blank lines between partial summaries.
+constexpr std::size_t kReduceOverheadTokens = 16;
+
+bool startsInsideCharacter(const std::string &piece) {
+  return !piece.empty() && (static_cast<unsigned char>(piece.front()) & 0xC0) == 0x80;
+}
+
+bool endsParagraph(const std::string &piece) {
+  return !piece.empty() && piece.back() == '\n';
+}
+
+bool endsSentence(const std::string &piece) {
+  if (piece.empty()) return false;
+  const char last = piece.back();
+  return last == '.' || last == '!' || last == '?' || last == ';' || last == ':';
+}
+
+// Stand-in for the tokenizer's pieces: runs of TaskQueue::estimateTokens()'s
+// bytes per token, also ended after a newline or sentence mark so split()
+// can still cut there, and never ended inside a UTF-8 character.
+std::vector<std::string> estimatePieces(const std::string &text) {
+  const std::size_t tokens = std::max<std::size_t>(1, TaskQueue::estimateTokens(text));
+  const std::size_t bytes_per_token = std::max<std::size_t>(1, text.size() / tokens);
+  std::vector<std::string> pieces;
+  std::string piece;
+  for (std::size_t i = 0; i < text.size(); ++i) {
+    piece += text[i];
+    const bool at_character = i + 1 == text.size() ||
+                              (static_cast<unsigned char>(text[i + 1]) & 0xC0) != 0x80;
+    if (at_character && (piece.size() >= bytes_per_token || endsParagraph(piece) ||
+                         endsSentence(piece))) {
+      pieces.push_back(std::move(piece));
+      piece.clear();
+    }
+  }
+  if (!piece.empty()) pieces.push_back(std::move(piece));
+  return pieces;
+}
+
+std::string joinPartials(std::vector<std::string>::const_iterator first,
+                         std::vector<std::string>::const_iterator last) {
+  std::string text = kReduceHeader;
+  for (auto it = first; it != last; ++it) {
+    text += *it;
+    text += "\n\n";
+  }
+  return text;
+}
+
+}  // namespace
+
+struct MapReduceSummarizer::Job {
+  Task request;
+  ProgressHandler progress;
+  DoneHandler done;
+
+  std::mutex mutex;
+  bool finished{false};
+  std::vector<std::uint64_t> task_ids;  // for cancelling the rest after a rejection
+  bool admitted{false};  // the first task has passed the rate limit
+  // The level in flight: whether it is the last, its summaries, their token
+  // counts, and how many are still outstanding.
+  bool final{false};
+  std::vector<std::string> outputs;
+  std::vector<std::size_t> tokens;
+  std::size_t remaining{0};
+  // Its tasks not yet queued, and how many queued ones have not finished.
+  std::vector<Task> pending;
+  std::size_t next{0};
+  std::size_t in_flight{0};
+};
+
+MapReduceSummarizer::MapReduceSummarizer(TaskQueue *queue, WorkerPool *pool, Tokenizer tokenizer,
+                                         MapReduceOptions options)
+    : queue_(queue), pool_(pool), tokenizer_(std::move(tokenizer)), options_(options) {
+  options_.chunk_tokens = std::max<std::size_t>(options_.chunk_tokens, 16);
+  options_.overlap_tokens = std::min(options_.overlap_tokens, options_.chunk_tokens / 4);
+  options_.max_in_flight = std::max<std::size_t>(options_.max_in_flight, 1);
+}
+
+void MapReduceSummarizer::summarize(Task request, ProgressHandler progress, DoneHandler done) {
+  auto job = std::make_shared<Job>();
+  job->request = std::move(request);
+  job->progress = std::move(progress);
+  job->done = std::move(done);
+  // A token covers at least one byte, so short text skips the tokenizer.
+  if (job->request.prompt.size() <= options_.chunk_tokens) {
+    std::vector<std::string> inputs{job->request.prompt};
+    runLevel(job, std::move(inputs), 0, true);
+    return;
+  }
+  pool_->submit([this, job] { start(job); });
+}
+
+void MapReduceSummarizer::start(const std::shared_ptr<Job> &job) {
+  std::vector<std::string> pieces = tokenizer_(job->request.prompt);
+  if (pieces.empty()) {
+    pieces = estimatePieces(job->request.prompt);
+  }
+  std::vector<std::string> chunks = split(pieces);
+  if (chunks.size() <= 1) {
+    // Fits one slot after all.
+    chunks.assign(1, job->request.prompt);
+  }
+  const bool final = chunks.size() == 1;
+  runLevel(job, std::move(chunks), 0, final);
+}
+
+void MapReduceSummarizer::runLevel(const std::shared_ptr<Job> &job,
+                                   std::vector<std::string> inputs, int level, bool final) {
+  {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->finished) return;
+    job->final = final;
+    job->outputs.assign(inputs.size(), {});
+    job->tokens.assign(inputs.size(), 0);
+    job->remaining = inputs.size();
+    job->pending.clear();
+    job->pending.reserve(inputs.size());
+    job->next = 0;
+    job->in_flight = 0;
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+      Task task;
+      if (final) {
+        task = job->request;
+      } else {
+        task.type = job->request.type;
+        task.priority = job->request.priority;
+        task.deadline = job->request.deadline;
+        task.cancel_token = job->request.cancel_token;
+      }
+      task.id = queue_->nextTaskId();
+      task.prompt = std::move(inputs[i]);
+      task.callback = [this, job, level, i](const std::string &summary) {
+        onPartial(job, level, i, summary);
+      };
+      task.on_failure = [this, job](TaskFailure failure) { fail(job, Admission{}, failure); };
+      job->task_ids.push_back(task.id);
+      job->pending.push_back(std::move(task));
+    }
+    if (job->progress) {
+      job->progress({level == 0 ? MapReduceProgress::Stage::kMap : MapReduceProgress::Stage::kReduce,
+                     level, 0, job->pending.size()});
+    }
+  }
+  feed(job);
+}
+
+void MapReduceSummarizer::feed(const std::shared_ptr<Job> &job) {
+  for (;;) {
+    Task task;
+    bool admitted = false;
+    {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      if (job->finished || job->next == job->pending.size() ||
+          job->in_flight >= options_.max_in_flight) {
+        return;
+      }
+      task = std::move(job->pending[job->next++]);
+      ++job->in_flight;
+      admitted = std::exchange(job->admitted, true);
+    }
+    // Callbacks may run before this returns; the counts above are already set.
+    const std::uint64_t id = task.id;
+    const Admission admission = admitted ? queue_->tryEnqueueAdmitted(std::move(task))
+                                         : queue_->tryEnqueue(std::move(task));
+    if (!admission.accepted()) {
+      fail(job, admission, std::nullopt);
+      return;
+    }
+    // A failure elsewhere may have cancelled the job's tasks before this one
+    // reached the queue.
+    bool finished = false;
+    {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      finished = job->finished;
+    }
+    if (finished) {
+      queue_->cancel(id);
+      return;
+    }
+  }
+}
+
+void MapReduceSummarizer::onPartial(const std::shared_ptr<Job> &job, int level, std::size_t index,
+                                    const std::string &summary) {
+  // The final task's summary is never reduced again, so skip tokenizing it.
+  const bool last = [&] {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    return job->final;
+  }();
+  const std::size_t tokens = last ? 0 : tokenizer_(summary).size();
+  std::vector<std::string> partials;
+  std::vector<std::size_t> counts;
+  bool more = false;
+  {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->finished) return;
+    job->outputs[index] = summary;
+    job->tokens[index] =
+        tokens ? tokens : std::max<std::size_t>(1, TaskQueue::estimateTokens(summary));
+    const std::size_t total = job->outputs.size();
+    --job->remaining;
+    --job->in_flight;
+    if (job->progress) {
+      job->progress({level == 0 ? MapReduceProgress::Stage::kMap : MapReduceProgress::Stage::kReduce,
+                     level, total - job->remaining, total});
+    }
+    more = job->remaining > 0;
+    if (!more) {
+      job->pending.clear();
+      if (last) {
+        job->finished = true;
+      } else {
+        partials = std::move(job->outputs);
+        counts = std::move(job->tokens);
+        job->task_ids.clear();
+      }
+    }
+  }
+  if (more) {
+    feed(job);
+    return;
+  }
+  if (last) {
+    job->done(summary, Admission{}, std::nullopt);
+    return;
+  }
+  reduce(job, std::move(partials), counts, level + 1);
+}
+
+void MapReduceSummarizer::reduce(const std::shared_ptr<Job> &job,
+                                 std::vector<std::string> partials,
+                                 const std::vector<std::size_t> &tokens, int level) {
+  const std::size_t budget = options_.chunk_tokens - std::min(options_.chunk_tokens / 2,
+                                                              kReduceOverheadTokens);
+  std::size_t total = 0;
+  for (std::size_t count : tokens) total += count;
+  if (total <= budget) {
+    runLevel(job, {joinPartials(partials.begin(), partials.end())}, level, true);
+    return;
+  }
+  // Consecutive partials up to the budget per group, at least two each so
+  // every round shrinks the input; a trailing single joins the group before.
+  std::vector<std::pair<std::size_t, std::size_t>> groups;
+  std::size_t begin = 0;
+  std::size_t size = 0;
+  for (std::size_t i = 0; i < partials.size(); ++i) {
+    if (i - begin >= 2 && size + tokens[i] > budget) {
+      groups.emplace_back(begin, i);
+      begin = i;
+      size = 0;
+    }
+    size += tokens[i];
+  }
+  if (partials.size() - begin == 1 && !groups.empty()) {
+    groups.back().second = partials.size();
+  } else {
+    groups.emplace_back(begin, partials.size());
+  }
+  std::vector<std::string> inputs;
+  inputs.reserve(groups.size());
+  for (const auto &[first, last] : groups) {
+    inputs.push_back(joinPartials(partials.begin() + static_cast<std::ptrdiff_t>(first),
+                                  partials.begin() + static_cast<std::ptrdiff_t>(last)));
+  }
+  runLevel(job, std::move(inputs), level, groups.size() == 1);
+}
+
+void MapReduceSummarizer::fail(const std::shared_ptr<Job> &job, const Admission &rejection,
+                               std::optional<TaskFailure> failure) {
+  std::vector<std::uint64_t> ids;
+  {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->finished) return;
+    job->finished = true;
+    ids.swap(job->task_ids);
+    // Their callbacks hold the job.
+    job->pending.clear();
+  }
+  for (std::uint64_t id : ids) queue_->cancel(id);
+  job->done(std::nullopt, rejection, failure);
+}
+
+std::vector<std::string> MapReduceSummarizer::split(const std::vector<std::string> &pieces) const {
+  std::vector<std::string> chunks;
+  std::size_t begin = 0;
+  while (begin < pieces.size()) {
+    std::size_t end = std::min(begin + options_.chunk_tokens, pieces.size());
+    if (end < pieces.size()) end = boundary(pieces, begin, end);
+    std::string chunk;
+    for (std::size_t i = begin; i < end; ++i) chunk += pieces[i];
+    chunks.push_back(std::move(chunk));
+    if (end == pieces.size()) break;
+    std::size_t next = std::max(end - std::min(end, options_.overlap_tokens), begin + 1);
+    while (next < end && startsInsideCharacter(pieces[next])) ++next;
+    begin = next;
+  }
+  return chunks;
+}
+
+// Best place to end the chunk [begin, end): after a newline, else after a
+// sentence, within the last quarter of the chunk; otherwise at `end`, moved
+// back to the start of a character.
+std::size_t MapReduceSummarizer::boundary(const std::vector<std::string> &pieces,
+                                          std::size_t begin, std::size_t end) const {
+  const std::size_t earliest = begin + std::max<std::size_t>(1, (end - begin) * 3 / 4);
+  for (auto ends : {endsParagraph, endsSentence}) {
+    for (std::size_t cut = end; cut > earliest; --cut) {
+      if (ends(pieces[cut - 1]) && !startsInsideCharacter(pieces[cut])) return cut;
+    }
+  }
+  std::size_t cut = end;
+  while (cut > begin + 1 && startsInsideCharacter(pieces[cut])) --cut;
+  return cut;
+}
+
+}  // namespace vibenote
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "queue.h"
+
+namespace vibenote {
+
+class WorkerPool;
+
+// Where one MapReduceSummarizer::summarize() call is.
+struct MapReduceProgress {
+  enum class Stage { kMap, kReduce };
+
+  Stage stage{Stage::kMap};
+  int level{0};           // 0 while summarizing chunks, then one per reduce round
+  std::size_t done{0};    // summaries of this level finished
+  std::size_t total{0};   // summaries this level produces
+};
+
+struct MapReduceOptions {
+  // Largest input, in tokens of the model's tokenizer, summarized by one
+  // task. Leave room for the preamble and the reply in a slot's context.
+  std::size_t chunk_tokens{1536};
+  // Tokens of the previous chunk repeated at the start of the next, so a
+  // sentence cut by a boundary is seen whole once.
+  std::size_t overlap_tokens{32};
+  // Tasks of one job handed to the queue at a time, e.g. the backend's
+  // parallel slots. The rest follow as those finish, so a long document
+  // neither fills the queue nor takes every slot from other work.
+  std::size_t max_in_flight{4};
+};
+
+// Summarizes text longer than one generation slot's context.
+//
+// The text is split on token boundaries, preferring paragraph and sentence
+// ends, into chunks of at most chunk_tokens. Every chunk becomes its own task
+// in the TaskQueue, so chunks are summarized in parallel on as many slots as
+// the queue grants. The partial summaries are then combined in rounds:
+// consecutive partials are grouped up to chunk_tokens and each group is
+// summarized again, until everything fits in one final task. End-to-end
+// latency is roughly (chunks / max_in_flight + rounds) summaries. A job is
+// charged against its type's rate limit once, by its first task.
+class MapReduceSummarizer {
+ public:
+  // Returns the bytes of each token of `text` (LlamaEngine::tokenPieces() or
+  // the server's /tokenize). Empty on failure, in which case chunks are cut
+  // by TaskQueue::estimateTokens()'s byte ratio. Called on pool workers
+  // only, so it may block.
+  using Tokenizer = std::function<std::vector<std::string>(const std::string &)>;
+  using ProgressHandler = std::function<void(const MapReduceProgress &)>;
+  // Receives the final summary, or nullopt and why there is none: the
+  // admission of a task the queue turned away, or the failure of one it
+  // admitted (then `rejection` is default, i.e. accepted). Tasks of the call
+  // still queued are cancelled.
+  using DoneHandler = std::function<void(std::optional<std::string> summary,
+                                         const Admission &rejection,
+                                         std::optional<TaskFailure> failure)>;
+
+  MapReduceSummarizer(TaskQueue *queue, WorkerPool *pool, Tokenizer tokenizer,
+                      MapReduceOptions options = {});
+
+  // Summarizes `request.prompt`. Text that fits one chunk is queued as
+  // `request` itself. Otherwise chunk and reduce tasks take its type,
+  // priority and deadline, and only the final task carries its grammar and
+  // json_schema. Returns at once. `progress` and `done` run on the calling
+  // thread or on pool workers, `progress` never concurrently with itself.
+  void summarize(Task request, ProgressHandler progress, DoneHandler done);
+
+  // Concatenates `pieces` (one token each) into chunks of at most
+  // chunk_tokens tokens. Cuts never fall inside a UTF-8 character.
+  std::vector<std::string> split(const std::vector<std::string> &pieces) const;
+
+ private:
+  struct Job;
+
+  void start(const std::shared_ptr<Job> &job);
+  // Prepares one task per input; `final` marks the single last task.
+  void runLevel(const std::shared_ptr<Job> &job, std::vector<std::string> inputs, int level,
+                bool final);
+  // Queues prepared tasks until max_in_flight of the level are outstanding.
+  void feed(const std::shared_ptr<Job> &job);
+  void onPartial(const std::shared_ptr<Job> &job, int level, std::size_t index,
+                 const std::string &summary);
+  void reduce(const std::shared_ptr<Job> &job, std::vector<std::string> partials,
+              const std::vector<std::size_t> &tokens, int level);
+  void fail(const std::shared_ptr<Job> &job, const Admission &rejection,
+            std::optional<TaskFailure> failure);
+  std::size_t boundary(const std::vector<std::string> &pieces, std::size_t begin,
+                       std::size_t end) const;
+
+  TaskQueue *queue_;
+  WorkerPool *pool_;
+  Tokenizer tokenizer_;
+  MapReduceOptions options_;
+};
+
+}  // namespace vibenote
@@ -1 +1,46 @@
-// Placeholder for metrics implementation
+#include "metrics.h"
+
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include "queue_metrics.h"
+
+namespace vibenote {
+
+void appendFamilyHeader(std::string &out, const char *name, const char *type, const char *help) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void appendCounter(std::string &out, const char *name, const char *help, std::uint64_t value) {
+    appendFamilyHeader(out, name, "counter", help);
+    out.append(name).append(" ").append(std::to_string(value)).append("\n");
+}
+
+void appendGauge(std::string &out, const char *name, const char *help, double value) {
+    appendFamilyHeader(out, name, "gauge", help);
+    char sample[32];
+    std::snprintf(sample, sizeof(sample), " %g\n", value);
+    out.append(name).append(sample);
+}
+
+} // namespace vibenote
+
+Metrics::Metrics(const vibenote::QueueMetrics *queue)
+    : queue_(queue) {}
+
+void Metrics::addSource(std::function<void(std::string &)> source) {
+    sources_.push_back(std::move(source));
+}
+
+QByteArray Metrics::serialize() const {
+    std::string out;
+    if (queue_) {
+        queue_->serialize(out);
+    }
+    for (const auto &source : sources_) {
+        source(out);
+    }
+    return QByteArray::fromStdString(out);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <QByteArray>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace vibenote {
+class QueueMetrics;
+
+// Prometheus text-format helpers for metric sources.
+// The HELP and TYPE lines that open a family.
+void appendFamilyHeader(std::string &out, const char *name, const char *type, const char *help);
+// A whole family holding one unlabelled sample.
+void appendCounter(std::string &out, const char *name, const char *help, std::uint64_t value);
+void appendGauge(std::string &out, const char *name, const char *help, double value);
+}
+
+// Renders the daemon's Prometheus metrics for the /metrics endpoint.
+class Metrics {
+public:
+    explicit Metrics(const vibenote::QueueMetrics *queue = nullptr);
+
+    // Appends more families on every scrape. Sources are called from the
+    // HTTP server's thread and must outlive it.
+    void addSource(std::function<void(std::string &)> source);
+
+    QByteArray serialize() const;
+
+private:
+    const vibenote::QueueMetrics *queue_;
+    std::vector<std::function<void(std::string &)>> sources_;
+};
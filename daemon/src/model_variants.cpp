@@ -0,0 +1,160 @@
+#include "model_variants.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+#include <utility>
+
+#include "metrics.h"
+
+namespace vibenote {
+
+std::uint64_t ModelVariant::weightBytes() const {
+  return std::accumulate(layout.block_bytes.begin(), layout.block_bytes.end(),
+                         layout.output_bytes + layout.host_bytes);
+}
+
+ModelVariants::ModelVariants(std::vector<ModelVariant> variants, Options options)
+    : variants_(std::move(variants)), options_(options), stats_(variants_.size()) {
+  std::stable_sort(variants_.begin(), variants_.end(), [](const ModelVariant &a, const ModelVariant &b) {
+    return a.weightBytes() > b.weightBytes();
+  });
+}
+
+VariantChoice ModelVariants::choose(std::uint64_t memory_bytes) const {
+  std::lock_guard lock(mutex_);
+  return chooseLocked(memory_bytes);
+}
+
+VariantChoice ModelVariants::chooseLocked(std::uint64_t memory_bytes) const {
+  VariantChoice choice;
+  for (std::size_t i = 0; i < variants_.size(); ++i) {
+    OffloadBudget budget = options_.budget;
+    budget.memory_bytes = static_cast<std::uint64_t>(static_cast<double>(memory_bytes) / memoryScaleLocked(i));
+    choice.variant = i;
+    choice.plan = planOffload(variants_[i].layout, budget);
+    if (choice.plan.gpu_layers == variants_[i].layout.fullOffload()) {
+      break;
+    }
+  }
+  return choice;
+}
+
+// Measured over estimated device memory, never below 1: an estimate that
+// came out high is kept as a margin.
+double ModelVariants::memoryScaleLocked(std::size_t index) const {
+  const Stats &s = stats_[index];
+  if (s.device_bytes == 0 || s.gpu_layers == 0) {
+    return 1.0;
+  }
+  const std::uint64_t estimate =
+      estimateOffload(variants_[index].layout, s.gpu_layers, options_.budget.context_size, options_.budget)
+          .totalBytes();
+  return estimate == 0 ? 1.0 : std::max(1.0, static_cast<double>(s.device_bytes) / static_cast<double>(estimate));
+}
+
+std::uint64_t ModelVariants::footprintLocked(std::size_t index, const OffloadPlan &plan) const {
+  const std::uint64_t estimate =
+      estimateOffload(variants_[index].layout, plan.gpu_layers, plan.context_size, options_.budget).totalBytes();
+  return static_cast<std::uint64_t>(static_cast<double>(estimate) * memoryScaleLocked(index));
+}
+
+void ModelVariants::setActive(std::size_t index, const OffloadPlan &plan) {
+  std::lock_guard lock(mutex_);
+  active_ = index;
+  active_plan_ = plan;
+  options_.budget.context_size = plan.context_size;
+  options_.budget.min_context = plan.context_size;
+  pending_.reset();
+}
+
+OffloadBudget ModelVariants::budget() const {
+  std::lock_guard lock(mutex_);
+  return options_.budget;
+}
+
+std::size_t ModelVariants::active() const {
+  std::lock_guard lock(mutex_);
+  return active_;
+}
+
+OffloadPlan ModelVariants::activePlan() const {
+  std::lock_guard lock(mutex_);
+  return active_plan_;
+}
+
+std::uint64_t ModelVariants::activeBytes() const {
+  std::lock_guard lock(mutex_);
+  return active_ < variants_.size() ? footprintLocked(active_, active_plan_) : 0;
+}
+
+std::optional<std::size_t> ModelVariants::update(std::int64_t margin_bytes, Clock::time_point now) {
+  std::lock_guard lock(mutex_);
+  if (active_ >= variants_.size()) {
+    return std::nullopt;
+  }
+  const auto available = static_cast<std::int64_t>(footprintLocked(active_, active_plan_)) + margin_bytes;
+  const std::size_t target = chooseLocked(static_cast<std::uint64_t>(std::max<std::int64_t>(0, available))).variant;
+  if (target == active_) {
+    pending_.reset();
+    return std::nullopt;
+  }
+  if (pending_ != target) {
+    pending_ = target;
+    pending_since_ = now;
+    return std::nullopt;
+  }
+  if (now - pending_since_ < options_.hold) {
+    return std::nullopt;
+  }
+  pending_.reset();
+  return target;
+}
+
+void ModelVariants::recordMemory(std::uint64_t device_bytes) {
+  std::lock_guard lock(mutex_);
+  if (active_ >= variants_.size()) {
+    return;
+  }
+  stats_[active_].device_bytes = device_bytes;
+  stats_[active_].gpu_layers = active_plan_.gpu_layers;
+}
+
+void ModelVariants::recordGeneration(std::size_t tokens, double seconds) {
+  std::lock_guard lock(mutex_);
+  if (active_ >= variants_.size() || tokens == 0 || seconds <= 0) {
+    return;
+  }
+  stats_[active_].tokens += tokens;
+  stats_[active_].seconds += seconds;
+}
+
+ModelVariants::Stats ModelVariants::stats(std::size_t index) const {
+  std::lock_guard lock(mutex_);
+  return stats_[index];
+}
+
+void ModelVariants::serializeMetrics(std::string &out) const {
+  std::lock_guard lock(mutex_);
+  char line[384];
+  const auto family = [&](const char *name, const char *type, const char *help, auto value) {
+    appendFamilyHeader(out, name, type, help);
+    for (std::size_t i = 0; i < variants_.size(); ++i) {
+      std::snprintf(line, sizeof(line), "%s{variant=\"%s\"} %.9g\n", name, variants_[i].name.c_str(),
+                    static_cast<double>(value(i)));
+      out += line;
+    }
+  };
+  family("vibenote_model_variant_active", "gauge", "1 for the model variant being served.",
+         [&](std::size_t i) { return i == active_ ? 1 : 0; });
+  family("vibenote_model_variant_generated_tokens_total", "counter",
+         "Tokens streamed while the variant was served.", [&](std::size_t i) { return stats_[i].tokens; });
+  family("vibenote_model_variant_tokens_per_second", "gauge",
+         "Average generation rate of the variant, prompt processing included.",
+         [&](std::size_t i) { return stats_[i].tokensPerSecond(); });
+  family("vibenote_model_variant_device_bytes", "gauge",
+         "Device memory the variant was last measured to hold; 0 if never served.",
+         [&](std::size_t i) { return stats_[i].device_bytes; });
+}
+
+}  // namespace vibenote
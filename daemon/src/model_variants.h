@@ -0,0 +1,114 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "offload_planner.h"
+
+namespace vibenote {
+
+// One quantization of the model (Q8_0, Q5_K_M, Q4_K_M, ...).
+struct ModelVariant {
+  std::string path;
+  std::string name;  // label in logs and metrics, usually the file name
+  ModelLayout layout;
+
+  // Every tensor, wherever llama.cpp places it.
+  std::uint64_t weightBytes() const;
+};
+
+struct VariantChoice {
+  std::size_t variant{0};  // index into ModelVariants
+  OffloadPlan plan;
+};
+
+// Picks which quantization of the model to serve from the memory the
+// resource monitor reports, and keeps what each one measured while serving.
+//
+// Variants are quantizations of the same weights, so more bytes per weight
+// is higher quality; they are ordered by size, largest first. The choice is
+// the first that offloads every layer, since a partly offloaded model runs
+// at CPU speed no matter how good its weights are. A variant that was seen
+// to use more device memory than planOffload() estimated has its estimate
+// scaled up by the same factor from then on. Thread-safe.
+class ModelVariants {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    // Context sizes and buffers to plan with; memory_bytes is ignored. Once
+    // a variant is active, switches keep its context, since the server's
+    // --ctx-size and the summary chunking were sized for it.
+    OffloadBudget budget;
+    // How long another variant must stay the choice before update() asks
+    // for it. Pressure that clears sooner is the throttle's business.
+    std::chrono::milliseconds hold{30000};
+  };
+
+  struct Stats {
+    std::uint64_t tokens{0};
+    double seconds{0};  // spent generating them
+    std::uint64_t device_bytes{0};  // last measured, 0 if never
+    int gpu_layers{0};  // -ngl device_bytes was measured at
+
+    double tokensPerSecond() const { return seconds > 0 ? static_cast<double>(tokens) / seconds : 0.0; }
+  };
+
+  ModelVariants(std::vector<ModelVariant> variants, Options options);
+
+  std::size_t size() const { return variants_.size(); }
+  const ModelVariant &variant(std::size_t index) const { return variants_[index]; }
+
+  // The highest-quality variant that fully offloads into `memory_bytes` and
+  // its plan; the smallest variant, partly offloaded, if none does.
+  VariantChoice choose(std::uint64_t memory_bytes) const;
+
+  // `index` now serves with `plan`. Pins the context to plan.context_size.
+  void setActive(std::size_t index, const OffloadPlan &plan);
+  // Options::budget with the active context pinned.
+  OffloadBudget budget() const;
+  // SIZE_MAX before setActive().
+  std::size_t active() const;
+  OffloadPlan activePlan() const;
+  // Device memory the active variant holds, as estimated and corrected by
+  // its measurements.
+  std::uint64_t activeBytes() const;
+
+  // Called at each check with the free device memory less the headroom to
+  // keep, negative when the headroom is being eaten into. The active
+  // variant's own memory counts as available, so the choice is made for
+  // after it is unloaded. Returns the variant to switch to once the same
+  // other choice has held for `hold`, then starts over.
+  std::optional<std::size_t> update(std::int64_t margin_bytes, Clock::time_point now);
+
+  // The active variant was seen to hold `device_bytes`.
+  void recordMemory(std::uint64_t device_bytes);
+  // The active variant generated `tokens` in `seconds`.
+  void recordGeneration(std::size_t tokens, double seconds);
+
+  Stats stats(std::size_t index) const;
+  // Appends Prometheus families; registered with Metrics::addSource.
+  void serializeMetrics(std::string &out) const;
+
+ private:
+  VariantChoice chooseLocked(std::uint64_t memory_bytes) const;
+  double memoryScaleLocked(std::size_t index) const;
+  std::uint64_t footprintLocked(std::size_t index, const OffloadPlan &plan) const;
+
+  std::vector<ModelVariant> variants_;
+  Options options_;
+
+  mutable std::mutex mutex_;
+  std::vector<Stats> stats_;
+  std::size_t active_{SIZE_MAX};
+  OffloadPlan active_plan_;
+  std::optional<std::size_t> pending_;
+  Clock::time_point pending_since_;
+};
+
+}  // namespace vibenote
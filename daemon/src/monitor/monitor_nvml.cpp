@@ -0,0 +1,50 @@
+#include "resource_monitor.h"
+
+#include <nvml.h>
+
+namespace vibenote {
+
+namespace {
+
+constexpr unsigned long long kMB = 1024 * 1024;
+
+// GPU utilization and VRAM of one device. Owns the NVML session.
+class NvmlMonitor : public ResourceMonitor {
+ public:
+  explicit NvmlMonitor(nvmlDevice_t device) : device_(device) {}
+  ~NvmlMonitor() override { nvmlShutdown(); }
+
+  const char *name() const override { return "nvml"; }
+
+  std::optional<ResourceSample> sample() override {
+    nvmlUtilization_t util{};
+    nvmlMemory_t mem{};
+    if (nvmlDeviceGetUtilizationRates(device_, &util) != NVML_SUCCESS ||
+        nvmlDeviceGetMemoryInfo(device_, &mem) != NVML_SUCCESS) {
+      return std::nullopt;
+    }
+    ResourceSample s;
+    s.time_ms = monotonicMs();
+    s.utilization = static_cast<float>(util.gpu);
+    s.memory_free_mb = static_cast<std::size_t>(mem.free / kMB);
+    s.memory_total_mb = static_cast<std::size_t>(mem.total / kMB);
+    return s;
+  }
+
+ private:
+  nvmlDevice_t device_;
+};
+
+}  // namespace
+
+std::unique_ptr<ResourceMonitor> ResourceMonitor::createNvml(unsigned index) {
+  if (nvmlInit_v2() != NVML_SUCCESS) return nullptr;
+  nvmlDevice_t device{};
+  if (nvmlDeviceGetHandleByIndex_v2(index, &device) != NVML_SUCCESS) {
+    nvmlShutdown();
+    return nullptr;
+  }
+  return std::make_unique<NvmlMonitor>(device);
+}
+
+}  // namespace vibenote
@@ -0,0 +1,157 @@
+#include "resource_monitor.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+namespace vibenote {
+
+namespace {
+
+constexpr unsigned long long kMB = 1024 * 1024;
+
+std::optional<std::string> readFile(const std::string &path) {
+  std::ifstream in(path);
+  if (!in) return std::nullopt;
+  std::ostringstream out;
+  out << in.rdbuf();
+  return out.str();
+}
+
+std::optional<unsigned long long> readNumber(const std::string &path) {
+  const auto text = readFile(path);
+  unsigned long long value = 0;
+  // cgroup v2 writes "max" for no limit, which fails to parse here.
+  if (!text || std::sscanf(text->c_str(), "%llu", &value) != 1) return std::nullopt;
+  return value;
+}
+
+// Value in bytes of a "Key:   123 kB" line of /proc/meminfo.
+std::optional<unsigned long long> meminfoBytes(const std::string &meminfo, const char *key) {
+  const std::size_t at = meminfo.find(key);
+  unsigned long long kb = 0;
+  if (at == std::string::npos || std::sscanf(meminfo.c_str() + at + std::char_traits<char>::length(key),
+                                             ": %llu", &kb) != 1) {
+    return std::nullopt;
+  }
+  return kb * 1024;
+}
+
+// CPU pressure and memory of the cgroup the daemon runs in, for hosts where
+// inference runs on the CPU. Utilization is the share of wall time in which
+// some runnable task waited for a CPU ("some" in /proc/pressure/cpu): it
+// rises as soon as generation competes with other work, while plain CPU
+// usage would just read 100% whenever a model is decoding.
+class PsiMonitor : public ResourceMonitor {
+ public:
+  PsiMonitor(std::string cpu_pressure, std::string meminfo, std::string memory_limit,
+             std::string memory_usage)
+      : cpu_pressure_(std::move(cpu_pressure)),
+        meminfo_(std::move(meminfo)),
+        memory_limit_(std::move(memory_limit)),
+        memory_usage_(std::move(memory_usage)) {}
+
+  const char *name() const override { return "psi"; }
+
+  std::optional<ResourceSample> sample() override {
+    const auto pressure = readFile(cpu_pressure_);
+    const auto meminfo = readFile(meminfo_);
+    float avg10 = 0;
+    unsigned long long total_us = 0;
+    if (!pressure || !meminfo ||
+        std::sscanf(pressure->c_str(), "some avg10=%f avg60=%*f avg300=%*f total=%llu", &avg10,
+                    &total_us) != 2) {
+      return std::nullopt;
+    }
+
+    ResourceSample s;
+    s.time_ms = monotonicMs();
+    // The cumulative stall counter covers exactly the time since the last
+    // sample; avg10 lags by seconds and only seeds the first reading.
+    if (last_time_ms_ > 0 && s.time_ms > last_time_ms_ && total_us >= last_total_us_) {
+      const double stalled_ms = static_cast<double>(total_us - last_total_us_) / 1000.0;
+      s.utilization = static_cast<float>(
+          std::min(100.0, 100.0 * stalled_ms / static_cast<double>(s.time_ms - last_time_ms_)));
+    } else if (last_time_ms_ > 0) {
+      s.utilization = last_utilization_;
+    } else {
+      s.utilization = avg10;
+    }
+    last_time_ms_ = s.time_ms;
+    last_total_us_ = total_us;
+    last_utilization_ = s.utilization;
+
+    unsigned long long total = meminfoBytes(*meminfo, "MemTotal").value_or(0);
+    unsigned long long free = meminfoBytes(*meminfo, "MemAvailable").value_or(0);
+    // A cgroup limit below physical memory is the one the OOM killer enforces.
+    const auto limit = readNumber(memory_limit_);
+    const auto usage = readNumber(memory_usage_);
+    if (limit && usage && *limit < total) {
+      total = *limit;
+      free = std::min(free, *limit - std::min(*limit, *usage));
+    }
+    s.memory_free_mb = static_cast<std::size_t>(free / kMB);
+    s.memory_total_mb = static_cast<std::size_t>(total / kMB);
+    return s;
+  }
+
+ private:
+  std::string cpu_pressure_;
+  std::string meminfo_;
+  std::string memory_limit_;
+  std::string memory_usage_;
+  std::int64_t last_time_ms_{0};
+  unsigned long long last_total_us_{0};
+  float last_utilization_{0.0f};
+};
+
+}  // namespace
+
+std::unique_ptr<ResourceMonitor> ResourceMonitor::createPsi(std::string proc_root,
+                                                            std::string cgroup_root) {
+  const std::string cpu_pressure = proc_root + "/pressure/cpu";
+  if (!readFile(cpu_pressure)) return nullptr;
+
+  // "0::/path" under cgroup v2; "N:memory:/path" under v1. Inside a
+  // container the path may name the host's hierarchy, so fall back to the
+  // mount's root when it does not exist.
+  std::string limit_file = cgroup_root + "/memory.max";
+  std::string usage_file = cgroup_root + "/memory.current";
+  std::istringstream cgroups(readFile(proc_root + "/self/cgroup").value_or(""));
+  for (std::string line; std::getline(cgroups, line);) {
+    const std::size_t first = line.find(':');
+    const std::size_t second = line.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) continue;
+    const std::string controllers = line.substr(first + 1, second - first - 1);
+    const std::string path = line.substr(second + 1);
+    std::string dir;
+    const char *limit_name = nullptr;
+    const char *usage_name = nullptr;
+    if (controllers.empty()) {
+      dir = cgroup_root;
+      limit_name = "/memory.max";
+      usage_name = "/memory.current";
+    } else if (controllers == "memory") {
+      dir = cgroup_root + "/memory";
+      limit_name = "/memory.limit_in_bytes";
+      usage_name = "/memory.usage_in_bytes";
+    } else {
+      continue;
+    }
+    if (!readFile(dir + path + limit_name)) {
+      if (!readFile(dir + limit_name)) continue;
+    } else {
+      dir += path;
+    }
+    limit_file = dir + limit_name;
+    usage_file = dir + usage_name;
+    // v1 wins on hybrid hosts, where the v2 hierarchy has no memory controller.
+    if (!controllers.empty()) break;
+  }
+  return std::make_unique<PsiMonitor>(cpu_pressure, proc_root + "/meminfo", limit_file,
+                                      usage_file);
+}
+
+}  // namespace vibenote
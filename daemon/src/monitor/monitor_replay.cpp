@@ -0,0 +1,64 @@
+#include "resource_monitor.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <utility>
+
+namespace vibenote {
+
+namespace {
+
+// Plays back recorded samples, one per call, for deterministic tests.
+class ReplayMonitor : public ResourceMonitor {
+ public:
+  ReplayMonitor(std::vector<ResourceSample> samples, bool loop)
+      : samples_(std::move(samples)), loop_(loop) {}
+
+  const char *name() const override { return "replay"; }
+
+  std::optional<ResourceSample> sample() override {
+    if (samples_.empty()) return std::nullopt;
+    if (next_ == samples_.size()) {
+      if (!loop_) return samples_.back();
+      next_ = 0;
+    }
+    return samples_[next_++];
+  }
+
+ private:
+  std::vector<ResourceSample> samples_;
+  bool loop_;
+  std::size_t next_{0};
+};
+
+}  // namespace
+
+std::unique_ptr<ResourceMonitor> ResourceMonitor::createReplay(std::vector<ResourceSample> samples,
+                                                               bool loop) {
+  return std::make_unique<ReplayMonitor>(std::move(samples), loop);
+}
+
+std::unique_ptr<ResourceMonitor> ResourceMonitor::loadReplay(const std::string &path, bool loop) {
+  std::ifstream in(path);
+  if (!in) return nullptr;
+  std::vector<ResourceSample> samples;
+  std::string line;
+  while (std::getline(in, line)) {
+    line.erase(std::min(line.find('#'), line.size()));
+    long long time_ms = 0;
+    float utilization = 0;
+    unsigned long long free_mb = 0;
+    unsigned long long total_mb = 0;
+    if (std::sscanf(line.c_str(), "%lld ,%f ,%llu ,%llu", &time_ms, &utilization, &free_mb,
+                    &total_mb) != 4) {
+      continue;
+    }
+    samples.push_back({time_ms, utilization, static_cast<std::size_t>(free_mb),
+                       static_cast<std::size_t>(total_mb)});
+  }
+  if (samples.empty()) return nullptr;
+  return createReplay(std::move(samples), loop);
+}
+
+}  // namespace vibenote
@@ -0,0 +1,21 @@
+#include "resource_monitor.h"
+
+namespace vibenote {
+
+#ifndef VIBENOTE_HAVE_NVML
+std::unique_ptr<ResourceMonitor> ResourceMonitor::createNvml(unsigned) { return nullptr; }
+#endif
+
+std::unique_ptr<ResourceMonitor> ResourceMonitor::create(const std::string &spec) {
+  constexpr char kReplay[] = "replay:";
+  if (spec == "nvml") return createNvml();
+  if (spec == "psi") return createPsi();
+  if (spec.rfind(kReplay, 0) == 0) return loadReplay(spec.substr(sizeof(kReplay) - 1));
+  if (spec.empty() || spec == "auto") {
+    if (auto nvml = createNvml()) return nvml;
+    return createPsi();
+  }
+  return nullptr;
+}
+
+}  // namespace vibenote
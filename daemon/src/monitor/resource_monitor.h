@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace vibenote {
+
+// One reading of the device inference runs on.
+struct ResourceSample {
+  std::int64_t time_ms{0};        // steady clock; replayed traces carry their own
+  float utilization{0.0f};        // percent: GPU busy, or CPU pressure stall time
+  std::size_t memory_free_mb{0};  // VRAM, or memory left under the cgroup limit
+  std::size_t memory_total_mb{0};
+};
+
+inline std::int64_t monotonicMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Source of ResourceSamples for GpuGuard's throttling. Backends read NVML
+// on GPU hosts, Linux pressure stall information and cgroup memory on
+// CPU-only hosts, or play back a recorded trace so throttling can be tested
+// and tuned without the hardware. sample() is called from one thread at a
+// time.
+class ResourceMonitor {
+ public:
+  virtual ~ResourceMonitor() = default;
+
+  // "nvml", "psi" or "replay".
+  virtual const char *name() const = 0;
+  // Current reading; nullopt once the backend can no longer report.
+  virtual std::optional<ResourceSample> sample() = 0;
+
+  // GPU `index` through NVML. nullptr without a driver or device, or in
+  // builds without NVML (VIBENOTE_HAVE_NVML).
+  static std::unique_ptr<ResourceMonitor> createNvml(unsigned index = 0);
+  // CPU pressure from <proc_root>/pressure/cpu; memory from the process's
+  // cgroup (v1 or v2) under `cgroup_root`, capped by MemAvailable. nullptr if
+  // the kernel has no PSI.
+  static std::unique_ptr<ResourceMonitor> createPsi(std::string proc_root = "/proc",
+                                                    std::string cgroup_root = "/sys/fs/cgroup");
+  // Returns `samples` in order, one per sample() call. After the last one it
+  // starts over if `loop` is set, and otherwise keeps returning the last.
+  static std::unique_ptr<ResourceMonitor> createReplay(std::vector<ResourceSample> samples,
+                                                       bool loop = false);
+  // Reads a trace of "time_ms,utilization,memory_free_mb,memory_total_mb"
+  // lines; '#' starts a comment and lines that do not parse (a header) are
+  // skipped. nullptr if the file is missing or has no samples.
+  static std::unique_ptr<ResourceMonitor> loadReplay(const std::string &path, bool loop = false);
+
+  // "nvml", "psi", "replay:<trace.csv>", or "auto" for NVML when it is
+  // available and PSI otherwise. nullptr if the backend cannot start.
+  static std::unique_ptr<ResourceMonitor> create(const std::string &spec);
+};
+
+}  // namespace vibenote
@@ -0,0 +1,224 @@
+#include "offload_planner.h"
+
+#include <algorithm>
+#include <charconv>
+#include <memory>
+#include <string_view>
+
+#include "gguf.h"
+
+namespace vibenote {
+
+namespace {
+
+// llama.cpp pads n_ctx to this.
+constexpr std::uint32_t kContextStep = 256;
+constexpr std::uint64_t kF32Bytes = 4;
+
+struct GgufDeleter {
+  void operator()(gguf_context *gguf) const { gguf_free(gguf); }
+};
+
+template <typename T>
+std::uint64_t arrayMax(const gguf_context *gguf, std::int64_t id) {
+  const auto *values = static_cast<const T *>(gguf_get_arr_data(gguf, id));
+  std::uint64_t max = 0;
+  for (std::size_t i = 0; i < gguf_get_arr_n(gguf, id); ++i) {
+    max = std::max<std::uint64_t>(max, values[i] > 0 ? static_cast<std::uint64_t>(values[i]) : 0);
+  }
+  return max;
+}
+
+// An unsigned integer value of any width. Per-layer arrays, which some
+// architectures use for head counts, yield their largest entry.
+std::optional<std::uint64_t> readUint(const gguf_context *gguf, const std::string &key) {
+  const std::int64_t id = gguf_find_key(gguf, key.c_str());
+  if (id < 0) {
+    return std::nullopt;
+  }
+  switch (gguf_get_kv_type(gguf, id)) {
+    case GGUF_TYPE_UINT8:
+      return gguf_get_val_u8(gguf, id);
+    case GGUF_TYPE_UINT16:
+      return gguf_get_val_u16(gguf, id);
+    case GGUF_TYPE_UINT32:
+      return gguf_get_val_u32(gguf, id);
+    case GGUF_TYPE_UINT64:
+      return gguf_get_val_u64(gguf, id);
+    case GGUF_TYPE_INT32:
+      return static_cast<std::uint64_t>(std::max(0, gguf_get_val_i32(gguf, id)));
+    case GGUF_TYPE_INT64:
+      return static_cast<std::uint64_t>(std::max<std::int64_t>(0, gguf_get_val_i64(gguf, id)));
+    case GGUF_TYPE_ARRAY:
+      switch (gguf_get_arr_type(gguf, id)) {
+        case GGUF_TYPE_UINT32:
+          return arrayMax<std::uint32_t>(gguf, id);
+        case GGUF_TYPE_INT32:
+          return arrayMax<std::int32_t>(gguf, id);
+        default:
+          return std::nullopt;
+      }
+    default:
+      return std::nullopt;
+  }
+}
+
+std::uint32_t readU32(const gguf_context *gguf, const std::string &key, std::uint32_t fallback) {
+  const std::optional<std::uint64_t> value = readUint(gguf, key);
+  return value ? static_cast<std::uint32_t>(std::min<std::uint64_t>(*value, UINT32_MAX)) : fallback;
+}
+
+// Block index of a "blk.N.<name>" tensor.
+std::optional<std::uint32_t> blockIndex(std::string_view name) {
+  constexpr std::string_view kPrefix = "blk.";
+  if (name.substr(0, kPrefix.size()) != kPrefix) {
+    return std::nullopt;
+  }
+  name.remove_prefix(kPrefix.size());
+  std::uint32_t index = 0;
+  const auto [end, ec] = std::from_chars(name.data(), name.data() + name.size(), index);
+  if (ec != std::errc() || end == name.data() || end == name.data() + name.size() || *end != '.') {
+    return std::nullopt;
+  }
+  return index;
+}
+
+std::uint32_t roundDown(std::uint32_t context) { return context / kContextStep * kContextStep; }
+
+std::uint32_t roundUp(std::uint32_t context) {
+  return (context + kContextStep - 1) / kContextStep * kContextStep;
+}
+
+}  // namespace
+
+std::optional<ModelLayout> ModelLayout::read(const std::string &path) {
+  gguf_init_params params{};
+  params.no_alloc = true;
+  params.ctx = nullptr;
+  std::unique_ptr<gguf_context, GgufDeleter> gguf(gguf_init_from_file(path.c_str(), params));
+  if (!gguf) {
+    return std::nullopt;
+  }
+  return fromGguf(gguf.get());
+}
+
+std::optional<ModelLayout> ModelLayout::fromGguf(const gguf_context *gguf) {
+  const std::int64_t arch_id = gguf_find_key(gguf, "general.architecture");
+  if (arch_id < 0 || gguf_get_kv_type(gguf, arch_id) != GGUF_TYPE_STRING) {
+    return std::nullopt;
+  }
+  ModelLayout layout;
+  layout.architecture = gguf_get_val_str(gguf, arch_id);
+  const std::string arch = layout.architecture + ".";
+
+  const std::uint32_t blocks = readU32(gguf, arch + "block_count", 0);
+  layout.context_length = readU32(gguf, arch + "context_length", 0);
+  layout.embedding_length = readU32(gguf, arch + "embedding_length", 0);
+  layout.feed_forward_length = readU32(gguf, arch + "feed_forward_length", 0);
+  layout.head_count = readU32(gguf, arch + "attention.head_count", 0);
+  if (blocks == 0 || layout.embedding_length == 0 || layout.head_count == 0) {
+    return std::nullopt;
+  }
+  layout.head_count_kv = readU32(gguf, arch + "attention.head_count_kv", layout.head_count);
+  const std::uint32_t head_size = layout.embedding_length / layout.head_count;
+  layout.key_length = readU32(gguf, arch + "attention.key_length", head_size);
+  layout.value_length = readU32(gguf, arch + "attention.value_length", head_size);
+
+  const std::int64_t tokens_id = gguf_find_key(gguf, "tokenizer.ggml.tokens");
+  layout.vocab_size = tokens_id >= 0 && gguf_get_kv_type(gguf, tokens_id) == GGUF_TYPE_ARRAY
+                          ? static_cast<std::uint32_t>(gguf_get_arr_n(gguf, tokens_id))
+                          : readU32(gguf, arch + "vocab_size", 0);
+
+  layout.block_bytes.assign(blocks, 0);
+  std::uint64_t token_embd_bytes = 0;
+  bool has_output = false;
+  for (std::int64_t i = 0; i < gguf_get_n_tensors(gguf); ++i) {
+    const std::string_view name = gguf_get_tensor_name(gguf, i);
+    const std::uint64_t bytes = gguf_get_tensor_size(gguf, i);
+    if (const std::optional<std::uint32_t> block = blockIndex(name)) {
+      if (*block >= blocks) {
+        return std::nullopt;
+      }
+      layout.block_bytes[*block] += bytes;
+    } else if (name.substr(0, 6) == "output") {
+      has_output = has_output || name == "output.weight";
+      layout.output_bytes += bytes;
+    } else {
+      if (name == "token_embd.weight") {
+        token_embd_bytes = bytes;
+      }
+      layout.host_bytes += bytes;
+    }
+  }
+  if (!has_output) {
+    layout.output_bytes += token_embd_bytes;
+  }
+  return layout;
+}
+
+OffloadPlan estimateOffload(const ModelLayout &model, int gpu_layers, std::uint32_t context_size,
+                            const OffloadBudget &budget) {
+  OffloadPlan plan;
+  plan.gpu_layers = std::clamp(gpu_layers, 0, model.fullOffload());
+  plan.context_size = context_size;
+  if (plan.gpu_layers == 0) {
+    return plan;
+  }
+  // llama.cpp offloads the last blocks first, and the output head only once
+  // -ngl exceeds the block count.
+  const auto blocks = static_cast<int>(model.blockCount());
+  const int first = std::max(0, blocks - plan.gpu_layers);
+  for (int i = first; i < blocks; ++i) {
+    plan.weight_bytes += model.block_bytes[static_cast<std::size_t>(i)];
+  }
+  const bool output = plan.gpu_layers > blocks;
+  if (output) {
+    plan.weight_bytes += model.output_bytes;
+  }
+  // Each offloaded block keeps its K and V for the whole context on device.
+  const std::uint64_t kv_per_token =
+      static_cast<std::uint64_t>(model.head_count_kv) * (model.key_length + model.value_length) *
+      budget.kv_bytes_per_element;
+  plan.kv_bytes = static_cast<std::uint64_t>(blocks - first) * context_size * kv_per_token;
+  // The graph allocator reuses one layer's buffers across layers, so the
+  // peak is that layer's KQ scores and a handful of f32 activations per
+  // ubatch token, plus the logits when the output head runs on device.
+  const std::uint64_t ubatch = budget.ubatch;
+  plan.compute_bytes = kF32Bytes * ubatch *
+                       (static_cast<std::uint64_t>(model.head_count) * context_size +
+                        4ull * model.embedding_length + 2ull * model.feed_forward_length);
+  if (output) {
+    plan.compute_bytes += kF32Bytes * ubatch * model.vocab_size;
+  }
+  return plan;
+}
+
+OffloadPlan planOffload(const ModelLayout &model, const OffloadBudget &budget) {
+  std::uint32_t wanted = budget.context_size != 0 ? budget.context_size : model.context_length;
+  const std::uint32_t min_context = std::max(kContextStep, roundUp(budget.min_context));
+  wanted = std::max(min_context, roundDown(wanted));
+  const auto fits = [&](int layers, std::uint32_t context) {
+    return estimateOffload(model, layers, context, budget).totalBytes() <= budget.memory_bytes;
+  };
+
+  for (int layers = model.fullOffload(); layers > 0; --layers) {
+    if (!fits(layers, min_context)) {
+      continue;
+    }
+    // Memory grows with the context, so bisect for the largest that fits.
+    std::uint32_t low = min_context / kContextStep;
+    std::uint32_t high = wanted / kContextStep;
+    while (low < high) {
+      const std::uint32_t mid = low + (high - low + 1) / 2;
+      if (fits(layers, mid * kContextStep)) {
+        low = mid;
+      } else {
+        high = mid - 1;
+      }
+    }
+    return estimateOffload(model, layers, low * kContextStep, budget);
+  }
+  return estimateOffload(model, 0, wanted, budget);
+}
+
+}  // namespace vibenote
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct gguf_context;
+
+namespace vibenote {
+
+// What a model needs in memory, read from its GGUF header: hyperparameters
+// from the metadata and the size of every tensor, grouped the way llama.cpp
+// places them. No tensor data is loaded.
+struct ModelLayout {
+  std::string architecture;
+  std::uint32_t context_length{0};  // trained context
+  std::uint32_t embedding_length{0};
+  std::uint32_t feed_forward_length{0};
+  std::uint32_t head_count{0};
+  std::uint32_t head_count_kv{0};
+  std::uint32_t key_length{0};  // per head
+  std::uint32_t value_length{0};
+  std::uint32_t vocab_size{0};
+  // Weights of each repeating block ("blk.N.*"); the size is the block count.
+  std::vector<std::uint64_t> block_bytes;
+  // The output head and its norm. A model without output.weight reuses the
+  // token embeddings, which llama.cpp then copies to the output device.
+  std::uint64_t output_bytes{0};
+  // Token embeddings and anything else llama.cpp keeps in host memory.
+  std::uint64_t host_bytes{0};
+
+  // Nullopt if `path` is not a readable GGUF file with the hyperparameters
+  // planning needs.
+  static std::optional<ModelLayout> read(const std::string &path);
+  static std::optional<ModelLayout> fromGguf(const gguf_context *gguf);
+
+  std::uint32_t blockCount() const { return static_cast<std::uint32_t>(block_bytes.size()); }
+  // The -ngl value that offloads every block and the output head.
+  int fullOffload() const { return static_cast<int>(blockCount()) + 1; }
+};
+
+struct OffloadBudget {
+  std::uint64_t memory_bytes{0};  // device memory the model may use
+  std::uint32_t context_size{0};  // wanted total context; 0 uses the trained one
+  std::uint32_t min_context{2048};
+  std::uint32_t ubatch{512};  // tokens per compute graph (--ubatch-size)
+  std::uint32_t kv_bytes_per_element{2};  // f16 cache
+};
+
+// Device memory for one choice of -ngl and context size, as llama.cpp
+// would allocate it: the last `gpu_layers` blocks (and, past the block
+// count, the output head), their slice of the KV cache, and a compute buffer.
+struct OffloadPlan {
+  int gpu_layers{0};
+  std::uint32_t context_size{0};
+  std::uint64_t weight_bytes{0};
+  std::uint64_t kv_bytes{0};
+  std::uint64_t compute_bytes{0};
+
+  std::uint64_t totalBytes() const { return weight_bytes + kv_bytes + compute_bytes; }
+};
+
+// Device memory -ngl `gpu_layers` needs at `context_size`.
+OffloadPlan estimateOffload(const ModelLayout &model, int gpu_layers, std::uint32_t context_size,
+                            const OffloadBudget &budget);
+
+// The most layers that fit `budget`, then the largest context that still
+// fits with them. Contexts are multiples of 256, as llama.cpp pads them, and
+// shrink from the requested size down to min_context before a layer is given
+// up. With not even one layer fitting, returns -ngl 0 at the requested
+// context, which needs no device memory.
+OffloadPlan planOffload(const ModelLayout &model, const OffloadBudget &budget);
+
+}  // namespace vibenote
@@ -1,131 +1,379 @@
-#include <array>
-#include <condition_variable>
-#include <cstdint>
-#include <queue>
-#include <deque>
-#include <functional>
-#include <mutex>
-#include <optional>
-#include <string>
-#include <unordered_map>
+#include "queue.h"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cmath>
+#include <limits>
 
 #include "gpu_guard.h"
+#include "queue_journal.h"
+#include "queue_metrics.h"
 
 namespace vibenote {
 
-enum class TaskType { kWatch, kInteractive, kExport };
-
-enum class TaskPriority { kHigh = 0, kNormal = 1, kLow = 2, kCount };
+namespace {
 
-struct Task {
-  std::uint64_t id{};
-  TaskType type{TaskType::kInteractive};
-  TaskPriority priority{TaskPriority::kNormal};
-  std::string prompt;
-  std::function<void(const std::string &)> callback;
-};
+constexpr std::size_t kHighIdx = static_cast<std::size_t>(TaskPriority::kHigh);
+constexpr std::size_t kNormalIdx = static_cast<std::size_t>(TaskPriority::kNormal);
+constexpr std::size_t kLowIdx = static_cast<std::size_t>(TaskPriority::kLow);
 
-struct QueueConfig {
-  std::size_t max_queue_depth{128};
-  std::unordered_map<TaskType, std::size_t> max_concurrent;
-};
-
-}  // namespace vibenote
+constexpr std::uint32_t kRowMask = (1u << kTaskTypeCount) - 1u;
 
-namespace std {
-template <>
-struct hash<vibenote::TaskType> {
-  std::size_t operator()(const vibenote::TaskType &t) const noexcept {
-    return static_cast<std::size_t>(t);
+// Bits of every priority row that belong to one task type.
+constexpr std::uint32_t typeColumnMask(std::size_t type) {
+  std::uint32_t mask = 0;
+  for (std::size_t p = 0; p < kTaskPriorityCount; ++p) {
+    mask |= 1u << (p * kTaskTypeCount + type);
   }
-};
-}  // namespace std
+  return mask;
+}
 
-namespace vibenote {
+constexpr auto kNoDeadline = TaskClock::time_point::max();
 
-class TaskQueue {
- public:
-  TaskQueue(GpuGuard *guard, QueueConfig cfg);
+// Weight of the newest sample in the per-type service time average.
+constexpr double kServiceAlpha = 0.2;
+// Retry hint for a full queue before any service time has been observed.
+constexpr auto kDefaultRetryAfter = std::chrono::seconds(1);
 
-  bool enqueue(Task task);
-  Task dequeue();
-  void taskCompleted(std::uint64_t id);
-  void setPaused(bool paused);
+}  // namespace
 
-  struct Stats {
-    std::array<std::size_t, static_cast<std::size_t>(TaskPriority::kCount)> queued{};
-    std::unordered_map<TaskType, std::size_t> running;
-  };
+bool CancellationToken::cancel() {
+  std::vector<std::function<void()>> hooks;
+  {
+    std::lock_guard lock(mutex_);
+    if (cancelled_.exchange(true, std::memory_order_acq_rel)) {
+      return false;
+    }
+    hooks.swap(hooks_);
+  }
+  for (auto &hook : hooks) {
+    hook();
+  }
+  return true;
+}
+
+void CancellationToken::onCancel(std::function<void()> hook) {
+  {
+    std::lock_guard lock(mutex_);
+    if (!cancelled_.load(std::memory_order_acquire)) {
+      hooks_.push_back(std::move(hook));
+      return;
+    }
+  }
+  hook();
+}
 
-  Stats getStats() const;
+TaskQueue::TaskQueue(GpuGuard *guard, QueueConfig cfg)
+    : guard_(guard), config_(std::move(cfg)) {
+  for (std::size_t t = 0; t < kTaskTypeCount; ++t) {
+    const auto type = static_cast<TaskType>(t);
+    auto max_it = config_.max_concurrent.find(type);
+    limits_[t] = max_it == config_.max_concurrent.end() ? 0 : max_it->second;
+    inference_[t] = config_.inference_types.count(type) > 0;
+    preemptible_[t] = config_.preemptible.count(type) > 0;
+  }
+  updateRunnableMaskUnlocked();
 
- private:
-  bool canRunUnlocked() const;
-  std::optional<Task> popNextTaskUnlocked();
-  std::optional<Task> findReadyTask(std::deque<Task> &q) const;
-  std::size_t totalQueuedUnlocked() const;
+  const auto now = TaskClock::now();
+  for (const auto &[type, limit] : config_.rate_limits) {
+    auto t = static_cast<std::size_t>(type);
+    rate_limits_[t] = limit;
+    rate_buckets_[t] = TokenBucket{limit.burst, now};
+  }
+}
 
-  mutable std::mutex mutex_;
-  std::condition_variable cv_;
+bool TaskQueue::enqueue(Task task) { return tryEnqueue(std::move(task)).accepted(); }
 
-  std::array<std::deque<Task>, static_cast<std::size_t>(TaskPriority::kCount)> queues_;
-  std::unordered_map<TaskType, std::size_t> running_;
-  std::unordered_map<std::uint64_t, TaskType> inflight_;
+Admission TaskQueue::tryEnqueue(Task task) {
+  return admit(std::move(task), true, config_.coalesce_prompts);
+}
 
-  GpuGuard *guard_;
-  QueueConfig config_;
-  bool paused_{false};
-  std::size_t rr_index_{static_cast<std::size_t>(TaskPriority::kNormal)};  // rotate normal/low
-};
+Admission TaskQueue::tryEnqueueAdmitted(Task task) {
+  return admit(std::move(task), false, config_.coalesce_prompts);
+}
 
-TaskQueue::TaskQueue(GpuGuard *guard, QueueConfig cfg)
-    : guard_(guard), config_(std::move(cfg)) {
-  running_[TaskType::kWatch] = 0;
-  running_[TaskType::kInteractive] = 0;
-  running_[TaskType::kExport] = 0;
+bool TaskQueue::requeue(Task task) { return admit(std::move(task), false, false).accepted(); }
 
-  if (guard_) {
-    guard_->throttleStateChanged([this](bool paused) { setPaused(paused); });
+Admission TaskQueue::admit(Task task, bool charge_rate, bool coalesce) {
+  // A real tokenizer may be slow; run it before taking the lock.
+  if (task.estimated_cost == 0) {
+    task.estimated_cost =
+        config_.cost_estimator ? config_.cost_estimator(task.prompt) : estimateTokens(task.prompt);
+  }
+  std::optional<CoalesceKey> key = coalesce ? coalesceKey(task) : std::nullopt;
+  Admission admission;
+  WaiterHook hook;
+  std::shared_ptr<CancellationToken> victim;
+  std::unique_lock lock(mutex_);
+  const auto type = static_cast<std::size_t>(task.type);
+  const auto prio = static_cast<std::size_t>(task.priority);
+  if (key) {
+    coalesce_lookups_++;
+  }
+  // A coalesced task adds no queued work, so it is neither turned away by a
+  // full queue nor charged a rate-limit token.
+  if (key && joinCoalesceGroupUnlocked(task, *key, hook)) {
+    admission.result = Admission::Result::kCoalesced;
+    admission.projected_wait = projectedWaitUnlocked(type, prio);
+  } else {
+    if (total_queued_ >= config_.max_queue_depth) {
+      purgeDeadUnlocked();
+    }
+    if (total_queued_ >= config_.max_queue_depth) {
+      rejected_full_++;
+      admission.result = Admission::Result::kQueueFull;
+      admission.retry_after = queueRetryAfterUnlocked();
+    } else if (auto wait = charge_rate ? rateLimitWaitUnlocked(type)
+                                       : std::chrono::milliseconds::zero();
+               wait > std::chrono::milliseconds::zero()) {
+      rejected_rate_++;
+      admission.result = Admission::Result::kRateLimited;
+      admission.retry_after = wait;
+    } else {
+      if (charge_rate && rate_limits_[type].rate > 0.0) {
+        rate_buckets_[type].tokens -= 1.0;
+      }
+      if (key) {
+        startCoalesceGroupUnlocked(task, std::move(*key), hook);
+      }
+      admission.projected_wait = projectedWaitUnlocked(type, prio);
+      pushTaskUnlocked(std::move(task));
+      victim = pickPreemptionVictimUnlocked(type, prio);
+    }
+  }
+  updateBackpressureUnlocked(!admission.accepted());
+  std::vector<Failure> failed = takeFailedUnlocked();
+  lock.unlock();
+  notifyBackpressure();
+  notifyFailed(std::move(failed));
+  // Runs at once if the producer's token is already cancelled.
+  if (hook.group) {
+    hook.token->onCancel([group = std::weak_ptr<CoalesceGroup>(hook.group), id = hook.id] {
+      if (auto g = group.lock()) {
+        g->detach(id);
+      }
+    });
   }
+  // Hooks stop the victim's generation; never run them under mutex_.
+  if (victim) {
+    victim->cancel();
+  }
+  return admission;
 }
 
-bool TaskQueue::enqueue(Task task) {
-  std::lock_guard lock(mutex_);
-  if (totalQueuedUnlocked() >= config_.max_queue_depth) {
-    return false;
+void TaskQueue::pushTaskUnlocked(Task task) {
+  if (!task.cancel_token) {
+    task.cancel_token = std::make_shared<CancellationToken>();
+  }
+  // A coalesced primary already registered its own token under its id.
+  tokens_.try_emplace(task.id, task.cancel_token);
+  if (journal_) {
+    journal_->recordEnqueue(task);
   }
-  auto idx = static_cast<std::size_t>(task.priority);
-  queues_[idx].push_back(std::move(task));
+
+  auto prio = static_cast<std::size_t>(task.priority);
+  auto cls = classIndex(prio, static_cast<std::size_t>(task.type));
+  task.enqueued_at = TaskClock::now();
+  auto due = task.deadline.value_or(kNoDeadline);
+  auto rank = task.enqueued_at +
+              config_.aging_per_token * static_cast<std::int64_t>(task.estimated_cost);
+  auto &bucket = buckets_[cls];
+  bucket.push_back(Entry{due, rank, next_seq_++, std::move(task)});
+  std::push_heap(bucket.begin(), bucket.end(), servedAfter);
+  nonempty_mask_ |= 1u << cls;
+  queued_[prio]++;
+  total_queued_++;
   cv_.notify_one();
-  return true;
 }
 
 Task TaskQueue::dequeue() {
   std::unique_lock lock(mutex_);
-  cv_.wait(lock, [this] { return !paused_ && canRunUnlocked(); });
-  auto task_opt = popNextTaskUnlocked();
-  // canRunUnlocked guarantees task
-  Task task = std::move(*task_opt);
-  running_[task.type]++;
-  inflight_[task.id] = task.type;
+  std::optional<Task> task;
+  while (!task) {
+    cv_.wait(lock, [this] { return stopped_ || (!paused_ && canRunUnlocked()); });
+    if (stopped_) {
+      break;
+    }
+    // Empty only if every candidate turned out to be expired or cancelled.
+    task = takeNextTaskUnlocked();
+  }
+  updateBackpressureUnlocked(false);
+  std::vector<Failure> failed = takeFailedUnlocked();
+  lock.unlock();
+  notifyBackpressure();
+  notifyFailed(std::move(failed));
+  return task ? std::move(*task) : Task{};
+}
+
+std::optional<Task> TaskQueue::dequeue(std::chrono::milliseconds timeout) {
+  std::unique_lock lock(mutex_);
+  const auto until = TaskClock::now() + timeout;
+  std::optional<Task> task;
+  while (!task) {
+    bool ready = cv_.wait_until(
+        lock, until, [this] { return stopped_ || (!paused_ && canRunUnlocked()); });
+    if (!ready || stopped_) {
+      break;
+    }
+    task = takeNextTaskUnlocked();
+  }
+  updateBackpressureUnlocked(false);
+  std::vector<Failure> failed = takeFailedUnlocked();
+  lock.unlock();
+  notifyBackpressure();
+  notifyFailed(std::move(failed));
+  return task;
+}
+
+std::vector<Task> TaskQueue::dequeueBatch(std::size_t max_tasks, std::size_t max_tokens,
+                                          std::chrono::milliseconds timeout) {
+  std::vector<Task> batch;
+  std::unique_lock lock(mutex_);
+  const auto until = TaskClock::now() + timeout;
+  std::optional<Task> first;
+  while (!first) {
+    bool ready = cv_.wait_until(
+        lock, until, [this] { return stopped_ || (!paused_ && canRunUnlocked()); });
+    if (!ready || stopped_) {
+      break;
+    }
+    first = takeNextTaskUnlocked();
+  }
+
+  if (first) {
+    const auto cls = classIndex(static_cast<std::size_t>(first->priority),
+                                static_cast<std::size_t>(first->type));
+    const bool batchable = config_.batchable.count(first->type) > 0;
+    const auto started = inflight_[first->id].started;
+    batch.push_back(std::move(*first));
+    if (batchable) {
+      fillBatchUnlocked(batch, cls, max_tasks, max_tokens, started);
+    }
+    for (const Task &task : batch) {
+      inflight_[task.id].batch_size = batch.size();
+    }
+    if (const std::size_t extra = extraBatchSlotsUnlocked(batch.front().type, batch.size())) {
+      inference_running_ += extra;
+      updateRunnableMaskUnlocked();
+    }
+  }
+  updateBackpressureUnlocked(false);
+  std::vector<Failure> failed = takeFailedUnlocked();
+  lock.unlock();
+  notifyBackpressure();
+  notifyFailed(std::move(failed));
+  return batch;
+}
+
+void TaskQueue::fillBatchUnlocked(std::vector<Task> &batch, std::size_t cls,
+                                  std::size_t max_tasks, std::size_t max_tokens,
+                                  TaskClock::time_point now) {
+  const auto type = batch.front().type;
+  const auto slot = batch.front().id;
+  const auto preempt = batch.front().preempt_token;  // copy: push_back reallocates
+  std::size_t tokens = 0;
+  while (batch.size() < max_tasks &&
+         inference_running_ + extraBatchSlotsUnlocked(type, batch.size() + 1) <=
+             sharedSlotsUnlocked() &&
+         dropIfDeadUnlocked(cls, now)) {
+    std::size_t cost = buckets_[cls].front().task.estimated_cost;
+    if (tokens + cost > max_tokens) {
+      break;
+    }
+    tokens += cost;
+    Task task = std::move(popBucketUnlocked(cls).task);
+    task.preempt_token = preempt;
+    task.dispatched_at = now;
+    if (metrics_) {
+      metrics_->recordWait(type, task.priority, now - task.enqueued_at);
+    }
+    inflight_[task.id] = Inflight{type, task.priority, slot, now, preempt, task.cancel_token};
+    slot_refs_[slot]++;
+    expireWaitersUnlocked(task.id, now);
+    batch.push_back(std::move(task));
+  }
+}
+
+std::optional<Task> TaskQueue::takeNextTaskUnlocked() {
+  auto task = popNextTaskUnlocked();
+  if (task) {
+    markRunningUnlocked(task->type, 1);
+    task->preempt_token = preemptible_[static_cast<std::size_t>(task->type)]
+                              ? std::make_shared<CancellationToken>()
+                              : nullptr;
+    task->dispatched_at = TaskClock::now();
+    if (metrics_) {
+      metrics_->recordWait(task->type, task->priority, task->dispatched_at - task->enqueued_at);
+    }
+    inflight_[task->id] = Inflight{task->type, task->priority, task->id, task->dispatched_at,
+                                   task->preempt_token, task->cancel_token};
+    slot_refs_[task->id] = 1;
+    expireWaitersUnlocked(task->id, task->dispatched_at);
+  }
   return task;
+}
 
+// Calibrated for llama-family BPE vocabularies on English text.
+std::size_t TaskQueue::estimateTokens(std::string_view prompt) {
+  return (prompt.size() + 3) / 4;
 }
 
 void TaskQueue::taskCompleted(std::uint64_t id) {
   std::lock_guard lock(mutex_);
   auto it = inflight_.find(id);
   if (it != inflight_.end()) {
-    auto type = it->second;
-    auto run_it = running_.find(type);
-    if (run_it != running_.end() && run_it->second > 0) {
-      run_it->second--;
+    auto refs = slot_refs_.find(it->second.slot);
+    if (refs != slot_refs_.end() && --refs->second == 0) {
+      slot_refs_.erase(refs);
+      preempted_slots_.erase(it->second.slot);
+      inference_running_ -= extraBatchSlotsUnlocked(it->second.type, it->second.batch_size);
+      if (running_[static_cast<std::size_t>(it->second.type)] > 0) {
+        markRunningUnlocked(it->second.type, -1);
+      }
+    }
+  }
+  auto token_it = tokens_.find(id);
+  const bool cancelled = it != inflight_.end()
+                             ? it->second.cancel && it->second.cancel->isCancelled()
+                             : token_it != tokens_.end() && token_it->second->isCancelled();
+  if (cancelled) {
+    cancelled_count_++;
+  }
+  if (it != inflight_.end()) {
+    // Cancelled and preempted runs stop early and would drag the estimate
+    // down. A batch shares one generation, so each of its tasks is charged
+    // an equal part of it.
+    const bool preempted = it->second.preempt && it->second.preempt->isCancelled();
+    if (!cancelled && !preempted) {
+      const auto elapsed = (TaskClock::now() - it->second.started) /
+                           static_cast<std::int64_t>(it->second.batch_size);
+      recordServiceTimeUnlocked(static_cast<std::size_t>(it->second.type), elapsed);
+      if (metrics_) {
+        metrics_->recordService(it->second.type, it->second.priority, elapsed);
+      }
     }
     inflight_.erase(it);
   }
+  releaseTaskUnlocked(id);
   cv_.notify_all();
 }
 
+bool TaskQueue::cancel(std::uint64_t id) {
+  std::shared_ptr<CancellationToken> token;
+  {
+    std::lock_guard lock(mutex_);
+    auto it = tokens_.find(id);
+    if (it == tokens_.end()) {
+      return false;
+    }
+    token = it->second;
+  }
+  // Hooks may reach into other subsystems; never run them under mutex_.
+  token->cancel();
+  return true;
+}
+
 void TaskQueue::setPaused(bool paused) {
   {
     std::lock_guard lock(mutex_);
@@ -134,16 +382,254 @@ void TaskQueue::setPaused(bool paused) {
   cv_.notify_all();
 }
 
+void TaskQueue::setInferenceShare(double share) {
+  {
+    std::lock_guard lock(mutex_);
+    inference_share_ = std::clamp(share, 0.0, 1.0);
+    updateRunnableMaskUnlocked();
+  }
+  cv_.notify_all();
+}
+
+void TaskQueue::setJournal(QueueJournal *journal) {
+  std::lock_guard lock(mutex_);
+  journal_ = journal;
+}
+
+void TaskQueue::backpressureChanged(std::function<void(bool)> handler) {
+  backpressure_handler_ = std::move(handler);
+}
+
+std::chrono::milliseconds TaskQueue::projectedWait(TaskType type, TaskPriority priority) const {
+  std::lock_guard lock(mutex_);
+  return projectedWaitUnlocked(static_cast<std::size_t>(type), static_cast<std::size_t>(priority));
+}
+
+void TaskQueue::setMetrics(QueueMetrics *metrics) {
+  std::lock_guard lock(mutex_);
+  metrics_ = metrics;
+}
+
+void TaskQueue::stop() {
+  {
+    std::lock_guard lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+}
+
 TaskQueue::Stats TaskQueue::getStats() const {
   std::lock_guard lock(mutex_);
   Stats stats;
-  for (std::size_t i = 0; i < static_cast<std::size_t>(TaskPriority::kCount); ++i) {
-    stats.queued[i] = queues_[i].size();
+  stats.queued = queued_;
+  stats.expired = expired_count_;
+  stats.cancelled = cancelled_count_;
+  stats.coalesce_lookups = coalesce_lookups_;
+  stats.coalesce_hits = coalesce_hits_;
+  stats.rejected_full = rejected_full_;
+  stats.rejected_rate = rejected_rate_;
+  stats.preemptions = preemptions_;
+  stats.backpressure = backpressure_.load(std::memory_order_acquire);
+  stats.inference_share = inference_share_;
+  stats.service_ms = service_ewma_ms_;
+  for (std::size_t t = 0; t < kTaskTypeCount; ++t) {
+    stats.running[static_cast<TaskType>(t)] = running_[t];
   }
-  stats.running = running_;
   return stats;
 }
 
+// Collapses whitespace runs and folds ASCII case, so OCR of an unchanged
+// screen hashes identically despite incidental spacing differences.
+std::string TaskQueue::normalizePrompt(std::string_view prompt) {
+  std::string out;
+  out.reserve(prompt.size());
+  bool pending_space = false;
+  for (char c : prompt) {
+    auto uc = static_cast<unsigned char>(c);
+    if (std::isspace(uc)) {
+      pending_space = !out.empty();
+      continue;
+    }
+    if (pending_space) {
+      out.push_back(' ');
+      pending_space = false;
+    }
+    out.push_back(static_cast<char>(std::tolower(uc)));
+  }
+  return out;
+}
+
+std::optional<TaskQueue::CoalesceKey> TaskQueue::coalesceKey(const Task &task) {
+  if (task.prompt.empty() || !task.callback) {
+    return std::nullopt;
+  }
+  CoalesceKey key;
+  key.prompt = normalizePrompt(task.prompt);
+  if (!task.grammar.empty() || !task.json_schema.empty()) {
+    key.prompt.append(1, '\0').append(task.grammar).append(1, '\0').append(task.json_schema);
+  }
+  key.hash = std::hash<std::string>{}(key.prompt);
+  key.hash ^= (static_cast<std::uint64_t>(task.type) << 8 |
+               static_cast<std::uint64_t>(task.priority)) *
+              0x9e3779b97f4a7c15ull;
+  return key;
+}
+
+// Attaches `task` to an identical pending or running task. Its own cancel
+// token goes into tokens_ under its id and into `hook` for admit() to wire
+// up, and a queued run's deadline is moved out to cover the new waiter.
+bool TaskQueue::joinCoalesceGroupUnlocked(Task &task, const CoalesceKey &key, WaiterHook &hook) {
+  auto it = coalesce_.find(key.hash);
+  if (it == coalesce_.end()) {
+    return false;
+  }
+  auto &group = *it->second.group;
+  const auto due = task.deadline.value_or(kNoDeadline);
+  {
+    std::lock_guard group_lock(group.mutex);
+    if (group.closed || group.prompt != key.prompt) {
+      return false;
+    }
+    group.waiters.push_back({task.id, std::move(task.callback), std::move(task.on_failure), due});
+    group.ids.push_back(task.id);
+  }
+  auto token = task.cancel_token ? task.cancel_token : std::make_shared<CancellationToken>();
+  tokens_[task.id] = token;
+  hook = WaiterHook{std::move(token), it->second.group, task.id};
+  extendDeadlineUnlocked(it->second.task_id,
+                         classIndex(static_cast<std::size_t>(task.priority),
+                                    static_cast<std::size_t>(task.type)),
+                         due);
+  coalesce_hits_++;
+  return true;
+}
+
+// Makes `task` the first waiter of a new group: its callbacks fan the result
+// out to every waiter, and it runs under the group's token so that
+// cancelling the task itself only detaches it.
+void TaskQueue::startCoalesceGroupUnlocked(Task &task, CoalesceKey key, WaiterHook &hook) {
+  auto group = std::make_shared<CoalesceGroup>();
+  group->prompt = std::move(key.prompt);
+  group->waiters.push_back({task.id, std::move(task.callback), std::move(task.on_failure),
+                            task.deadline.value_or(kNoDeadline)});
+  group->ids.push_back(task.id);
+  group->run = std::make_shared<CancellationToken>();
+  auto token = task.cancel_token ? task.cancel_token : std::make_shared<CancellationToken>();
+  tokens_[task.id] = token;
+  task.cancel_token = group->run;
+  task.callback = [this, group](const std::string &result) {
+    for (auto &waiter : closeCoalesceGroup(*group)) {
+      waiter.callback(result);
+    }
+  };
+  task.on_failure = [this, group](TaskFailure failure) {
+    for (auto &waiter : closeCoalesceGroup(*group)) {
+      if (waiter.on_failure) {
+        waiter.on_failure(failure);
+      }
+    }
+  };
+  hook = WaiterHook{std::move(token), group, task.id};
+  coalesce_[key.hash] = CoalesceEntry{task.id, std::move(group)};
+  coalesce_key_[task.id] = key.hash;
+}
+
+// Runs outside mutex_, from the shared run's callbacks.
+std::vector<TaskQueue::CoalesceWaiter> TaskQueue::closeCoalesceGroup(CoalesceGroup &group) {
+  std::vector<CoalesceWaiter> waiters = group.close();
+  std::lock_guard lock(mutex_);
+  for (std::uint64_t id : group.ids) {
+    tokens_.erase(id);
+  }
+  return waiters;
+}
+
+std::vector<TaskQueue::CoalesceWaiter> TaskQueue::CoalesceGroup::close() {
+  std::vector<CoalesceWaiter> taken;
+  std::lock_guard lock(mutex);
+  closed = true;
+  taken.swap(waiters);
+  return taken;
+}
+
+void TaskQueue::CoalesceGroup::detach(std::uint64_t id) {
+  std::function<void(TaskFailure)> on_failure;
+  bool last = false;
+  {
+    std::lock_guard lock(mutex);
+    auto it = std::find_if(waiters.begin(), waiters.end(),
+                           [id](const CoalesceWaiter &w) { return w.id == id; });
+    if (closed || it == waiters.end()) {
+      return;
+    }
+    on_failure = std::move(it->on_failure);
+    waiters.erase(it);
+    last = waiters.empty();
+    closed = last;
+  }
+  if (on_failure) {
+    on_failure(TaskFailure::kCancelled);
+  }
+  if (last) {
+    run->cancel();
+  }
+}
+
+// A queued run is dispatched until the latest deadline of its waiters;
+// expireWaitersUnlocked() fails the ones it has outlived.
+void TaskQueue::extendDeadlineUnlocked(std::uint64_t id, std::size_t cls,
+                                       TaskClock::time_point due) {
+  auto &bucket = buckets_[cls];
+  auto it = std::find_if(bucket.begin(), bucket.end(),
+                         [id](const Entry &e) { return e.task.id == id; });
+  if (it == bucket.end() || it->due >= due) {
+    return;
+  }
+  it->due = due;
+  it->task.deadline = due == kNoDeadline ? std::nullopt : std::optional(due);
+  std::make_heap(bucket.begin(), bucket.end(), servedAfter);
+}
+
+// At dispatch: drops waiters of the run `id` whose own deadline has passed.
+void TaskQueue::expireWaitersUnlocked(std::uint64_t id, TaskClock::time_point now) {
+  auto key_it = coalesce_key_.find(id);
+  if (key_it == coalesce_key_.end()) {
+    return;
+  }
+  auto entry_it = coalesce_.find(key_it->second);
+  if (entry_it == coalesce_.end() || entry_it->second.task_id != id) {
+    return;
+  }
+  auto &group = *entry_it->second.group;
+  std::lock_guard group_lock(group.mutex);
+  auto live_end = std::partition(group.waiters.begin(), group.waiters.end(),
+                                 [now](const CoalesceWaiter &w) { return w.due >= now; });
+  for (auto it = live_end; it != group.waiters.end(); ++it) {
+    expired_count_++;
+    if (it->on_failure) {
+      failed_.emplace_back(std::move(it->on_failure), TaskFailure::kExpired);
+    }
+  }
+  group.waiters.erase(live_end, group.waiters.end());
+}
+
+void TaskQueue::releaseTaskUnlocked(std::uint64_t id) {
+  tokens_.erase(id);
+  if (journal_) {
+    journal_->recordCompleted(id);
+  }
+  auto key_it = coalesce_key_.find(id);
+  if (key_it == coalesce_key_.end()) {
+    return;
+  }
+  auto entry_it = coalesce_.find(key_it->second);
+  // A newer primary may already own the key if our group closed early.
+  if (entry_it != coalesce_.end() && entry_it->second.task_id == id) {
+    coalesce_.erase(entry_it);
+  }
+  coalesce_key_.erase(key_it);
+}
+
 bool TaskQueue::canRunUnlocked() const {
   if (paused_) {
     return false;
@@ -151,57 +637,318 @@ bool TaskQueue::canRunUnlocked() const {
   if (!guard_ || !guard_->canAcceptWork()) {
     return false;
   }
-  for (const auto &q : queues_) {
-    for (const auto &task : q) {
-      auto max_it = config_.max_concurrent.find(task.type);
-      std::size_t limit =
-          max_it == config_.max_concurrent.end() ? 0 : max_it->second;
-      if (running_.at(task.type) < limit) {
-        return true;
-      }
-    }
-  }
-  return false;
+  return (nonempty_mask_ & runnable_mask_) != 0;
 }
 
 std::optional<Task> TaskQueue::popNextTaskUnlocked() {
-  if (auto t = findReadyTask(queues_[static_cast<std::size_t>(TaskPriority::kHigh)])) {
+  if (auto t = popFromPriorityUnlocked(kHighIdx)) {
     return t;
   }
 
   for (std::size_t i = 0; i < 2; ++i) {
     auto idx = rr_index_;
-    rr_index_ = idx == static_cast<std::size_t>(TaskPriority::kNormal)
-                    ? static_cast<std::size_t>(TaskPriority::kLow)
-                    : static_cast<std::size_t>(TaskPriority::kNormal);
-    if (auto t = findReadyTask(queues_[idx])) {
+    rr_index_ = idx == kNormalIdx ? kLowIdx : kNormalIdx;
+    if (auto t = popFromPriorityUnlocked(idx)) {
       return t;
     }
   }
   return std::nullopt;
 }
 
-std::optional<Task> TaskQueue::findReadyTask(std::deque<Task> &q) const {
-  for (auto it = q.begin(); it != q.end(); ++it) {
-    auto max_it = config_.max_concurrent.find(it->type);
-    std::size_t limit =
-        max_it == config_.max_concurrent.end() ? 0 : max_it->second;
-    if (running_.at(it->type) < limit) {
-      Task t = std::move(*it);
-      q.erase(it);
-      return t;
+// Within one priority the runnable task with the earliest (deadline, aged
+// cost, enqueue order) wins. Bucket heads are the only candidates; dead heads are dropped on
+// the way so nothing expired or cancelled is ever dispatched.
+std::optional<Task> TaskQueue::popFromPriorityUnlocked(std::size_t priority) {
+  const auto shift = priority * kTaskTypeCount;
+  const auto now = TaskClock::now();
+  std::uint32_t ready = ((nonempty_mask_ & runnable_mask_) >> shift) & kRowMask;
+
+  const Entry *best = nullptr;
+  std::size_t best_cls = 0;
+  while (ready != 0) {
+    auto cls = shift + static_cast<std::size_t>(std::countr_zero(ready));
+    ready &= ready - 1;
+    if (!dropIfDeadUnlocked(cls, now)) {
+      continue;
+    }
+    const Entry &front = buckets_[cls].front();
+    if (!best || servedAfter(*best, front)) {
+      best = &front;
+      best_cls = cls;
     }
   }
-  return std::nullopt;
+  if (!best) {
+    return std::nullopt;
+  }
+  return std::move(popBucketUnlocked(best_cls).task);
 }
 
-std::size_t TaskQueue::totalQueuedUnlocked() const {
-  std::size_t total = 0;
-  for (const auto &q : queues_) {
-    total += q.size();
+TaskQueue::Entry TaskQueue::popBucketUnlocked(std::size_t cls) {
+  auto &bucket = buckets_[cls];
+  std::pop_heap(bucket.begin(), bucket.end(), servedAfter);
+  Entry entry = std::move(bucket.back());
+  bucket.pop_back();
+  if (bucket.empty()) {
+    nonempty_mask_ &= ~(1u << cls);
   }
-  return total;
+  queued_[cls / kTaskTypeCount]--;
+  total_queued_--;
+  return entry;
 }
 
-}  // namespace vibenote
+// Drops expired or cancelled tasks from the head of a bucket. Returns whether
+// a live task remains at the head.
+bool TaskQueue::dropIfDeadUnlocked(std::size_t cls, TaskClock::time_point now) {
+  auto &bucket = buckets_[cls];
+  while (!bucket.empty()) {
+    const Entry &head = bucket.front();
+    const bool cancelled = head.task.cancel_token->isCancelled();
+    if (!cancelled && head.due >= now) {
+      return true;
+    }
+    if (cancelled) {
+      cancelled_count_++;
+    } else {
+      expired_count_++;
+    }
+    Task task = std::move(popBucketUnlocked(cls).task);
+    dropTaskUnlocked(task, cancelled ? TaskFailure::kCancelled : TaskFailure::kExpired);
+  }
+  return false;
+}
+
+void TaskQueue::dropTaskUnlocked(Task &task, TaskFailure failure) {
+  releaseTaskUnlocked(task.id);
+  if (task.on_failure) {
+    failed_.emplace_back(std::move(task.on_failure), failure);
+  }
+}
+
+std::vector<TaskQueue::Failure> TaskQueue::takeFailedUnlocked() {
+  std::vector<Failure> failed;
+  failed.swap(failed_);
+  return failed;
+}
+
+// Producers may call back into the queue (e.g. cancel sibling tasks), so
+// this runs only after mutex_ is released.
+void TaskQueue::notifyFailed(std::vector<Failure> failed) {
+  for (auto &[on_failure, failure] : failed) {
+    on_failure(failure);
+  }
+}
+
+// Full sweep used only when the queue is at capacity, so dead tasks buried
+// below live heads do not keep new work out.
+void TaskQueue::purgeDeadUnlocked() {
+  const auto now = TaskClock::now();
+  for (std::size_t cls = 0; cls < buckets_.size(); ++cls) {
+    auto &bucket = buckets_[cls];
+    auto live_end = std::partition(bucket.begin(), bucket.end(), [&](const Entry &e) {
+      return !e.task.cancel_token->isCancelled() && e.due >= now;
+    });
+    for (auto it = live_end; it != bucket.end(); ++it) {
+      const bool cancelled = it->task.cancel_token->isCancelled();
+      if (cancelled) {
+        cancelled_count_++;
+      } else {
+        expired_count_++;
+      }
+      dropTaskUnlocked(it->task, cancelled ? TaskFailure::kCancelled : TaskFailure::kExpired);
+    }
+    auto removed = static_cast<std::size_t>(std::distance(live_end, bucket.end()));
+    if (removed == 0) {
+      continue;
+    }
+    bucket.erase(live_end, bucket.end());
+    std::make_heap(bucket.begin(), bucket.end(), servedAfter);
+    if (bucket.empty()) {
+      nonempty_mask_ &= ~(1u << cls);
+    }
+    queued_[cls / kTaskTypeCount] -= removed;
+    total_queued_ -= removed;
+  }
+}
+
+// Refills the type's bucket and returns how long until it holds a whole
+// token; zero when a task may be admitted now.
+std::chrono::milliseconds TaskQueue::rateLimitWaitUnlocked(std::size_t type) {
+  const auto &limit = rate_limits_[type];
+  if (limit.rate <= 0.0) {
+    return std::chrono::milliseconds::zero();
+  }
+  const auto now = TaskClock::now();
+  auto &bucket = rate_buckets_[type];
+  const double elapsed = std::chrono::duration<double>(now - bucket.refilled).count();
+  bucket.tokens = std::min(limit.burst, bucket.tokens + elapsed * limit.rate);
+  bucket.refilled = now;
+  if (bucket.tokens >= 1.0) {
+    return std::chrono::milliseconds::zero();
+  }
+  return std::chrono::ceil<std::chrono::milliseconds>(
+      std::chrono::duration<double>((1.0 - bucket.tokens) / limit.rate));
+}
+
+// Every queued task of the same type at this or a higher priority, plus the
+// running ones, has to clear a slot first; slots free up every
+// service / limit on average.
+std::chrono::milliseconds TaskQueue::projectedWaitUnlocked(std::size_t type,
+                                                           std::size_t priority) const {
+  const double service = service_ewma_ms_[type];
+  if (service <= 0.0) {
+    return std::chrono::milliseconds::zero();
+  }
+  std::size_t ahead = running_[type];
+  for (std::size_t p = 0; p <= priority; ++p) {
+    ahead += buckets_[classIndex(p, type)].size();
+  }
+  const std::size_t slots = std::max<std::size_t>(limits_[type], 1);
+  if (ahead < slots) {
+    return std::chrono::milliseconds::zero();
+  }
+  return std::chrono::milliseconds(static_cast<std::int64_t>(
+      std::ceil(service * static_cast<double>(ahead - slots + 1) / static_cast<double>(slots))));
+}
+
+// A full queue admits again once a queued task is dispatched, i.e. when the
+// first running task of a type with a backlog finishes.
+std::chrono::milliseconds TaskQueue::queueRetryAfterUnlocked() const {
+  double best = 0.0;
+  for (std::size_t t = 0; t < kTaskTypeCount; ++t) {
+    if (service_ewma_ms_[t] <= 0.0 || running_[t] == 0 ||
+        (nonempty_mask_ & typeColumnMask(t)) == 0) {
+      continue;
+    }
+    const double next = service_ewma_ms_[t] / static_cast<double>(running_[t]);
+    best = best == 0.0 ? next : std::min(best, next);
+  }
+  if (best == 0.0) {
+    return kDefaultRetryAfter;
+  }
+  return std::chrono::milliseconds(static_cast<std::int64_t>(std::ceil(best)));
+}
+
+void TaskQueue::recordServiceTimeUnlocked(std::size_t type, TaskClock::duration elapsed) {
+  const double ms = std::chrono::duration<double, std::milli>(elapsed).count();
+  double &avg = service_ewma_ms_[type];
+  avg = avg == 0.0 ? ms : avg + kServiceAlpha * (ms - avg);
+}
+
+// Raised on any rejection or a deep queue. Cleared only once the queue is
+// shallow again and every rate-limited type could admit a task, so capture
+// does not bounce straight back to full speed into an empty token bucket.
+void TaskQueue::updateBackpressureUnlocked(bool rejected) {
+  const bool on = backpressure_.load(std::memory_order_relaxed);
+  const auto depth = static_cast<double>(total_queued_);
+  const auto max_depth = static_cast<double>(config_.max_queue_depth);
+  if (rejected || depth >= config_.backpressure_high * max_depth) {
+    if (!on) {
+      backpressure_.store(true, std::memory_order_release);
+    }
+    return;
+  }
+  if (!on || depth > config_.backpressure_low * max_depth) {
+    return;
+  }
+  for (std::size_t t = 0; t < kTaskTypeCount; ++t) {
+    if (rateLimitWaitUnlocked(t) > std::chrono::milliseconds::zero()) {
+      return;
+    }
+  }
+  backpressure_.store(false, std::memory_order_release);
+}
+
+void TaskQueue::notifyBackpressure() {
+  if (!backpressure_handler_ ||
+      backpressure_.load(std::memory_order_acquire) ==
+          backpressure_notified_.load(std::memory_order_acquire)) {
+    return;
+  }
+  std::lock_guard lock(notify_mutex_);
+  const bool state = backpressure_.load(std::memory_order_acquire);
+  if (state == backpressure_notified_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  backpressure_notified_.store(state, std::memory_order_release);
+  backpressure_handler_(state);
+}
+
+// Returns the preempt token of the running slot a just-queued task should
+// take over, if any: the task is a kHigh non-preemptible inference task, its
+// own type has room, but every shared inference slot is busy. The most
+// recently started preemptible slot loses the least work. Nothing is
+// preempted while admission is paused: the kHigh task could not run either.
+std::shared_ptr<CancellationToken> TaskQueue::pickPreemptionVictimUnlocked(std::size_t type,
+                                                                          std::size_t priority) {
+  if (priority != kHighIdx || !inference_[type] || preemptible_[type] ||
+      config_.max_inference == 0 || inference_share_ <= 0.0 ||
+      inference_running_ < sharedSlotsUnlocked() || running_[type] >= limits_[type]) {
+    return nullptr;
+  }
+  // Only as many victims as waiting kHigh tasks that their own limits let run.
+  std::size_t waiting = 0;
+  for (std::size_t t = 0; t < kTaskTypeCount; ++t) {
+    if (inference_[t] && !preemptible_[t] && running_[t] < limits_[t]) {
+      waiting += std::min(buckets_[classIndex(kHighIdx, t)].size(), limits_[t] - running_[t]);
+    }
+  }
+  if (waiting <= preempted_slots_.size()) {
+    return nullptr;
+  }
+  const Inflight *victim = nullptr;
+  for (const auto &[id, inflight] : inflight_) {
+    if (!inflight.preempt || id != inflight.slot || preempted_slots_.count(id) > 0) {
+      continue;
+    }
+    if (!victim || inflight.started > victim->started) {
+      victim = &inflight;
+    }
+  }
+  if (!victim) {
+    return nullptr;
+  }
+  preempted_slots_.insert(victim->slot);
+  preemptions_++;
+  return victim->preempt;
+}
 
+void TaskQueue::markRunningUnlocked(TaskType type, std::ptrdiff_t delta) {
+  auto t = static_cast<std::size_t>(type);
+  running_[t] = static_cast<std::size_t>(static_cast<std::ptrdiff_t>(running_[t]) + delta);
+  if (inference_[t]) {
+    inference_running_ =
+        static_cast<std::size_t>(static_cast<std::ptrdiff_t>(inference_running_) + delta);
+  }
+  updateRunnableMaskUnlocked();
+}
+
+std::size_t TaskQueue::sharedSlotsUnlocked() const {
+  if (inference_share_ <= 0.0) {
+    return 0;
+  }
+  if (config_.max_inference == 0) {
+    return std::numeric_limits<std::size_t>::max();
+  }
+  const auto allowed = static_cast<std::size_t>(
+      std::ceil(inference_share_ * static_cast<double>(config_.max_inference)));
+  return std::clamp<std::size_t>(allowed, 1, config_.max_inference);
+}
+
+std::size_t TaskQueue::extraBatchSlotsUnlocked(TaskType type, std::size_t tasks) const {
+  if (!inference_[static_cast<std::size_t>(type)] || config_.max_inference == 0 || tasks == 0) {
+    return 0;
+  }
+  return std::min(tasks, config_.max_inference) - 1;
+}
+
+void TaskQueue::updateRunnableMaskUnlocked() {
+  const bool shared_free = inference_running_ < sharedSlotsUnlocked();
+  runnable_mask_ = 0;
+  for (std::size_t t = 0; t < kTaskTypeCount; ++t) {
+    if (running_[t] < limits_[t] && (shared_free || !inference_[t])) {
+      runnable_mask_ |= typeColumnMask(t);
+    }
+  }
+}
+
+}  // namespace vibenote
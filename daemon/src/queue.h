@@ -0,0 +1,435 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+class GpuGuard;
+
+namespace vibenote {
+
+class QueueJournal;
+class QueueMetrics;
+
+enum class TaskType { kWatch, kInteractive, kExport, kCount };
+
+enum class TaskPriority { kHigh = 0, kNormal = 1, kLow = 2, kCount };
+
+inline constexpr std::size_t kTaskTypeCount = static_cast<std::size_t>(TaskType::kCount);
+inline constexpr std::size_t kTaskPriorityCount =
+    static_cast<std::size_t>(TaskPriority::kCount);
+
+using TaskClock = std::chrono::steady_clock;
+
+// Why a task ended without its callback running; see Task::on_failure.
+enum class TaskFailure {
+  kExpired,    // still queued at its deadline
+  kCancelled,  // cancelled before it finished
+  kDropped,    // preempted, and the queue was too full to take it back
+  kError,      // its handler threw or none is registered
+};
+
+// Shared between whoever produced a task and whoever is running it. Handlers
+// register hooks that abort in-flight work (e.g. a llama generation).
+class CancellationToken {
+ public:
+  // Returns false if the token was already cancelled.
+  bool cancel();
+  bool isCancelled() const { return cancelled_.load(std::memory_order_acquire); }
+  // Runs `hook` on cancel(), or right away if the token is already cancelled.
+  void onCancel(std::function<void()> hook);
+
+ private:
+  std::atomic<bool> cancelled_{false};
+  std::mutex mutex_;
+  std::vector<std::function<void()>> hooks_;
+};
+
+struct Task {
+  std::uint64_t id{};
+  TaskType type{TaskType::kInteractive};
+  TaskPriority priority{TaskPriority::kNormal};
+  std::string prompt;
+  // Optional constraint on a summary's output: a GBNF grammar, or a JSON
+  // schema (as JSON text) the backend turns into one. Tasks only coalesce
+  // when these match too.
+  std::string grammar;
+  std::string json_schema;
+  // Receives the finished result of the task (summary text, export payload).
+  std::function<void(const std::string &)> callback;
+  // Runs instead of `callback` when the task ends without a result, so a
+  // producer waiting on it can answer or clean up. Never runs under the
+  // queue lock.
+  std::function<void(TaskFailure)> on_failure;
+  // Tasks still queued past their deadline are dropped instead of dispatched.
+  std::optional<TaskClock::time_point> deadline;
+  // Filled in by TaskQueue::enqueue() when the producer does not supply one.
+  std::shared_ptr<CancellationToken> cancel_token;
+  // Estimated prompt tokens; computed at enqueue when left at zero.
+  std::size_t estimated_cost{0};
+  // Set by TaskQueue at dispatch for preemptible types. Fires when a
+  // high-priority task needs the slot; the handler should stop generating and
+  // requeue() the task with what it produced so far in partial_output. Tasks
+  // dispatched together in one batch share the token.
+  std::shared_ptr<CancellationToken> preempt_token;
+  // Output generated before a preemption; a resumed run continues after it.
+  // Left empty for grammar- or schema-constrained tasks, which cannot resume
+  // mid-output and rerun from the start.
+  std::string partial_output;
+  // Lifecycle timestamps stamped by TaskQueue; completion is observed in
+  // taskCompleted().
+  TaskClock::time_point enqueued_at;
+  TaskClock::time_point dispatched_at;
+};
+
+// Token bucket for one task type: `rate` tasks per second on average, with
+// bursts of up to `burst`. A zero rate leaves the type unlimited.
+struct RateLimit {
+  double rate{0.0};
+  double burst{1.0};
+};
+
+struct QueueConfig {
+  std::size_t max_queue_depth{128};
+  std::unordered_map<TaskType, std::size_t> max_concurrent;
+  // Attach tasks whose normalized prompt matches a pending or running task of
+  // the same type and priority to that task instead of queuing a duplicate.
+  bool coalesce_prompts{true};
+  // Types whose tasks dequeueBatch() may group into one concurrency slot.
+  std::unordered_set<TaskType> batchable{TaskType::kWatch};
+  // Watch tasks come from screen capture and can flood the queue; everything
+  // else is user-driven and unlimited by default.
+  std::unordered_map<TaskType, RateLimit> rate_limits{{TaskType::kWatch, RateLimit{1.0, 8.0}}};
+  // Backpressure is raised when a task is rejected or this share of
+  // max_queue_depth is queued, and cleared once the queue drains below
+  // backpressure_low.
+  double backpressure_high{0.75};
+  double backpressure_low{0.5};
+  // Maps a prompt to its cost in tokens, e.g. through the model's tokenizer.
+  // Unset uses a byte ratio calibrated for llama-family vocabularies.
+  std::function<std::size_t(const std::string &)> cost_estimator;
+  // Shortest-job-first with aging: a task without a deadline is ranked as if
+  // it had arrived this much later per estimated token. Cheap tasks overtake
+  // expensive ones, but never by more than cost * aging_per_token, so large
+  // jobs cannot starve. Zero keeps plain FIFO order.
+  std::chrono::microseconds aging_per_token{250};
+  // Slots shared by every type in `inference_types`, e.g. the llama server's
+  // parallel slots. Zero leaves only the per-type max_concurrent limits.
+  std::size_t max_inference{0};
+  std::unordered_set<TaskType> inference_types{TaskType::kWatch, TaskType::kInteractive};
+  // When a kHigh task of another inference type finds every shared slot busy,
+  // the most recently started running task of one of these types is preempted.
+  std::unordered_set<TaskType> preemptible{TaskType::kWatch};
+};
+
+// Outcome of TaskQueue::tryEnqueue().
+struct Admission {
+  enum class Result { kAccepted, kCoalesced, kQueueFull, kRateLimited };
+
+  Result result{Result::kAccepted};
+  // Rejections: how long until the same task would likely be admitted.
+  std::chrono::milliseconds retry_after{0};
+  // Accepted tasks: projected time before the task starts running.
+  std::chrono::milliseconds projected_wait{0};
+
+  bool accepted() const { return result == Result::kAccepted || result == Result::kCoalesced; }
+};
+
+// Priority scheduler in front of the inference and export workers.
+//
+// Queued tasks live in one bucket per (priority, type) class. Two bitmaps
+// track which classes are non-empty and which task types are below their
+// concurrency limit, so checking for runnable work and picking the next task
+// never walk the queued tasks themselves. Each bucket is a min-heap on
+// (deadline, aged cost, enqueue order): tasks with a deadline are served
+// earliest deadline first, tasks without one follow shortest-job-first with
+// aging (see QueueConfig::aging_per_token).
+//
+// Admission is rate limited per task type with token buckets. Service times
+// of completed tasks feed an EWMA per type, from which the queue projects how
+// long a new task will wait and when a rejected one is worth retrying.
+class TaskQueue {
+ public:
+  TaskQueue(GpuGuard *guard, QueueConfig cfg);
+
+  // Returns true when the task was queued or coalesced onto an identical one;
+  // a coalesced task's callback receives the shared result and its own id is
+  // never dispatched.
+  bool enqueue(Task task);
+  // Like enqueue() but reports why a task was rejected and when to retry.
+  // Coalescing is tried first: a coalesced task is neither turned away by a
+  // full queue nor charged a rate-limit token.
+  Admission tryEnqueue(Task task);
+  // Like tryEnqueue() for further tasks of work that was already admitted
+  // once, e.g. the later chunks of one map-reduce job: they are not charged
+  // against their type's rate limit again.
+  Admission tryEnqueueAdmitted(Task task);
+  // Queues work that was already admitted once (e.g. replayed from the
+  // journal or resumed after preemption) without charging its type's rate
+  // limit. Never coalesces: the task's callback already fans out to any
+  // waiters it had.
+  bool requeue(Task task);
+  // Blocks until a task may run. Returns a default-constructed Task once stop()
+  // has been called.
+  Task dequeue();
+  // Like dequeue() but gives up after `timeout`; returns nullopt on timeout or stop.
+  std::optional<Task> dequeue(std::chrono::milliseconds timeout);
+  // Dequeues like dequeue(timeout), then, for batchable types, tops the result
+  // up with further live tasks of the same type and priority: at most
+  // `max_tasks` in total and, beyond the first, no more than `max_tokens` of
+  // estimated prompt tokens. The batch occupies one concurrency slot of its
+  // type and, for inference types, one shared slot per task up to
+  // max_inference, as the backend spreads its prompts over that many; it only
+  // grows while those slots are free. They are released when every task in
+  // it has completed. Empty on timeout or stop.
+  std::vector<Task> dequeueBatch(std::size_t max_tasks, std::size_t max_tokens,
+                                 std::chrono::milliseconds timeout);
+  void taskCompleted(std::uint64_t id);
+  // Cancels a queued or running task. Queued tasks are dropped at dispatch;
+  // running ones see their token's hooks fire. A task coalesced with others
+  // is only detached from them; their shared run stops once every one of them
+  // is cancelled. Returns false if unknown.
+  bool cancel(std::uint64_t id);
+  void setPaused(bool paused);
+  // Runs only this share of max_inference slots (at least one while it is
+  // above zero, none at zero), as decided by GpuGuard's admission control.
+  // Running tasks are not interrupted when the share shrinks.
+  void setInferenceShare(double share);
+  // Records every accepted task and its completion or drop in `journal`.
+  // Attach after replaying the journal so replayed tasks are logged afresh.
+  void setJournal(QueueJournal *journal);
+  // Feeds queue-wait and service-time histograms. Attach before use.
+  void setMetrics(QueueMetrics *metrics);
+  // `handler(true)` fires when producers should slow down, `handler(false)`
+  // once the queue has drained. It runs on the enqueuing or dequeuing thread,
+  // never under the queue lock. Register before any task is enqueued.
+  void backpressureChanged(std::function<void(bool)> handler);
+  // Expected time before a task of this type and priority would start, based
+  // on the tasks ahead of it and recent service times.
+  std::chrono::milliseconds projectedWait(TaskType type, TaskPriority priority) const;
+  // Wakes every blocked dequeue() and makes further calls return immediately.
+  void stop();
+
+  // Process-wide unique task id for producers that do not bring their own.
+  std::uint64_t nextTaskId() { return next_id_.fetch_add(1, std::memory_order_relaxed); }
+
+  // Whitespace- and case-folded prompt that coalescing compares; also the
+  // input SummaryCache hashes.
+  static std::string normalizePrompt(std::string_view prompt);
+  // Prompt tokens by a byte ratio calibrated for llama-family vocabularies,
+  // for when no tokenizer is at hand.
+  static std::size_t estimateTokens(std::string_view prompt);
+
+  struct Stats {
+    std::array<std::size_t, kTaskPriorityCount> queued{};
+    std::unordered_map<TaskType, std::size_t> running;
+    std::size_t expired{0};    // dropped at dispatch because the deadline passed
+    std::size_t cancelled{0};  // cancelled while queued or running
+    std::size_t coalesce_lookups{0};  // enqueues eligible for coalescing
+    std::size_t coalesce_hits{0};     // of those, attached to an existing task
+    std::size_t rejected_full{0};
+    std::size_t rejected_rate{0};
+    std::size_t preemptions{0};
+    bool backpressure{false};
+    double inference_share{1.0};
+    std::array<double, kTaskTypeCount> service_ms{};  // EWMA, 0 until the first sample
+
+    double coalesceHitRate() const {
+      return coalesce_lookups == 0
+                 ? 0.0
+                 : static_cast<double>(coalesce_hits) / static_cast<double>(coalesce_lookups);
+    }
+  };
+
+  Stats getStats() const;
+
+ private:
+  struct Entry {
+    TaskClock::time_point due;
+    TaskClock::time_point rank;  // enqueue time + estimated_cost * aging_per_token
+    std::uint64_t seq{};
+    Task task;
+  };
+  // Heap comparator: the entry with the earliest (due, rank, seq) sits at front().
+  static bool servedAfter(const Entry &a, const Entry &b) {
+    if (a.due != b.due) {
+      return a.due > b.due;
+    }
+    return a.rank != b.rank ? a.rank > b.rank : a.seq > b.seq;
+  }
+
+  // One bit per (priority, type) class; bit index is priority * kTaskTypeCount + type.
+  using ClassMask = std::uint32_t;
+  static_assert(kTaskPriorityCount * kTaskTypeCount <= sizeof(ClassMask) * 8);
+
+  static constexpr std::size_t classIndex(std::size_t priority, std::size_t type) {
+    return priority * kTaskTypeCount + type;
+  }
+
+  // Tasks sharing one inference. Each waiter keeps its id, deadline and
+  // cancel token: cancelling it detaches only that waiter, and the shared run
+  // stops once none is left. Closed once the result or failure has been
+  // fanned out, or the last waiter is gone, so late arrivals queue a fresh
+  // task instead.
+  struct CoalesceWaiter {
+    std::uint64_t id{};
+    std::function<void(const std::string &)> callback;
+    std::function<void(TaskFailure)> on_failure;
+    TaskClock::time_point due;
+  };
+  struct CoalesceGroup {
+    std::mutex mutex;
+    bool closed{false};
+    std::string prompt;  // normalized, guards against hash collisions
+    std::vector<CoalesceWaiter> waiters;
+    std::vector<std::uint64_t> ids;  // every waiter ever attached, to clear tokens_
+    std::shared_ptr<CancellationToken> run;  // the shared run's cancel token
+    // Closes the group and hands its waiters to the caller.
+    std::vector<CoalesceWaiter> close();
+    // Fails waiter `id` as cancelled and cancels the run if it was the last.
+    void detach(std::uint64_t id);
+  };
+  struct CoalesceEntry {
+    std::uint64_t task_id{};
+    std::shared_ptr<CoalesceGroup> group;
+  };
+  struct CoalesceKey {
+    std::uint64_t hash{};
+    std::string prompt;
+  };
+  // A waiter's own token, hooked to detach it once mutex_ is released.
+  struct WaiterHook {
+    std::shared_ptr<CancellationToken> token;
+    std::shared_ptr<CoalesceGroup> group;
+    std::uint64_t id{};
+  };
+
+  Admission admit(Task task, bool charge_rate, bool coalesce);
+  // Nullopt for tasks that never coalesce.
+  static std::optional<CoalesceKey> coalesceKey(const Task &task);
+  bool joinCoalesceGroupUnlocked(Task &task, const CoalesceKey &key, WaiterHook &hook);
+  void startCoalesceGroupUnlocked(Task &task, CoalesceKey key, WaiterHook &hook);
+  std::vector<CoalesceWaiter> closeCoalesceGroup(CoalesceGroup &group);
+  void extendDeadlineUnlocked(std::uint64_t id, std::size_t cls, TaskClock::time_point due);
+  void expireWaitersUnlocked(std::uint64_t id, TaskClock::time_point now);
+  void pushTaskUnlocked(Task task);
+  void releaseTaskUnlocked(std::uint64_t id);
+
+  // on_failure hooks of tasks dropped under mutex_; run once it is released.
+  using Failure = std::pair<std::function<void(TaskFailure)>, TaskFailure>;
+  void dropTaskUnlocked(Task &task, TaskFailure failure);
+  std::vector<Failure> takeFailedUnlocked();
+  static void notifyFailed(std::vector<Failure> failed);
+
+  struct Inflight {
+    TaskType type{};
+    TaskPriority priority{};
+    std::uint64_t slot{};  // id of the first task of the batch it ran in
+    TaskClock::time_point started;
+    std::shared_ptr<CancellationToken> preempt;  // null unless the type is preemptible
+    std::shared_ptr<CancellationToken> cancel;   // the run's, not a coalesced waiter's
+    std::size_t batch_size{1};  // tasks dispatched in the same slot
+  };
+
+  struct TokenBucket {
+    double tokens{0.0};
+    TaskClock::time_point refilled;
+  };
+
+  bool canRunUnlocked() const;
+  std::optional<Task> takeNextTaskUnlocked();
+  void fillBatchUnlocked(std::vector<Task> &batch, std::size_t cls, std::size_t max_tasks,
+                         std::size_t max_tokens, TaskClock::time_point now);
+  std::optional<Task> popNextTaskUnlocked();
+  std::optional<Task> popFromPriorityUnlocked(std::size_t priority);
+  Entry popBucketUnlocked(std::size_t cls);
+  bool dropIfDeadUnlocked(std::size_t cls, TaskClock::time_point now);
+  void purgeDeadUnlocked();
+  void markRunningUnlocked(TaskType type, std::ptrdiff_t delta);
+  void updateRunnableMaskUnlocked();
+  // Shared inference slots currently allowed; SIZE_MAX when unlimited.
+  std::size_t sharedSlotsUnlocked() const;
+  // Shared slots a batch of `tasks` occupies beyond those of its first task.
+  std::size_t extraBatchSlotsUnlocked(TaskType type, std::size_t tasks) const;
+  std::shared_ptr<CancellationToken> pickPreemptionVictimUnlocked(std::size_t type,
+                                                                 std::size_t priority);
+  std::chrono::milliseconds rateLimitWaitUnlocked(std::size_t type);
+  std::chrono::milliseconds projectedWaitUnlocked(std::size_t type, std::size_t priority) const;
+  std::chrono::milliseconds queueRetryAfterUnlocked() const;
+  void recordServiceTimeUnlocked(std::size_t type, TaskClock::duration elapsed);
+  void updateBackpressureUnlocked(bool rejected);
+  void notifyBackpressure();
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+
+  std::array<std::vector<Entry>, kTaskPriorityCount * kTaskTypeCount> buckets_;
+  std::array<std::size_t, kTaskPriorityCount> queued_{};
+  std::size_t total_queued_{0};
+  std::uint64_t next_seq_{0};
+
+  ClassMask nonempty_mask_{0};  // classes with at least one queued task
+  ClassMask runnable_mask_{0};  // classes whose type is below its concurrency limit
+
+  std::array<std::size_t, kTaskTypeCount> running_{};
+  std::array<std::size_t, kTaskTypeCount> limits_{};
+  std::array<bool, kTaskTypeCount> inference_{};
+  std::array<bool, kTaskTypeCount> preemptible_{};
+  std::size_t inference_running_{0};
+  double inference_share_{1.0};
+  // Slots whose preempt token fired and that have not been released yet, so
+  // one waiting task does not preempt several victims.
+  std::unordered_set<std::uint64_t> preempted_slots_;
+  std::size_t preemptions_{0};
+  std::unordered_map<std::uint64_t, Inflight> inflight_;
+  std::unordered_map<std::uint64_t, std::size_t> slot_refs_;  // tasks still running per slot
+  // Tokens of every queued and running task, for cancel(id).
+  std::unordered_map<std::uint64_t, std::shared_ptr<CancellationToken>> tokens_;
+  std::size_t expired_count_{0};
+  std::size_t cancelled_count_{0};
+  std::vector<Failure> failed_;
+
+  // Keyed by hash of (normalized prompt, type, priority); coalesce_key_ maps a
+  // primary task back to its key so it can be forgotten when it finishes.
+  std::unordered_map<std::uint64_t, CoalesceEntry> coalesce_;
+  std::unordered_map<std::uint64_t, std::uint64_t> coalesce_key_;
+  std::size_t coalesce_lookups_{0};
+  std::size_t coalesce_hits_{0};
+
+  std::array<RateLimit, kTaskTypeCount> rate_limits_{};
+  std::array<TokenBucket, kTaskTypeCount> rate_buckets_{};
+  std::array<double, kTaskTypeCount> service_ewma_ms_{};
+  std::size_t rejected_full_{0};
+  std::size_t rejected_rate_{0};
+
+  // backpressure_ is the state decided under mutex_; notify_mutex_ serialises
+  // handler calls so they are delivered in order and only on a change.
+  std::atomic<bool> backpressure_{false};
+  std::mutex notify_mutex_;
+  std::atomic<bool> backpressure_notified_{false};
+  std::function<void(bool)> backpressure_handler_;
+
+  GpuGuard *guard_;
+  QueueJournal *journal_{nullptr};
+  QueueMetrics *metrics_{nullptr};
+  QueueConfig config_;
+  bool paused_{false};
+  bool stopped_{false};
+  std::atomic<std::uint64_t> next_id_{1};
+  std::size_t rr_index_{static_cast<std::size_t>(TaskPriority::kNormal)};  // rotate normal/low
+};
+
+}  // namespace vibenote
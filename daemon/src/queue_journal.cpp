@@ -0,0 +1,582 @@
+#include "queue_journal.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+
+#include "logging.h"
+
+namespace vibenote {
+
+namespace {
+
+// File layout: 16-byte header, then 8-byte aligned records. A record is
+//   u32 length   total record bytes, 0 marks the end of the log
+//   u32 crc      CRC-32 over everything from `kind` to the end of the payload
+//   u8  kind, u8 type, u8 priority, u8 reserved
+//   u32 prompt_size
+//   u64 id
+//   i64 deadline in wall-clock ms since epoch, -1 for none
+//   u32 grammar_size, u32 schema_size, u32 partial_size, u32 reserved
+//   prompt, grammar, json_schema and partial_output bytes, zero padded
+constexpr std::array<char, 8> kMagic{'V', 'N', 'Q', 'J', '0', '0', '0', '2'};
+// Version 1 records carried only the prompt; such a journal is started afresh.
+constexpr std::array<char, 8> kMagicV1{'V', 'N', 'Q', 'J', '0', '0', '0', '1'};
+constexpr std::size_t kHeaderSize = 16;
+constexpr std::size_t kRecordFixed = 48;
+constexpr std::size_t kCrcStart = 8;
+// Where the sizes of prompt, grammar, json_schema and partial_output are
+// stored; their bytes follow the fixed part in this order.
+constexpr std::array<std::size_t, 4> kFieldSizeOffsets{12, 32, 36, 40};
+
+constexpr std::uint8_t kKindEnqueue = 1;
+constexpr std::uint8_t kKindCompleted = 2;
+
+constexpr std::size_t align8(std::size_t n) { return (n + 7) & ~std::size_t{7}; }
+
+constexpr std::array<std::uint32_t, 256> makeCrcTable() {
+  std::array<std::uint32_t, 256> table{};
+  for (std::uint32_t i = 0; i < 256; ++i) {
+    std::uint32_t c = i;
+    for (int k = 0; k < 8; ++k) {
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    table[i] = c;
+  }
+  return table;
+}
+
+constexpr auto kCrcTable = makeCrcTable();
+
+std::uint32_t crc32(const std::uint8_t *data, std::size_t size) {
+  std::uint32_t c = 0xFFFFFFFFu;
+  for (std::size_t i = 0; i < size; ++i) {
+    c = kCrcTable[(c ^ data[i]) & 0xFFu] ^ (c >> 8);
+  }
+  return c ^ 0xFFFFFFFFu;
+}
+
+template <typename T>
+T load(const std::uint8_t *p) {
+  T value;
+  std::memcpy(&value, p, sizeof(T));
+  return value;
+}
+
+template <typename T>
+void store(std::uint8_t *p, T value) {
+  std::memcpy(p, &value, sizeof(T));
+}
+
+// Bytes following the fixed part of the record at `rec`.
+std::size_t payloadSize(const std::uint8_t *rec) {
+  std::size_t size = 0;
+  for (std::size_t offset : kFieldSizeOffsets) {
+    size += load<std::uint32_t>(rec + offset);
+  }
+  return size;
+}
+
+std::size_t payloadSize(const Task &task) {
+  return task.prompt.size() + task.grammar.size() + task.json_schema.size() +
+         task.partial_output.size();
+}
+
+std::int64_t wallClockMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// Encodes a record at `dst`, which must have align8(kRecordFixed +
+// payloadSize(task)) zeroed bytes available. The length field is written last.
+void encodeRecord(std::uint8_t *dst, std::uint8_t kind, const Task &task) {
+  const bool enqueue = kind == kKindEnqueue;
+  const auto payload_size = enqueue ? payloadSize(task) : 0;
+  const auto length = align8(kRecordFixed + payload_size);
+  std::int64_t deadline_ms = -1;
+  if (enqueue && task.deadline) {
+    deadline_ms = wallClockMs() + std::chrono::duration_cast<std::chrono::milliseconds>(
+                                      *task.deadline - TaskClock::now())
+                                      .count();
+  }
+  dst[8] = kind;
+  dst[9] = static_cast<std::uint8_t>(task.type);
+  dst[10] = static_cast<std::uint8_t>(task.priority);
+  store<std::uint64_t>(dst + 16, task.id);
+  store<std::int64_t>(dst + 24, deadline_ms);
+  if (enqueue) {
+    std::uint8_t *out = dst + kRecordFixed;
+    const std::string *fields[] = {&task.prompt, &task.grammar, &task.json_schema,
+                                   &task.partial_output};
+    for (std::size_t i = 0; i < kFieldSizeOffsets.size(); ++i) {
+      store<std::uint32_t>(dst + kFieldSizeOffsets[i],
+                           static_cast<std::uint32_t>(fields[i]->size()));
+      std::memcpy(out, fields[i]->data(), fields[i]->size());
+      out += fields[i]->size();
+    }
+  }
+  store<std::uint32_t>(dst + 4, crc32(dst + kCrcStart, kRecordFixed - kCrcStart + payload_size));
+  store<std::uint32_t>(dst, static_cast<std::uint32_t>(length));
+}
+
+}  // namespace
+
+QueueJournal::QueueJournal(std::string path) : QueueJournal(std::move(path), Options{}) {}
+
+QueueJournal::QueueJournal(std::string path, Options options)
+    : path_(std::move(path)), options_(options) {}
+
+QueueJournal::~QueueJournal() {
+  stop();
+  close();
+}
+
+bool QueueJournal::open() {
+  std::lock_guard lock(mutex_);
+  fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd_ < 0) {
+    LOG_ERROR("Cannot open queue journal" << path_.c_str() << ":" << std::strerror(errno));
+    return false;
+  }
+  struct stat st {};
+  if (::fstat(fd_, &st) != 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  bool fresh = st.st_size == 0;
+  auto size = static_cast<std::size_t>(st.st_size);
+  if (fresh) {
+    size = std::max(options_.initial_size, kHeaderSize + kRecordFixed);
+    if (::ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+      ::close(fd_);
+      fd_ = -1;
+      return false;
+    }
+  } else if (size < kHeaderSize) {
+    LOG_ERROR("Queue journal" << path_.c_str() << "is truncated");
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  if (!mapFile(size)) {
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  if (!fresh && std::memcmp(map_, kMagicV1.data(), kMagicV1.size()) == 0) {
+    LOG_WARNING("Queue journal" << path_.c_str() << "has an older format; starting a new one");
+    std::memset(map_, 0, map_size_);
+    fresh = true;
+  }
+  if (fresh) {
+    std::memcpy(map_, kMagic.data(), kMagic.size());
+  } else if (std::memcmp(map_, kMagic.data(), kMagic.size()) != 0) {
+    LOG_ERROR("Queue journal" << path_.c_str() << "has an unknown format");
+    unmapFile();
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  std::size_t off = kHeaderSize;
+  while (off + kRecordFixed <= map_size_) {
+    const auto *rec = map_ + off;
+    const auto length = load<std::uint32_t>(rec);
+    if (length == 0) {
+      break;
+    }
+    const auto payload_size = payloadSize(rec);
+    const bool sane = length % 8 == 0 && length >= kRecordFixed && off + length <= map_size_ &&
+                      kRecordFixed + payload_size <= length;
+    if (!sane || load<std::uint32_t>(rec + 4) !=
+                     crc32(rec + kCrcStart, kRecordFixed - kCrcStart + payload_size)) {
+      // Torn tail from a crash mid-append: drop it and everything after.
+      torn_records_++;
+      std::memset(map_ + off, 0, map_size_ - off);
+      break;
+    }
+    const auto id = load<std::uint64_t>(rec + 16);
+    if (rec[8] == kKindEnqueue) {
+      live_[id] = Span{off, length};
+      live_bytes_ += length;
+    } else if (rec[8] == kKindCompleted) {
+      auto it = live_.find(id);
+      if (it != live_.end()) {
+        live_bytes_ -= it->second.length;
+        live_.erase(it);
+      }
+    }
+    off += length;
+  }
+  write_offset_.store(off, std::memory_order_release);
+  synced_offset_ = off;
+  return true;
+}
+
+void QueueJournal::close() {
+  std::lock_guard lock(mutex_);
+  std::unique_lock map_lock(map_mutex_);
+  if (map_) {
+    ::msync(map_, write_offset_.load(std::memory_order_acquire), MS_SYNC);
+  }
+  epoch_++;
+  unmapFile();
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool QueueJournal::mapFile(std::size_t size) {
+  void *addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (addr == MAP_FAILED) {
+    LOG_ERROR("Cannot map queue journal:" << std::strerror(errno));
+    return false;
+  }
+  map_ = static_cast<std::uint8_t *>(addr);
+  map_size_ = size;
+  return true;
+}
+
+void QueueJournal::unmapFile() {
+  if (map_) {
+    ::munmap(map_, map_size_);
+    map_ = nullptr;
+    map_size_ = 0;
+  }
+}
+
+std::vector<Task> QueueJournal::replay() const {
+  std::lock_guard lock(mutex_);
+  std::vector<Span> spans;
+  spans.reserve(live_.size());
+  for (const auto &entry : live_) {
+    spans.push_back(entry.second);
+  }
+  std::sort(spans.begin(), spans.end(),
+            [](const Span &a, const Span &b) { return a.offset < b.offset; });
+
+  const auto now_ms = wallClockMs();
+  const auto now = TaskClock::now();
+  std::vector<Task> tasks;
+  tasks.reserve(spans.size());
+  for (const auto &span : spans) {
+    const auto *rec = map_ + span.offset;
+    Task task;
+    task.type = static_cast<TaskType>(rec[9]);
+    task.priority = static_cast<TaskPriority>(rec[10]);
+    task.id = load<std::uint64_t>(rec + 16);
+    const auto deadline_ms = load<std::int64_t>(rec + 24);
+    if (deadline_ms >= 0) {
+      task.deadline = now + std::chrono::milliseconds(deadline_ms - now_ms);
+    }
+    const auto *in = reinterpret_cast<const char *>(rec + kRecordFixed);
+    std::string *fields[] = {&task.prompt, &task.grammar, &task.json_schema,
+                             &task.partial_output};
+    for (std::size_t i = 0; i < kFieldSizeOffsets.size(); ++i) {
+      const auto size = load<std::uint32_t>(rec + kFieldSizeOffsets[i]);
+      fields[i]->assign(in, size);
+      in += size;
+    }
+    tasks.push_back(std::move(task));
+  }
+  return tasks;
+}
+
+void QueueJournal::reset() {
+  std::lock_guard lock(mutex_);
+  std::unique_lock map_lock(map_mutex_);
+  if (!map_) {
+    return;
+  }
+  const auto end = write_offset_.load(std::memory_order_acquire);
+  std::memset(map_ + kHeaderSize, 0, end - kHeaderSize);
+  ::msync(map_, end, MS_SYNC);
+  live_.clear();
+  live_bytes_ = 0;
+  epoch_++;
+  write_offset_.store(kHeaderSize, std::memory_order_release);
+  synced_offset_ = kHeaderSize;
+}
+
+bool QueueJournal::ensureCapacityLocked(std::size_t needed) {
+  const auto end = write_offset_.load(std::memory_order_relaxed) + needed;
+  if (end + sizeof(std::uint32_t) <= map_size_) {
+    return true;
+  }
+  const auto new_size = std::max(map_size_ * 2, align8(end + sizeof(std::uint32_t)));
+  std::unique_lock map_lock(map_mutex_);
+  if (::ftruncate(fd_, static_cast<off_t>(new_size)) != 0) {
+    LOG_ERROR("Cannot grow queue journal:" << std::strerror(errno));
+    return false;
+  }
+  void *addr = ::mremap(map_, map_size_, new_size, MREMAP_MAYMOVE);
+  if (addr == MAP_FAILED) {
+    LOG_ERROR("Cannot remap queue journal:" << std::strerror(errno));
+    return false;
+  }
+  map_ = static_cast<std::uint8_t *>(addr);
+  map_size_ = new_size;
+  return true;
+}
+
+void QueueJournal::recordEnqueue(const Task &task) {
+  std::lock_guard lock(mutex_);
+  const auto length = align8(kRecordFixed + payloadSize(task));
+  if (!map_ || !ensureCapacityLocked(length)) {
+    return;
+  }
+  const auto off = write_offset_.load(std::memory_order_relaxed);
+  encodeRecord(map_ + off, kKindEnqueue, task);
+  live_[task.id] = Span{off, length};
+  live_bytes_ += length;
+  write_offset_.store(off + length, std::memory_order_release);
+}
+
+void QueueJournal::recordCompleted(std::uint64_t id) {
+  std::lock_guard lock(mutex_);
+  auto it = live_.find(id);
+  if (it == live_.end() || !ensureCapacityLocked(kRecordFixed)) {
+    return;
+  }
+  live_bytes_ -= it->second.length;
+  live_.erase(it);
+
+  Task marker;
+  marker.id = id;
+  const auto off = write_offset_.load(std::memory_order_relaxed);
+  encodeRecord(map_ + off, kKindCompleted, marker);
+  write_offset_.store(off + kRecordFixed, std::memory_order_release);
+}
+
+void QueueJournal::start() {
+  std::lock_guard lock(sync_mutex_);
+  if (sync_running_) {
+    return;
+  }
+  sync_running_ = true;
+  sync_thread_ = std::thread([this] { syncLoop(); });
+}
+
+void QueueJournal::stop() {
+  {
+    std::lock_guard lock(sync_mutex_);
+    if (!sync_running_) {
+      return;
+    }
+    sync_running_ = false;
+  }
+  sync_cv_.notify_all();
+  if (sync_thread_.joinable()) {
+    sync_thread_.join();
+  }
+  sync();
+}
+
+void QueueJournal::syncLoop() {
+  std::unique_lock lock(sync_mutex_);
+  while (sync_running_) {
+    sync_cv_.wait_for(lock, options_.sync_interval, [this] { return !sync_running_; });
+    lock.unlock();
+    sync();
+    bool compact_now = false;
+    {
+      std::lock_guard state_lock(mutex_);
+      compact_now = shouldCompactLocked();
+    }
+    if (compact_now) {
+      compact();
+    }
+    lock.lock();
+  }
+}
+
+void QueueJournal::sync() {
+  // Shared lock only: appends keep going while the dirty pages are flushed.
+  std::shared_lock map_lock(map_mutex_);
+  if (!map_) {
+    return;
+  }
+  const auto end = write_offset_.load(std::memory_order_acquire);
+  const auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  std::size_t start = 0;
+  {
+    std::lock_guard lock(sync_offset_mutex_);
+    if (end <= synced_offset_) {
+      return;
+    }
+    start = synced_offset_ / page * page;
+  }
+  if (::msync(map_ + start, end - start, MS_SYNC) != 0) {
+    // Leave the range dirty so the next sync retries it.
+    LOG_WARNING("Queue journal msync failed:" << std::strerror(errno));
+    return;
+  }
+  std::lock_guard lock(sync_offset_mutex_);
+  synced_offset_ = std::max(synced_offset_, end);
+}
+
+bool QueueJournal::shouldCompactLocked() const {
+  const auto used = write_offset_.load(std::memory_order_relaxed) - kHeaderSize;
+  if (used < options_.compact_min_bytes) {
+    return false;
+  }
+  const auto dead = used - live_bytes_;
+  return static_cast<double>(dead) > options_.compact_dead_ratio * static_cast<double>(used);
+}
+
+// Compaction holds mutex_ only twice, briefly: to snapshot the live records
+// and to install the new file. In between, appends go on while the snapshot
+// is copied out and synced. Records are never rewritten in place, so the
+// snapshot stays valid; whatever was appended meanwhile (enqueues and
+// completions alike) is copied over verbatim at install time.
+bool QueueJournal::compact() {
+  std::lock_guard compact_lock(compact_mutex_);
+  std::vector<std::pair<std::uint64_t, Span>> ordered;
+  std::size_t snapshot_end = 0;
+  std::uint64_t epoch = 0;
+  std::size_t new_size = 0;
+  {
+    std::lock_guard lock(mutex_);
+    if (!map_) {
+      return false;
+    }
+    ordered.assign(live_.begin(), live_.end());
+    snapshot_end = write_offset_.load(std::memory_order_relaxed);
+    epoch = epoch_;
+    new_size = std::max(options_.initial_size, align8(kHeaderSize + 2 * live_bytes_ + 8));
+  }
+  std::sort(ordered.begin(), ordered.end(),
+            [](const auto &a, const auto &b) { return a.second.offset < b.second.offset; });
+
+  const std::string tmp_path = path_ + ".compact";
+  int tmp_fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (tmp_fd < 0) {
+    LOG_WARNING("Cannot create compacted queue journal:" << std::strerror(errno));
+    return false;
+  }
+  void *addr = MAP_FAILED;
+  if (::ftruncate(tmp_fd, static_cast<off_t>(new_size)) == 0) {
+    addr = ::mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, tmp_fd, 0);
+  }
+  const auto discard = [&] {
+    if (addr != MAP_FAILED) {
+      ::munmap(addr, new_size);
+    }
+    ::close(tmp_fd);
+    ::unlink(tmp_path.c_str());
+  };
+  if (addr == MAP_FAILED) {
+    LOG_WARNING("Cannot size compacted queue journal:" << std::strerror(errno));
+    discard();
+    return false;
+  }
+  auto *dst = static_cast<std::uint8_t *>(addr);
+  std::memcpy(dst, kMagic.data(), kMagic.size());
+
+  std::unordered_map<std::uint64_t, std::size_t> moved;
+  moved.reserve(ordered.size());
+  std::size_t off = kHeaderSize;
+  {
+    // Shared: keeps the old mapping in place without blocking appends.
+    std::shared_lock map_lock(map_mutex_);
+    if (epoch != epoch_) {
+      discard();
+      return false;
+    }
+    for (const auto &[id, span] : ordered) {
+      std::memcpy(dst + off, map_ + span.offset, span.length);
+      moved.emplace(id, off);
+      off += span.length;
+    }
+  }
+  if (::msync(dst, off, MS_SYNC) != 0 || ::fsync(tmp_fd) != 0) {
+    LOG_WARNING("Cannot write compacted queue journal:" << std::strerror(errno));
+    discard();
+    return false;
+  }
+
+  {
+    std::lock_guard lock(mutex_);
+    std::unique_lock map_lock(map_mutex_);
+    if (!map_ || epoch != epoch_) {
+      discard();
+      return false;
+    }
+    const auto end = write_offset_.load(std::memory_order_relaxed);
+    const auto tail = end - snapshot_end;
+    const auto needed = align8(off + tail + sizeof(std::uint32_t));
+    if (needed > new_size) {
+      const auto grown = std::max(new_size * 2, needed);
+      void *remapped = MAP_FAILED;
+      if (::ftruncate(tmp_fd, static_cast<off_t>(grown)) == 0) {
+        remapped = ::mremap(addr, new_size, grown, MREMAP_MAYMOVE);
+      }
+      if (remapped == MAP_FAILED) {
+        LOG_WARNING("Cannot grow compacted queue journal:" << std::strerror(errno));
+        discard();
+        return false;
+      }
+      addr = remapped;
+      dst = static_cast<std::uint8_t *>(addr);
+      new_size = grown;
+    }
+    std::memcpy(dst + off, map_ + snapshot_end, tail);
+    if ((tail > 0 && ::msync(dst, off + tail, MS_SYNC) != 0) ||
+        ::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+      LOG_WARNING("Cannot install compacted queue journal:" << std::strerror(errno));
+      discard();
+      return false;
+    }
+    for (auto &[id, span] : live_) {
+      if (span.offset >= snapshot_end) {
+        span.offset = span.offset - snapshot_end + off;
+      } else {
+        span.offset = moved.at(id);
+      }
+    }
+    unmapFile();
+    ::close(fd_);
+    fd_ = tmp_fd;
+    map_ = dst;
+    map_size_ = new_size;
+    write_offset_.store(off + tail, std::memory_order_release);
+    {
+      std::lock_guard sync_lock(sync_offset_mutex_);
+      synced_offset_ = off + tail;
+    }
+    compactions_++;
+  }
+
+  // Persist the rename itself. Appends made before this lands are at risk
+  // like any other not-yet-synced append.
+  auto slash = path_.find_last_of('/');
+  std::string dir = slash == std::string::npos ? std::string(".") : path_.substr(0, slash + 1);
+  int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0) {
+    ::fsync(dir_fd);
+    ::close(dir_fd);
+  }
+  return true;
+}
+
+QueueJournal::Stats QueueJournal::getStats() const {
+  std::lock_guard lock(mutex_);
+  Stats stats;
+  stats.live_tasks = live_.size();
+  stats.file_bytes = map_size_;
+  stats.live_bytes = live_bytes_;
+  stats.compactions = compactions_;
+  stats.torn_records = torn_records_;
+  return stats;
+}
+
+}  // namespace vibenote
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "queue.h"
+
+namespace vibenote {
+
+// Append-only, memory-mapped log of queued and completed tasks so work that
+// was accepted survives a daemon crash.
+//
+// Appends are a memcpy into a shared mapping under a mutex; the file is only
+// grown (ftruncate + mremap) when the mapping fills up. A background thread
+// flushes the dirty range with msync on a timer (group commit), so a crash can
+// lose at most one sync interval of enqueues. The same thread compacts the
+// file by rewriting only the still-live enqueue records once completed
+// records dominate it. Records carry a CRC so a torn tail is detected and
+// discarded on replay.
+class QueueJournal {
+ public:
+  struct Options {
+    std::chrono::milliseconds sync_interval{50};
+    std::size_t initial_size{4 * 1024 * 1024};
+    // Compact when dead bytes exceed this share of the file and this size.
+    double compact_dead_ratio{0.5};
+    std::size_t compact_min_bytes{1024 * 1024};
+  };
+
+  struct Stats {
+    std::size_t live_tasks{0};
+    std::size_t file_bytes{0};
+    std::size_t live_bytes{0};
+    std::size_t compactions{0};
+    std::size_t torn_records{0};  // discarded at open because of a bad CRC
+  };
+
+  explicit QueueJournal(std::string path);
+  QueueJournal(std::string path, Options options);
+  ~QueueJournal();
+
+  QueueJournal(const QueueJournal &) = delete;
+  QueueJournal &operator=(const QueueJournal &) = delete;
+
+  // Maps the journal, creating it if needed, and indexes the existing
+  // records. Returns false if the file cannot be opened or is not a journal.
+  bool open();
+  void close();
+
+  // Tasks enqueued but never completed, in original enqueue order, with
+  // their prompt, output constraints and partial output. Callbacks are not
+  // persisted; deadlines are restored relative to the wall clock.
+  std::vector<Task> replay() const;
+  // Forgets every record. To replay, requeue the tasks with the journal
+  // attached and retire each old id with recordCompleted() instead, so a
+  // crash in between loses nothing.
+  void reset();
+
+  void recordEnqueue(const Task &task);
+  void recordCompleted(std::uint64_t id);
+
+  // Starts/stops the group-commit and compaction thread.
+  void start();
+  void stop();
+  // Flushes everything appended so far to disk.
+  void sync();
+  // Rewrites the file with only the live records. Appends are not held up
+  // while the new file is written and synced.
+  bool compact();
+
+  Stats getStats() const;
+
+ private:
+  struct Span {
+    std::size_t offset{};
+    std::size_t length{};
+  };
+
+  bool mapFile(std::size_t size);
+  void unmapFile();
+  bool ensureCapacityLocked(std::size_t needed);
+  void syncLoop();
+  bool shouldCompactLocked() const;
+
+  std::string path_;
+  Options options_;
+
+  int fd_{-1};
+  std::uint8_t *map_{nullptr};
+  std::size_t map_size_{0};
+
+  // mutex_ serialises appends and bookkeeping; map_mutex_ is held shared
+  // while msync or compaction reads the mapping and exclusively while it is
+  // replaced.
+  mutable std::mutex mutex_;
+  mutable std::shared_mutex map_mutex_;
+  std::mutex compact_mutex_;
+  // Bumped under both locks when the records are dropped (reset, close), so
+  // a compaction that started before knows its snapshot is stale.
+  std::uint64_t epoch_{0};
+  std::atomic<std::size_t> write_offset_{0};
+  std::mutex sync_offset_mutex_;
+  std::size_t synced_offset_{0};
+  std::unordered_map<std::uint64_t, Span> live_;
+  std::size_t live_bytes_{0};
+  std::size_t compactions_{0};
+  std::size_t torn_records_{0};
+
+  std::thread sync_thread_;
+  std::mutex sync_mutex_;
+  std::condition_variable sync_cv_;
+  bool sync_running_{false};
+};
+
+}  // namespace vibenote
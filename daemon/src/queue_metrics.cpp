@@ -0,0 +1,86 @@
+#include "queue_metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "metrics.h"
+
+namespace vibenote {
+
+namespace {
+
+constexpr std::array<const char *, kTaskTypeCount> kTypeNames{"watch", "interactive", "export"};
+constexpr std::array<const char *, kTaskPriorityCount> kPriorityNames{"high", "normal", "low"};
+
+void appendFamily(std::string &out, const char *name, const char *help,
+                  const std::array<LatencyHistogram, kTaskTypeCount * kTaskPriorityCount> &hists) {
+  appendFamilyHeader(out, name, "histogram", help);
+  char line[256];
+  for (std::size_t p = 0; p < kTaskPriorityCount; ++p) {
+    for (std::size_t t = 0; t < kTaskTypeCount; ++t) {
+      const auto snap = hists[p * kTaskTypeCount + t].snapshot();
+      const char *type = kTypeNames[t];
+      const char *prio = kPriorityNames[p];
+      std::uint64_t cumulative = 0;
+      for (std::size_t b = 0; b < LatencyHistogram::kBucketCount; ++b) {
+        cumulative += snap.buckets[b];
+        if (b < LatencyHistogram::kBoundsNs.size()) {
+          std::snprintf(line, sizeof(line),
+                        "%s_bucket{type=\"%s\",priority=\"%s\",le=\"%g\"} %llu\n", name, type,
+                        prio, static_cast<double>(LatencyHistogram::kBoundsNs[b]) / 1e9,
+                        static_cast<unsigned long long>(cumulative));
+        } else {
+          std::snprintf(line, sizeof(line),
+                        "%s_bucket{type=\"%s\",priority=\"%s\",le=\"+Inf\"} %llu\n", name, type,
+                        prio, static_cast<unsigned long long>(cumulative));
+        }
+        out += line;
+      }
+      std::snprintf(line, sizeof(line),
+                    "%s_sum{type=\"%s\",priority=\"%s\"} %.9g\n"
+                    "%s_count{type=\"%s\",priority=\"%s\"} %llu\n",
+                    name, type, prio, snap.sum_seconds, name, type, prio,
+                    static_cast<unsigned long long>(cumulative));
+      out += line;
+    }
+  }
+}
+
+}  // namespace
+
+void LatencyHistogram::observe(TaskClock::duration elapsed) {
+  const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  const auto bucket = static_cast<std::size_t>(
+      std::lower_bound(kBoundsNs.begin(), kBoundsNs.end(), ns) - kBoundsNs.begin());
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  sum_ns_.fetch_add(static_cast<std::uint64_t>(std::max<std::int64_t>(ns, 0)),
+                    std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+  Snapshot snap;
+  for (std::size_t b = 0; b < kBucketCount; ++b) {
+    snap.buckets[b] = buckets_[b].load(std::memory_order_relaxed);
+    snap.count += snap.buckets[b];
+  }
+  snap.sum_seconds = static_cast<double>(sum_ns_.load(std::memory_order_relaxed)) / 1e9;
+  return snap;
+}
+
+void QueueMetrics::recordWait(TaskType type, TaskPriority priority, TaskClock::duration elapsed) {
+  wait_[index(type, priority)].observe(elapsed);
+}
+
+void QueueMetrics::recordService(TaskType type, TaskPriority priority,
+                                 TaskClock::duration elapsed) {
+  service_[index(type, priority)].observe(elapsed);
+}
+
+void QueueMetrics::serialize(std::string &out) const {
+  appendFamily(out, "vibenote_queue_wait_seconds",
+               "Time tasks spent queued between enqueue and dispatch.", wait_);
+  appendFamily(out, "vibenote_task_service_seconds",
+               "Time tasks spent running between dispatch and completion.", service_);
+}
+
+}  // namespace vibenote
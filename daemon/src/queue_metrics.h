@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "queue.h"
+
+namespace vibenote {
+
+// Fixed-bucket latency histogram. observe() is a couple of relaxed atomic
+// increments, so it can be called from any thread, inside the queue's
+// critical section, without locking or allocating.
+class LatencyHistogram {
+ public:
+  // Upper bounds of the finite buckets, in nanoseconds; an implicit +Inf
+  // bucket follows. Spans sub-millisecond dispatch to minute-long exports.
+  static constexpr std::array<std::int64_t, 18> kBoundsNs{
+      100'000,        250'000,        500'000,        1'000'000,      2'500'000,
+      5'000'000,      10'000'000,     25'000'000,     50'000'000,     100'000'000,
+      250'000'000,    500'000'000,    1'000'000'000,  2'500'000'000,  5'000'000'000,
+      10'000'000'000, 30'000'000'000, 60'000'000'000};
+  static constexpr std::size_t kBucketCount = kBoundsNs.size() + 1;
+
+  void observe(TaskClock::duration elapsed);
+
+  struct Snapshot {
+    std::array<std::uint64_t, kBucketCount> buckets{};  // per bucket, not cumulative
+    std::uint64_t count{0};
+    double sum_seconds{0.0};
+  };
+  // Not atomic as a whole: a concurrent observe() may show up in some fields
+  // and not others, which Prometheus scrapes tolerate.
+  Snapshot snapshot() const;
+
+ private:
+  std::array<std::atomic<std::uint64_t>, kBucketCount> buckets_{};
+  std::atomic<std::uint64_t> sum_ns_{0};
+};
+
+// Queue-wait (enqueue to dispatch) and service-time (dispatch to completion)
+// histograms for every task type and priority, fed by TaskQueue.
+class QueueMetrics {
+ public:
+  void recordWait(TaskType type, TaskPriority priority, TaskClock::duration elapsed);
+  void recordService(TaskType type, TaskPriority priority, TaskClock::duration elapsed);
+
+  // Appends both histogram families in the Prometheus text format.
+  void serialize(std::string &out) const;
+
+ private:
+  static std::size_t index(TaskType type, TaskPriority priority) {
+    return static_cast<std::size_t>(priority) * kTaskTypeCount + static_cast<std::size_t>(type);
+  }
+
+  std::array<LatencyHistogram, kTaskTypeCount * kTaskPriorityCount> wait_;
+  std::array<LatencyHistogram, kTaskTypeCount * kTaskPriorityCount> service_;
+};
+
+}  // namespace vibenote
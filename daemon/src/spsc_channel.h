@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace vibenote {
+
+// Bounded single-producer/single-consumer ring. One thread pushes and one
+// thread pops without locks: each side owns one index and publishes it with
+// release/acquire ordering, and keeps a cached copy of the other side's index
+// so the shared cache lines are only touched when the ring looks full/empty.
+template <typename T>
+class SpscChannel {
+ public:
+  // `capacity` is rounded up to a power of two.
+  explicit SpscChannel(std::size_t capacity) {
+    std::size_t size = 2;
+    while (size < capacity) size <<= 1;
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+
+  SpscChannel(const SpscChannel &) = delete;
+  SpscChannel &operator=(const SpscChannel &) = delete;
+
+  // Producer only. Moves from `value` and returns true if there was room.
+  bool tryPush(T &value) {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) return false;
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only.
+  bool tryPop(T &value) {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) return false;
+    }
+    value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  std::size_t capacity() const { return slots_.size(); }
+
+ private:
+  static constexpr std::size_t kCacheLine = 64;
+
+  std::vector<T> slots_;
+  std::size_t mask_{0};
+  alignas(kCacheLine) std::atomic<std::size_t> head_{0};  // written by the consumer
+  alignas(kCacheLine) std::size_t cached_tail_{0};        // consumer's view of tail_
+  alignas(kCacheLine) std::atomic<std::size_t> tail_{0};  // written by the producer
+  alignas(kCacheLine) std::size_t cached_head_{0};        // producer's view of head_
+};
+
+}  // namespace vibenote
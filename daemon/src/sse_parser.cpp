@@ -0,0 +1,468 @@
+#include "sse_parser.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace vibenote {
+
+namespace {
+
+std::size_t roundUpPow2(std::size_t n) {
+  std::size_t capacity = 64;
+  while (capacity < n) capacity <<= 1;
+  return capacity;
+}
+
+bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+char lower(char c) { return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c; }
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) return false;
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    if (lower(a[i]) != lower(b[i])) return false;
+  }
+  return true;
+}
+
+bool containsIgnoreCase(std::string_view haystack, std::string_view needle) {
+  if (needle.size() > haystack.size()) return false;
+  for (std::size_t i = 0; i + needle.size() <= haystack.size(); ++i) {
+    if (equalsIgnoreCase(haystack.substr(i, needle.size()), needle)) return true;
+  }
+  return false;
+}
+
+std::string_view trim(std::string_view s) {
+  while (!s.empty() && isSpace(s.front())) s.remove_prefix(1);
+  while (!s.empty() && isSpace(s.back())) s.remove_suffix(1);
+  return s;
+}
+
+int hexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c = lower(c);
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+bool parseHex4(std::string_view s, std::size_t at, std::uint32_t *value) {
+  if (at + 4 > s.size()) return false;
+  std::uint32_t v = 0;
+  for (std::size_t i = at; i < at + 4; ++i) {
+    const int d = hexDigit(s[i]);
+    if (d < 0) return false;
+    v = (v << 4) | static_cast<std::uint32_t>(d);
+  }
+  *value = v;
+  return true;
+}
+
+void appendUtf8(std::string &out, std::uint32_t cp) {
+  if (cp < 0x80) {
+    out.push_back(static_cast<char>(cp));
+  } else if (cp < 0x800) {
+    out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+  } else if (cp < 0x10000) {
+    out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+  } else {
+    out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+  }
+}
+
+// Decodes the body of a JSON string literal (without its quotes).
+bool unescape(std::string_view raw, std::string &out) {
+  out.clear();
+  std::size_t i = 0;
+  while (i < raw.size()) {
+    const std::size_t slash = raw.find('\\', i);
+    out.append(raw.substr(i, slash == std::string_view::npos ? raw.size() - i : slash - i));
+    if (slash == std::string_view::npos) break;
+    if (slash + 1 >= raw.size()) return false;
+    i = slash + 2;
+    switch (raw[slash + 1]) {
+      case '"': out.push_back('"'); break;
+      case '\\': out.push_back('\\'); break;
+      case '/': out.push_back('/'); break;
+      case 'b': out.push_back('\b'); break;
+      case 'f': out.push_back('\f'); break;
+      case 'n': out.push_back('\n'); break;
+      case 'r': out.push_back('\r'); break;
+      case 't': out.push_back('\t'); break;
+      case 'u': {
+        std::uint32_t cp = 0;
+        if (!parseHex4(raw, i, &cp)) return false;
+        i += 4;
+        std::uint32_t low = 0;
+        if (cp >= 0xD800 && cp < 0xDC00 && i + 1 < raw.size() && raw[i] == '\\' &&
+            raw[i + 1] == 'u' && parseHex4(raw, i + 2, &low) && low >= 0xDC00 && low < 0xE000) {
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+          i += 6;
+        } else if (cp >= 0xD800 && cp < 0xE000) {
+          cp = 0xFFFD;  // unpaired surrogate
+        }
+        appendUtf8(out, cp);
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+// Locates the string value of the member named `key` (given with quotes).
+// Returns false if the member is missing or not a string.
+bool findStringMember(std::string_view json, std::string_view key, std::string_view *raw,
+                      bool *escaped) {
+  std::size_t pos = 0;
+  while (pos < json.size()) {
+    // memmem skips ahead far faster than find(), whose first character ('"')
+    // occurs every few bytes in JSON.
+    const void *hit = ::memmem(json.data() + pos, json.size() - pos, key.data(), key.size());
+    if (hit == nullptr) return false;
+    pos = static_cast<std::size_t>(static_cast<const char *>(hit) - json.data());
+    std::size_t p = pos + key.size();
+    if (pos > 0 && json[pos - 1] == '\\') {
+      pos = p;
+      continue;
+    }
+    while (p < json.size() && isSpace(json[p])) ++p;
+    if (p >= json.size() || json[p] != ':') {
+      pos = p;  // the name appeared as a value
+      continue;
+    }
+    ++p;
+    while (p < json.size() && isSpace(json[p])) ++p;
+    if (p >= json.size() || json[p] != '"') return false;
+    const std::size_t start = ++p;
+    *escaped = false;
+    while (p < json.size()) {
+      if (json[p] == '"') {
+        *raw = json.substr(start, p - start);
+        return true;
+      }
+      if (json[p] == '\\') {
+        *escaped = true;
+        ++p;
+      }
+      ++p;
+    }
+    return false;
+  }
+  return false;
+}
+
+}  // namespace
+
+ByteRing::ByteRing(std::size_t capacity)
+    : buffer_(roundUpPow2(capacity)), mask_(buffer_.size() - 1) {}
+
+std::span<char> ByteRing::writable() {
+  if (size() == capacity()) grow();
+  const std::size_t start = static_cast<std::size_t>(tail_) & mask_;
+  const std::size_t head = static_cast<std::size_t>(head_) & mask_;
+  const std::size_t length = (start >= head) ? capacity() - start : head - start;
+  return {buffer_.data() + start, length};
+}
+
+void ByteRing::commit(std::size_t n) { tail_ += n; }
+
+void ByteRing::append(std::string_view data) {
+  while (!data.empty()) {
+    std::span<char> free = writable();
+    const std::size_t n = std::min(free.size(), data.size());
+    std::memcpy(free.data(), data.data(), n);
+    commit(n);
+    data.remove_prefix(n);
+  }
+}
+
+std::string_view ByteRing::readable() const {
+  const std::size_t start = static_cast<std::size_t>(head_) & mask_;
+  return {buffer_.data() + start, std::min(size(), capacity() - start)};
+}
+
+void ByteRing::consume(std::size_t n) {
+  head_ += n;
+  // Rewind when drained so the next read gets the whole buffer unwrapped.
+  if (head_ == tail_) head_ = tail_ = 0;
+}
+
+void ByteRing::grow() {
+  std::vector<char> bigger(buffer_.size() * 2);
+  const std::size_t used = size();
+  std::size_t copied = 0;
+  while (copied < used) {
+    const std::size_t start = static_cast<std::size_t>(head_ + copied) & mask_;
+    const std::size_t n = std::min(used - copied, capacity() - start);
+    std::memcpy(bigger.data() + copied, buffer_.data() + start, n);
+    copied += n;
+  }
+  buffer_.swap(bigger);
+  mask_ = buffer_.size() - 1;
+  head_ = 0;
+  tail_ = used;
+}
+
+void SseStreamParser::reset() {
+  ring_.clear();
+  state_ = State::kStatusLine;
+  frame_line_.clear();
+  body_line_.clear();
+  frame_line_used_ = false;
+  body_line_used_ = false;
+  status_ = 0;
+  keep_alive_ = true;
+  chunked_ = false;
+  content_length_ = kUnlimited;
+  remaining_ = 0;
+  scanned_ = 0;
+  done_ = false;
+}
+
+// Returns the next complete line (without CR/LF) from at most `*budget`
+// buffered bytes. An incomplete line is left in the ring and only the bytes
+// not yet searched are scanned on the next call; it is copied into `carry`
+// only when it runs into the end of the ring's storage or of the budget.
+bool SseStreamParser::takeLine(std::string &carry, bool &carry_used, std::uint64_t *budget,
+                               std::string_view *line) {
+  if (carry_used) {
+    carry.clear();
+    carry_used = false;
+  }
+  while (budget == nullptr || *budget > 0) {
+    if (ring_.size() <= scanned_) return false;  // nothing new since the last call
+    std::string_view avail = ring_.readable();
+    const bool limited = budget != nullptr && avail.size() > *budget;
+    if (limited) avail = avail.substr(0, static_cast<std::size_t>(*budget));
+    const char *newline = static_cast<const char *>(
+        std::memchr(avail.data() + scanned_, '\n', avail.size() - scanned_));
+    if (newline == nullptr && !limited && avail.size() == ring_.size()) {
+      if (carry.size() + avail.size() > kMaxLine) {
+        state_ = State::kError;
+        return false;
+      }
+      scanned_ = avail.size();
+      return false;
+    }
+    const std::size_t take =
+        newline ? static_cast<std::size_t>(newline - avail.data()) + 1 : avail.size();
+    // Consuming does not touch the bytes, so `avail` stays readable below.
+    ring_.consume(take);
+    scanned_ = 0;
+    if (budget != nullptr) *budget -= take;
+    if (newline == nullptr) {
+      if (carry.size() + take > kMaxLine) {
+        state_ = State::kError;
+        return false;
+      }
+      carry.append(avail);
+      continue;
+    }
+    std::string_view out = avail.substr(0, take - 1);
+    if (!carry.empty()) {
+      carry.append(out);
+      out = carry;
+      carry_used = true;
+    }
+    if (!out.empty() && out.back() == '\r') out.remove_suffix(1);
+    *line = out;
+    return true;
+  }
+  return false;
+}
+
+SseStreamParser::Event SseStreamParser::next(std::string_view *token) {
+  std::string_view line;
+  Event event = Event::kNeedMore;
+  while (true) {
+    switch (state_) {
+      case State::kStatusLine:
+        if (!takeLine(frame_line_, frame_line_used_, nullptr, &line)) return stalled();
+        if (line.empty()) break;  // stray CRLF between responses
+        if (!parseStatusLine(line)) return fail();
+        state_ = State::kHeaders;
+        break;
+
+      case State::kHeaders:
+        if (!takeLine(frame_line_, frame_line_used_, nullptr, &line)) return stalled();
+        if (!line.empty()) {
+          parseHeader(line);
+          break;
+        }
+        if (status_ < 200) {
+          state_ = State::kStatusLine;  // interim response; the real one follows
+          break;
+        }
+        return beginBody();
+
+      case State::kChunkSize: {
+        if (!takeLine(frame_line_, frame_line_used_, nullptr, &line)) return stalled();
+        line = trim(line.substr(0, line.find(';')));
+        if (line.empty() || line.size() > 15) return fail();
+        std::uint64_t size = 0;
+        for (char c : line) {
+          const int d = hexDigit(c);
+          if (d < 0) return fail();
+          size = (size << 4) | static_cast<std::uint64_t>(d);
+        }
+        if (size == 0) {
+          state_ = State::kTrailers;
+        } else {
+          remaining_ = size;
+          state_ = State::kChunkData;
+        }
+        break;
+      }
+
+      case State::kChunkData:
+      case State::kBody:
+        if (remaining_ == 0) {
+          if (state_ == State::kBody) return endMessage();
+          state_ = State::kChunkDataEnd;
+          break;
+        }
+        if (!takeLine(body_line_, body_line_used_, &remaining_, &line)) {
+          if (state_ == State::kError) return fail();
+          if (remaining_ == 0) break;  // the line continues in the next chunk
+          return Event::kNeedMore;
+        }
+        if (bodyLine(line, token, &event)) return event;
+        break;
+
+      case State::kChunkDataEnd:
+        if (!takeLine(frame_line_, frame_line_used_, nullptr, &line)) return stalled();
+        if (!line.empty()) return fail();
+        state_ = State::kChunkSize;
+        break;
+
+      case State::kTrailers:
+        if (!takeLine(frame_line_, frame_line_used_, nullptr, &line)) return stalled();
+        if (line.empty()) return endMessage();
+        break;
+
+      case State::kBodyUntilClose:
+        if (!takeLine(body_line_, body_line_used_, nullptr, &line)) return stalled();
+        if (bodyLine(line, token, &event)) return event;
+        break;
+
+      case State::kError:
+        return Event::kError;
+    }
+  }
+}
+
+bool SseStreamParser::bodyLine(std::string_view line, std::string_view *token, Event *event) {
+  // llama-server sends one `data:` line per event, so each line is handled as
+  // it completes rather than buffered until the blank separator line.
+  if (line.size() < 5 || line.compare(0, 5, "data:") != 0) return false;
+  std::string_view payload = line.substr(5);
+  if (!payload.empty() && payload.front() == ' ') payload.remove_prefix(1);
+  if (payload == "[DONE]") {
+    if (done_) return false;
+    done_ = true;
+    *event = Event::kDone;
+    return true;
+  }
+  if (!extractToken(payload, token_scratch_, token)) return false;
+  *event = Event::kToken;
+  return true;
+}
+
+bool SseStreamParser::extractToken(std::string_view json, std::string &scratch,
+                                   std::string_view *token) {
+  std::string_view raw;
+  bool escaped = false;
+  if (!findStringMember(json, "\"content\"", &raw, &escaped) || raw.empty()) {
+    if (!findStringMember(json, "\"text\"", &raw, &escaped) || raw.empty()) return false;
+  }
+  if (!escaped) {
+    *token = raw;
+    return true;
+  }
+  if (!unescape(raw, scratch)) return false;
+  *token = scratch;
+  return !scratch.empty();
+}
+
+bool SseStreamParser::parseStatusLine(std::string_view line) {
+  // HTTP/1.1 200 OK
+  if (line.size() < 12 || line.compare(0, 7, "HTTP/1.") != 0 || line[8] != ' ') return false;
+  int status = 0;
+  for (std::size_t i = 9; i < 12; ++i) {
+    if (line[i] < '0' || line[i] > '9') return false;
+    status = status * 10 + (line[i] - '0');
+  }
+  status_ = status;
+  keep_alive_ = line[7] != '0';
+  chunked_ = false;
+  content_length_ = kUnlimited;
+  return true;
+}
+
+void SseStreamParser::parseHeader(std::string_view line) {
+  const std::size_t colon = line.find(':');
+  if (colon == std::string_view::npos) return;
+  const std::string_view name = trim(line.substr(0, colon));
+  const std::string_view value = trim(line.substr(colon + 1));
+  if (equalsIgnoreCase(name, "transfer-encoding")) {
+    chunked_ = containsIgnoreCase(value, "chunked");
+  } else if (equalsIgnoreCase(name, "content-length")) {
+    std::uint64_t length = 0;
+    for (char c : value) {
+      if (c < '0' || c > '9') return;
+      length = length * 10 + static_cast<std::uint64_t>(c - '0');
+    }
+    content_length_ = length;
+  } else if (equalsIgnoreCase(name, "connection")) {
+    if (containsIgnoreCase(value, "close")) {
+      keep_alive_ = false;
+    } else if (containsIgnoreCase(value, "keep-alive")) {
+      keep_alive_ = true;
+    }
+  }
+}
+
+SseStreamParser::Event SseStreamParser::beginBody() {
+  done_ = false;
+  body_line_.clear();
+  body_line_used_ = false;
+  if (status_ == 204 || status_ == 304) {
+    remaining_ = 0;
+    state_ = State::kBody;
+  } else if (chunked_) {
+    state_ = State::kChunkSize;
+  } else if (content_length_ != kUnlimited) {
+    remaining_ = content_length_;
+    state_ = State::kBody;
+  } else {
+    keep_alive_ = false;
+    state_ = State::kBodyUntilClose;
+  }
+  return Event::kHeaders;
+}
+
+SseStreamParser::Event SseStreamParser::endMessage() {
+  body_line_.clear();
+  body_line_used_ = false;
+  state_ = State::kStatusLine;
+  return Event::kMessageEnd;
+}
+
+SseStreamParser::Event SseStreamParser::stalled() const {
+  return state_ == State::kError ? Event::kError : Event::kNeedMore;
+}
+
+SseStreamParser::Event SseStreamParser::fail() {
+  state_ = State::kError;
+  return Event::kError;
+}
+
+}  // namespace vibenote
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace vibenote {
+
+// Byte ring with power-of-two capacity. Socket reads land directly in
+// writable() and the parser scans readable() in place, so stream bytes are
+// not copied on their way to the token scanner. Grows (doubling) only when a
+// write finds it full.
+class ByteRing {
+ public:
+  explicit ByteRing(std::size_t capacity = 16 * 1024);
+
+  std::size_t size() const { return static_cast<std::size_t>(tail_ - head_); }
+  std::size_t capacity() const { return buffer_.size(); }
+  bool empty() const { return head_ == tail_; }
+
+  // Largest contiguous free region; follow with commit().
+  std::span<char> writable();
+  void commit(std::size_t n);
+  // Copies `data` in, for callers that already hold the bytes.
+  void append(std::string_view data);
+
+  // Largest contiguous region at the read position. Views stay valid until
+  // the next writable()/append().
+  std::string_view readable() const;
+  void consume(std::size_t n);
+  void clear() { head_ = tail_ = 0; }
+
+ private:
+  void grow();
+
+  std::vector<char> buffer_;
+  std::size_t mask_;
+  std::uint64_t head_{0};
+  std::uint64_t tail_{0};
+};
+
+// Incremental parser for llama-server streaming responses on a keep-alive
+// connection: HTTP/1.1 status line and headers, chunked or Content-Length
+// framing, SSE `data:` lines, and the generated text inside each event.
+//
+// It is a pull parser: feed bytes into ring(), then call next() until it
+// returns kNeedMore. Every byte is searched once; lines are handed out as
+// views into the ring and only copied when they straddle a chunk boundary or
+// the end of the ring's storage. Tokens are found with a targeted scan for the `content`
+// (or `text`) string field instead of parsing the event into a DOM.
+// Successive responses on the same connection are parsed back to back.
+class SseStreamParser {
+ public:
+  enum class Event {
+    kNeedMore,    // everything buffered has been consumed
+    kHeaders,     // status() and keepAlive() are valid
+    kToken,       // *token holds the next piece of generated text
+    kDone,        // `data: [DONE]` seen
+    kMessageEnd,  // response fully read; the connection is free again
+    kError,       // malformed framing; the connection must be dropped
+  };
+
+  SseStreamParser() = default;
+
+  ByteRing &ring() { return ring_; }
+
+  // Advances to the next event. A token view stays valid until the next
+  // call to next() or write into the ring.
+  Event next(std::string_view *token);
+
+  int status() const { return status_; }
+  bool keepAlive() const { return keep_alive_; }
+  // Forgets all buffered bytes and state, e.g. for a new connection.
+  void reset();
+
+  // Finds the string value of the first `"content"` (or, failing that,
+  // `"text"`) member in an OpenAI- or llama-style stream event and decodes
+  // JSON escapes into `scratch` when needed. Returns false if there is none
+  // or it is empty.
+  static bool extractToken(std::string_view json, std::string &scratch,
+                           std::string_view *token);
+
+ private:
+  enum class State {
+    kStatusLine,
+    kHeaders,
+    kChunkSize,
+    kChunkData,
+    kChunkDataEnd,
+    kTrailers,
+    kBody,           // Content-Length framing
+    kBodyUntilClose, // no framing: the body ends with the connection
+    kError,
+  };
+
+  static constexpr std::size_t kMaxLine = 1024 * 1024;
+  static constexpr std::uint64_t kUnlimited = ~std::uint64_t{0};
+
+  bool takeLine(std::string &carry, bool &carry_used, std::uint64_t *budget,
+                std::string_view *line);
+  bool bodyLine(std::string_view line, std::string_view *token, Event *event);
+  bool parseStatusLine(std::string_view line);
+  void parseHeader(std::string_view line);
+  Event beginBody();
+  Event endMessage();
+  Event stalled() const;
+  Event fail();
+
+  ByteRing ring_;
+  State state_{State::kStatusLine};
+  // Partial lines carried across boundaries; framing and body lines are kept
+  // apart because a body line may span chunks.
+  std::string frame_line_;
+  std::string body_line_;
+  bool frame_line_used_{false};
+  bool body_line_used_{false};
+  std::string token_scratch_;
+  std::size_t scanned_{0};  // bytes at the ring head already searched for '\n'
+
+  int status_{0};
+  bool keep_alive_{true};
+  bool chunked_{false};
+  std::uint64_t content_length_{kUnlimited};
+  std::uint64_t remaining_{0};
+  bool done_{false};
+};
+
+}  // namespace vibenote
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace vibenote {
+
+// Write-behind queue: any thread submits items, one writer thread hands them
+// to `commit` in batches, so a store can write many rows per transaction
+// instead of paying a WAL commit for each. A batch goes out once it holds
+// max_batch items or its oldest item has waited max_delay. Each submit()
+// returns a future the commit function fulfils, typically with a row id.
+template <typename Item, typename Result>
+class GroupCommitQueue {
+ public:
+  struct Options {
+    std::size_t max_batch{256};
+    std::chrono::milliseconds max_delay{5};
+  };
+
+  struct Entry {
+    Item item;
+    std::promise<Result> result;
+  };
+
+  // Runs on the writer thread with each batch, in submission order, and
+  // sets every entry's result. Entries it leaves unset when it throws fail
+  // with that exception.
+  using Commit = std::function<void(std::vector<Entry> &batch)>;
+
+  GroupCommitQueue(Commit commit, Options options)
+      : commit_(std::move(commit)), options_(withMinBatch(options)), writer_([this] { run(); }) {}
+
+  // Commits everything still queued, then joins the writer.
+  ~GroupCommitQueue() {
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    writer_.join();
+  }
+
+  GroupCommitQueue(const GroupCommitQueue &) = delete;
+  GroupCommitQueue &operator=(const GroupCommitQueue &) = delete;
+
+  std::future<Result> submit(Item item) {
+    Pending pending{Entry{std::move(item), {}}, Clock::now()};
+    std::future<Result> result = pending.entry.result.get_future();
+    bool wake = false;
+    {
+      std::lock_guard lock(mutex_);
+      pending_.push_back(std::move(pending));
+      // The first item starts the writer's timer; after that only a full
+      // batch needs it sooner.
+      wake = pending_.size() == 1 || pending_.size() == options_.max_batch;
+    }
+    if (wake) {
+      cv_.notify_one();
+    }
+    return result;
+  }
+
+  std::uint64_t committedItems() const { return items_.load(std::memory_order_relaxed); }
+  std::uint64_t committedBatches() const { return batches_.load(std::memory_order_relaxed); }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Pending {
+    Entry entry;
+    Clock::time_point submitted;
+  };
+
+  static Options withMinBatch(Options options) {
+    options.max_batch = std::max<std::size_t>(1, options.max_batch);
+    return options;
+  }
+
+  void run() {
+    std::vector<Entry> batch;
+    std::unique_lock lock(mutex_);
+    for (;;) {
+      cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      cv_.wait_until(lock, pending_.front().submitted + options_.max_delay,
+                     [this] { return stopping_ || pending_.size() >= options_.max_batch; });
+      const auto count = static_cast<std::ptrdiff_t>(std::min(pending_.size(), options_.max_batch));
+      for (auto it = pending_.begin(); it != pending_.begin() + count; ++it) {
+        batch.push_back(std::move(it->entry));
+      }
+      pending_.erase(pending_.begin(), pending_.begin() + count);
+      lock.unlock();
+      commitBatch(batch);
+      batch.clear();
+      lock.lock();
+    }
+  }
+
+  void commitBatch(std::vector<Entry> &batch) {
+    // Counted first: once the promises are set, a caller may already read them.
+    items_.fetch_add(batch.size(), std::memory_order_relaxed);
+    batches_.fetch_add(1, std::memory_order_relaxed);
+    try {
+      commit_(batch);
+    } catch (...) {
+      const std::exception_ptr error = std::current_exception();
+      for (Entry &entry : batch) {
+        try {
+          entry.result.set_exception(error);
+        } catch (const std::future_error &) {
+          // Already set before the commit failed.
+        }
+      }
+    }
+  }
+
+  Commit commit_;
+  Options options_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Pending> pending_;
+  bool stopping_{false};
+
+  std::atomic<std::uint64_t> items_{0};
+  std::atomic<std::uint64_t> batches_{0};
+  std::thread writer_;  // last: starts once everything above exists
+};
+
+}  // namespace vibenote
@@ -55,4 +55,17 @@ CREATE TABLE metrics (
     PRIMARY KEY (metric_name, timestamp)
 );
 
+-- Summaries keyed by SHA-256 of (model, prompt template, normalized input);
+-- see SummaryCache. accessed_at orders eviction once the table exceeds its
+-- byte cap.
+CREATE TABLE IF NOT EXISTS summary_cache (
+    key TEXT PRIMARY KEY,
+    summary TEXT NOT NULL,
+    bytes INTEGER NOT NULL,
+    created_at INTEGER NOT NULL,
+    accessed_at INTEGER NOT NULL
+) WITHOUT ROWID;
+
+CREATE INDEX IF NOT EXISTS idx_summary_cache_accessed ON summary_cache (accessed_at);
+
 INSERT INTO schema_version VALUES (1, CURRENT_TIMESTAMP);
@@ -1,17 +1,24 @@
 #include <sqlite3.h>
 
+#include <QByteArray>
 #include <QFile>
 #include <QFileInfo>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QString>
+#include <QStringList>
 
+#include <future>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "logging.h"
+#include "store/group_commit_queue.h"
 
 namespace {
 // Expected schema version defined in schema.sql PRAGMA user_version
@@ -26,11 +33,29 @@ inline void finalize(sqlite3_stmt* stmt) {
 
 class SqliteStore {
 public:
-    explicit SqliteStore(const QString& dbPath);
+    // A note with its columns already encoded, so the writer thread only
+    // binds bytes.
+    struct PendingNote {
+        qint64 timestamp;
+        qint64 windowId;
+        QByteArray text;
+        QByteArray enrichedText;
+        QByteArray metadata;  // compact JSON
+    };
+    using NoteQueue = vibenote::GroupCommitQueue<PendingNote, qint64>;
+
+    explicit SqliteStore(const QString& dbPath, NoteQueue::Options ingest = {});
     ~SqliteStore();
 
+    // One autocommit INSERT on the calling thread.
     qint64 insertNote(qint64 timestamp, qint64 windowId, const QString& text,
                       const QString& enrichedText, const QJsonObject& metadata);
+    // Write-behind: queues the note for the ingest thread, which commits
+    // queued notes together in one transaction. The future yields the note's
+    // id once its transaction has committed, or the error that failed it.
+    // A windowId of 0 stores the note without a window.
+    std::future<qint64> enqueueNote(qint64 timestamp, qint64 windowId, const QString& text,
+                                    const QString& enrichedText, const QJsonObject& metadata);
 
     QJsonArray queryNotes(qint64 fromTs, qint64 toTs, const QString& appFilter,
                           int limit);
@@ -42,28 +67,51 @@ public:
 
     void vacuum();
 
+    // Backing table of SummaryCache.
+    std::optional<QString> lookupSummary(const QString& key, qint64 createdAfter,
+                                         qint64* createdAt);
+    void touchSummaries(const QStringList& keys, qint64 accessedAt);
+    void storeSummary(const QString& key, const QString& summary, qint64 createdAt);
+    qint64 pruneSummaries(qint64 createdBefore, qint64 maxBytes);
+
 private:
     void openDatabase(const QString& dbPath);
     void applyMigrations();
     void prepareStatements();
     void exec(const QString& sql);
+    static PendingNote encodeNote(qint64 timestamp, qint64 windowId, const QString& text,
+                                  const QString& enrichedText, const QJsonObject& metadata);
+    // Runs insertNoteStmt_ for `note`; mutex_ must be held.
+    qint64 stepInsertNote(const PendingNote& note);
+    void commitNotes(std::vector<NoteQueue::Entry>& batch);
 
     sqlite3* db_ {nullptr};
     sqlite3_stmt* insertNoteStmt_ {nullptr};
     sqlite3_stmt* insertWindowStmt_ {nullptr};
+    sqlite3_stmt* lookupSummaryStmt_ {nullptr};
+    sqlite3_stmt* touchSummaryStmt_ {nullptr};
+    sqlite3_stmt* storeSummaryStmt_ {nullptr};
 
     std::mutex mutex_;
+    std::unique_ptr<NoteQueue> ingest_;
 };
 
-SqliteStore::SqliteStore(const QString& dbPath) {
+SqliteStore::SqliteStore(const QString& dbPath, NoteQueue::Options ingest) {
     openDatabase(dbPath);
     applyMigrations();
     prepareStatements();
+    ingest_ = std::make_unique<NoteQueue>(
+        [this](std::vector<NoteQueue::Entry>& batch) { commitNotes(batch); }, ingest);
 }
 
 SqliteStore::~SqliteStore() {
+    // Commits what is still queued while the statements exist.
+    ingest_.reset();
     finalize(insertNoteStmt_);
     finalize(insertWindowStmt_);
+    finalize(lookupSummaryStmt_);
+    finalize(touchSummaryStmt_);
+    finalize(storeSummaryStmt_);
     if (db_) {
         sqlite3_close(db_);
     }
@@ -137,31 +185,106 @@ void SqliteStore::prepareStatements() {
             -1, &insertWindowStmt_, nullptr) != SQLITE_OK) {
         throw std::runtime_error("prepare insert_window failed");
     }
+    if (sqlite3_prepare_v2(
+            db_,
+            "SELECT summary, created_at FROM summary_cache"
+            " WHERE key = ? AND created_at >= ?;",
+            -1, &lookupSummaryStmt_, nullptr) != SQLITE_OK) {
+        throw std::runtime_error("prepare lookup_summary failed");
+    }
+    if (sqlite3_prepare_v2(
+            db_,
+            "UPDATE summary_cache SET accessed_at = ? WHERE key = ?;",
+            -1, &touchSummaryStmt_, nullptr) != SQLITE_OK) {
+        throw std::runtime_error("prepare touch_summary failed");
+    }
+    if (sqlite3_prepare_v2(
+            db_,
+            "INSERT INTO summary_cache(key, summary, bytes, created_at, accessed_at)"
+            " VALUES(?,?,?,?,?)"
+            " ON CONFLICT(key) DO UPDATE SET summary=excluded.summary,"
+            " bytes=excluded.bytes, created_at=excluded.created_at,"
+            " accessed_at=excluded.accessed_at;",
+            -1, &storeSummaryStmt_, nullptr) != SQLITE_OK) {
+        throw std::runtime_error("prepare store_summary failed");
+    }
+}
+
+SqliteStore::PendingNote SqliteStore::encodeNote(qint64 timestamp, qint64 windowId,
+                                                const QString& text,
+                                                const QString& enrichedText,
+                                                const QJsonObject& metadata) {
+    return PendingNote{timestamp, windowId, text.toUtf8(), enrichedText.toUtf8(),
+                       QJsonDocument(metadata).toJson(QJsonDocument::Compact)};
+}
+
+qint64 SqliteStore::stepInsertNote(const PendingNote& note) {
+    // The encoded columns outlive the step, so SQLite need not copy them.
+    sqlite3_reset(insertNoteStmt_);
+    sqlite3_bind_int64(insertNoteStmt_, 1, note.timestamp);
+    if (note.windowId > 0) {
+        sqlite3_bind_int64(insertNoteStmt_, 2, note.windowId);
+    } else {
+        sqlite3_bind_null(insertNoteStmt_, 2);
+    }
+    sqlite3_bind_text(insertNoteStmt_, 3, note.text.constData(), note.text.size(),
+                      SQLITE_STATIC);
+    sqlite3_bind_text(insertNoteStmt_, 4, note.enrichedText.constData(),
+                      note.enrichedText.size(), SQLITE_STATIC);
+    sqlite3_bind_text(insertNoteStmt_, 5, note.metadata.constData(), note.metadata.size(),
+                      SQLITE_STATIC);
+
+    const int rc = sqlite3_step(insertNoteStmt_);
+    sqlite3_reset(insertNoteStmt_);
+    sqlite3_clear_bindings(insertNoteStmt_);
+    if (rc != SQLITE_DONE) {
+        throw std::runtime_error("insert note failed");
+    }
+    return sqlite3_last_insert_rowid(db_);
 }
 
 qint64 SqliteStore::insertNote(qint64 timestamp, qint64 windowId,
                                const QString& text,
                                const QString& enrichedText,
                                const QJsonObject& metadata) {
+    const PendingNote note = encodeNote(timestamp, windowId, text, enrichedText, metadata);
     std::lock_guard<std::mutex> lock(mutex_);
+    return stepInsertNote(note);
+}
 
-    sqlite3_reset(insertNoteStmt_);
-    sqlite3_bind_int64(insertNoteStmt_, 1, timestamp);
-    sqlite3_bind_int64(insertNoteStmt_, 2, windowId);
-    sqlite3_bind_text(insertNoteStmt_, 3, text.toUtf8().constData(), -1,
-                      SQLITE_TRANSIENT);
-    sqlite3_bind_text(insertNoteStmt_, 4, enrichedText.toUtf8().constData(), -1,
-                      SQLITE_TRANSIENT);
-    QString metaStr = QString::fromUtf8(QJsonDocument(metadata).toJson(QJsonDocument::Compact));
-    sqlite3_bind_text(insertNoteStmt_, 5, metaStr.toUtf8().constData(), -1,
-                      SQLITE_TRANSIENT);
+std::future<qint64> SqliteStore::enqueueNote(qint64 timestamp, qint64 windowId,
+                                             const QString& text,
+                                             const QString& enrichedText,
+                                             const QJsonObject& metadata) {
+    return ingest_->submit(encodeNote(timestamp, windowId, text, enrichedText, metadata));
+}
 
-    if (sqlite3_step(insertNoteStmt_) != SQLITE_DONE) {
-        sqlite3_reset(insertNoteStmt_);
-        throw std::runtime_error("insert note failed");
+// Called on the ingest thread with each batch. A note that fails on its own
+// fails alone; ids are handed out only once the transaction has committed.
+void SqliteStore::commitNotes(std::vector<NoteQueue::Entry>& batch) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<qint64> ids(batch.size(), 0);
+    exec("BEGIN IMMEDIATE;");
+    try {
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            try {
+                ids[i] = stepInsertNote(batch[i].item);
+            } catch (const std::runtime_error& e) {
+                LOG_WARNING("Dropping queued note:" << e.what());
+                batch[i].result.set_exception(std::current_exception());
+            }
+        }
+        exec("COMMIT;");
+    } catch (const std::exception& e) {
+        LOG_WARNING("Dropping" << batch.size() << "queued notes:" << e.what());
+        sqlite3_exec(db_, "ROLLBACK;", nullptr, nullptr, nullptr);
+        throw;
+    }
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        if (ids[i] != 0) {
+            batch[i].result.set_value(ids[i]);
+        }
     }
-    sqlite3_reset(insertNoteStmt_);
-    return sqlite3_last_insert_rowid(db_);
 }
 
 QJsonArray SqliteStore::queryNotes(qint64 fromTs, qint64 toTs,
@@ -279,7 +402,107 @@ void SqliteStore::vacuum() {
     exec("VACUUM;");
 }
 
+std::optional<QString> SqliteStore::lookupSummary(const QString& key,
+                                                  qint64 createdAfter,
+                                                  qint64* createdAt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const QByteArray keyUtf8 = key.toUtf8();
+    sqlite3_reset(lookupSummaryStmt_);
+    sqlite3_bind_text(lookupSummaryStmt_, 1, keyUtf8.constData(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(lookupSummaryStmt_, 2, createdAfter);
+    if (sqlite3_step(lookupSummaryStmt_) != SQLITE_ROW) {
+        sqlite3_reset(lookupSummaryStmt_);
+        return std::nullopt;
+    }
+    QString summary = QString::fromUtf8(reinterpret_cast<const char*>(
+        sqlite3_column_text(lookupSummaryStmt_, 0)));
+    if (createdAt) {
+        *createdAt = sqlite3_column_int64(lookupSummaryStmt_, 1);
+    }
+    sqlite3_reset(lookupSummaryStmt_);
+    return summary;
+}
+
+// Marks the rows as used at accessedAt, for the byte cap's LRU order.
+void SqliteStore::touchSummaries(const QStringList& keys, qint64 accessedAt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exec("BEGIN IMMEDIATE;");
+    try {
+        for (const QString& key : keys) {
+            const QByteArray keyUtf8 = key.toUtf8();
+            sqlite3_reset(touchSummaryStmt_);
+            sqlite3_bind_int64(touchSummaryStmt_, 1, accessedAt);
+            sqlite3_bind_text(touchSummaryStmt_, 2, keyUtf8.constData(), -1, SQLITE_TRANSIENT);
+            sqlite3_step(touchSummaryStmt_);
+        }
+        sqlite3_reset(touchSummaryStmt_);
+        exec("COMMIT;");
+    } catch (const std::exception&) {
+        sqlite3_reset(touchSummaryStmt_);
+        sqlite3_exec(db_, "ROLLBACK;", nullptr, nullptr, nullptr);
+        throw;
+    }
+}
+
+void SqliteStore::storeSummary(const QString& key, const QString& summary,
+                               qint64 createdAt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const QByteArray summaryUtf8 = summary.toUtf8();
+    sqlite3_reset(storeSummaryStmt_);
+    sqlite3_bind_text(storeSummaryStmt_, 1, key.toUtf8().constData(), -1,
+                      SQLITE_TRANSIENT);
+    sqlite3_bind_text(storeSummaryStmt_, 2, summaryUtf8.constData(),
+                      summaryUtf8.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int64(storeSummaryStmt_, 3, summaryUtf8.size());
+    sqlite3_bind_int64(storeSummaryStmt_, 4, createdAt);
+    sqlite3_bind_int64(storeSummaryStmt_, 5, createdAt);
+    if (sqlite3_step(storeSummaryStmt_) != SQLITE_DONE) {
+        sqlite3_reset(storeSummaryStmt_);
+        throw std::runtime_error("store summary failed");
+    }
+    sqlite3_reset(storeSummaryStmt_);
+}
+
+// Drops expired summaries, then the least recently used ones until the rest
+// fit in maxBytes. Returns the bytes left in the table.
+qint64 SqliteStore::pruneSummaries(qint64 createdBefore, qint64 maxBytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db_, "DELETE FROM summary_cache WHERE created_at < ?;", -1,
+                           &stmt, nullptr) != SQLITE_OK) {
+        throw std::runtime_error("prepare expire_summaries failed");
+    }
+    sqlite3_bind_int64(stmt, 1, createdBefore);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(
+            db_,
+            "DELETE FROM summary_cache WHERE key IN ("
+            " SELECT key FROM (SELECT key, SUM(bytes) OVER"
+            " (ORDER BY accessed_at DESC, key) AS total FROM summary_cache)"
+            " WHERE total > ?);",
+            -1, &stmt, nullptr) != SQLITE_OK) {
+        throw std::runtime_error("prepare evict_summaries failed");
+    }
+    sqlite3_bind_int64(stmt, 1, maxBytes);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    qint64 remaining = 0;
+    if (sqlite3_prepare_v2(db_, "SELECT COALESCE(SUM(bytes), 0) FROM summary_cache;",
+                           -1, &stmt, nullptr) != SQLITE_OK) {
+        throw std::runtime_error("prepare summary_bytes failed");
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        remaining = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return remaining;
+}
+
 // Integration notes:
 // SqliteStore is utilised by HTTP handlers, exporters and enrichment modules.
-// All access is serialized through the internal mutex to ensure thread-safety.
+// All access is serialized through the internal mutex to ensure thread-safety;
+// the ingest thread takes it for each batch of queued notes.
 
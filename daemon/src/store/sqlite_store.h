@@ -5,6 +5,9 @@
 #include <QJsonObject>
 #include <QSqlDatabase>
 #include <QDateTime>
+#include <QStringList>
+#include <future>
+#include <optional>
 
 namespace vibenote {
 
@@ -19,10 +22,24 @@ public:
     void close();
     
     bool storeNote(const QJsonObject &note);
+    // Write-behind: queues the note for the ingest thread, which commits
+    // queued notes together in one transaction. The future yields the note's
+    // id once its transaction has committed, or the error that failed it.
+    // A windowId of 0 stores the note without a window.
+    std::future<qint64> enqueueNote(qint64 timestamp, qint64 windowId, const QString &text,
+                                    const QString &enrichedText, const QJsonObject &metadata);
     QJsonArray queryNotes(qint64 from, qint64 to, const QString &app = QString(), int limit = 100);
     QJsonObject getStats();
     bool vacuum();
 
+    // Backing table of SummaryCache. Lookups do not mark a row as used;
+    // touchSummaries() does that for many keys in one transaction.
+    std::optional<QString> lookupSummary(const QString &key, qint64 createdAfter,
+                                         qint64 *createdAt);
+    void touchSummaries(const QStringList &keys, qint64 accessedAt);
+    void storeSummary(const QString &key, const QString &summary, qint64 createdAt);
+    qint64 pruneSummaries(qint64 createdBefore, qint64 maxBytes);
+
 signals:
     void noteStored(const QJsonObject &note);
     void error(const QString &message);
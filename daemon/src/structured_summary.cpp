@@ -0,0 +1,52 @@
+#include "structured_summary.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+
+std::optional<StructuredSummary> StructuredSummary::parse(const QString &text) {
+    const QJsonDocument doc = QJsonDocument::fromJson(text.trimmed().toUtf8());
+    if (!doc.isObject()) {
+        return std::nullopt;
+    }
+    const QJsonObject object = doc.object();
+    const QJsonValue title = object.value(QStringLiteral("title"));
+    const QJsonValue activity = object.value(QStringLiteral("activity"));
+    const QJsonValue entities = object.value(QStringLiteral("entities"));
+    if (!title.isString() || !activity.isString() || !entities.isArray()) {
+        return std::nullopt;
+    }
+    StructuredSummary summary;
+    summary.title = title.toString();
+    summary.activity = activity.toString();
+    for (const QJsonValue &entity : entities.toArray()) {
+        if (entity.isString()) {
+            summary.entities.append(entity.toString());
+        }
+    }
+    return summary;
+}
+
+QJsonObject StructuredSummary::toJson() const {
+    return {{QStringLiteral("title"), title},
+            {QStringLiteral("activity"), activity},
+            {QStringLiteral("entities"), QJsonArray::fromStringList(entities)}};
+}
+
+QJsonObject summarySchema() {
+    auto text = [](int maxLength) {
+        return QJsonObject{{QStringLiteral("type"), QStringLiteral("string")},
+                           {QStringLiteral("maxLength"), maxLength}};
+    };
+    const QJsonObject properties{
+        {QStringLiteral("title"), text(80)},
+        {QStringLiteral("activity"), text(240)},
+        {QStringLiteral("entities"), QJsonObject{{QStringLiteral("type"), QStringLiteral("array")},
+                                                 {QStringLiteral("items"), text(60)},
+                                                 {QStringLiteral("maxItems"), 8}}}};
+    return {{QStringLiteral("type"), QStringLiteral("object")},
+            {QStringLiteral("properties"), properties},
+            {QStringLiteral("required"),
+             QJsonArray{QStringLiteral("title"), QStringLiteral("activity"),
+                        QStringLiteral("entities")}},
+            {QStringLiteral("additionalProperties"), false}};
+}
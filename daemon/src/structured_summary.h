@@ -0,0 +1,25 @@
+#pragma once
+
+#include <QJsonObject>
+#include <QString>
+#include <QStringList>
+#include <optional>
+
+// Summary fields the exporters and a note's `metadata` JSON use. Requests
+// that pass summarySchema() as "json_schema" get output the backend was
+// constrained to, so parse() needs no repair or re-prompt.
+struct StructuredSummary {
+    QString title;         // a few words naming what is on screen
+    QString activity;      // what the user is doing
+    QStringList entities;  // files, people, projects, websites
+
+    // Reads model output generated under summarySchema(). Returns nullopt
+    // if it is not such an object, e.g. when generation hit max_tokens.
+    static std::optional<StructuredSummary> parse(const QString &text);
+
+    QJsonObject toJson() const;
+};
+
+// JSON schema for StructuredSummary. Length caps keep constrained output
+// well within a summary's token budget.
+QJsonObject summarySchema();
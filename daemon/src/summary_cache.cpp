@@ -0,0 +1,236 @@
+#include "summary_cache.h"
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <cstdio>
+#include <QStringList>
+#include <exception>
+#include <utility>
+
+#include "logging.h"
+#include "metrics.h"
+#include "queue.h"
+#include "store/sqlite_store.h"
+
+namespace {
+
+// The table is trimmed to the TTL and byte cap every this many inserts.
+constexpr std::uint64_t kPruneInterval = 64;
+// Disk hits are marked as used in one transaction once this many are queued,
+// and before every prune.
+constexpr std::size_t kTouchBatch = 32;
+
+} // namespace
+
+SummaryCache::SummaryCache(vibenote::SqliteStore *store, Options options)
+    : store_(options.disk_bytes > 0 ? store : nullptr), options_(std::move(options)) {
+    pruneDisk();
+}
+
+SummaryCache::~SummaryCache() {
+    flushTouches();
+}
+
+std::string SummaryCache::key(const vibenote::Task &task) const {
+    // Fields are NUL-separated so no two tuples hash the same input.
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    auto add = [&hash](QByteArrayView field) {
+        hash.addData(field);
+        hash.addData(QByteArrayView("\0", 1));
+    };
+    add(options_.model_id.toUtf8());
+    add(options_.prompt_template.toUtf8());
+    const char type = static_cast<char>(task.type);
+    add(QByteArrayView(&type, 1));
+    add(QByteArrayView(task.grammar.data(), static_cast<qsizetype>(task.grammar.size())));
+    add(QByteArrayView(task.json_schema.data(), static_cast<qsizetype>(task.json_schema.size())));
+    const std::string text = vibenote::TaskQueue::normalizePrompt(task.prompt);
+    hash.addData(QByteArrayView(text.data(), static_cast<qsizetype>(text.size())));
+    return hash.result().toHex().toStdString();
+}
+
+std::int64_t SummaryCache::expiredBefore() const {
+    return QDateTime::currentSecsSinceEpoch() - options_.ttl.count();
+}
+
+std::optional<std::string> SummaryCache::lookup(const std::string &key) {
+    if (auto summary = lookupInMemory(key)) {
+        return summary;
+    }
+    return lookupOnDisk(key);
+}
+
+std::optional<std::string> SummaryCache::lookupInMemory(const std::string &key) {
+    const std::int64_t cutoff = expiredBefore();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        return std::nullopt;
+    }
+    if (it->second->created >= cutoff) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        memory_hits_.fetch_add(1, std::memory_order_relaxed);
+        hit_bytes_.fetch_add(it->second->summary.size(), std::memory_order_relaxed);
+        return it->second->summary;
+    }
+    memory_size_ -= it->second->key.size() + it->second->summary.size();
+    lru_.erase(it->second);
+    index_.erase(it);
+    return std::nullopt;
+}
+
+std::optional<std::string> SummaryCache::lookupOnDisk(const std::string &key) {
+    if (store_) {
+        try {
+            qint64 created = 0;
+            if (auto summary = store_->lookupSummary(QString::fromStdString(key), expiredBefore(),
+                                                     &created)) {
+                std::string text = summary->toStdString();
+                disk_hits_.fetch_add(1, std::memory_order_relaxed);
+                hit_bytes_.fetch_add(text.size(), std::memory_order_relaxed);
+                bool flush = false;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    insertUnlocked(key, text, created);
+                    touched_.push_back(key);
+                    flush = touched_.size() >= kTouchBatch;
+                }
+                if (flush) {
+                    flushTouches();
+                }
+                return text;
+            }
+        } catch (const std::exception &e) {
+            LOG_WARNING("Summary cache lookup failed:" << e.what());
+        }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return std::nullopt;
+}
+
+void SummaryCache::insert(const std::string &key, const std::string &summary) {
+    const std::int64_t now = QDateTime::currentSecsSinceEpoch();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        insertUnlocked(key, summary, now);
+    }
+    const std::uint64_t inserts = inserts_.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (!store_) {
+        return;
+    }
+    try {
+        store_->storeSummary(QString::fromStdString(key), QString::fromStdString(summary), now);
+        disk_size_.fetch_add(static_cast<std::int64_t>(summary.size()), std::memory_order_relaxed);
+    } catch (const std::exception &e) {
+        LOG_WARNING("Summary cache write failed:" << e.what());
+    }
+    if (inserts % kPruneInterval == 0) {
+        pruneDisk();
+    }
+}
+
+void SummaryCache::insertUnlocked(const std::string &key, const std::string &summary,
+                                  std::int64_t created) {
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        memory_size_ -= it->second->key.size() + it->second->summary.size();
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+    lru_.push_front(Entry{key, summary, created});
+    index_.emplace(key, lru_.begin());
+    memory_size_ += key.size() + summary.size();
+    evictUnlocked();
+}
+
+void SummaryCache::evictUnlocked() {
+    while (!lru_.empty() &&
+           (memory_size_ > options_.memory_bytes || lru_.size() > options_.memory_entries)) {
+        const Entry &last = lru_.back();
+        memory_size_ -= last.key.size() + last.summary.size();
+        index_.erase(last.key);
+        lru_.pop_back();
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void SummaryCache::flushTouches() {
+    if (!store_) {
+        return;
+    }
+    QStringList keys;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        keys.reserve(static_cast<qsizetype>(touched_.size()));
+        for (const std::string &key : touched_) {
+            keys.append(QString::fromStdString(key));
+        }
+        touched_.clear();
+    }
+    if (keys.isEmpty()) {
+        return;
+    }
+    try {
+        store_->touchSummaries(keys, QDateTime::currentSecsSinceEpoch());
+    } catch (const std::exception &e) {
+        LOG_WARNING("Summary cache touch failed:" << e.what());
+    }
+}
+
+void SummaryCache::pruneDisk() {
+    if (!store_) {
+        return;
+    }
+    // The byte cap evicts by accessed_at, so queued hits must land first.
+    flushTouches();
+    try {
+        disk_size_.store(store_->pruneSummaries(expiredBefore(), options_.disk_bytes),
+                         std::memory_order_relaxed);
+    } catch (const std::exception &e) {
+        LOG_WARNING("Summary cache prune failed:" << e.what());
+    }
+}
+
+SummaryCache::Stats SummaryCache::stats() const {
+    Stats stats;
+    stats.memory_hits = memory_hits_.load(std::memory_order_relaxed);
+    stats.disk_hits = disk_hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.inserts = inserts_.load(std::memory_order_relaxed);
+    stats.evictions = evictions_.load(std::memory_order_relaxed);
+    stats.hit_bytes = hit_bytes_.load(std::memory_order_relaxed);
+    stats.disk_size = disk_size_.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats.memory_size = memory_size_;
+    return stats;
+}
+
+void SummaryCache::serializeMetrics(std::string &out) const {
+    const Stats s = stats();
+    char line[160];
+    vibenote::appendFamilyHeader(out, "vibenote_summary_cache_hits_total", "counter",
+                                 "Summaries answered from the cache.");
+    std::snprintf(line, sizeof(line),
+                  "vibenote_summary_cache_hits_total{tier=\"memory\"} %llu\n"
+                  "vibenote_summary_cache_hits_total{tier=\"disk\"} %llu\n",
+                  static_cast<unsigned long long>(s.memory_hits),
+                  static_cast<unsigned long long>(s.disk_hits));
+    out += line;
+    vibenote::appendCounter(out, "vibenote_summary_cache_misses_total",
+                            "Summaries not found in the cache.", s.misses);
+    vibenote::appendCounter(out, "vibenote_summary_cache_inserts_total",
+                            "Generated summaries added to the cache.", s.inserts);
+    vibenote::appendCounter(out, "vibenote_summary_cache_evictions_total",
+                            "In-memory entries dropped to stay within the size caps.", s.evictions);
+    vibenote::appendCounter(out, "vibenote_summary_cache_hit_bytes_total",
+                            "Summary bytes served from the cache.", s.hit_bytes);
+    out += "# HELP vibenote_summary_cache_bytes Bytes held by the cache.\n"
+           "# TYPE vibenote_summary_cache_bytes gauge\n";
+    std::snprintf(line, sizeof(line),
+                  "vibenote_summary_cache_bytes{tier=\"memory\"} %llu\n"
+                  "vibenote_summary_cache_bytes{tier=\"disk\"} %lld\n",
+                  static_cast<unsigned long long>(s.memory_size),
+                  static_cast<long long>(s.disk_size));
+    out += line;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <QString>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace vibenote {
+class SqliteStore;
+struct Task;
+}
+
+// Finished summaries keyed by a hash of what produced them: the normalized
+// input text, the model and the prompt template (preamble, grammar or
+// schema). An in-memory LRU sits over the store's summary_cache table, so an
+// unchanged screen or a repeated /v1/summarize body is answered without
+// entering the TaskQueue, also after a restart. Thread-safe; lookups come from
+// pool workers and the HTTP server. Disk hits are marked as used in the
+// table in batches rather than one UPDATE per hit.
+class SummaryCache {
+public:
+    struct Options {
+        QString model_id;          // identifies the model file
+        QString prompt_template;   // everything else that shapes the output
+        std::size_t memory_bytes = 8u << 20;
+        std::size_t memory_entries = 4096;
+        std::int64_t disk_bytes = 64ll << 20;  // 0 keeps the cache in memory only
+        std::chrono::seconds ttl = std::chrono::hours(24 * 7);
+    };
+
+    struct Stats {
+        std::uint64_t memory_hits = 0;
+        std::uint64_t disk_hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t inserts = 0;
+        std::uint64_t evictions = 0;    // memory entries dropped for the caps
+        std::uint64_t hit_bytes = 0;    // summary bytes served from the cache
+        std::uint64_t memory_size = 0;  // bytes currently held in memory
+        std::int64_t disk_size = 0;     // bytes in the table, recounted on each prune
+    };
+
+    // `store` may be null for a memory-only cache.
+    SummaryCache(vibenote::SqliteStore *store, Options options);
+    ~SummaryCache();
+
+    std::string key(const vibenote::Task &task) const;
+
+    // Both tiers; on a memory miss this queries the store.
+    std::optional<std::string> lookup(const std::string &key);
+    // The two halves of lookup(), for callers that must not block on the
+    // store: the memory tier never touches SQLite, and a miss is only
+    // counted once lookupOnDisk() has missed too.
+    std::optional<std::string> lookupInMemory(const std::string &key);
+    std::optional<std::string> lookupOnDisk(const std::string &key);
+    bool hasDiskTier() const { return store_ != nullptr; }
+    void insert(const std::string &key, const std::string &summary);
+
+    Stats stats() const;
+    // Appends Prometheus families; registered with Metrics::addSource.
+    void serializeMetrics(std::string &out) const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::string summary;
+        std::int64_t created = 0;  // seconds since the epoch
+    };
+
+    std::int64_t expiredBefore() const;
+    void evictUnlocked();
+    void insertUnlocked(const std::string &key, const std::string &summary, std::int64_t created);
+    void flushTouches();
+    void pruneDisk();
+
+    vibenote::SqliteStore *store_;
+    const Options options_;
+
+    mutable std::mutex mutex_;
+    std::list<Entry> lru_;  // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    std::size_t memory_size_ = 0;
+    std::vector<std::string> touched_;  // disk hits not yet marked in the table
+
+    std::atomic<std::uint64_t> memory_hits_{0};
+    std::atomic<std::uint64_t> disk_hits_{0};
+    std::atomic<std::uint64_t> misses_{0};
+    std::atomic<std::uint64_t> inserts_{0};
+    std::atomic<std::uint64_t> evictions_{0};
+    std::atomic<std::uint64_t> hit_bytes_{0};
+    std::atomic<std::int64_t> disk_size_{0};
+};
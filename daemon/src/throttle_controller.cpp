@@ -0,0 +1,85 @@
+#include "throttle_controller.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace vibenote {
+
+namespace {
+
+// Caps how fast an idle device reopens admission: at most this many gap
+// widths of headroom count per update.
+constexpr double kMaxHeadroom = 4.0;
+
+// Weight of a new observation arriving `dt_ms` after the previous one for an
+// exponential average with time constant `tau_ms`.
+double weight(double dt_ms, double tau_ms) {
+  return tau_ms <= 0 ? 1.0 : 1.0 - std::exp(-dt_ms / tau_ms);
+}
+
+}  // namespace
+
+void ThrottleController::Holt::update(double value, double dt_ms, double alpha, double beta) {
+  if (!primed) {
+    primed = true;
+    level = value;
+    trend = 0;
+    return;
+  }
+  const double predicted = level + trend * dt_ms;
+  const double next = predicted + alpha * (value - predicted);
+  trend += beta * ((next - level) / dt_ms - trend);
+  level = next;
+}
+
+ThrottleController::ThrottleController(ThrottleOptions options) : options_(options) {
+  options_.util_target = std::min(options_.util_target, options_.util_threshold - 1.0f);
+  options_.memory_ramp_mb = std::max<std::size_t>(options_.memory_ramp_mb, 1);
+}
+
+double ThrottleController::update(const ResourceSample &sample) {
+  // Samples with the same timestamp (or a clock step back) count as 1 ms apart.
+  const double dt_ms =
+      util_.primed ? std::max<double>(1.0, static_cast<double>(sample.time_ms - last_time_ms_)) : 0;
+  last_time_ms_ = sample.time_ms;
+  const double alpha = weight(dt_ms, static_cast<double>(options_.smoothing.count()));
+  const double beta = weight(dt_ms, static_cast<double>(options_.trend_smoothing.count()));
+  util_.update(sample.utilization, dt_ms, alpha, beta);
+  free_mb_.update(static_cast<double>(sample.memory_free_mb), dt_ms, alpha, beta);
+  last_free_mb_ = sample.memory_free_mb;
+
+  const double util = forecastUtilization();
+  const double gap = options_.util_threshold - options_.util_target;
+  double share = admission_;
+  if (util > options_.util_threshold) {
+    // Scaled by the gap over the excess: a forecast twice as far past the
+    // target as the threshold halves admission.
+    share *= gap / (util - options_.util_target);
+  } else {
+    const double headroom = (options_.util_target - util) / gap;
+    share += options_.gain * std::min(headroom, kMaxHeadroom) * dt_ms / 1000.0;
+  }
+  const double free_mb = static_cast<double>(forecastFreeMb());
+  const double memory_share = (free_mb - static_cast<double>(options_.vram_headroom_mb)) /
+                              static_cast<double>(options_.memory_ramp_mb);
+  share = std::clamp(std::min(share, memory_share), 0.0, 1.0);
+  // Reopening passes through small shares; only a cut below min_share pauses.
+  if (share < admission_ && share < options_.min_share) {
+    share = 0;
+  }
+  admission_ = share;
+  return admission_;
+}
+
+float ThrottleController::forecastUtilization() const {
+  const double ahead = static_cast<double>(options_.horizon.count());
+  return static_cast<float>(std::clamp(util_.forecast(ahead), 0.0, 100.0));
+}
+
+std::size_t ThrottleController::forecastFreeMb() const {
+  const double ahead = static_cast<double>(options_.horizon.count());
+  const double forecast = std::max(0.0, free_mb_.forecast(ahead));
+  return std::min(last_free_mb_, static_cast<std::size_t>(forecast));
+}
+
+}  // namespace vibenote
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "monitor/resource_monitor.h"
+
+namespace vibenote {
+
+struct ThrottleOptions {
+  // Utilization (percent) that must not be exceeded; a forecast above it
+  // cuts admission in proportion to the excess.
+  float util_threshold{85.0f};
+  // Utilization admission steers toward. Every second, the share moves by
+  // `gain` times the forecast's distance from it, in units of the gap up to
+  // the threshold.
+  float util_target{80.0f};
+  double gain{1.0};
+  // A cut that leaves less than this share pauses admission instead: a
+  // sliver of capacity still runs a whole slot.
+  double min_share{0.5};
+  // Free memory that must remain; admission ramps up over the next
+  // memory_ramp_mb above it.
+  std::size_t vram_headroom_mb{800};
+  std::size_t memory_ramp_mb{1024};
+  // Time constants of the level and trend estimates, and how far ahead the
+  // forecast looks. Longer smoothing rides out single-sample spikes; the
+  // horizon covers the delay between admitting a task and it loading the
+  // device.
+  std::chrono::milliseconds smoothing{600};
+  std::chrono::milliseconds trend_smoothing{1200};
+  std::chrono::milliseconds horizon{400};
+};
+
+// Turns resource samples into the share of inference capacity to admit.
+//
+// Utilization and free memory are each tracked with Holt's linear
+// smoothing (an EWMA of the level plus an EWMA of its slope), weighted by
+// the actual time between samples, and extrapolated over `horizon`, so a
+// rising load is met before it crosses the threshold.
+//
+// The admitted work is itself part of the utilization, so mapping headroom
+// straight to a share would oscillate: full admission fills the device,
+// which cuts admission, which empties it. Instead the share integrates the
+// predicted headroom around util_target, and is cut in proportion once the
+// threshold is forecast to be crossed. Under bursty load it settles at a
+// partial share rather than flapping between paused and running. Memory caps
+// the share directly, from the lower of the sample and its forecast: running
+// out of it is not something to smooth over. Not thread-safe.
+class ThrottleController {
+ public:
+  explicit ThrottleController(ThrottleOptions options = {});
+
+  // Folds in `sample` and returns the new admission share in [0, 1].
+  double update(const ResourceSample &sample);
+
+  double admission() const { return admission_; }
+  // Utilization expected `horizon` from the last sample.
+  float forecastUtilization() const;
+  std::size_t forecastFreeMb() const;
+  const ThrottleOptions &options() const { return options_; }
+
+ private:
+  struct Holt {
+    bool primed{false};
+    double level{0};
+    double trend{0};  // per millisecond
+
+    void update(double value, double dt_ms, double alpha, double beta);
+    double forecast(double ahead_ms) const { return level + trend * ahead_ms; }
+  };
+
+  ThrottleOptions options_;
+  Holt util_;
+  Holt free_mb_;
+  std::size_t last_free_mb_{0};
+  std::int64_t last_time_ms_{0};
+  double admission_{1.0};
+};
+
+}  // namespace vibenote
@@ -0,0 +1,81 @@
+#include "variant_switcher.h"
+
+#include "gpu_guard.h"
+#include "llama_client.h"
+#include "logging.h"
+#include "model_variants.h"
+
+VariantSwitcher::VariantSwitcher(vibenote::ModelVariants *variants, GpuGuard *guard,
+                                 LlamaClient *client, std::chrono::milliseconds interval,
+                                 QObject *parent)
+    : QObject(parent), m_variants(variants), m_guard(guard), m_client(client) {
+    m_timer.setInterval(interval);
+    connect(&m_timer, &QTimer::timeout, this, &VariantSwitcher::check);
+    connect(m_client, &LlamaClient::serverSwitched, this,
+            [this](int ngl, qint64, qint64) { onSwitched(ngl); });
+    connect(m_client, &LlamaClient::serverRetired, this, &VariantSwitcher::onRetired);
+    connect(m_client, &LlamaClient::serverSwitchFailed, this, [this](const QString &) {
+        m_loading.reset();
+    });
+}
+
+void VariantSwitcher::start() { m_timer.start(); }
+
+void VariantSwitcher::check() {
+    if (m_loading) {
+        return;
+    }
+    const std::optional<std::size_t> next =
+        m_variants->update(m_guard->memoryMarginBytes(), vibenote::ModelVariants::Clock::now());
+    if (!next) {
+        return;
+    }
+    const vibenote::ModelVariant &variant = m_variants->variant(*next);
+    LOG_INFO("Memory now suits" << QString::fromStdString(variant.name) << "; switching to it");
+    launch(*next, m_guard->planOffload(variant.layout, m_variants->budget()));
+}
+
+void VariantSwitcher::launch(std::size_t index, const vibenote::OffloadPlan &plan) {
+    m_free_before_mb = m_guard->getStats().vramFreeMb;
+    const QString path = QString::fromStdString(m_variants->variant(index).path);
+    if (m_client->restartWithModel(path, plan.gpu_layers)) {
+        m_loading = index;
+        m_loading_plan = plan;
+    }
+}
+
+void VariantSwitcher::onSwitched(int ngl) {
+    if (!m_loading) {
+        // Restarted by someone else with the same model and another -ngl.
+        if (m_variants->active() >= m_variants->size()) {
+            return;
+        }
+        vibenote::OffloadPlan plan = m_variants->activePlan();
+        plan.gpu_layers = ngl;
+        m_variants->setActive(m_variants->active(), plan);
+        return;
+    }
+    m_variants->setActive(*m_loading, m_loading_plan);
+    m_loading.reset();
+    // Both servers are loaded now; the replaced one still holds what it held
+    // at launch.
+    const std::size_t free_mb = m_guard->getStats().vramFreeMb;
+    if (m_free_before_mb > free_mb) {
+        m_variants->recordMemory(static_cast<std::uint64_t>(m_free_before_mb - free_mb) << 20);
+    }
+}
+
+void VariantSwitcher::onRetired() {
+    const std::size_t active = m_variants->active();
+    if (m_loading || active >= m_variants->size()) {
+        return;
+    }
+    const vibenote::OffloadPlan plan =
+        m_guard->planOffload(m_variants->variant(active).layout, m_variants->budget());
+    if (plan.gpu_layers > m_variants->activePlan().gpu_layers) {
+        LOG_INFO("Replaced llama server freed memory; raising -ngl to" << plan.gpu_layers);
+        launch(active, plan);
+    }
+}
+
+#include "moc_variant_switcher.cpp"
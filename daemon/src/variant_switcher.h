@@ -0,0 +1,56 @@
+#pragma once
+
+#include <QObject>
+#include <QTimer>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "offload_planner.h"
+
+class GpuGuard;
+class LlamaClient;
+
+namespace vibenote {
+class ModelVariants;
+}
+
+// Moves a spawned llama server between quantizations of the model as device
+// memory comes and goes. Every `interval` it passes the guard's memory margin
+// to ModelVariants::update(), and restarts the client blue/green with the
+// variant that returns.
+//
+// The replacement loads next to the server it replaces, so it starts with
+// the layers that fit the memory free at that moment; under pressure that
+// may be none. Once the replaced server has drained and released its
+// memory, another restart raises -ngl to what fits then. The device memory
+// a replacement took is measured as the drop in free memory from its launch
+// until it is healthy. Lives on the client's thread.
+class VariantSwitcher : public QObject {
+    Q_OBJECT
+
+public:
+    VariantSwitcher(vibenote::ModelVariants *variants, GpuGuard *guard, LlamaClient *client,
+                    std::chrono::milliseconds interval = std::chrono::seconds(5),
+                    QObject *parent = nullptr);
+
+    void start();
+
+private:
+    void check();
+    void launch(std::size_t index, const vibenote::OffloadPlan &plan);
+    void onSwitched(int ngl);
+    void onRetired();
+
+    vibenote::ModelVariants *m_variants;
+    GpuGuard *m_guard;
+    LlamaClient *m_client;
+    QTimer m_timer;
+
+    // Variant and plan of the replacement being loaded, and the free memory
+    // (MB) sampled when it was launched.
+    std::optional<std::size_t> m_loading;
+    vibenote::OffloadPlan m_loading_plan;
+    std::size_t m_free_before_mb = 0;
+};
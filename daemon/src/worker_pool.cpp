@@ -0,0 +1,278 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <exception>
+
+#include "logging.h"
+
+namespace vibenote {
+
+namespace {
+
+constexpr std::chrono::milliseconds kDequeuePoll{100};
+
+// Identifies the worker the current thread belongs to, for local submits.
+thread_local const WorkerPool *tls_pool = nullptr;
+thread_local std::size_t tls_index = 0;
+
+}  // namespace
+
+WorkerPool::WorkerPool(TaskQueue *queue, std::size_t workers) : queue_(queue) {
+  if (workers == 0) {
+    workers = std::thread::hardware_concurrency();
+  }
+  if (workers == 0) {
+    workers = 1;
+  }
+  workers_.reserve(workers);
+  for (std::size_t i = 0; i < workers; ++i) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+}
+
+WorkerPool::~WorkerPool() { stop(); }
+
+void WorkerPool::setHandler(TaskType type, Handler handler) {
+  handlers_[static_cast<std::size_t>(type)] = std::move(handler);
+}
+
+void WorkerPool::setBatchHandler(TaskType type, BatchHandler handler, std::size_t max_tasks,
+                                 std::size_t max_tokens) {
+  batch_handlers_[static_cast<std::size_t>(type)] = std::move(handler);
+  batch_max_tasks_ = std::max(batch_max_tasks_, max_tasks);
+  batch_max_tokens_ = std::max(batch_max_tokens_, max_tokens);
+}
+
+void WorkerPool::start() {
+  if (running_.exchange(true)) {
+    return;
+  }
+  {
+    std::lock_guard lock(state_mutex_);
+    stopping_ = false;
+  }
+  for (std::size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i]->thread = std::thread([this, i] { workerLoop(i); });
+  }
+  dispatcher_ = std::thread([this] { dispatchLoop(); });
+}
+
+void WorkerPool::stop() {
+  if (!running_.exchange(false)) {
+    return;
+  }
+  {
+    std::lock_guard lock(state_mutex_);
+    stopping_ = true;
+  }
+  state_cv_.notify_all();
+  if (dispatcher_.joinable()) {
+    dispatcher_.join();
+  }
+  for (auto &worker : workers_) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+}
+
+void WorkerPool::submit(Job job) {
+  if (tls_pool == this) {
+    push(tls_index, std::move(job));
+    return;
+  }
+  push(next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size(), std::move(job));
+}
+
+void WorkerPool::push(std::size_t index, Job job) {
+  {
+    std::lock_guard lock(workers_[index]->mutex);
+    workers_[index]->jobs.push_back(std::move(job));
+  }
+  {
+    std::lock_guard lock(state_mutex_);
+    pending_++;
+  }
+  state_cv_.notify_all();
+}
+
+std::optional<WorkerPool::Job> WorkerPool::popLocal(std::size_t index) {
+  auto &worker = *workers_[index];
+  std::lock_guard lock(worker.mutex);
+  if (worker.jobs.empty()) {
+    return std::nullopt;
+  }
+  Job job = std::move(worker.jobs.back());
+  worker.jobs.pop_back();
+  return job;
+}
+
+std::optional<WorkerPool::Job> WorkerPool::steal(std::size_t thief) {
+  for (std::size_t k = 1; k < workers_.size(); ++k) {
+    auto &victim = *workers_[(thief + k) % workers_.size()];
+    std::lock_guard lock(victim.mutex);
+    if (!victim.jobs.empty()) {
+      Job job = std::move(victim.jobs.front());
+      victim.jobs.pop_front();
+      return job;
+    }
+  }
+  return std::nullopt;
+}
+
+void WorkerPool::workerLoop(std::size_t index) {
+  tls_pool = this;
+  tls_index = index;
+
+  while (true) {
+    auto job = popLocal(index);
+    if (!job) {
+      job = steal(index);
+    }
+    if (job) {
+      {
+        std::lock_guard lock(state_mutex_);
+        pending_--;
+      }
+      try {
+        (*job)();
+      } catch (const std::exception &e) {
+        LOG_ERROR("Worker job failed:" << e.what());
+      } catch (...) {
+        LOG_ERROR("Worker job failed with unknown exception");
+      }
+      continue;
+    }
+
+    std::unique_lock lock(state_mutex_);
+    if (pending_ > 0) {
+      continue;  // a job was pushed after our scan; rescan
+    }
+    if (stopping_) {
+      break;
+    }
+    idle_++;
+    state_cv_.notify_all();  // the dispatcher waits for idle workers
+    state_cv_.wait(lock, [this] { return pending_ > 0 || stopping_; });
+    idle_--;
+  }
+
+  tls_pool = nullptr;
+}
+
+void WorkerPool::dispatchLoop() {
+  while (true) {
+    {
+      std::unique_lock lock(state_mutex_);
+      state_cv_.wait(lock, [this] { return stopping_ || idle_ > pending_; });
+      if (stopping_) {
+        return;
+      }
+    }
+    auto batch = queue_->dequeueBatch(batch_max_tasks_, batch_max_tokens_, kDequeuePoll);
+    if (batch.empty()) {
+      continue;
+    }
+    auto index = next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    if (batch.size() == 1 && !batch_handlers_[static_cast<std::size_t>(batch.front().type)]) {
+      push(index, [this, t = std::move(batch.front())] { runTask(t); });
+    } else {
+      push(index, [this, b = std::move(batch)] { runBatch(b); });
+    }
+  }
+}
+
+void WorkerPool::runTask(const Task &task) {
+  // Release the task's concurrency slot on every exit path.
+  struct SlotRelease {
+    TaskQueue *queue;
+    std::uint64_t id;
+    ~SlotRelease() { queue->taskCompleted(id); }
+  } release{queue_, task.id};
+
+  if (task.cancel_token && task.cancel_token->isCancelled()) {
+    fail(task, TaskFailure::kCancelled);
+    return;
+  }
+  const auto &handler = handlers_[static_cast<std::size_t>(task.type)];
+  if (!handler) {
+    LOG_WARNING("No handler registered for task type" << static_cast<int>(task.type));
+    fail(task, TaskFailure::kError);
+    return;
+  }
+  try {
+    handler(task);
+  } catch (const std::exception &e) {
+    LOG_ERROR("Task" << task.id << "failed:" << e.what());
+    fail(task, TaskFailure::kError);
+  } catch (...) {
+    LOG_ERROR("Task" << task.id << "failed with unknown exception");
+    fail(task, TaskFailure::kError);
+  }
+}
+
+void WorkerPool::runBatch(const std::vector<Task> &batch) {
+  const auto &handler = batch_handlers_[static_cast<std::size_t>(batch.front().type)];
+  if (!handler) {
+    // Batchable type without a batch handler: run the tasks back to back so
+    // they still share the one slot they were dequeued under.
+    for (const auto &task : batch) {
+      runTask(task);
+    }
+    return;
+  }
+
+  struct SlotRelease {
+    TaskQueue *queue;
+    const std::vector<Task> &batch;
+    ~SlotRelease() {
+      for (const auto &task : batch) {
+        queue->taskCompleted(task.id);
+      }
+    }
+  } release{queue_, batch};
+
+  std::vector<Task> live;
+  live.reserve(batch.size());
+  for (const auto &task : batch) {
+    if (!task.cancel_token || !task.cancel_token->isCancelled()) {
+      live.push_back(task);
+    } else {
+      fail(task, TaskFailure::kCancelled);
+    }
+  }
+  if (live.empty()) {
+    return;
+  }
+  bool threw = true;
+  try {
+    handler(live);
+    threw = false;
+  } catch (const std::exception &e) {
+    LOG_ERROR("Batch of" << live.size() << "tasks failed:" << e.what());
+  } catch (...) {
+    LOG_ERROR("Batch of" << live.size() << "tasks failed with unknown exception");
+  }
+  if (threw) {
+    for (const auto &task : live) {
+      fail(task, TaskFailure::kError);
+    }
+  }
+}
+
+// A throwing failure hook must not skip the slot release or the rest of a
+// batch.
+void WorkerPool::fail(const Task &task, TaskFailure failure) {
+  if (!task.on_failure) {
+    return;
+  }
+  try {
+    task.on_failure(failure);
+  } catch (const std::exception &e) {
+    LOG_ERROR("Failure hook of task" << task.id << "threw:" << e.what());
+  } catch (...) {
+    LOG_ERROR("Failure hook of task" << task.id << "threw an unknown exception");
+  }
+}
+
+}  // namespace vibenote
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "queue.h"
+
+namespace vibenote {
+
+// Executes tasks drained from a TaskQueue on a fixed set of worker threads.
+//
+// A dispatcher thread pulls tasks out of the queue only while some worker is
+// idle, so per-type concurrency slots are not held by tasks that have nowhere
+// to run. Each worker owns a local deque: it pops its own jobs LIFO and steals
+// from the front of other workers' deques when it runs dry. CPU-bound helper
+// jobs (OCR regions, export formatting) go through submit() and are not
+// subject to the queue's per-type limits; GPU-bound inference stays capped by
+// QueueConfig::max_concurrent because it only enters the pool via dequeue().
+class WorkerPool {
+ public:
+  using Job = std::function<void()>;
+  using Handler = std::function<void(const Task &)>;
+  using BatchHandler = std::function<void(const std::vector<Task> &)>;
+
+  // `workers == 0` uses one worker per hardware thread.
+  explicit WorkerPool(TaskQueue *queue, std::size_t workers = 0);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  // Handlers must be registered before start(). A handler runs synchronously
+  // on a worker; the task's queue slot is released when it returns or throws.
+  // Tasks cancelled before they run, and tasks whose handler throws, get
+  // their Task::on_failure instead.
+  void setHandler(TaskType type, Handler handler);
+  // Tasks of a batchable type (QueueConfig::batchable) are pulled with
+  // TaskQueue::dequeueBatch() and passed to `handler` together. Every task's
+  // slot is released once the handler returns.
+  void setBatchHandler(TaskType type, BatchHandler handler, std::size_t max_tasks,
+                       std::size_t max_tokens);
+
+  void start();
+  void stop();
+
+  // Queues a job on the calling worker's deque, or spreads it round-robin when
+  // called from outside the pool.
+  void submit(Job job);
+
+  std::size_t workerCount() const { return workers_.size(); }
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+    std::thread thread;
+  };
+
+  void workerLoop(std::size_t index);
+  void dispatchLoop();
+  void push(std::size_t index, Job job);
+  std::optional<Job> popLocal(std::size_t index);
+  std::optional<Job> steal(std::size_t thief);
+  void runTask(const Task &task);
+  void runBatch(const std::vector<Task> &batch);
+  static void fail(const Task &task, TaskFailure failure);
+
+  TaskQueue *queue_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::array<Handler, kTaskTypeCount> handlers_;
+  std::array<BatchHandler, kTaskTypeCount> batch_handlers_;
+  std::size_t batch_max_tasks_{1};
+  std::size_t batch_max_tokens_{0};
+  std::thread dispatcher_;
+
+  std::mutex state_mutex_;
+  std::condition_variable state_cv_;
+  std::size_t pending_{0};  // jobs pushed and not yet taken by any worker
+  std::size_t idle_{0};     // workers parked waiting for jobs
+  bool stopping_{false};
+
+  std::atomic<bool> running_{false};
+  std::atomic<std::size_t> next_worker_{0};
+};
+
+}  // namespace vibenote
@@ -0,0 +1,127 @@
+// Throughput benchmark for LlamaEngine's continuous batching, in the spirit
+// of llama.cpp's batched-bench.
+//
+// Submits the same burst of summaries (screen-text prompts, greedy sampling,
+// reply lengths varying per request so sequences finish at different steps
+// and queued requests are admitted mid-flight) to engines decoding 1, 2, 4
+// and 8 sequences at once. Reports wall time, generated tokens per second,
+// mean tokens per decode step, and how many replies differ from the
+// one-at-a-time run (batched kernels may round differently).
+//
+// Usage: bench_batching <model.gguf> [requests]
+
+#include "llama_engine.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace vibenote;
+
+namespace {
+
+std::string screenText(int i) {
+    std::string text = "Terminal - build " + std::to_string(i) + "\n";
+    for (int line = 0; line < 6; ++line) {
+        text += "[" + std::to_string(10 + line) + "/42] Building CXX object daemon/CMakeFiles/"
+                "vibenote-daemon.dir/src/queue.cpp.o\n";
+    }
+    return text;
+}
+
+struct Run {
+    double seconds = 0;
+    std::uint64_t tokens = 0;
+    LlamaEngine::Stats stats;
+    std::vector<std::string> replies;
+};
+
+bool runBurst(const char *model, std::uint32_t sequences, int requests, Run *run) {
+    LlamaEngine::Options options;
+    options.model_path = model;
+    options.max_sequences = sequences;
+    options.context_size = 1024 * sequences;
+    LlamaEngine engine(options);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool woken = false;
+    engine.setWakeup([&] {
+        std::lock_guard<std::mutex> lock(mutex);
+        woken = true;
+        cv.notify_one();
+    });
+    if (!engine.start()) {
+        return false;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::unordered_map<std::uint64_t, int> index;
+    for (int i = 0; i < requests; ++i) {
+        GenerationParams params;
+        params.temperature = 0.0f;
+        params.max_tokens = 16 + (i * 13) % 49;
+        index[engine.submit(screenText(i), params)] = i;
+    }
+    run->replies.assign(static_cast<std::size_t>(requests), {});
+    int finished = 0;
+    while (finished < requests) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return woken; });
+            woken = false;
+        }
+        engine.drain([&](EngineEvent &&event) {
+            if (event.kind == EngineEvent::Kind::kToken) {
+                run->replies[static_cast<std::size_t>(index[event.request])] += event.text;
+                ++run->tokens;
+            } else {
+                ++finished;
+            }
+        });
+    }
+    run->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    run->stats = engine.stats();
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <model.gguf> [requests]\n", argv[0]);
+        return 1;
+    }
+    const int requests = argc > 2 ? std::atoi(argv[2]) : 32;
+
+    std::printf("%4s %9s %8s %10s %9s %10s %8s\n", "seq", "time (s)", "tokens", "tok/s",
+                "speedup", "tok/step", "differ");
+    Run baseline;
+    for (std::uint32_t sequences : {1u, 2u, 4u, 8u}) {
+        Run run;
+        if (!runBurst(argv[1], sequences, requests, &run)) {
+            std::fprintf(stderr, "cannot load %s\n", argv[1]);
+            return 1;
+        }
+        if (sequences == 1) {
+            baseline = run;
+        }
+        int differ = 0;
+        for (std::size_t i = 0; i < run.replies.size(); ++i) {
+            differ += run.replies[i] != baseline.replies[i];
+        }
+        const double rate = static_cast<double>(run.tokens) / run.seconds;
+        const double base_rate = static_cast<double>(baseline.tokens) / baseline.seconds;
+        std::printf("%4u %9.3f %8llu %10.1f %8.2fx %10.1f %8d\n", sequences, run.seconds,
+                    static_cast<unsigned long long>(run.tokens), rate, rate / base_rate,
+                    static_cast<double>(run.stats.batched_tokens) /
+                        static_cast<double>(std::max<std::uint64_t>(1, run.stats.decode_steps)),
+                    differ);
+    }
+    return 0;
+}
@@ -0,0 +1,207 @@
+// Insert throughput benchmark for note ingest.
+//
+// Several capture threads write OCR-sized notes into a WAL database set up
+// like SqliteStore's: synchronous=NORMAL, a timestamp index and an FTS5
+// index kept by trigger. Compares one autocommit INSERT per note under a
+// mutex (SqliteStore::insertNote) with the write-behind GroupCommitQueue
+// that SqliteStore::enqueueNote uses, for a few batch sizes and delays.
+// Every note's id is awaited through its future before the clock stops.
+
+#include "store/group_commit_queue.h"
+
+#include <sqlite3.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace vibenote;
+
+namespace {
+
+constexpr std::size_t kThreads = 4;
+constexpr std::size_t kNotesPerThread = 5000;
+constexpr std::size_t kTextBytes = 1200;
+constexpr std::size_t kEnrichedBytes = 300;
+
+struct Note {
+    std::int64_t timestamp;
+    std::int64_t window_id;
+    std::string text;
+    std::string enriched_text;
+    std::string metadata;
+};
+
+using NoteQueue = GroupCommitQueue<Note, std::int64_t>;
+
+void exec(sqlite3 *db, const char *sql) {
+    char *err = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &err) != SQLITE_OK) {
+        std::string msg = err ? err : "unknown error";
+        sqlite3_free(err);
+        throw std::runtime_error(msg);
+    }
+}
+
+class Database {
+public:
+    explicit Database(const std::string &path) {
+        ::unlink(path.c_str());
+        ::unlink((path + "-wal").c_str());
+        ::unlink((path + "-shm").c_str());
+        if (sqlite3_open(path.c_str(), &db_) != SQLITE_OK) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        exec(db_, "PRAGMA journal_mode=WAL;");
+        exec(db_, "PRAGMA synchronous=NORMAL;");
+        exec(db_,
+             "CREATE TABLE notes(id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER,"
+             " window_id INTEGER, text TEXT, enriched_text TEXT, metadata TEXT);"
+             "CREATE INDEX idx_notes_timestamp ON notes(timestamp);"
+             "CREATE VIRTUAL TABLE notes_fts USING fts5(content, content_rowid='id');"
+             "CREATE TRIGGER notes_fts_insert AFTER INSERT ON notes BEGIN"
+             " INSERT INTO notes_fts(rowid, content)"
+             " VALUES(new.id, new.text || ' ' || new.enriched_text); END;");
+        sqlite3_prepare_v2(db_,
+                           "INSERT INTO notes(timestamp, window_id, text, enriched_text, metadata)"
+                           " VALUES(?,?,?,?,?);",
+                           -1, &insert_, nullptr);
+    }
+    ~Database() {
+        sqlite3_finalize(insert_);
+        sqlite3_close(db_);
+    }
+
+    // What SqliteStore::insertNote does.
+    std::int64_t insertOne(const Note &note) {
+        std::lock_guard lock(mutex_);
+        return insert(note);
+    }
+
+    // What SqliteStore::commitNotes does with a batch.
+    void commit(std::vector<NoteQueue::Entry> &batch) {
+        std::lock_guard lock(mutex_);
+        std::vector<std::int64_t> ids(batch.size());
+        exec(db_, "BEGIN IMMEDIATE;");
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            ids[i] = insert(batch[i].item);
+        }
+        exec(db_, "COMMIT;");
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            batch[i].result.set_value(ids[i]);
+        }
+    }
+
+private:
+    std::int64_t insert(const Note &note) {
+        sqlite3_reset(insert_);
+        sqlite3_bind_int64(insert_, 1, note.timestamp);
+        sqlite3_bind_int64(insert_, 2, note.window_id);
+        sqlite3_bind_text(insert_, 3, note.text.data(), static_cast<int>(note.text.size()),
+                          SQLITE_STATIC);
+        sqlite3_bind_text(insert_, 4, note.enriched_text.data(),
+                          static_cast<int>(note.enriched_text.size()), SQLITE_STATIC);
+        sqlite3_bind_text(insert_, 5, note.metadata.data(), static_cast<int>(note.metadata.size()),
+                          SQLITE_STATIC);
+        const int rc = sqlite3_step(insert_);
+        sqlite3_reset(insert_);
+        sqlite3_clear_bindings(insert_);
+        if (rc != SQLITE_DONE) {
+            throw std::runtime_error("insert note failed");
+        }
+        return sqlite3_last_insert_rowid(db_);
+    }
+
+    std::mutex mutex_;
+    sqlite3 *db_ = nullptr;
+    sqlite3_stmt *insert_ = nullptr;
+};
+
+Note makeNote(std::size_t thread, std::size_t i) {
+    Note note;
+    note.timestamp = static_cast<std::int64_t>(1700000000 + i);
+    note.window_id = static_cast<std::int64_t>(thread + 1);
+    note.text.assign(kTextBytes, 'a' + static_cast<char>(i % 26));
+    note.enriched_text.assign(kEnrichedBytes, 'e');
+    note.metadata = "{\"app\":\"editor\",\"ocr\":\"tesseract\",\"confidence\":0.93}";
+    return note;
+}
+
+// Runs kThreads writers of kNotesPerThread notes each; returns notes/s.
+template <typename Write>
+double run(Write write) {
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&write, t] {
+            std::vector<std::future<std::int64_t>> ids;
+            ids.reserve(kNotesPerThread);
+            for (std::size_t i = 0; i < kNotesPerThread; ++i) {
+                ids.push_back(write(makeNote(t, i)));
+            }
+            for (auto &id : ids) {
+                id.get();
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const double secs =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return static_cast<double>(kThreads * kNotesPerThread) / secs;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const std::string path = argc > 1 ? argv[1] : "/tmp/vibenote_bench_ingest.db";
+    std::printf("%zu threads x %zu notes of %zu bytes\n\n", kThreads, kNotesPerThread,
+                kTextBytes + kEnrichedBytes);
+    std::printf("%-28s %12s %12s\n", "mode", "notes/s", "avg batch");
+
+    double unbatched = 0;
+    {
+        Database db(path);
+        unbatched = run([&db](Note note) {
+            std::promise<std::int64_t> id;
+            id.set_value(db.insertOne(note));
+            return id.get_future();
+        });
+        std::printf("%-28s %12.0f %12s\n", "autocommit per note", unbatched, "1");
+    }
+
+    const NoteQueue::Options configs[] = {
+        {16, std::chrono::milliseconds(1)},
+        {64, std::chrono::milliseconds(2)},
+        {256, std::chrono::milliseconds(5)},
+        {1024, std::chrono::milliseconds(10)},
+    };
+    for (const NoteQueue::Options &options : configs) {
+        Database db(path);
+        double rate = 0;
+        double batch = 0;
+        {
+            NoteQueue queue([&db](std::vector<NoteQueue::Entry> &entries) { db.commit(entries); },
+                            options);
+            rate = run([&queue](Note note) { return queue.submit(std::move(note)); });
+            batch = static_cast<double>(queue.committedItems()) /
+                    static_cast<double>(queue.committedBatches());
+        }
+        char mode[64];
+        std::snprintf(mode, sizeof(mode), "batch %zu / %lld ms", options.max_batch,
+                      static_cast<long long>(options.max_delay.count()));
+        std::printf("%-28s %12.0f %12.1f   %.1fx\n", mode, rate, batch, rate / unbatched);
+    }
+    ::unlink(path.c_str());
+    ::unlink((path + "-wal").c_str());
+    ::unlink((path + "-shm").c_str());
+    return 0;
+}
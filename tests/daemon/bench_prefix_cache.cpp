@@ -0,0 +1,153 @@
+// Prompt-processing benchmark for LlamaEngine's prefix cache.
+//
+// Runs the same sequence of short summaries (a long fixed instruction
+// preamble followed by a few lines of screen text, 4 generated tokens) three
+// ways: with the preamble inlined into every prompt, with it passed as a
+// cached prefix, and with a fresh engine that restores the prefix from the
+// state file the previous run saved. Reports time per summary and the
+// prompt tokens evaluated versus reused.
+//
+// Usage: bench_prefix_cache <model.gguf> [cache-dir]
+
+#include "llama_engine.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <string>
+
+using namespace vibenote;
+
+namespace {
+
+constexpr int kSummaries = 16;
+
+double seconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+std::string preamble() {
+    std::string text =
+        "You are VibeNote, a private assistant that keeps a running journal of what the "
+        "user does on their computer. You will be given text recognized from a screenshot "
+        "of the active window. Write one or two sentences describing the activity: which "
+        "application is in use, what the user is working on, and any files, people, "
+        "projects or websites that are named. Do not speculate beyond the text. Do not "
+        "repeat the text verbatim. Prefer concrete nouns over adjectives.\n";
+    std::string rules;
+    for (int i = 0; i < 6; ++i) {
+        rules += "Rule " + std::to_string(i + 1) +
+                 ": keep the summary factual, short, and free of personal data such as "
+                 "passwords, tokens or payment details even if they appear on screen.\n";
+    }
+    return text + rules + "\nScreen text:\n";
+}
+
+std::string note(int i) {
+    return "main.cpp - VibeNote - Visual Studio Code\nvoid runSummary(InferenceBackend *llama, "
+           "TaskQueue *queue) line " + std::to_string(40 + i) + "\nPROBLEMS 0  OUTPUT  TERMINAL\n";
+}
+
+class SyncEngine {
+public:
+    explicit SyncEngine(const LlamaEngine::Options &options) : engine_(options) {
+        engine_.setWakeup([this] {
+            std::lock_guard<std::mutex> lock(mutex_);
+            woken_ = true;
+            cv_.notify_one();
+        });
+    }
+
+    bool start() { return engine_.start(); }
+    LlamaEngine::Stats stats() const { return engine_.stats(); }
+
+    // Submits one request and waits for it to finish.
+    void run(const std::string &prompt, const std::string &prefix) {
+        GenerationParams params;
+        params.max_tokens = 4;
+        params.temperature = 0.0f;
+        engine_.submit(prompt, params, prefix);
+        bool finished = false;
+        while (!finished) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return woken_; });
+                woken_ = false;
+            }
+            engine_.drain([&finished](EngineEvent &&event) {
+                finished = finished || event.kind != EngineEvent::Kind::kToken;
+            });
+        }
+    }
+
+private:
+    LlamaEngine engine_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool woken_ = false;
+};
+
+void report(const char *label, double total, const LlamaEngine::Stats &stats) {
+    std::printf("%-18s %8.1f ms/summary  evaluated %6llu  reused %6llu  hits %llu  misses %llu\n",
+                label, total * 1e3 / kSummaries,
+                static_cast<unsigned long long>(stats.prompt_tokens_evaluated),
+                static_cast<unsigned long long>(stats.prompt_tokens_reused),
+                static_cast<unsigned long long>(stats.prefix_hits),
+                static_cast<unsigned long long>(stats.prefix_misses));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <model.gguf> [cache-dir]\n", argv[0]);
+        return 1;
+    }
+    LlamaEngine::Options options;
+    options.model_path = argv[1];
+    options.context_size = 4096;
+    options.prefix_cache_dir = argc > 2 ? argv[2] : "/tmp/vibenote_bench_kv";
+    std::filesystem::remove_all(options.prefix_cache_dir);
+
+    const std::string prefix = preamble();
+
+    {
+        SyncEngine engine(options);
+        if (!engine.start()) {
+            std::fprintf(stderr, "cannot load %s\n", argv[1]);
+            return 1;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kSummaries; ++i) {
+            engine.run(prefix + note(i), {});
+        }
+        report("inlined preamble", seconds(std::chrono::steady_clock::now() - start), engine.stats());
+    }
+    {
+        SyncEngine engine(options);
+        engine.start();
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kSummaries; ++i) {
+            engine.run(note(i), prefix);
+        }
+        report("cached prefix", seconds(std::chrono::steady_clock::now() - start), engine.stats());
+    }
+    {
+        // A restarted daemon: the first summary loads the saved state.
+        SyncEngine engine(options);
+        engine.start();
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kSummaries; ++i) {
+            engine.run(note(i), prefix);
+        }
+        const LlamaEngine::Stats stats = engine.stats();
+        report("after restart", seconds(std::chrono::steady_clock::now() - start), stats);
+        if (stats.prefix_misses != 0) {
+            std::fprintf(stderr, "prefix state was not restored from disk\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Contention benchmark for TaskQueue.
+//
+// Reproduces the watch-mode flood: the low band holds max_queue_depth - 1
+// watch tasks whose type is already at its concurrency limit while several
+// threads push interactive work through enqueue/dequeue/taskCompleted. Every
+// wake-up used to rescan the blocked watch backlog; with per-class buckets the
+// cost of a round trip should not depend on the backlog size.
+
+#include "queue.h"
+#include "gpu_guard.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace vibenote;
+
+namespace {
+
+constexpr int kRoundTripsPerThread = 200000;
+
+Task makeTask(TaskType type, TaskPriority prio, std::uint64_t id) {
+    Task t;
+    t.id = id;
+    t.type = type;
+    t.priority = prio;
+    return t;
+}
+
+double runScenario(int threads, std::size_t backlog) {
+    QueueConfig cfg;
+    cfg.max_queue_depth = backlog + static_cast<std::size_t>(threads) + 1;
+    cfg.max_concurrent[TaskType::kWatch] = 1;
+    cfg.max_concurrent[TaskType::kInteractive] = static_cast<std::size_t>(threads);
+    cfg.rate_limits.clear();  // measure scheduling, not admission
+
+    GpuGuard guard;  // unmonitored: admits every task
+    TaskQueue queue(&guard, cfg);
+
+    // Occupy the only watch slot so the backlog below can never run.
+    queue.enqueue(makeTask(TaskType::kWatch, TaskPriority::kLow, 0));
+    queue.dequeue();
+    for (std::size_t i = 0; i < backlog; ++i) {
+        queue.enqueue(makeTask(TaskType::kWatch, TaskPriority::kLow, 1 + i));
+    }
+
+    std::atomic<bool> go{false};
+    std::vector<std::thread> workers;
+    for (int w = 0; w < threads; ++w) {
+        workers.emplace_back([&, w] {
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            std::uint64_t base = (static_cast<std::uint64_t>(w) + 1) << 32;
+            for (int i = 0; i < kRoundTripsPerThread; ++i) {
+                queue.enqueue(makeTask(TaskType::kInteractive,
+                                       i % 2 ? TaskPriority::kNormal : TaskPriority::kHigh,
+                                       base + static_cast<std::uint64_t>(i)));
+                Task t = queue.dequeue();
+                queue.taskCompleted(t.id);
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto &th : workers) {
+        th.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(threads) * kRoundTripsPerThread / elapsed.count();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    int maxThreads = argc > 1 ? std::atoi(argv[1])
+                              : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+    std::printf("%-8s %-8s %16s\n", "threads", "backlog", "round-trips/s");
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        for (std::size_t backlog : {std::size_t{0}, std::size_t{127}}) {
+            std::printf("%-8d %-8zu %16.0f\n", threads, backlog, runScenario(threads, backlog));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Tail-latency comparison of FIFO and shortest-job-first with aging.
+//
+// One worker serves a stream of interactive tasks: mostly short overlay
+// queries with an occasional multi-thousand-token prompt. Service time is
+// proportional to the estimated token cost. The same arrival sequence runs
+// with aging_per_token = 0 (FIFO) and with the default aging, and the queue
+// wait percentiles of short and long tasks are printed for both.
+
+#include "queue.h"
+#include "gpu_guard.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace vibenote;
+
+namespace {
+
+constexpr int kTasks = 600;
+constexpr std::size_t kShortBytes = 80;     // ~20 tokens
+constexpr std::size_t kLongBytes = 12000;   // ~3000 tokens
+constexpr auto kServicePerToken = std::chrono::microseconds(15);
+constexpr auto kMeanInterArrival = std::chrono::microseconds(6000);
+
+struct Sample {
+    bool isShort;
+    double waitMs;
+};
+
+double percentile(std::vector<double> v, double p) {
+    if (v.empty()) {
+        return 0.0;
+    }
+    std::sort(v.begin(), v.end());
+    return v[static_cast<std::size_t>(p * static_cast<double>(v.size() - 1))];
+}
+
+void runScenario(const char *name, std::chrono::microseconds aging) {
+    QueueConfig cfg;
+    cfg.max_queue_depth = kTasks;
+    cfg.max_concurrent[TaskType::kInteractive] = 1;
+    cfg.rate_limits.clear();
+    cfg.coalesce_prompts = false;
+    cfg.aging_per_token = aging;
+
+    GpuGuard guard;  // unmonitored: admits every task
+    TaskQueue queue(&guard, cfg);
+    std::vector<std::chrono::steady_clock::time_point> enqueued(kTasks + 1);
+    std::vector<Sample> samples;
+    samples.reserve(kTasks);
+
+    std::thread worker([&] {
+        for (int served = 0; served < kTasks; ++served) {
+            Task t = queue.dequeue();
+            auto wait = std::chrono::steady_clock::now() - enqueued[t.id];
+            samples.push_back({t.prompt.size() == kShortBytes,
+                               std::chrono::duration<double, std::milli>(wait).count()});
+            std::this_thread::sleep_for(kServicePerToken * static_cast<long>(t.estimated_cost));
+            queue.taskCompleted(t.id);
+        }
+    });
+
+    std::mt19937 rng(42);
+    std::exponential_distribution<double> gap(1.0 / static_cast<double>(kMeanInterArrival.count()));
+    std::bernoulli_distribution isLong(0.1);
+    for (int i = 1; i <= kTasks; ++i) {
+        Task t;
+        t.id = static_cast<std::uint64_t>(i);
+        t.type = TaskType::kInteractive;
+        t.priority = TaskPriority::kHigh;
+        t.prompt.assign(isLong(rng) ? kLongBytes : kShortBytes, 'x');
+        enqueued[t.id] = std::chrono::steady_clock::now();
+        queue.enqueue(std::move(t));
+        std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long>(gap(rng))));
+    }
+    worker.join();
+
+    std::vector<double> shortWaits;
+    std::vector<double> longWaits;
+    for (const auto &s : samples) {
+        (s.isShort ? shortWaits : longWaits).push_back(s.waitMs);
+    }
+    std::printf("%-6s %10.1f %10.1f %10.1f %10.1f\n", name, percentile(shortWaits, 0.5),
+                percentile(shortWaits, 0.99), percentile(longWaits, 0.5),
+                percentile(longWaits, 0.99));
+}
+
+} // namespace
+
+int main() {
+    std::printf("%-6s %10s %10s %10s %10s\n", "order", "short p50", "short p99", "long p50",
+                "long p99");
+    runScenario("fifo", std::chrono::microseconds(0));
+    runScenario("sjf", QueueConfig{}.aging_per_token);
+    return 0;
+}
@@ -0,0 +1,132 @@
+// Speculative decoding benchmark for LlamaEngine.
+//
+// Generates the same greedy summaries with and without a draft model and
+// reports generated tokens per second, the draft acceptance rate, how many
+// sequences fell back to plain decoding, and how many replies differ from
+// the plain run (verification keeps them identical up to the rounding of
+// batched kernels).
+//
+// Usage: bench_speculative <model.gguf> <draft.gguf> [requests] [sequences]
+
+#include "llama_engine.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace vibenote;
+
+namespace {
+
+std::string screenText(int i) {
+    return "Firefox - Pull request #" + std::to_string(120 + i) +
+           " - Add speculative decoding - GitHub\nFiles changed 4  Conversation 2  Commits 3\n"
+           "daemon/src/llama_engine.cpp  +212 -38\nReview requested from the daemon owners\n";
+}
+
+struct Run {
+    double seconds = 0;
+    std::uint64_t pieces = 0;
+    LlamaEngine::Stats stats;
+    std::vector<std::string> replies;
+};
+
+bool runBurst(LlamaEngine::Options options, int requests, Run *run) {
+    LlamaEngine engine(options);
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool woken = false;
+    engine.setWakeup([&] {
+        std::lock_guard<std::mutex> lock(mutex);
+        woken = true;
+        cv.notify_one();
+    });
+    if (!engine.start()) {
+        return false;
+    }
+    if (!options.draft_model_path.empty() && !engine.speculative()) {
+        std::fprintf(stderr, "draft model not usable, running without it\n");
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::unordered_map<std::uint64_t, int> index;
+    for (int i = 0; i < requests; ++i) {
+        GenerationParams params;
+        params.temperature = 0.0f;
+        params.max_tokens = 64;
+        index[engine.submit(screenText(i), params)] = i;
+    }
+    run->replies.assign(static_cast<std::size_t>(requests), {});
+    int finished = 0;
+    while (finished < requests) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return woken; });
+            woken = false;
+        }
+        engine.drain([&](EngineEvent &&event) {
+            if (event.kind == EngineEvent::Kind::kToken) {
+                run->replies[static_cast<std::size_t>(index[event.request])] += event.text;
+                ++run->pieces;
+            } else {
+                ++finished;
+            }
+        });
+    }
+    run->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    run->stats = engine.stats();
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::fprintf(stderr, "usage: %s <model.gguf> <draft.gguf> [requests] [sequences]\n", argv[0]);
+        return 1;
+    }
+    const int requests = argc > 3 ? std::atoi(argv[3]) : 8;
+    LlamaEngine::Options options;
+    options.model_path = argv[1];
+    options.max_sequences = argc > 4 ? static_cast<std::uint32_t>(std::atoi(argv[4])) : 1;
+    options.context_size = 1024 * options.max_sequences;
+
+    // The first load pays for reading the file; keep it out of the timings.
+    Run warmup;
+    Run plain;
+    Run speculative;
+    if (!runBurst(options, 1, &warmup) || !runBurst(options, requests, &plain)) {
+        std::fprintf(stderr, "cannot load %s\n", argv[1]);
+        return 1;
+    }
+    options.draft_model_path = argv[2];
+    if (!runBurst(options, requests, &speculative)) {
+        return 1;
+    }
+
+    int differ = 0;
+    for (std::size_t i = 0; i < plain.replies.size(); ++i) {
+        differ += plain.replies[i] != speculative.replies[i];
+    }
+    const auto &s = speculative.stats;
+    std::printf("%-12s %9s %8s %10s\n", "", "time (s)", "tokens", "tok/s");
+    for (const auto &[label, run] : {std::pair<const char *, const Run &>{"plain", plain},
+                                     std::pair<const char *, const Run &>{"speculative", speculative}}) {
+        std::printf("%-12s %9.3f %8llu %10.1f\n", label, run.seconds,
+                    static_cast<unsigned long long>(run.pieces),
+                    static_cast<double>(run.pieces) / run.seconds);
+    }
+    std::printf("drafted %llu accepted %llu (%.1f%%), fallbacks %llu, replies differing %d\n",
+                static_cast<unsigned long long>(s.draft_tokens_proposed),
+                static_cast<unsigned long long>(s.draft_tokens_accepted),
+                s.draft_tokens_proposed ? 100.0 * static_cast<double>(s.draft_tokens_accepted) /
+                                              static_cast<double>(s.draft_tokens_proposed)
+                                        : 0.0,
+                static_cast<unsigned long long>(s.speculation_fallbacks), differ);
+    return 0;
+}
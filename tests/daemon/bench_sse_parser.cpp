@@ -0,0 +1,210 @@
+// Replay benchmark for SseStreamParser.
+//
+// Replays llama-server streaming responses (HTTP/1.1, chunked, one SSE event
+// per chunk, several responses back to back on one keep-alive connection)
+// through the parser with different socket read sizes, checks that every
+// read size yields the same token text, and reports throughput. The same
+// bytes also go through the previous LlamaClient approach (append to a flat
+// buffer, search for "\n\n" from the front, erase the consumed prefix) for
+// comparison; that baseline reuses the targeted token scan, so it leaves out
+// the per-event QJsonDocument the old client also built.
+//
+// Usage: bench_sse_parser [capture]
+// `capture` is a raw response recording, e.g. from
+//   curl -sN --raw -i http://127.0.0.1:8080/v1/completions -d '{..., "stream": true}'
+// Without it a synthetic recording in the same wire format is used.
+
+#include "sse_parser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using namespace vibenote;
+
+namespace {
+
+constexpr int kResponses = 8;
+constexpr int kTokensPerResponse = 256;
+constexpr std::size_t kReplayBytes = 64u << 20;  // per measurement
+
+double seconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+void appendChunk(std::string &out, const std::string &payload) {
+    char size[32];
+    std::snprintf(size, sizeof(size), "%zx\r\n", payload.size());
+    out += size;
+    out += payload;
+    out += "\r\n";
+}
+
+// Mirrors what llama-server sends for POST /v1/completions with stream=true.
+std::string recordStreams(std::string *expected) {
+    static const char *kWords[] = {" the", " user", " edited", " main.cpp", " in", " VS Code",
+                                   ",", " then", " ran", " \\\"make\\\"", "\\n", " caf\\u00e9",
+                                   " \\ud83d\\ude00", " and", " reviewed", " a", " PR", "."};
+    static const char *kDecoded[] = {" the", " user", " edited", " main.cpp", " in", " VS Code",
+                                     ",", " then", " ran", " \"make\"", "\n", " caf\xc3\xa9",
+                                     " \xf0\x9f\x98\x80", " and", " reviewed", " a", " PR", "."};
+    constexpr std::size_t kWordCount = sizeof(kWords) / sizeof(kWords[0]);
+
+    std::string wire;
+    for (int r = 0; r < kResponses; ++r) {
+        wire += "HTTP/1.1 200 OK\r\n"
+                "Keep-Alive: timeout=5, max=100\r\n"
+                "Content-Type: text/event-stream\r\n"
+                "Server: llama.cpp\r\n"
+                "Transfer-Encoding: chunked\r\n"
+                "Access-Control-Allow-Origin: \r\n"
+                "\r\n";
+        for (int t = 0; t < kTokensPerResponse; ++t) {
+            const std::size_t w = static_cast<std::size_t>(r * 7 + t) % kWordCount;
+            std::string event = "data: {\"choices\":[{\"text\":\"";
+            event += kWords[w];
+            event += "\",\"index\":0,\"logprobs\":null,\"finish_reason\":null}],"
+                     "\"created\":1718000000,\"model\":\"gpt-3.5-turbo\","
+                     "\"system_fingerprint\":\"b3412-5e2727f\",\"object\":\"text_completion\","
+                     "\"id\":\"chatcmpl-3tR0cmLUbDRC1BXWSgyYrqnB5hAJ3A0B\"}\n\n";
+            appendChunk(wire, event);
+            *expected += kDecoded[w];
+        }
+        appendChunk(wire, "data: {\"choices\":[{\"text\":\"\",\"index\":0,\"logprobs\":null,"
+                          "\"finish_reason\":\"stop\"}],\"created\":1718000000,"
+                          "\"model\":\"gpt-3.5-turbo\",\"object\":\"text_completion\","
+                          "\"id\":\"chatcmpl-3tR0cmLUbDRC1BXWSgyYrqnB5hAJ3A0B\"}\n\n");
+        appendChunk(wire, "data: [DONE]\n\n");
+        wire += "0\r\n\r\n";
+    }
+    return wire;
+}
+
+struct Result {
+    std::string text;
+    std::size_t tokens = 0;
+    int done = 0;
+    int messages = 0;
+    bool error = false;
+};
+
+Result replay(const std::string &wire, std::size_t read_size, bool keep_text) {
+    Result result;
+    SseStreamParser parser;
+    std::size_t offset = 0;
+    while (offset < wire.size() && !result.error) {
+        std::span<char> free = parser.ring().writable();
+        const std::size_t n = std::min({free.size(), read_size, wire.size() - offset});
+        std::memcpy(free.data(), wire.data() + offset, n);
+        parser.ring().commit(n);
+        offset += n;
+
+        std::string_view token;
+        for (auto event = parser.next(&token); event != SseStreamParser::Event::kNeedMore;
+             event = parser.next(&token)) {
+            if (event == SseStreamParser::Event::kToken) {
+                ++result.tokens;
+                if (keep_text) {
+                    result.text.append(token);
+                }
+            } else if (event == SseStreamParser::Event::kDone) {
+                ++result.done;
+            } else if (event == SseStreamParser::Event::kMessageEnd) {
+                ++result.messages;
+            } else if (event == SseStreamParser::Event::kError) {
+                result.error = true;
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+// The pre-parser LlamaClient loop, on std::string instead of QByteArray.
+std::size_t replayLegacy(const std::string &wire, std::size_t read_size) {
+    std::size_t tokens = 0;
+    std::string buffer;
+    std::string scratch;
+    for (std::size_t offset = 0; offset < wire.size(); offset += read_size) {
+        buffer.append(wire, offset, read_size);
+        while (true) {
+            const std::size_t idx = buffer.find("\n\n");
+            if (idx == std::string::npos) {
+                break;
+            }
+            std::string event = buffer.substr(0, idx);
+            buffer.erase(0, idx + 2);
+            const std::size_t data = event.find("data: ");
+            if (data == std::string::npos) {
+                continue;
+            }
+            std::string_view token;
+            if (SseStreamParser::extractToken(std::string_view(event).substr(data + 6), scratch,
+                                              &token)) {
+                ++tokens;
+            }
+        }
+    }
+    return tokens;
+}
+
+template <typename Fn>
+double measure(const std::string &wire, Fn fn) {
+    const std::size_t rounds = std::max<std::size_t>(1, kReplayBytes / wire.size());
+    const auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < rounds; ++i) {
+        fn();
+    }
+    return seconds(std::chrono::steady_clock::now() - start) / static_cast<double>(rounds);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::string expected;
+    std::string wire;
+    if (argc > 1) {
+        std::ifstream in(argv[1], std::ios::binary);
+        if (!in) {
+            std::fprintf(stderr, "cannot open %s\n", argv[1]);
+            return 1;
+        }
+        wire.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    } else {
+        wire = recordStreams(&expected);
+    }
+
+    const Result reference = replay(wire, wire.size(), true);
+    if (reference.error) {
+        std::fprintf(stderr, "parse error in recording\n");
+        return 1;
+    }
+    if (!expected.empty() && reference.text != expected) {
+        std::fprintf(stderr, "decoded text does not match the recording\n");
+        return 1;
+    }
+    std::printf("recording: %zu bytes, %d responses, %zu tokens, %d [DONE]\n", wire.size(),
+                reference.messages, reference.tokens, reference.done);
+
+    std::printf("%10s %14s %12s %14s %12s\n", "read", "parser MB/s", "ns/token", "legacy MB/s",
+                "ns/token");
+    for (std::size_t read_size : {1ul, 61ul, 1460ul, 16384ul, 262144ul}) {
+        const Result check = replay(wire, read_size, true);
+        if (check.error || check.text != reference.text || check.messages != reference.messages) {
+            std::fprintf(stderr, "read size %zu: output differs from reference\n", read_size);
+            return 1;
+        }
+        const double parser = measure(wire, [&] { replay(wire, read_size, false); });
+        const double legacy = measure(wire, [&] { replayLegacy(wire, read_size); });
+        const double mb = static_cast<double>(wire.size()) / 1e6;
+        const double tokens = static_cast<double>(reference.tokens);
+        std::printf("%10zu %14.1f %12.1f %14.1f %12.1f\n", read_size, mb / parser,
+                    parser * 1e9 / tokens, mb / legacy, legacy * 1e9 / tokens);
+    }
+    return 0;
+}
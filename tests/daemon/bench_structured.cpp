@@ -0,0 +1,150 @@
+// Token cost of structured summaries with and without a JSON-schema
+// constraint.
+//
+// The free-text run asks for the JSON object in the prompt and re-prompts
+// (up to three attempts, new seed each time) until the reply parses with
+// the fields the daemon needs; the constrained run passes the schema to the
+// engine and makes one attempt. Reports valid replies, generated tokens per
+// valid summary and wall time.
+//
+// Usage: bench_structured <model.gguf> [requests]
+
+#include "llama_engine.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+
+#include <nlohmann/json.hpp>
+
+using namespace vibenote;
+
+namespace {
+
+// summarySchema() from daemon/src/structured_summary.cpp as QJsonDocument
+// serializes it (keys sorted).
+constexpr char kSchema[] = R"({
+  "additionalProperties": false,
+  "properties": {
+    "activity": {"maxLength": 240, "type": "string"},
+    "entities": {"items": {"maxLength": 60, "type": "string"}, "maxItems": 8, "type": "array"},
+    "title": {"maxLength": 80, "type": "string"}
+  },
+  "required": ["title", "activity", "entities"],
+  "type": "object"
+})";
+
+constexpr int kAttempts = 3;
+
+std::string prompt(int i) {
+    return "Describe the screen below as a JSON object with a short \"title\", the user's "
+           "\"activity\" and a list of \"entities\" (files, people, projects).\n\nScreen text:\n"
+           "Thunderbird - Inbox - Re: release notes for 0." + std::to_string(i) +
+           "\nFrom: Dana  To: daemon-team\nPlease review the changelog before Friday\n";
+}
+
+bool valid(const std::string &reply) {
+    const auto json = nlohmann::json::parse(reply, nullptr, false);
+    return json.is_object() && json.contains("title") && json["title"].is_string() &&
+           json.contains("activity") && json["activity"].is_string() &&
+           json.contains("entities") && json["entities"].is_array();
+}
+
+class SyncEngine {
+public:
+    explicit SyncEngine(const LlamaEngine::Options &options) : engine_(options) {
+        engine_.setWakeup([this] {
+            std::lock_guard<std::mutex> lock(mutex_);
+            woken_ = true;
+            cv_.notify_one();
+        });
+    }
+
+    bool start() { return engine_.start(); }
+
+    // Runs one request to completion; counts its tokens into *tokens.
+    std::string run(const std::string &text, const GenerationParams &params, std::uint64_t *tokens) {
+        engine_.submit(text, params);
+        std::string reply;
+        bool finished = false;
+        while (!finished) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return woken_; });
+                woken_ = false;
+            }
+            engine_.drain([&](EngineEvent &&event) {
+                if (event.kind == EngineEvent::Kind::kToken) {
+                    reply += event.text;
+                    ++*tokens;
+                } else {
+                    finished = true;
+                }
+            });
+        }
+        return reply;
+    }
+
+private:
+    LlamaEngine engine_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool woken_ = false;
+};
+
+void report(const char *label, int requests, int ok, std::uint64_t tokens, double seconds) {
+    std::printf("%-12s valid %3d/%-3d  tokens %6llu  tokens/valid %8.1f  %7.3f s\n", label, ok,
+                requests, static_cast<unsigned long long>(tokens),
+                ok ? static_cast<double>(tokens) / ok : static_cast<double>(tokens), seconds);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <model.gguf> [requests]\n", argv[0]);
+        return 1;
+    }
+    const int requests = argc > 2 ? std::atoi(argv[2]) : 16;
+    LlamaEngine::Options options;
+    options.model_path = argv[1];
+    SyncEngine engine(options);
+    if (!engine.start()) {
+        std::fprintf(stderr, "cannot load %s\n", argv[1]);
+        return 1;
+    }
+
+    GenerationParams params;
+    params.max_tokens = 160;
+    params.temperature = 0.7f;
+
+    std::uint64_t tokens = 0;
+    int ok = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < requests; ++i) {
+        for (int attempt = 0; attempt < kAttempts; ++attempt) {
+            params.seed = static_cast<std::uint32_t>(i * kAttempts + attempt);
+            if (valid(engine.run(prompt(i), params, &tokens))) {
+                ++ok;
+                break;
+            }
+        }
+    }
+    report("re-prompted", requests, ok, tokens,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    params.json_schema = kSchema;
+    tokens = 0;
+    ok = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < requests; ++i) {
+        params.seed = static_cast<std::uint32_t>(i);
+        ok += valid(engine.run(prompt(i), params, &tokens));
+    }
+    report("constrained", requests, ok, tokens,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    return 0;
+}
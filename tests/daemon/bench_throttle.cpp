@@ -0,0 +1,162 @@
+// Throughput and overshoot of inference throttling on utilization traces.
+//
+// Replays background utilization (recorded with a ResourceMonitor, or a
+// generated bursty GPU load) and simulates four inference slots on top: each
+// running slot adds kSlotUtil points to the next sample, as the device only
+// shows new work once it is loaded. Demand never runs out. Two policies
+// decide how many slots run after every sample:
+//
+//   threshold  the former GpuGuard::pollGpu: pause above 85%, resume below
+//              75%, all slots or none.
+//   forecast   ThrottleController: Holt-smoothed forecast, slots in
+//              proportion to the admission share it steers toward 80%.
+//
+// Reports the share of slot time used (throughput), the utilization points
+// above 85% that admitted work added on top of the background (overshoot),
+// how often utilization ended above 85% because of it, and how often
+// inference was paused or resumed (flaps).
+//
+// Usage: bench_throttle [trace.csv ...], e.g. traces/psi_bursty.csv
+
+#include "monitor/resource_monitor.h"
+#include "throttle_controller.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace vibenote;
+
+namespace {
+
+constexpr int kSlots = 4;
+constexpr float kSlotUtil = 15.0f;
+constexpr float kThreshold = 85.0f;
+constexpr float kResumeBelow = 75.0f;
+
+// Idle around 20% with bursts of other work to 70-95% lasting 1-4 s.
+std::vector<ResourceSample> burstyGpuTrace(std::size_t samples, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> noise(0.0f, 4.0f);
+    std::uniform_int_distribution<int> idle_len(5, 25);
+    std::uniform_int_distribution<int> burst_len(5, 20);
+    std::uniform_real_distribution<float> burst_level(70.0f, 95.0f);
+    std::vector<ResourceSample> trace;
+    bool burst = false;
+    int left = idle_len(rng);
+    float level = 20.0f;
+    for (std::size_t i = 0; i < samples; ++i) {
+        if (--left <= 0) {
+            burst = !burst;
+            left = burst ? burst_len(rng) : idle_len(rng);
+            level = burst ? burst_level(rng) : 20.0f;
+        }
+        const float util = std::clamp(level + noise(rng), 0.0f, 100.0f);
+        trace.push_back({static_cast<std::int64_t>(i) * 200, util, 12000, 24000});
+    }
+    return trace;
+}
+
+struct Result {
+    double throughput = 0;  // share of slot time used
+    double overshoot = 0;   // mean points above the threshold added by admitted work
+    double over_share = 0;  // share of samples pushed above the threshold by admitted work
+    int flaps = 0;          // transitions between no slots and some slots
+};
+
+template <typename Policy>
+Result simulate(const std::vector<ResourceSample> &trace, Policy policy) {
+    Result result;
+    int running = 0;
+    for (const ResourceSample &background : trace) {
+        ResourceSample seen = background;
+        seen.utilization = std::min(100.0f, background.utilization + kSlotUtil * running);
+        const float excess = seen.utilization - std::max(kThreshold, background.utilization);
+        if (excess > 0) {
+            result.overshoot += excess;
+            result.over_share += 1;
+        }
+        const int next = policy(seen);
+        if ((next == 0) != (running == 0)) {
+            ++result.flaps;
+        }
+        running = next;
+        result.throughput += running;
+    }
+    const auto n = static_cast<double>(trace.size());
+    result.throughput /= n * kSlots;
+    result.overshoot /= n;
+    result.over_share /= n;
+    return result;
+}
+
+Result thresholdPolicy(const std::vector<ResourceSample> &trace) {
+    bool throttled = false;
+    return simulate(trace, [&throttled](const ResourceSample &s) {
+        if (s.utilization > kThreshold) {
+            throttled = true;
+        } else if (throttled && s.utilization < kResumeBelow) {
+            throttled = false;
+        }
+        return throttled ? 0 : kSlots;
+    });
+}
+
+Result forecastPolicy(const std::vector<ResourceSample> &trace) {
+    ThrottleOptions options;
+    options.util_threshold = kThreshold;
+    auto controller = std::make_shared<ThrottleController>(options);
+    return simulate(trace, [controller](const ResourceSample &s) {
+        const double share = controller->update(s);
+        return share <= 0 ? 0 : static_cast<int>(std::ceil(share * kSlots));
+    });
+}
+
+void report(const char *trace, const char *policy, const Result &r) {
+    std::printf("%-22s %-10s %9.1f%% %10.2f %9.1f%% %6d\n", trace, policy, r.throughput * 100,
+                r.overshoot, r.over_share * 100, r.flaps);
+}
+
+void compare(const std::string &name, const std::vector<ResourceSample> &trace) {
+    report(name.c_str(), "threshold", thresholdPolicy(trace));
+    report(name.c_str(), "forecast", forecastPolicy(trace));
+}
+
+std::vector<ResourceSample> load(const std::string &path) {
+    std::vector<ResourceSample> trace;
+    auto monitor = ResourceMonitor::loadReplay(path);
+    if (!monitor) {
+        return trace;
+    }
+    // The replay repeats its last sample once exhausted.
+    for (auto s = monitor->sample(); s; s = monitor->sample()) {
+        if (!trace.empty() && s->time_ms == trace.back().time_ms) {
+            break;
+        }
+        trace.push_back(*s);
+    }
+    return trace;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::printf("%-22s %-10s %10s %10s %10s %6s\n", "trace", "policy", "throughput", "overshoot",
+                "time over", "flaps");
+    compare("generated bursty gpu", burstyGpuTrace(3000, 42));
+    for (int i = 1; i < argc; ++i) {
+        const std::vector<ResourceSample> trace = load(argv[i]);
+        if (trace.empty()) {
+            std::fprintf(stderr, "cannot read trace %s\n", argv[i]);
+            return 1;
+        }
+        std::string name = argv[i];
+        name = name.substr(name.find_last_of('/') + 1);
+        compare(name, trace);
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include <gtest/gtest.h>
+
+#include "gpu_guard.h"
+#include "monitor/resource_monitor.h"
+#include "throttle_controller.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryDir>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using vibenote::ResourceMonitor;
+using vibenote::ResourceSample;
+
+namespace {
+
+class FailingMonitor : public ResourceMonitor {
+public:
+    const char *name() const override { return "failing"; }
+    std::optional<ResourceSample> sample() override { return std::nullopt; }
+};
+
+ResourceSample at(std::int64_t time_ms, float utilization, std::size_t free_mb = 8000) {
+    return ResourceSample{time_ms, utilization, free_mb, 16000};
+}
+
+// Reacts to each sample as it is, and leaves stepping to the test.
+GpuGuard::Limits unsmoothed() {
+    GpuGuard::Limits limits;
+    limits.smoothing = std::chrono::milliseconds(0);
+    limits.trend_smoothing = std::chrono::milliseconds(0);
+    limits.horizon = std::chrono::milliseconds(0);
+    limits.poll_interval = std::chrono::milliseconds(0);
+    return limits;
+}
+
+void writeFile(const QString &path, const QByteArray &contents) {
+    QDir().mkpath(QFileInfo(path).path());
+    QFile file(path);
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+    file.write(contents);
+}
+
+class GpuGuardTest : public ::testing::Test {
+protected:
+    // Signal delivery needs an application object.
+    int argc_ = 0;
+    QCoreApplication app_{argc_, nullptr};
+};
+
+} // namespace
+
+TEST_F(GpuGuardTest, CutsAdmissionAboveThresholdAndReopensGradually) {
+    GpuGuard guard(ResourceMonitor::createReplay({at(0, 50), at(200, 90), at(400, 95), at(600, 84),
+                                                  at(800, 70), at(1000, 70), at(1200, 70)}),
+                   unsmoothed());
+    std::vector<bool> requests;
+    std::vector<double> shares;
+    QObject::connect(&guard, &GpuGuard::throttleRequested,
+                     [&requests](bool throttle) { requests.push_back(throttle); });
+    QObject::connect(&guard, &GpuGuard::admissionChanged,
+                     [&shares](double share) { shares.push_back(share); });
+
+    ASSERT_TRUE(guard.initialize());
+    EXPECT_TRUE(guard.canAcceptWork());
+    EXPECT_DOUBLE_EQ(guard.admission(), 1.0);
+
+    guard.pollGpu();  // 90%: twice as far past the 80% target as the threshold
+    EXPECT_DOUBLE_EQ(guard.admission(), 0.5);
+    EXPECT_TRUE(guard.canAcceptWork());
+
+    guard.pollGpu();  // 95%: a third of that is under min_share
+    EXPECT_FALSE(guard.canAcceptWork());
+    EXPECT_TRUE(guard.getStats().throttled);
+
+    guard.pollGpu();  // 84%: under the threshold but above the target
+    EXPECT_TRUE(guard.getStats().throttled);
+
+    guard.pollGpu();  // 70%: two gaps of headroom at gain 1 reopen 0.4 per 200 ms
+    EXPECT_TRUE(guard.canAcceptWork());
+    EXPECT_NEAR(guard.admission(), 0.4, 1e-9);
+    guard.pollGpu();
+    guard.pollGpu();
+    EXPECT_DOUBLE_EQ(guard.admission(), 1.0);
+
+    EXPECT_EQ(requests, (std::vector<bool>{true, false}));
+    ASSERT_EQ(shares.size(), 5u);
+    EXPECT_DOUBLE_EQ(shares[0], 0.5);
+    EXPECT_EQ(shares[1], 0.0);
+    EXPECT_NEAR(shares[2], 0.4, 1e-9);
+    EXPECT_NEAR(shares[3], 0.8, 1e-9);
+    EXPECT_EQ(shares[4], 1.0);
+}
+
+TEST_F(GpuGuardTest, AdmissionShrinksWithMemoryHeadroom) {
+    // Headroom 800 MB plus half of the 1024 MB ramp.
+    GpuGuard guard(ResourceMonitor::createReplay({at(0, 10, 1312), at(200, 10, 700)}), unsmoothed());
+    ASSERT_TRUE(guard.initialize());
+    EXPECT_DOUBLE_EQ(guard.admission(), 0.5);
+
+    guard.pollGpu();
+    EXPECT_FALSE(guard.canAcceptWork());
+    EXPECT_TRUE(guard.getStats().throttled);
+    EXPECT_EQ(guard.getStats().vramFreeMb, 700u);
+}
+
+TEST_F(GpuGuardTest, SamplesOnItsOwnThread) {
+    GpuGuard::Limits limits = unsmoothed();
+    limits.poll_interval = std::chrono::milliseconds(5);
+    GpuGuard guard(ResourceMonitor::createReplay({at(0, 50), at(200, 95)}), limits);
+    ASSERT_TRUE(guard.initialize());
+    for (int i = 0; i < 200 && guard.canAcceptWork(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    EXPECT_FALSE(guard.canAcceptWork());
+    EXPECT_FLOAT_EQ(guard.getStats().utilization, 95.0f);
+}
+
+TEST_F(GpuGuardTest, FailedMonitorThrottles) {
+    GpuGuard guard(std::make_unique<FailingMonitor>(), unsmoothed());
+    EXPECT_FALSE(guard.initialize());
+    EXPECT_FALSE(guard.canAcceptWork());
+    EXPECT_TRUE(guard.getStats().throttled);
+}
+
+TEST_F(GpuGuardTest, UnmonitoredGuardAdmitsWork) {
+    GpuGuard guard(nullptr, GpuGuard::Limits{});
+    EXPECT_TRUE(guard.initialize());
+    EXPECT_TRUE(guard.canAcceptWork());
+    EXPECT_STREQ(guard.monitorName(), "none");
+}
+
+TEST(ThrottleControllerTest, RunsPartialShareInsteadOfFlapping) {
+    // Four slots of 15 points each over a steady 28% background: all four
+    // reach 88%, so a binary throttle alternates between all and none.
+    vibenote::ThrottleController controller;
+    int slots = 4;
+    int paused = 0;
+    int running = 0;
+    for (int i = 0; i < 100; ++i) {
+        const float seen = 28.0f + 15.0f * static_cast<float>(slots);
+        const double share = controller.update(at(i * 200, seen));
+        slots = static_cast<int>(std::ceil(share * 4));
+        if (i >= 10) {
+            paused += slots == 0;
+            running += slots;
+        }
+    }
+    EXPECT_LE(paused, 5);
+    EXPECT_GE(running, 3 * 90);
+}
+
+TEST(ThrottleControllerTest, ForecastPausesBeforeRisingLoadCrossesThreshold) {
+    vibenote::ThrottleController controller;
+    float util = 40.0f;
+    for (std::int64_t now = 0; util <= 100.0f; util += 2.0f, now += 200) {
+        if (controller.update(at(now, util)) == 0.0) {
+            break;
+        }
+    }
+    EXPECT_LE(util, 85.0f);
+    EXPECT_GT(controller.forecastUtilization(), 85.0f);
+}
+
+TEST(ThrottleControllerTest, RidesOutSingleSpike) {
+    vibenote::ThrottleController controller;
+    for (int i = 0; i < 10; ++i) {
+        controller.update(at(i * 200, 50));
+    }
+    EXPECT_DOUBLE_EQ(controller.update(at(2000, 95)), 1.0);
+    EXPECT_DOUBLE_EQ(controller.update(at(2200, 50)), 1.0);
+}
+
+TEST(ResourceMonitorTest, ReplaysTraceFile) {
+    QTemporaryDir dir;
+    const QString path = dir.filePath(QStringLiteral("trace.csv"));
+    writeFile(path, "time_ms,utilization,memory_free_mb,memory_total_mb\n"
+                    "0,12.5,4000,8000\n"
+                    "# spike\n"
+                    "200, 97 ,3900,8000  # comment\n");
+
+    auto once = ResourceMonitor::create("replay:" + path.toStdString());
+    ASSERT_TRUE(once);
+    EXPECT_STREQ(once->name(), "replay");
+    EXPECT_FLOAT_EQ(once->sample()->utilization, 12.5f);
+    EXPECT_EQ(once->sample()->time_ms, 200);
+    EXPECT_EQ(once->sample()->memory_free_mb, 3900u);  // holds the last sample
+
+    auto looped = ResourceMonitor::loadReplay(path.toStdString(), true);
+    looped->sample();
+    looped->sample();
+    EXPECT_EQ(looped->sample()->time_ms, 0);
+
+    EXPECT_FALSE(ResourceMonitor::loadReplay(dir.filePath(QStringLiteral("missing.csv")).toStdString()));
+}
+
+TEST(ResourceMonitorTest, ReadsCpuPressureAndCgroupMemory) {
+    QTemporaryDir proc;
+    QTemporaryDir cgroup;
+    writeFile(proc.filePath(QStringLiteral("pressure/cpu")),
+              "some avg10=42.50 avg60=10.00 avg300=2.00 total=123456\n"
+              "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    writeFile(proc.filePath(QStringLiteral("meminfo")),
+              "MemTotal:       16777216 kB\nMemFree:         1048576 kB\n"
+              "MemAvailable:    8388608 kB\n");
+    writeFile(proc.filePath(QStringLiteral("self/cgroup")), "0::/vibenote.service\n");
+    writeFile(cgroup.filePath(QStringLiteral("vibenote.service/memory.max")), "1073741824\n");
+    writeFile(cgroup.filePath(QStringLiteral("vibenote.service/memory.current")), "268435456\n");
+
+    auto monitor = ResourceMonitor::createPsi(proc.path().toStdString(), cgroup.path().toStdString());
+    ASSERT_TRUE(monitor);
+    const std::optional<ResourceSample> sample = monitor->sample();
+    ASSERT_TRUE(sample);
+    EXPECT_FLOAT_EQ(sample->utilization, 42.5f);  // first reading is avg10
+    EXPECT_EQ(sample->memory_total_mb, 1024u);    // the cgroup limit, not MemTotal
+    EXPECT_EQ(sample->memory_free_mb, 768u);
+
+    writeFile(cgroup.filePath(QStringLiteral("vibenote.service/memory.max")), "max\n");
+    EXPECT_EQ(monitor->sample()->memory_total_mb, 16384u);
+
+    EXPECT_FALSE(ResourceMonitor::createPsi(cgroup.path().toStdString()));
+}
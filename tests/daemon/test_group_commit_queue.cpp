@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+
+#include "store/group_commit_queue.h"
+
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+using vibenote::GroupCommitQueue;
+
+namespace {
+
+using IntQueue = GroupCommitQueue<int, int>;
+
+// Commits each item as its own square and remembers the batch sizes.
+struct Recorder {
+    std::mutex mutex;
+    std::vector<std::size_t> batches;
+
+    IntQueue::Commit commit() {
+        return [this](std::vector<IntQueue::Entry> &batch) {
+            {
+                std::lock_guard lock(mutex);
+                batches.push_back(batch.size());
+            }
+            for (auto &entry : batch) {
+                entry.result.set_value(entry.item * entry.item);
+            }
+        };
+    }
+};
+
+} // namespace
+
+TEST(GroupCommitQueueTest, CommitsAFullBatchWithoutWaitingForTheTimer) {
+    Recorder recorder;
+    IntQueue queue(recorder.commit(), {4, std::chrono::hours(1)});
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 8; ++i) {
+        results.push_back(queue.submit(i));
+    }
+    for (int i = 0; i < 8; ++i) {
+        ASSERT_EQ(results[i].wait_for(std::chrono::seconds(5)), std::future_status::ready);
+        EXPECT_EQ(results[i].get(), i * i);
+    }
+    EXPECT_EQ(queue.committedBatches(), 2u);
+    std::lock_guard lock(recorder.mutex);
+    EXPECT_EQ(recorder.batches, (std::vector<std::size_t>{4, 4}));
+}
+
+TEST(GroupCommitQueueTest, CommitsAPartialBatchAfterTheDelay) {
+    Recorder recorder;
+    IntQueue queue(recorder.commit(), {256, std::chrono::milliseconds(20)});
+    const auto start = std::chrono::steady_clock::now();
+    std::future<int> first = queue.submit(3);
+    std::future<int> second = queue.submit(4);
+    EXPECT_EQ(first.get(), 9);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+    EXPECT_EQ(second.get(), 16);
+    EXPECT_EQ(queue.committedBatches(), 1u);
+    EXPECT_EQ(queue.committedItems(), 2u);
+}
+
+TEST(GroupCommitQueueTest, FailedCommitFailsTheEntriesItLeftUnset) {
+    IntQueue queue(
+        [](std::vector<IntQueue::Entry> &batch) {
+            batch.front().result.set_value(1);
+            throw std::runtime_error("disk full");
+        },
+        {2, std::chrono::hours(1)});
+    std::future<int> committed = queue.submit(0);
+    std::future<int> failed = queue.submit(0);
+    EXPECT_EQ(committed.get(), 1);
+    EXPECT_THROW(failed.get(), std::runtime_error);
+}
+
+TEST(GroupCommitQueueTest, DrainsOnDestruction) {
+    Recorder recorder;
+    std::vector<std::future<int>> results;
+    {
+        IntQueue queue(recorder.commit(), {256, std::chrono::hours(1)});
+        for (int i = 0; i < 10; ++i) {
+            results.push_back(queue.submit(i));
+        }
+    }
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_EQ(results[i].get(), i * i);
+    }
+}
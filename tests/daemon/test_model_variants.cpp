@@ -0,0 +1,173 @@
+#include <gtest/gtest.h>
+
+#include "model_variants.h"
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+using vibenote::ModelLayout;
+using vibenote::ModelVariant;
+using vibenote::ModelVariants;
+using vibenote::OffloadPlan;
+
+namespace {
+
+constexpr std::uint64_t kMiB = 1024 * 1024;
+constexpr std::uint32_t kContext = 2048;
+
+// A llama-style layout of eight blocks; quantizations differ only in the
+// bytes per block.
+ModelVariant variant(const std::string &name, std::uint64_t block_bytes) {
+    ModelVariant v;
+    v.path = "/models/" + name + ".gguf";
+    v.name = name;
+    v.layout.architecture = "llama";
+    v.layout.context_length = 8192;
+    v.layout.embedding_length = 1024;
+    v.layout.feed_forward_length = 4096;
+    v.layout.head_count = 16;
+    v.layout.head_count_kv = 4;
+    v.layout.key_length = 64;
+    v.layout.value_length = 64;
+    v.layout.vocab_size = 32000;
+    v.layout.block_bytes.assign(8, block_bytes);
+    v.layout.output_bytes = block_bytes / 2;
+    v.layout.host_bytes = block_bytes / 2;
+    return v;
+}
+
+ModelVariants::Options options() {
+    ModelVariants::Options opts;
+    opts.budget.context_size = kContext;
+    opts.budget.min_context = kContext;
+    opts.hold = std::chrono::seconds(30);
+    return opts;
+}
+
+// Q4, Q8 and Q5 at roughly their relative sizes, deliberately out of order.
+ModelVariants threeVariants() {
+    return ModelVariants({variant("q4_k_m", 60 * kMiB), variant("q8_0", 110 * kMiB),
+                          variant("q5_k_m", 75 * kMiB)},
+                         options());
+}
+
+// Device memory variant `index` needs fully offloaded.
+std::uint64_t fullBytes(const ModelVariants &variants, std::size_t index) {
+    const ModelLayout &layout = variants.variant(index).layout;
+    return vibenote::estimateOffload(layout, layout.fullOffload(), kContext, options().budget)
+        .totalBytes();
+}
+
+} // namespace
+
+TEST(ModelVariantsTest, OrdersByQualityAndPicksTheBestThatFullyOffloads) {
+    const ModelVariants variants = threeVariants();
+    ASSERT_EQ(variants.size(), 3u);
+    EXPECT_EQ(variants.variant(0).name, "q8_0");
+    EXPECT_EQ(variants.variant(1).name, "q5_k_m");
+    EXPECT_EQ(variants.variant(2).name, "q4_k_m");
+
+    EXPECT_EQ(variants.choose(fullBytes(variants, 0)).variant, 0u);
+    const vibenote::VariantChoice q5 = variants.choose(fullBytes(variants, 0) - 1);
+    EXPECT_EQ(q5.variant, 1u);
+    EXPECT_EQ(q5.plan.gpu_layers, variants.variant(1).layout.fullOffload());
+    EXPECT_EQ(q5.plan.context_size, kContext);
+    EXPECT_EQ(variants.choose(fullBytes(variants, 2)).variant, 2u);
+}
+
+TEST(ModelVariantsTest, FallsBackToTheSmallestPartlyOffloaded) {
+    const ModelVariants variants = threeVariants();
+    const vibenote::VariantChoice choice = variants.choose(fullBytes(variants, 2) / 2);
+    EXPECT_EQ(choice.variant, 2u);
+    EXPECT_GT(choice.plan.gpu_layers, 0);
+    EXPECT_LT(choice.plan.gpu_layers, variants.variant(2).layout.fullOffload());
+    EXPECT_EQ(variants.choose(0).plan.gpu_layers, 0);
+}
+
+TEST(ModelVariantsTest, SwitchesOnlyAfterPressurePersists) {
+    ModelVariants variants = threeVariants();
+    const vibenote::VariantChoice best = variants.choose(fullBytes(variants, 0));
+    variants.setActive(best.variant, best.plan);
+    EXPECT_EQ(variants.activeBytes(), fullBytes(variants, 0));
+
+    // Another process eats into the headroom: with Q8 unloaded, only Q5
+    // would fit.
+    const auto q8 = static_cast<std::int64_t>(fullBytes(variants, 0));
+    const auto q5 = static_cast<std::int64_t>(fullBytes(variants, 1));
+    const std::int64_t squeezed = q5 - q8;
+    const auto start = ModelVariants::Clock::now();
+    EXPECT_FALSE(variants.update(0, start));
+    EXPECT_FALSE(variants.update(squeezed, start + std::chrono::seconds(1)));
+    EXPECT_FALSE(variants.update(squeezed, start + std::chrono::seconds(20)));
+    // The memory comes back before the hold runs out.
+    EXPECT_FALSE(variants.update(0, start + std::chrono::seconds(25)));
+    EXPECT_FALSE(variants.update(squeezed, start + std::chrono::seconds(40)));
+    EXPECT_FALSE(variants.update(squeezed, start + std::chrono::seconds(69)));
+    const std::optional<std::size_t> next = variants.update(squeezed, start + std::chrono::seconds(70));
+    ASSERT_TRUE(next);
+    EXPECT_EQ(*next, 1u);
+    // Asked once; the caller reports back with setActive().
+    EXPECT_FALSE(variants.update(squeezed, start + std::chrono::seconds(71)));
+}
+
+TEST(ModelVariantsTest, MovesBackUpWhenMemoryReturns) {
+    ModelVariants variants = threeVariants();
+    const vibenote::VariantChoice small = variants.choose(fullBytes(variants, 2));
+    variants.setActive(small.variant, small.plan);
+    const auto start = ModelVariants::Clock::now();
+    // Room for Q8 next to the Q4 still loaded.
+    const auto roomy = static_cast<std::int64_t>(fullBytes(variants, 0));
+    EXPECT_FALSE(variants.update(roomy, start));
+    const std::optional<std::size_t> next = variants.update(roomy, start + std::chrono::seconds(30));
+    ASSERT_TRUE(next);
+    EXPECT_EQ(*next, 0u);
+}
+
+TEST(ModelVariantsTest, MeasuredMemoryCorrectsTheEstimate) {
+    ModelVariants variants = threeVariants();
+    const std::uint64_t q8 = fullBytes(variants, 0);
+    const vibenote::VariantChoice best = variants.choose(q8);
+    ASSERT_EQ(best.variant, 0u);
+    variants.setActive(best.variant, best.plan);
+
+    // Q8 turned out to need a fifth more than estimated.
+    variants.recordMemory(q8 + q8 / 5);
+    EXPECT_EQ(variants.stats(0).device_bytes, q8 + q8 / 5);
+    EXPECT_EQ(variants.stats(0).gpu_layers, best.plan.gpu_layers);
+    EXPECT_NEAR(static_cast<double>(variants.activeBytes()), static_cast<double>(q8 + q8 / 5),
+                static_cast<double>(kMiB));
+    EXPECT_EQ(variants.choose(q8).variant, 1u);
+    EXPECT_EQ(variants.choose(q8 + q8 / 4).variant, 0u);
+
+    // Using less than estimated keeps the estimate.
+    ModelVariants lean = threeVariants();
+    lean.setActive(best.variant, best.plan);
+    lean.recordMemory(q8 / 2);
+    EXPECT_EQ(lean.choose(q8).variant, 0u);
+}
+
+TEST(ModelVariantsTest, RecordsThroughputOfTheActiveVariant) {
+    ModelVariants variants = threeVariants();
+    variants.recordGeneration(100, 1.0);  // nothing active yet
+    EXPECT_EQ(variants.stats(0).tokens, 0u);
+
+    variants.setActive(2, OffloadPlan{});
+    variants.recordGeneration(120, 2.0);
+    variants.recordGeneration(60, 1.0);
+    variants.recordGeneration(0, 1.0);
+    EXPECT_EQ(variants.stats(2).tokens, 180u);
+    EXPECT_DOUBLE_EQ(variants.stats(2).tokensPerSecond(), 60.0);
+    EXPECT_EQ(variants.stats(0).tokens, 0u);
+
+    std::string out;
+    variants.serializeMetrics(out);
+    EXPECT_NE(out.find("vibenote_model_variant_active{variant=\"q4_k_m\"} 1\n"), std::string::npos);
+    EXPECT_NE(out.find("vibenote_model_variant_active{variant=\"q8_0\"} 0\n"), std::string::npos);
+    EXPECT_NE(out.find("vibenote_model_variant_tokens_per_second{variant=\"q4_k_m\"} 60\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("vibenote_model_variant_generated_tokens_total{variant=\"q4_k_m\"} 180\n"),
+              std::string::npos);
+}
@@ -0,0 +1,207 @@
+#include <gtest/gtest.h>
+
+#include "offload_planner.h"
+
+#include "ggml.h"
+#include "gguf.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using vibenote::ModelLayout;
+using vibenote::OffloadBudget;
+using vibenote::OffloadPlan;
+
+namespace {
+
+constexpr std::uint64_t kMiB = 1024 * 1024;
+
+// A GGUF header for a small llama-style model whose tensors are f32 vectors
+// of chosen sizes. Tensor data is never allocated.
+class SyntheticModel {
+public:
+    SyntheticModel() {
+        ggml_init_params params{};
+        params.mem_size = 1024 * ggml_tensor_overhead();
+        params.no_alloc = true;
+        tensors_ = ggml_init(params);
+        gguf_ = gguf_init_empty();
+        gguf_set_val_str(gguf_, "general.architecture", "llama");
+        gguf_set_val_u32(gguf_, "llama.context_length", 8192);
+        gguf_set_val_u32(gguf_, "llama.embedding_length", 1024);
+        gguf_set_val_u32(gguf_, "llama.feed_forward_length", 4096);
+        gguf_set_val_u32(gguf_, "llama.attention.head_count", 16);
+        const char *tokens[] = {"<s>", "</s>", "a", "b"};
+        gguf_set_arr_str(gguf_, "tokenizer.ggml.tokens", tokens, 4);
+    }
+    ~SyntheticModel() {
+        gguf_free(gguf_);
+        ggml_free(tensors_);
+    }
+
+    SyntheticModel &set(const char *key, std::uint32_t value) {
+        gguf_set_val_u32(gguf_, key, value);
+        return *this;
+    }
+    SyntheticModel &tensor(const std::string &name, std::uint64_t bytes) {
+        ggml_tensor *t = ggml_new_tensor_1d(tensors_, GGML_TYPE_F32, static_cast<int64_t>(bytes / 4));
+        ggml_set_name(t, name.c_str());
+        gguf_add_tensor(gguf_, t);
+        return *this;
+    }
+    // `blocks` repeating blocks of `bytes` each, split over two tensors.
+    SyntheticModel &blocks(std::uint32_t count, std::uint64_t bytes) {
+        set("llama.block_count", count);
+        for (std::uint32_t i = 0; i < count; ++i) {
+            tensor("blk." + std::to_string(i) + ".attn_q.weight", bytes / 4);
+            tensor("blk." + std::to_string(i) + ".ffn_up.weight", bytes - bytes / 4);
+        }
+        return *this;
+    }
+
+    const gguf_context *gguf() const { return gguf_; }
+    ModelLayout layout() const { return *ModelLayout::fromGguf(gguf_); }
+
+private:
+    ggml_context *tensors_;
+    gguf_context *gguf_;
+};
+
+bool fits(const ModelLayout &model, int layers, std::uint32_t context, const OffloadBudget &budget) {
+    return vibenote::estimateOffload(model, layers, context, budget).totalBytes() <=
+           budget.memory_bytes;
+}
+
+} // namespace
+
+TEST(OffloadPlannerTest, ReadsBlockCountAndTensorSizes) {
+    SyntheticModel model;
+    model.blocks(3, 64 * kMiB)
+        .tensor("blk.2.ffn_down.weight", 32 * kMiB)  // blocks need not be uniform
+        .tensor("token_embd.weight", 16 * kMiB)
+        .tensor("output_norm.weight", 4096)
+        .tensor("output.weight", 16 * kMiB)
+        .set("llama.attention.head_count_kv", 4);
+
+    const ModelLayout layout = model.layout();
+    EXPECT_EQ(layout.architecture, "llama");
+    ASSERT_EQ(layout.blockCount(), 3u);
+    EXPECT_EQ(layout.block_bytes[0], 64 * kMiB);
+    EXPECT_EQ(layout.block_bytes[2], 96 * kMiB);
+    EXPECT_EQ(layout.output_bytes, 16 * kMiB + 4096);
+    EXPECT_EQ(layout.host_bytes, 16 * kMiB);
+    EXPECT_EQ(layout.head_count_kv, 4u);
+    EXPECT_EQ(layout.key_length, 64u);  // embedding / heads
+    EXPECT_EQ(layout.vocab_size, 4u);
+    EXPECT_EQ(layout.fullOffload(), 4);
+}
+
+TEST(OffloadPlannerTest, TiedEmbeddingsAreCopiedToTheOutputDevice) {
+    SyntheticModel model;
+    model.blocks(2, kMiB).tensor("token_embd.weight", 8 * kMiB).tensor("output_norm.weight", 4096);
+    const ModelLayout layout = model.layout();
+    EXPECT_EQ(layout.output_bytes, 8 * kMiB + 4096);
+    EXPECT_EQ(layout.host_bytes, 8 * kMiB);
+}
+
+TEST(OffloadPlannerTest, RejectsIncompleteHeaders) {
+    SyntheticModel model;
+    EXPECT_FALSE(ModelLayout::fromGguf(model.gguf()));  // no block_count
+    model.blocks(2, kMiB).tensor("blk.7.attn_q.weight", 4096);
+    EXPECT_FALSE(ModelLayout::fromGguf(model.gguf()));  // tensor past the block count
+}
+
+TEST(OffloadPlannerTest, EstimatesKvCacheAndComputeBuffer) {
+    SyntheticModel model;
+    model.blocks(4, 10 * kMiB)
+        .tensor("output.weight", 5 * kMiB)
+        .set("llama.attention.head_count_kv", 4);
+    const ModelLayout layout = model.layout();
+    OffloadBudget budget;
+
+    const OffloadPlan partial = vibenote::estimateOffload(layout, 2, 4096, budget);
+    EXPECT_EQ(partial.weight_bytes, 20 * kMiB);
+    // 2 blocks * 4096 tokens * 4 KV heads * (64 + 64) * 2 bytes
+    EXPECT_EQ(partial.kv_bytes, 2ull * 4096 * 4 * 128 * 2);
+    // 512 tokens * f32 * (16 heads * 4096 + 4 * 1024 + 2 * 4096), no logits
+    EXPECT_EQ(partial.compute_bytes, 512ull * 4 * (16 * 4096 + 4 * 1024 + 2 * 4096));
+
+    const OffloadPlan full = vibenote::estimateOffload(layout, 5, 4096, budget);
+    EXPECT_EQ(full.weight_bytes, 45 * kMiB);
+    EXPECT_EQ(full.compute_bytes - partial.compute_bytes, 512ull * 4 * 4);  // logits
+
+    EXPECT_EQ(vibenote::estimateOffload(layout, 0, 4096, budget).totalBytes(), 0u);
+}
+
+TEST(OffloadPlannerTest, OffloadsEverythingWhenItFits) {
+    SyntheticModel model;
+    model.blocks(8, 100 * kMiB).tensor("output.weight", 50 * kMiB);
+    OffloadBudget budget;
+    budget.memory_bytes = 8ull * 1024 * kMiB;
+    const OffloadPlan plan = vibenote::planOffload(model.layout(), budget);
+    EXPECT_EQ(plan.gpu_layers, 9);
+    EXPECT_EQ(plan.context_size, 8192u);  // the trained context
+}
+
+TEST(OffloadPlannerTest, ShrinksContextBeforeDroppingLayers) {
+    SyntheticModel model;
+    model.blocks(8, 100 * kMiB).tensor("output.weight", 50 * kMiB);
+    const ModelLayout layout = model.layout();
+    OffloadBudget budget;
+    budget.context_size = 8192;
+    budget.min_context = 1024;
+    budget.memory_bytes = vibenote::estimateOffload(layout, 9, 3000, budget).totalBytes();
+
+    const OffloadPlan plan = vibenote::planOffload(layout, budget);
+    EXPECT_EQ(plan.gpu_layers, 9);
+    EXPECT_EQ(plan.context_size, 2816u);  // 3000 rounded down to a multiple of 256
+    EXPECT_LE(plan.totalBytes(), budget.memory_bytes);
+    EXPECT_FALSE(fits(layout, 9, plan.context_size + 256, budget));
+}
+
+TEST(OffloadPlannerTest, OffloadsTheMostLayersThatFit) {
+    SyntheticModel model;
+    model.blocks(8, 100 * kMiB).tensor("output.weight", 50 * kMiB);
+    const ModelLayout layout = model.layout();
+    OffloadBudget budget;
+    budget.context_size = 4096;
+    budget.min_context = 2048;
+    budget.memory_bytes = 450 * kMiB;
+
+    const OffloadPlan plan = vibenote::planOffload(layout, budget);
+    ASSERT_GT(plan.gpu_layers, 0);
+    EXPECT_LT(plan.gpu_layers, 9);
+    EXPECT_LE(plan.totalBytes(), budget.memory_bytes);
+    EXPECT_FALSE(fits(layout, plan.gpu_layers + 1, budget.min_context, budget));
+    EXPECT_GE(plan.context_size, budget.min_context);
+    EXPECT_TRUE(plan.context_size == budget.context_size ||
+                !fits(layout, plan.gpu_layers, plan.context_size + 256, budget));
+}
+
+TEST(OffloadPlannerTest, FallsBackToCpuWhenNoLayerFits) {
+    SyntheticModel model;
+    model.blocks(4, 100 * kMiB);
+    OffloadBudget budget;
+    budget.context_size = 4096;
+    budget.memory_bytes = 50 * kMiB;
+    const OffloadPlan plan = vibenote::planOffload(model.layout(), budget);
+    EXPECT_EQ(plan.gpu_layers, 0);
+    EXPECT_EQ(plan.context_size, 4096u);
+    EXPECT_EQ(plan.totalBytes(), 0u);
+}
+
+TEST(OffloadPlannerTest, ReadsHeaderFromFile) {
+    SyntheticModel model;
+    model.blocks(2, kMiB).tensor("output.weight", kMiB);
+    const std::string path = ::testing::TempDir() + "offload_planner_header.gguf";
+    ASSERT_TRUE(gguf_write_to_file(model.gguf(), path.c_str(), /*only_meta=*/true));
+
+    const std::optional<ModelLayout> layout = ModelLayout::read(path);
+    std::remove(path.c_str());
+    ASSERT_TRUE(layout);
+    EXPECT_EQ(layout->blockCount(), 2u);
+    EXPECT_EQ(layout->output_bytes, kMiB);
+    EXPECT_FALSE(ModelLayout::read(path));
+}
@@ -2,183 +2,194 @@
 #include <gmock/gmock.h>
 
 #include "queue.h"
+#include "queue_metrics.h"
 #include "gpu_guard.h"
 
 #include <atomic>
 #include <chrono>
 #include <future>
+#include <optional>
+#include <string>
 #include <thread>
 #include <vector>
 
 using ::testing::NiceMock;
 using ::testing::Return;
-using ::testing::_;
+
+using vibenote::Admission;
+using vibenote::QueueConfig;
+using vibenote::QueueMetrics;
+using vibenote::Task;
+using vibenote::TaskClock;
+using vibenote::TaskFailure;
+using vibenote::TaskPriority;
+using vibenote::TaskQueue;
+using vibenote::TaskType;
 
 class MockGpuGuard : public GpuGuard {
 public:
-    MOCK_METHOD(bool, canAcceptWork, (), (override));
+    MOCK_METHOD(bool, canAcceptWork, (), (const, override));
 };
 
 namespace {
 
-Task makeTask(TaskClass cls, int id) {
+Task makeTask(TaskType type, std::uint64_t id, TaskPriority prio = TaskPriority::kNormal) {
     Task t;
     t.id = id;
-    t.cls = cls;
-    t.work = [] {};
+    t.type = type;
+    t.priority = prio;
     return t;
 }
 
-} // namespace
-
-TEST(QueueTest, EnqueueDequeue) {
+// One slot per type, no rate limits and plain FIFO order unless a test asks
+// for more.
+QueueConfig config(std::size_t depth = 16) {
     QueueConfig cfg;
-    cfg.capacity = 10;
-    cfg.classLimits[TaskClass::Interactive] = 2;
-    cfg.classLimits[TaskClass::Export] = 1;
-    cfg.classLimits[TaskClass::Watch] = 1;
+    cfg.max_queue_depth = depth;
+    cfg.max_concurrent[TaskType::kInteractive] = 1;
+    cfg.max_concurrent[TaskType::kExport] = 1;
+    cfg.max_concurrent[TaskType::kWatch] = 1;
+    cfg.rate_limits.clear();
+    cfg.aging_per_token = std::chrono::microseconds(0);
+    return cfg;
+}
 
-    NiceMock<MockGpuGuard> guard;
-    EXPECT_CALL(guard, canAcceptWork()).WillRepeatedly(Return(true));
-
-    TaskQueue queue(cfg, guard);
-
-    queue.enqueue(makeTask(TaskClass::Interactive, 1));
-    queue.enqueue(makeTask(TaskClass::Interactive, 2));
-    queue.enqueue(makeTask(TaskClass::Export, 3));
-    queue.enqueue(makeTask(TaskClass::Watch, 4));
-    queue.enqueue(makeTask(TaskClass::Watch, 5));
-
-    auto t1 = queue.dequeue();
-    auto t2 = queue.dequeue();
-    auto t3 = queue.dequeue();
-    auto t4 = queue.dequeue();
-    auto t5 = queue.dequeue();
-
-    EXPECT_EQ(t1.id, 1);
-    EXPECT_EQ(t2.id, 2);
-    EXPECT_EQ(t3.id, 3);
-    EXPECT_EQ(t4.id, 4);
-    EXPECT_EQ(t5.id, 5);
+// Dequeues and completes every runnable task, returning their ids in order.
+std::vector<std::uint64_t> drain(TaskQueue &queue) {
+    std::vector<std::uint64_t> order;
+    while (auto t = queue.dequeue(std::chrono::milliseconds(10))) {
+        order.push_back(t->id);
+        queue.taskCompleted(t->id);
+    }
+    return order;
 }
 
-TEST(QueueTest, CapacityLimit) {
-    QueueConfig cfg;
-    cfg.capacity = 2;
-    cfg.classLimits[TaskClass::Interactive] = 1;
+class QueueTest : public ::testing::Test {
+protected:
+    QueueTest() { ON_CALL(guard, canAcceptWork()).WillByDefault(Return(true)); }
 
     NiceMock<MockGpuGuard> guard;
-    EXPECT_CALL(guard, canAcceptWork()).WillRepeatedly(Return(true));
-
-    TaskQueue queue(cfg, guard);
+};
 
-    EXPECT_TRUE(queue.enqueue(makeTask(TaskClass::Interactive, 1)));
-    EXPECT_TRUE(queue.enqueue(makeTask(TaskClass::Interactive, 2)));
-    EXPECT_FALSE(queue.enqueue(makeTask(TaskClass::Interactive, 3)));
+} // namespace
 
-    auto t = queue.dequeue();
-    EXPECT_EQ(t.id, 1);
-    EXPECT_TRUE(queue.enqueue(makeTask(TaskClass::Interactive, 3)));
+TEST_F(QueueTest, EnqueueDequeue) {
+    QueueConfig cfg = config(10);
+    cfg.max_concurrent[TaskType::kInteractive] = 2;
+    TaskQueue queue(&guard, cfg);
+
+    queue.enqueue(makeTask(TaskType::kInteractive, 1));
+    queue.enqueue(makeTask(TaskType::kInteractive, 2));
+    queue.enqueue(makeTask(TaskType::kExport, 3));
+    queue.enqueue(makeTask(TaskType::kWatch, 4));
+    queue.enqueue(makeTask(TaskType::kWatch, 5));
+
+    EXPECT_EQ(queue.dequeue().id, 1u);
+    EXPECT_EQ(queue.dequeue().id, 2u);
+    EXPECT_EQ(queue.dequeue().id, 3u);
+    EXPECT_EQ(queue.dequeue().id, 4u);
+    // The only watch slot is taken until task 4 completes.
+    EXPECT_FALSE(queue.dequeue(std::chrono::milliseconds(10)).has_value());
+    queue.taskCompleted(4);
+    EXPECT_EQ(queue.dequeue().id, 5u);
 }
 
-TEST(QueueTest, ConcurrencyLimits) {
-    QueueConfig cfg;
-    cfg.capacity = 10;
-    cfg.classLimits[TaskClass::Interactive] = 1;
+TEST_F(QueueTest, CapacityLimit) {
+    TaskQueue queue(&guard, config(2));
 
-    NiceMock<MockGpuGuard> guard;
-    EXPECT_CALL(guard, canAcceptWork()).WillRepeatedly(Return(true));
+    EXPECT_TRUE(queue.enqueue(makeTask(TaskType::kInteractive, 1)));
+    EXPECT_TRUE(queue.enqueue(makeTask(TaskType::kInteractive, 2)));
+    const Admission full = queue.tryEnqueue(makeTask(TaskType::kInteractive, 3));
+    EXPECT_EQ(full.result, Admission::Result::kQueueFull);
+    EXPECT_GT(full.retry_after.count(), 0);
 
-    TaskQueue queue(cfg, guard);
+    EXPECT_EQ(queue.dequeue().id, 1u);
+    EXPECT_TRUE(queue.enqueue(makeTask(TaskType::kInteractive, 3)));
+    EXPECT_EQ(queue.getStats().rejected_full, 1u);
+}
 
-    queue.enqueue(makeTask(TaskClass::Interactive, 1));
-    queue.enqueue(makeTask(TaskClass::Interactive, 2));
+TEST_F(QueueTest, ConcurrencyLimits) {
+    TaskQueue queue(&guard, config());
 
-    auto first = std::async(std::launch::async, [&] { return queue.dequeue(); });
-    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    queue.enqueue(makeTask(TaskType::kInteractive, 1));
+    queue.enqueue(makeTask(TaskType::kInteractive, 2));
 
-    EXPECT_EQ(first.wait_for(std::chrono::milliseconds(0)), std::future_status::ready);
+    const Task first = queue.dequeue();
+    EXPECT_EQ(first.id, 1u);
 
-    auto second = std::async(std::launch::async, [&] { return queue.dequeue(std::chrono::milliseconds(50)); });
+    auto second = std::async(std::launch::async,
+                             [&] { return queue.dequeue(std::chrono::seconds(5)); });
     EXPECT_EQ(second.wait_for(std::chrono::milliseconds(30)), std::future_status::timeout);
 
-    queue.finish(first.get());
-    EXPECT_EQ(second.get().id, 2);
+    queue.taskCompleted(first.id);
+    const std::optional<Task> next = second.get();
+    ASSERT_TRUE(next.has_value());
+    EXPECT_EQ(next->id, 2u);
 }
 
-TEST(QueueTest, GpuThrottling) {
-    QueueConfig cfg;
-    cfg.capacity = 10;
-    cfg.classLimits[TaskClass::Interactive] = 1;
-
-    MockGpuGuard guard;
-    TaskQueue queue(cfg, guard);
+TEST_F(QueueTest, GpuThrottling) {
+    MockGpuGuard throttled;
+    std::atomic<bool> open{false};
+    ON_CALL(throttled, canAcceptWork()).WillByDefault([&open] { return open.load(); });
+    EXPECT_CALL(throttled, canAcceptWork()).Times(::testing::AtLeast(1));
+    TaskQueue queue(&throttled, config());
 
-    queue.enqueue(makeTask(TaskClass::Interactive, 1));
-
-    EXPECT_CALL(guard, canAcceptWork())
-        .WillOnce(Return(false))
-        .WillOnce(Return(true));
+    queue.enqueue(makeTask(TaskType::kInteractive, 1));
 
     auto fut = std::async(std::launch::async, [&] { return queue.dequeue(); });
     EXPECT_EQ(fut.wait_for(std::chrono::milliseconds(30)), std::future_status::timeout);
 
-    queue.notifyGpuAvailable();
-    EXPECT_EQ(fut.get().id, 1);
+    // GpuGuard::admissionChanged reaches the queue through setInferenceShare().
+    open = true;
+    queue.setInferenceShare(1.0);
+    EXPECT_EQ(fut.get().id, 1u);
 }
 
-TEST(QueueTest, FairScheduling) {
-    QueueConfig cfg;
-    cfg.capacity = 10;
-    cfg.classLimits[TaskClass::Interactive] = 2;
-    cfg.classLimits[TaskClass::Export] = 1;
-    cfg.classLimits[TaskClass::Watch] = 1;
-
-    NiceMock<MockGpuGuard> guard;
-    EXPECT_CALL(guard, canAcceptWork()).WillRepeatedly(Return(true));
-
-    TaskQueue queue(cfg, guard);
-
-    for (int i = 0; i < 3; ++i) {
-        queue.enqueue(makeTask(TaskClass::Interactive, 100 + i));
-        queue.enqueue(makeTask(TaskClass::Export, 200 + i));
-        queue.enqueue(makeTask(TaskClass::Watch, 300 + i));
-    }
+TEST_F(QueueTest, ServesTypesInArrivalOrderWithinAPriority) {
+    TaskQueue queue(&guard, config());
 
-    std::vector<int> order;
-    for (int i = 0; i < 9; ++i) {
-        order.push_back(queue.dequeue().id);
+    for (std::uint64_t i = 0; i < 3; ++i) {
+        queue.enqueue(makeTask(TaskType::kInteractive, 100 + i));
+        queue.enqueue(makeTask(TaskType::kExport, 200 + i));
+        queue.enqueue(makeTask(TaskType::kWatch, 300 + i));
     }
 
-    for (int i = 0; i < 3; ++i) {
+    const std::vector<std::uint64_t> order = drain(queue);
+    ASSERT_EQ(order.size(), 9u);
+    for (std::uint64_t i = 0; i < 3; ++i) {
         EXPECT_EQ(order[i * 3 + 0], 100 + i);
         EXPECT_EQ(order[i * 3 + 1], 200 + i);
         EXPECT_EQ(order[i * 3 + 2], 300 + i);
     }
 }
 
-TEST(QueueTest, ThreadSafety) {
-    QueueConfig cfg;
-    cfg.capacity = 100;
-    cfg.classLimits[TaskClass::Interactive] = 10;
+TEST_F(QueueTest, HighPriorityOvertakesQueuedWork) {
+    TaskQueue queue(&guard, config());
 
-    NiceMock<MockGpuGuard> guard;
-    EXPECT_CALL(guard, canAcceptWork()).WillRepeatedly(Return(true));
+    queue.enqueue(makeTask(TaskType::kInteractive, 1, TaskPriority::kLow));
+    queue.enqueue(makeTask(TaskType::kInteractive, 2, TaskPriority::kNormal));
+    queue.enqueue(makeTask(TaskType::kInteractive, 3, TaskPriority::kHigh));
+
+    EXPECT_EQ(drain(queue), (std::vector<std::uint64_t>{3, 2, 1}));
+}
 
-    TaskQueue queue(cfg, guard);
+TEST_F(QueueTest, ThreadSafety) {
+    QueueConfig cfg = config(256);
+    cfg.max_concurrent[TaskType::kInteractive] = 10;
+    TaskQueue queue(&guard, cfg);
 
     std::atomic<int> counter{0};
     auto producer = [&] {
         for (int i = 0; i < 100; ++i) {
-            queue.enqueue(makeTask(TaskClass::Interactive, i));
+            EXPECT_TRUE(queue.enqueue(makeTask(TaskType::kInteractive, queue.nextTaskId())));
         }
     };
 
     auto consumer = [&] {
         for (int i = 0; i < 100; ++i) {
-            auto t = queue.dequeue();
-            counter.fetch_add(t.id >= 0 ? 1 : 0);
-            queue.finish(t);
+            Task t = queue.dequeue();
+            counter.fetch_add(t.id != 0 ? 1 : 0);
+            queue.taskCompleted(t.id);
         }
     };
 
@@ -191,69 +202,363 @@ TEST(QueueTest, ThreadSafety) {
     c2.join();
 
     EXPECT_EQ(counter.load(), 200);
-    EXPECT_EQ(queue.size(), 0U);
+    const TaskQueue::Stats stats = queue.getStats();
+    for (std::size_t queued : stats.queued) {
+        EXPECT_EQ(queued, 0u);
+    }
+    EXPECT_EQ(stats.running.at(TaskType::kInteractive), 0u);
 }
 
-TEST(QueueTest, TimeoutAndCancellation) {
-    QueueConfig cfg;
-    cfg.capacity = 2;
-    cfg.classLimits[TaskClass::Interactive] = 1;
+TEST_F(QueueTest, TimeoutAndCancellation) {
+    TaskQueue queue(&guard, config(2));
 
-    NiceMock<MockGpuGuard> guard;
-    EXPECT_CALL(guard, canAcceptWork()).WillRepeatedly(Return(true));
+    EXPECT_FALSE(queue.dequeue(std::chrono::milliseconds(50)).has_value());
 
-    TaskQueue queue(cfg, guard);
+    std::vector<TaskFailure> failures;
+    queue.enqueue(makeTask(TaskType::kInteractive, 1));
+    Task cancelled = makeTask(TaskType::kInteractive, 2);
+    cancelled.on_failure = [&failures](TaskFailure failure) { failures.push_back(failure); };
+    queue.enqueue(std::move(cancelled));
+    EXPECT_TRUE(queue.cancel(2));
+    EXPECT_FALSE(queue.cancel(99));
 
-    auto empty = queue.dequeue(std::chrono::milliseconds(50));
-    EXPECT_FALSE(empty.has_value());
+    Task t = queue.dequeue();
+    EXPECT_EQ(t.id, 1u);
+    queue.taskCompleted(t.id);
+    EXPECT_FALSE(queue.dequeue(std::chrono::milliseconds(10)).has_value());
+    EXPECT_EQ(failures, (std::vector<TaskFailure>{TaskFailure::kCancelled}));
+    EXPECT_EQ(queue.getStats().cancelled, 1u);
+}
 
-    queue.enqueue(makeTask(TaskClass::Interactive, 1));
-    auto token = queue.enqueue(makeTask(TaskClass::Interactive, 2));
-    queue.cancel(token);
+TEST_F(QueueTest, EdgeCases) {
+    TaskQueue queue(&guard, config(1));
 
-    auto t = queue.dequeue();
-    EXPECT_EQ(t.id, 1);
     EXPECT_FALSE(queue.dequeue(std::chrono::milliseconds(10)).has_value());
+
+    queue.enqueue(makeTask(TaskType::kInteractive, 42));
+    Task t = queue.dequeue();
+    EXPECT_EQ(t.id, 42u);
+    EXPECT_FALSE(queue.dequeue(std::chrono::milliseconds(10)).has_value());
+
+    queue.stop();
+    EXPECT_EQ(queue.dequeue().id, 0u);
 }
 
-TEST(QueueTest, SignalEmission) {
-    QueueConfig cfg;
-    cfg.capacity = 2;
-    cfg.classLimits[TaskClass::Interactive] = 1;
+TEST_F(QueueTest, CoalescesIdenticalPromptsAndFansOutTheResult) {
+    TaskQueue queue(&guard, config());
+
+    std::vector<std::string> results;
+    auto summaryTask = [&results](std::uint64_t id, const char *prompt) {
+        Task t = makeTask(TaskType::kInteractive, id);
+        t.prompt = prompt;
+        t.callback = [&results, id](const std::string &result) {
+            results.push_back(std::to_string(id) + ":" + result);
+        };
+        return t;
+    };
 
-    NiceMock<MockGpuGuard> guard;
-    EXPECT_CALL(guard, canAcceptWork()).WillRepeatedly(Return(true));
+    EXPECT_EQ(queue.tryEnqueue(summaryTask(1, "Hello   World\n")).result,
+              Admission::Result::kAccepted);
+    EXPECT_EQ(queue.tryEnqueue(summaryTask(2, "hello world")).result,
+              Admission::Result::kCoalesced);
+    // A different output constraint is a different request.
+    Task constrained = summaryTask(3, "hello world");
+    constrained.json_schema = "{\"type\":\"object\"}";
+    EXPECT_EQ(queue.tryEnqueue(std::move(constrained)).result, Admission::Result::kAccepted);
+
+    Task primary = queue.dequeue();
+    ASSERT_EQ(primary.id, 1u);
+    // Arrivals while it runs attach to it too.
+    EXPECT_EQ(queue.tryEnqueue(summaryTask(4, "HELLO WORLD")).result,
+              Admission::Result::kCoalesced);
+
+    primary.callback("summary");
+    queue.taskCompleted(primary.id);
+    EXPECT_EQ(results, (std::vector<std::string>{"1:summary", "2:summary", "4:summary"}));
+
+    // Once the group has finished, the same prompt is queued afresh.
+    EXPECT_EQ(queue.tryEnqueue(summaryTask(5, "hello world")).result,
+              Admission::Result::kAccepted);
+    EXPECT_EQ(drain(queue), (std::vector<std::uint64_t>{3, 5}));
+    EXPECT_EQ(queue.getStats().coalesce_hits, 2u);
+}
 
-    TaskQueue queue(cfg, guard);
+TEST_F(QueueTest, CoalescedWaitersShareTheFailure) {
+    TaskQueue queue(&guard, config());
 
-    testing::MockFunction<void(const Task&)> enqueued;
-    testing::MockFunction<void(const Task&)> dequeued;
-    queue.onEnqueued(enqueued.AsStdFunction());
-    queue.onDequeued(dequeued.AsStdFunction());
+    std::vector<TaskFailure> failures;
+    for (std::uint64_t id = 1; id <= 2; ++id) {
+        Task t = makeTask(TaskType::kInteractive, id);
+        t.prompt = "same text";
+        t.callback = [](const std::string &) {};
+        t.on_failure = [&failures](TaskFailure failure) { failures.push_back(failure); };
+        queue.enqueue(std::move(t));
+    }
 
-    EXPECT_CALL(enqueued, Call(_)).Times(1);
-    EXPECT_CALL(dequeued, Call(_)).Times(1);
+    Task run = queue.dequeue();
+    run.on_failure(TaskFailure::kError);
+    queue.taskCompleted(run.id);
+    EXPECT_EQ(failures, (std::vector<TaskFailure>{TaskFailure::kError, TaskFailure::kError}));
+}
 
-    auto token = queue.enqueue(makeTask(TaskClass::Interactive, 1));
-    auto t = queue.dequeue();
-    queue.finish(t);
+TEST_F(QueueTest, CancellingACoalescedTaskDetachesOnlyThatTask) {
+    TaskQueue queue(&guard, config());
+
+    std::vector<std::string> events;
+    auto sameText = [&events](std::uint64_t id) {
+        Task t = makeTask(TaskType::kInteractive, id);
+        t.prompt = "same text";
+        t.callback = [&events, id](const std::string &result) {
+            events.push_back(std::to_string(id) + ":" + result);
+        };
+        t.on_failure = [&events, id](TaskFailure) {
+            events.push_back(std::to_string(id) + ":cancelled");
+        };
+        return t;
+    };
+    for (std::uint64_t id = 1; id <= 3; ++id) {
+        queue.enqueue(sameText(id));
+    }
+    EXPECT_TRUE(queue.cancel(2));
+    EXPECT_TRUE(queue.cancel(1));
+    EXPECT_EQ(events, (std::vector<std::string>{"2:cancelled", "1:cancelled"}));
+
+    // Task 3 still wants the result, so the shared run goes ahead.
+    Task run = queue.dequeue();
+    EXPECT_FALSE(run.cancel_token->isCancelled());
+    run.callback("summary");
+    queue.taskCompleted(run.id);
+    EXPECT_EQ(events.back(), "3:summary");
+    EXPECT_FALSE(queue.cancel(3));
+
+    // With every waiter cancelled the run is dropped.
+    queue.enqueue(sameText(4));
+    queue.enqueue(sameText(5));
+    queue.cancel(4);
+    queue.cancel(5);
+    EXPECT_FALSE(queue.dequeue(std::chrono::milliseconds(10)).has_value());
+    EXPECT_EQ(events, (std::vector<std::string>{"2:cancelled", "1:cancelled", "3:summary",
+                                                "4:cancelled", "5:cancelled"}));
 }
 
-TEST(QueueTest, EdgeCases) {
-    QueueConfig cfg;
-    cfg.capacity = 1;
-    cfg.classLimits[TaskClass::Interactive] = 1;
+TEST_F(QueueTest, CoalescesOntoQueuedWorkWhenTheQueueIsFull) {
+    TaskQueue queue(&guard, config(1));
 
-    NiceMock<MockGpuGuard> guard;
-    EXPECT_CALL(guard, canAcceptWork()).WillRepeatedly(Return(true));
+    auto sameText = [](std::uint64_t id) {
+        Task t = makeTask(TaskType::kInteractive, id);
+        t.prompt = "same text";
+        t.callback = [](const std::string &) {};
+        return t;
+    };
+    EXPECT_EQ(queue.tryEnqueue(sameText(1)).result, Admission::Result::kAccepted);
+    EXPECT_EQ(queue.tryEnqueue(sameText(2)).result, Admission::Result::kCoalesced);
+    Task other = sameText(3);
+    other.prompt = "other text";
+    EXPECT_EQ(queue.tryEnqueue(std::move(other)).result, Admission::Result::kQueueFull);
+}
 
-    TaskQueue queue(cfg, guard);
+TEST_F(QueueTest, RequeuedTaskRunsEvenWhileItsOriginalIsInFlight) {
+    TaskQueue queue(&guard, config());
+
+    std::vector<std::string> results;
+    Task original = makeTask(TaskType::kWatch, queue.nextTaskId(), TaskPriority::kLow);
+    original.prompt = "screen text";
+    original.callback = [&results](const std::string &result) { results.push_back(result); };
+    queue.enqueue(std::move(original));
+    const Task running = queue.dequeue();
+
+    // What requeuePreempted does: the handler has not returned yet, so the
+    // original still holds its slot and its coalescing group.
+    Task resumed = running;
+    resumed.id = queue.nextTaskId();
+    resumed.partial_output = "partial";
+    resumed.preempt_token.reset();
+    EXPECT_TRUE(queue.requeue(std::move(resumed)));
+    queue.taskCompleted(running.id);
+
+    const std::optional<Task> next = queue.dequeue(std::chrono::milliseconds(100));
+    ASSERT_TRUE(next.has_value());
+    EXPECT_NE(next->id, running.id);
+    EXPECT_EQ(next->partial_output, "partial");
+    next->callback("summary");
+    queue.taskCompleted(next->id);
+    EXPECT_EQ(results, (std::vector<std::string>{"summary"}));
+}
+
+TEST_F(QueueTest, ServesEarliestDeadlineFirst) {
+    TaskQueue queue(&guard, config());
+    const auto now = TaskClock::now();
+
+    queue.enqueue(makeTask(TaskType::kInteractive, 1));
+    Task late = makeTask(TaskType::kInteractive, 2);
+    late.deadline = now + std::chrono::seconds(30);
+    queue.enqueue(std::move(late));
+    Task soon = makeTask(TaskType::kInteractive, 3);
+    soon.deadline = now + std::chrono::seconds(10);
+    queue.enqueue(std::move(soon));
+    Task middle = makeTask(TaskType::kExport, 4);
+    middle.deadline = now + std::chrono::seconds(20);
+    queue.enqueue(std::move(middle));
+
+    // Deadlines order across types; tasks without one come last.
+    EXPECT_EQ(drain(queue), (std::vector<std::uint64_t>{3, 4, 2, 1}));
+}
+
+TEST_F(QueueTest, DropsExpiredTasksAndReportsThem) {
+    TaskQueue queue(&guard, config());
+
+    std::vector<TaskFailure> failures;
+    Task expired = makeTask(TaskType::kInteractive, 1);
+    expired.deadline = TaskClock::now() - std::chrono::milliseconds(1);
+    expired.callback = [](const std::string &) { ADD_FAILURE() << "expired task ran"; };
+    expired.on_failure = [&failures](TaskFailure failure) { failures.push_back(failure); };
+    queue.enqueue(std::move(expired));
 
     EXPECT_FALSE(queue.dequeue(std::chrono::milliseconds(10)).has_value());
+    EXPECT_EQ(failures, (std::vector<TaskFailure>{TaskFailure::kExpired}));
+    EXPECT_EQ(queue.getStats().expired, 1u);
+}
 
-    queue.enqueue(makeTask(TaskClass::Interactive, 42));
-    auto t = queue.dequeue();
-    EXPECT_EQ(t.id, 42);
+TEST_F(QueueTest, BatchesWatchTasksIntoOneSlot) {
+    QueueConfig cfg = config();
+    cfg.max_concurrent[TaskType::kWatch] = 1;
+    TaskQueue queue(&guard, cfg);
+    for (std::uint64_t id = 1; id <= 5; ++id) {
+        Task t = makeTask(TaskType::kWatch, id, TaskPriority::kLow);
+        t.prompt = "screen " + std::to_string(id);
+        queue.enqueue(std::move(t));
+    }
+
+    const std::vector<Task> batch = queue.dequeueBatch(3, 4096, std::chrono::milliseconds(10));
+    ASSERT_EQ(batch.size(), 3u);
+    EXPECT_EQ(batch[0].id, 1u);
+    EXPECT_EQ(batch[2].id, 3u);
+    EXPECT_EQ(batch[0].preempt_token, batch[2].preempt_token);
+    // The batch holds the one watch slot until every task in it completes.
+    queue.taskCompleted(1);
+    queue.taskCompleted(2);
+    EXPECT_TRUE(queue.dequeueBatch(3, 4096, std::chrono::milliseconds(10)).empty());
+    queue.taskCompleted(3);
+    EXPECT_EQ(queue.dequeueBatch(3, 4096, std::chrono::milliseconds(10)).size(), 2u);
+}
+
+TEST_F(QueueTest, BatchTakesASharedSlotPerTaskUpToMaxInference) {
+    QueueConfig cfg = config();
+    cfg.max_inference = 2;
+    TaskQueue queue(&guard, cfg);
+    auto enqueueWatch = [&queue](std::uint64_t first, std::uint64_t last) {
+        for (std::uint64_t id = first; id <= last; ++id) {
+            Task t = makeTask(TaskType::kWatch, id, TaskPriority::kLow);
+            t.prompt = "screen " + std::to_string(id);
+            queue.enqueue(std::move(t));
+        }
+    };
+
+    // With the other shared slot busy, the batch cannot grow.
+    queue.enqueue(makeTask(TaskType::kInteractive, 1));
+    const Task interactive = queue.dequeue();
+    enqueueWatch(2, 4);
+    EXPECT_EQ(queue.dequeueBatch(8, 4096, std::chrono::milliseconds(10)).size(), 1u);
+    queue.taskCompleted(interactive.id);
+    queue.taskCompleted(2);
+
+    // Spread over both shared slots, the batch leaves none for a high
+    // priority task, which preempts it.
+    enqueueWatch(5, 6);
+    const std::vector<Task> batch = queue.dequeueBatch(8, 4096, std::chrono::milliseconds(10));
+    ASSERT_EQ(batch.size(), 4u);
+    queue.enqueue(makeTask(TaskType::kInteractive, 7, TaskPriority::kHigh));
+    EXPECT_TRUE(batch.front().preempt_token->isCancelled());
+}
+
+TEST_F(QueueTest, RateLimitsBurstsWithRetryAfter) {
+    QueueConfig cfg = config();
+    cfg.rate_limits[TaskType::kInteractive] = vibenote::RateLimit{1.0, 2.0};
+    TaskQueue queue(&guard, cfg);
+
+    EXPECT_TRUE(queue.tryEnqueue(makeTask(TaskType::kInteractive, 1)).accepted());
+    EXPECT_TRUE(queue.tryEnqueue(makeTask(TaskType::kInteractive, 2)).accepted());
+    const Admission limited = queue.tryEnqueue(makeTask(TaskType::kInteractive, 3));
+    EXPECT_EQ(limited.result, Admission::Result::kRateLimited);
+    EXPECT_GT(limited.retry_after.count(), 0);
+    EXPECT_LE(limited.retry_after.count(), 1000);
+    EXPECT_TRUE(queue.getStats().backpressure);
+
+    // Other types and requeued work are not charged.
+    EXPECT_TRUE(queue.tryEnqueue(makeTask(TaskType::kExport, 4)).accepted());
+    EXPECT_TRUE(queue.requeue(makeTask(TaskType::kInteractive, 5)));
+    EXPECT_EQ(queue.getStats().rejected_rate, 1u);
+}
+
+TEST_F(QueueTest, ServesCheaperTasksFirstWithinTheAgingBound) {
+    const std::string longPrompt(4000, 'x');  // about 1000 tokens
+
+    QueueConfig cfg = config();
+    cfg.aging_per_token = std::chrono::milliseconds(1);
+    TaskQueue sjf(&guard, cfg);
+    Task expensive = makeTask(TaskType::kInteractive, 1);
+    expensive.prompt = longPrompt;
+    sjf.enqueue(std::move(expensive));
+    Task cheap = makeTask(TaskType::kInteractive, 2);
+    cheap.prompt = "short";
+    sjf.enqueue(std::move(cheap));
+    EXPECT_EQ(drain(sjf), (std::vector<std::uint64_t>{2, 1}));
+
+    // With 10us per token the long task is only held back 10ms; a cheap task
+    // arriving after that no longer overtakes it.
+    cfg.aging_per_token = std::chrono::microseconds(10);
+    TaskQueue aged(&guard, cfg);
+    Task waiting = makeTask(TaskType::kInteractive, 1);
+    waiting.prompt = longPrompt;
+    aged.enqueue(std::move(waiting));
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    Task later = makeTask(TaskType::kInteractive, 2);
+    later.prompt = "short";
+    aged.enqueue(std::move(later));
+    EXPECT_EQ(drain(aged), (std::vector<std::uint64_t>{1, 2}));
+}
+
+TEST_F(QueueTest, PreemptsTheNewestWatchTaskForHighPriorityInteractive) {
+    QueueConfig cfg = config();
+    cfg.max_inference = 1;
+    TaskQueue queue(&guard, cfg);
+
+    queue.enqueue(makeTask(TaskType::kWatch, 1, TaskPriority::kLow));
+    const Task watch = queue.dequeue();
+    ASSERT_TRUE(watch.preempt_token);
+    EXPECT_FALSE(watch.preempt_token->isCancelled());
+
+    // Normal priority waits its turn; high priority takes the slot.
+    queue.enqueue(makeTask(TaskType::kInteractive, 2, TaskPriority::kNormal));
+    EXPECT_FALSE(watch.preempt_token->isCancelled());
+    queue.enqueue(makeTask(TaskType::kInteractive, 3, TaskPriority::kHigh));
+    EXPECT_TRUE(watch.preempt_token->isCancelled());
+    EXPECT_EQ(queue.getStats().preemptions, 1u);
+
+    // The slot frees once the preempted handler returns.
     EXPECT_FALSE(queue.dequeue(std::chrono::milliseconds(10)).has_value());
+    queue.taskCompleted(watch.id);
+    EXPECT_EQ(queue.dequeue().id, 3u);
+    // The cut-short run says nothing about how long a watch task takes.
+    EXPECT_EQ(queue.getStats().service_ms[static_cast<std::size_t>(TaskType::kWatch)], 0.0);
 }
 
+TEST_F(QueueTest, RecordsWaitAndServiceHistograms) {
+    TaskQueue queue(&guard, config());
+    QueueMetrics metrics;
+    queue.setMetrics(&metrics);
+
+    queue.enqueue(makeTask(TaskType::kExport, 1, TaskPriority::kLow));
+    Task t = queue.dequeue();
+    queue.taskCompleted(t.id);
+
+    std::string out;
+    metrics.serialize(out);
+    EXPECT_NE(out.find("vibenote_queue_wait_seconds_count{type=\"export\",priority=\"low\"} 1\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("vibenote_task_service_seconds_count{type=\"export\",priority=\"low\"} 1\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("vibenote_queue_wait_seconds_count{type=\"watch\",priority=\"low\"} 0\n"),
+              std::string::npos);
+    EXPECT_GT(queue.getStats().service_ms[static_cast<std::size_t>(TaskType::kExport)], 0.0);
+}
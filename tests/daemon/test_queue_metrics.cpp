@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+
+#include "queue_metrics.h"
+
+#include <chrono>
+#include <string>
+
+using vibenote::LatencyHistogram;
+using vibenote::QueueMetrics;
+using vibenote::TaskPriority;
+using vibenote::TaskType;
+
+TEST(LatencyHistogramTest, BucketsByInclusiveUpperBound) {
+    LatencyHistogram hist;
+    hist.observe(std::chrono::microseconds(50));    // first bucket
+    hist.observe(std::chrono::microseconds(100));   // on the bound: still the first
+    hist.observe(std::chrono::microseconds(101));   // second
+    hist.observe(std::chrono::milliseconds(3));     // le 5ms
+    hist.observe(std::chrono::minutes(5));          // +Inf
+
+    const LatencyHistogram::Snapshot snap = hist.snapshot();
+    EXPECT_EQ(snap.count, 5u);
+    EXPECT_EQ(snap.buckets[0], 2u);
+    EXPECT_EQ(snap.buckets[1], 1u);
+    EXPECT_EQ(snap.buckets[5], 1u);
+    EXPECT_EQ(snap.buckets[LatencyHistogram::kBucketCount - 1], 1u);
+    EXPECT_NEAR(snap.sum_seconds, 300.003251, 1e-9);
+}
+
+TEST(QueueMetricsTest, SerializesCumulativeBucketsPerTypeAndPriority) {
+    QueueMetrics metrics;
+    metrics.recordWait(TaskType::kWatch, TaskPriority::kLow, std::chrono::milliseconds(1));
+    metrics.recordWait(TaskType::kWatch, TaskPriority::kLow, std::chrono::seconds(2));
+    metrics.recordService(TaskType::kInteractive, TaskPriority::kHigh, std::chrono::seconds(1));
+
+    std::string out;
+    metrics.serialize(out);
+    EXPECT_NE(out.find("# TYPE vibenote_queue_wait_seconds histogram\n"), std::string::npos);
+    EXPECT_NE(out.find("vibenote_queue_wait_seconds_bucket{type=\"watch\",priority=\"low\","
+                       "le=\"0.001\"} 1\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("vibenote_queue_wait_seconds_bucket{type=\"watch\",priority=\"low\","
+                       "le=\"2.5\"} 2\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("vibenote_queue_wait_seconds_bucket{type=\"watch\",priority=\"low\","
+                       "le=\"+Inf\"} 2\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("vibenote_queue_wait_seconds_sum{type=\"watch\",priority=\"low\"} 2.001\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("vibenote_task_service_seconds_count{type=\"interactive\","
+                       "priority=\"high\"} 1\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("vibenote_task_service_seconds_count{type=\"export\","
+                       "priority=\"normal\"} 0\n"),
+              std::string::npos);
+}